@@ -24,11 +24,48 @@
 
 #include "platform/mbed_wait_api.h"
 
-AT25DF041B::AT25DF041B(PinName mosi, PinName miso, PinName sclk, PinName ssel) :
-        _spi(mosi, miso, sclk), _slave_select(ssel, 1) {
+#if AT25DF041B_ENABLE_STATS || AT25DF041B_ENABLE_TRACE
+#include "hal/us_ticker_api.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+template <typename Geometry>
+#if AT25DF041B_TRANSPORT_SPIDEV
+AT25DF<Geometry>::AT25DF(const char *device) :
+        _spi(device), _slave_select(&_spi), _verify_on_write(false),
+#else
+AT25DF<Geometry>::AT25DF(PinName mosi, PinName miso, PinName sclk, PinName ssel) :
+        _spi(mosi, miso, sclk), _slave_select(ssel, 1), _verify_on_write(false),
+#endif
+        _deferred_wait(false), _write_in_progress(false), _burst_length(0), _stream_remaining(0),
+        _stream_start_us(0), _stream_addr(0), _stream_size(0), _frequency(0),
+        _read_opcode(AT25DF041B_READ_ARRAY), _locked(0), _protected(0), _auto_protect(false),
+        _otp_cached(false) {
+    reset_stats();
+    reset_trace();
+    memset(_trimmed, 0, sizeof(_trimmed));
+    memset(_erased, 0, sizeof(_erased));
+    memset(_known, 0, sizeof(_known));
+
+    _blank_map_enabled = false;
+    _blank_map_region = 0;
+    _blank_map_slot = 0;
+    _blank_map_next = 0;
+    _blank_map_sequence = 0;
+
+#if AT25DF041B_ENABLE_WEAR_TRACKING
+    _wear_enabled = false;
+    _wear_region = 0;
+    _wear_table = 0;
+    _wear_sequence = 0;
+    _wear_pending_total = 0;
+#endif
 }
 
-int AT25DF041B::init() {
+template <typename Geometry>
+int AT25DF<Geometry>::init() {
     int res = exit_standby();
     if (res) {
         return res;
@@ -40,22 +77,39 @@ int AT25DF041B::init() {
     // Unprotect all sectors during initialization using global unprotect
     assert_slave_select();
 
-    _spi.write(AT25DF041B_WRITE_STATUS_REG);
-    _spi.write(0);
+    send_command(AT25DF041B_WRITE_STATUS_REG);
+    bus_write_byte(0);
 
     deassert_slave_select();
 
     enable_write_protection();
 
     // Read the status register and make sure SWP bits are 00 (all unprotected)
-    if ((get_status_register() & 0x0C) != 0) {
+    if ((get_status_register() & AT25DF041B_STATUS_SWP_MASK) != 0) {
         return -1;
     }
 
+    // Protect the locked sectors again, and the rest too with auto-protect
+    _protected = 0;
+    apply_protection(idle_protection());
+
+#ifdef AT25DF041B_TUNE_PATTERN_ADDR
+    res = tune_frequency(AT25DF041B_TUNE_PATTERN_ADDR);
+#endif
+
     return res;
 }
 
-int AT25DF041B::deinit() {
+template <typename Geometry>
+int AT25DF<Geometry>::deinit() {
+    // Close the stream first, everything below goes to the bus
+    if (_stream_remaining) {
+        return -1;
+    }
+
+    // Finish any outstanding write and persist any buffered erase counts
+    sync();
+
     // Disable writes
     enable_write_protection();
 
@@ -63,137 +117,408 @@ int AT25DF041B::deinit() {
     return enter_standby();
 }
 
-int AT25DF041B::read(void *buffer, bd_addr_t addr, bd_size_t size) {
+template <typename Geometry>
+int AT25DF<Geometry>::read(void *buffer, bd_addr_t addr, bd_size_t size) {
     if (check_device_id() == -1)
         return -1;
 
     if (!is_valid_operation(addr, size, AT25DF041B_OPERATION_TYPE_READ))
         return -2;
 
+    uint32_t start_us = stats_timestamp();
+
     // For reads, boundary crossings are not an issue
     assert_slave_select();
-    _spi.write(AT25DF041B_READ_ARRAY);
-    send_address(addr);
-    _spi.write(NULL, 0, (char*) buffer, size);
+    send_read_command(addr);
+    bus_read(buffer, size);
+    deassert_slave_select();
+
+    stats_record_latency(AT25DF041B_OPERATION_TYPE_READ, start_us);
+    trace_record(AT25DF041B_OPERATION_TYPE_READ, addr, size, start_us);
+
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::program(const void *buffer, bd_addr_t addr, bd_size_t size) {
+    // A plain program is a vectored program with a single segment, which
+    // checks the ID and the range itself
+    AT25DF041BIOVec segment = { (void*) buffer, size };
+    return programv(&segment, 1, addr);
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::readv(const AT25DF041BIOVec *segments, int count, bd_addr_t addr) {
+    if (check_device_id() == -1)
+        return -1;
+
+    bd_size_t size = segments_size(segments, count);
+    if (!is_valid_operation(addr, size, AT25DF041B_OPERATION_TYPE_READ))
+        return -2;
+
+    uint32_t start_us = stats_timestamp();
+
+    // Reads can run across pages, so every segment goes in the one transaction
+    assert_slave_select();
+    send_read_command(addr);
+    for (int i = 0; i < count; i++) {
+        if (segments[i].size) {
+            bus_read(segments[i].buffer, segments[i].size);
+        }
+    }
     deassert_slave_select();
 
+    stats_record_latency(AT25DF041B_OPERATION_TYPE_READ, start_us);
+    trace_record(AT25DF041B_OPERATION_TYPE_READ, addr, size, start_us);
+
     return 0;
 }
 
-int AT25DF041B::program(const void *buffer, bd_addr_t addr, bd_size_t size) {
+template <typename Geometry>
+int AT25DF<Geometry>::programv(const AT25DF041BIOVec *segments, int count, bd_addr_t addr) {
     if (check_device_id() == -1)
         return -1;
 
-    if (!is_valid_operation(addr, size, AT25DF041B_OPERATION_TYPE_PROGRAM))
+    bd_size_t size = segments_size(segments, count);
+    if (!is_valid_operation(addr, size, AT25DF041B_OPERATION_TYPE_PROGRAM)
+            || is_locked(addr, size))
         return -2;
 
+    uint32_t start_us = stats_timestamp();
+
+    // Unprotect every sector the program touches before the first page
+    open_sectors(addr, size);
+
     int pages = boundary_crossings(addr, size) + 1;
 
+    segment_cursor cursor = { segments, 0 };
     bd_addr_t start = addr;
     bd_addr_t chunk_size;
     for (int i = 0; i < pages; i++) {
-        // Write protection is automatically enabled after
-        // a program operation by the AT25DF041B
-        disable_write_protection();
-
-        assert_slave_select();
-
         chunk_size = round_up_to_page_boundary(start) - start;
 
         // Last iteration, chunk size may be smaller
         if (i == pages - 1)
             chunk_size = (addr + size) - start;
 
-        // Perform program operation
-        _spi.write(AT25DF041B_BYTE_PAGE_PROGRAM);
-        send_address(start);
-        _spi.write(&(((char*) buffer)[(start - addr)]), chunk_size, NULL, 0);
+        // The previous page has to finish before the next can be sent
+        wait_if_busy();
+        mark_programmed(start, chunk_size);
 
-        deassert_slave_select();
+        // Write protection is automatically enabled after
+        // a program operation by the AT25DF041B
+        disable_write_protection();
 
-        // Blocking wait until the AT25DF041B finishes program operation
-        wait_for_ready();
+        segment_cursor page_start = cursor;
+        assert_slave_select();
+        send_command(AT25DF041B_BYTE_PAGE_PROGRAM);
+        send_address(start);
+        bus_write_segments(cursor, chunk_size);
+        deassert_slave_select();
+        _write_in_progress = true;
+
+        // Check the page straight away while it is still the most recent
+        // thing written, rather than making the caller read it all back later
+        if (_verify_on_write) {
+            wait_if_busy();
+            if (compare_segments(page_start, start, chunk_size)) {
+                return -3;
+            }
+        }
 
         start += chunk_size;
     }
 
+    // In deferred mode the last page is left to finish in the background
+    if (!_deferred_wait) {
+        wait_if_busy();
+    }
+
+    stats_record_latency(AT25DF041B_OPERATION_TYPE_PROGRAM, start_us);
+    trace_record(AT25DF041B_OPERATION_TYPE_PROGRAM, addr, size, start_us);
+
     return 0;
 }
 
-int AT25DF041B::erase(bd_addr_t addr, bd_size_t size) {
+template <typename Geometry>
+int AT25DF<Geometry>::fill(bd_addr_t addr, bd_size_t size, const void *pattern,
+        bd_size_t pattern_size) {
+    if (pattern == NULL || pattern_size == 0)
+        return -2;
+
+    // Short patterns are repeated across the tile so each transfer carries
+    // a useful amount of data, longer ones are streamed as they are
+    uint8_t tile[AT25DF041B_FILL_TILE_SIZE];
+    pattern_cursor cursor = { (const uint8_t*) pattern, pattern_size, pattern_size, 0 };
+    if (pattern_size <= sizeof(tile)) {
+        bd_size_t repeats = sizeof(tile) / pattern_size;
+        for (bd_size_t i = 0; i < repeats; i++) {
+            memcpy(&tile[i * pattern_size], pattern, pattern_size);
+        }
+        cursor.tile = tile;
+        cursor.tile_size = repeats * pattern_size;
+    }
+
+    return program_pattern(cursor, addr, size);
+}
+
+/** Tile zero() streams from */
+static const uint8_t zero_tile[AT25DF041B_FILL_TILE_SIZE] = { 0 };
+
+template <typename Geometry>
+int AT25DF<Geometry>::zero(bd_addr_t addr, bd_size_t size) {
+    pattern_cursor cursor = { zero_tile, sizeof(zero_tile), 1, 0 };
+    return program_pattern(cursor, addr, size);
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::erase(bd_addr_t addr, bd_size_t size) {
     if (check_device_id() == -1)
         return -1;
 
-    if (!is_valid_operation(addr, size, AT25DF041B_OPERATION_TYPE_ERASE))
+    if (!is_valid_operation(addr, size, AT25DF041B_OPERATION_TYPE_ERASE)
+            || is_locked(addr, size))
         return -2;
 
     /** TODO make it possible to select PAGE BYTE erase sizes */
-    //int sectors = size / AT25DF041B_PAGE_BYTE_SIZE;
-    //int sectors = size >> 8; // More efficient
     // For compatibility with our bootloader, we need 4kB erase sectors
-    //int sectors = size / 4096;
-    int sectors = size >> 12; // More efficient
+    // The block erase commands ignore the low address bits, so an unaligned
+    // address erases the sector it falls in
+    bd_addr_t start = addr & ~((bd_addr_t) sector_size - 1);
+    bd_addr_t end = start + size;
+
+    uint32_t start_us = stats_timestamp();
+
+    // Unprotect all of the sectors up front rather than block by block
+    open_sectors(start, end - start);
+
+    while (start < end) {
+        // Skip sectors that are still blank, trimmed sectors erased
+        // in the background end up here
+        if (test_sector(_erased, start >> Geometry::sector_shift)) {
+            start += sector_size;
+            continue;
+        }
 
-    bd_addr_t start = addr;
-    for (int i = 0; i < sectors; i++) {
+        // Coalesce into the largest aligned block erase that fits,
+        // these are much faster per byte than 4kB erases
+        uint8_t opcode = AT25DF041B_BLOCK_ERASE_4KB;
+        bd_size_t block = sector_size;
+        if (((start & (AT25DF041B_BLOCK_64KB_SIZE - 1)) == 0)
+                && ((end - start) >= AT25DF041B_BLOCK_64KB_SIZE)) {
+            opcode = AT25DF041B_BLOCK_ERASE_64KB;
+            block = AT25DF041B_BLOCK_64KB_SIZE;
+        } else if (((start & (AT25DF041B_BLOCK_32KB_SIZE - 1)) == 0)
+                && ((end - start) >= AT25DF041B_BLOCK_32KB_SIZE)) {
+            opcode = AT25DF041B_BLOCK_ERASE_32KB;
+            block = AT25DF041B_BLOCK_32KB_SIZE;
+        }
 
-        // Write protection is automatically enabled after
-        // an erase operation by the AT25DF041B
-        disable_write_protection();
+        erase_block(opcode, start, !_deferred_wait);
 
-        assert_slave_select();
-        //_spi.write(AT25DF041B_PAGE_ERASE_256B);
-        _spi.write(AT25DF041B_BLOCK_ERASE_4KB);
-        send_address(start);
-        deassert_slave_select();
+#if AT25DF041B_ENABLE_WEAR_TRACKING
+        wear_record(start, block);
+#endif
 
-        // Move to next 256B page
-        //start += AT25DF041B_PAGE_BYTE_SIZE;
+        start += block;
+    }
 
-        // Move to the next 4kB sector
-        start += 4096;
+    stats_record_latency(AT25DF041B_OPERATION_TYPE_ERASE, start_us);
+    trace_record(AT25DF041B_OPERATION_TYPE_ERASE, addr, size, start_us);
 
-        // Blocking wait until the AT25DF041B finishes erase operation
-        wait_for_ready();
+#if AT25DF041B_ENABLE_WEAR_TRACKING
+    if (_wear_enabled && _wear_pending_total >= AT25DF041B_WEAR_FLUSH_THRESHOLD) {
+        return wear_tracking_sync();
+    }
+#endif
+
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::trim(bd_addr_t addr, bd_size_t size) {
+    if (!is_valid_operation(addr, size, AT25DF041B_OPERATION_TYPE_ERASE)
+            || (addr & (sector_size - 1)) != 0 || is_locked(addr, size))
+        return -2;
+
+    trace_record(AT25DF041B_TRACE_TRIM, addr, size, stats_timestamp());
+
+    // Blank sectors have nothing to erase
+    for (bd_addr_t end = addr + size; addr < end; addr += sector_size) {
+        int sector = addr >> Geometry::sector_shift;
+        if (!test_sector(_erased, sector)) {
+            mark_sectors(_trimmed, addr, sector_size, true);
+        }
     }
 
     return 0;
 }
 
-bd_size_t AT25DF041B::get_read_size() const {
+template <typename Geometry>
+int AT25DF<Geometry>::sync() {
+    // Anything clocked out now would land in the middle of the open stream
+    if (_stream_remaining) {
+        return -1;
+    }
+
+    wait_if_busy();
+    int res = wear_tracking_sync();
+    if (blank_map_sync()) {
+        res = -1;
+    }
+
+    // Nothing is being written now, with auto-protect that means everything is protected
+    apply_protection(idle_protection());
+    return res;
+}
+
+template <typename Geometry>
+bd_size_t AT25DF<Geometry>::get_read_size() const {
     return 1;
 }
 
-bd_size_t AT25DF041B::get_program_size() const {
+template <typename Geometry>
+bd_size_t AT25DF<Geometry>::get_program_size() const {
     return 1;
 }
 
-bd_size_t AT25DF041B::get_erase_size() const {
-    //return AT25DF041B_PAGE_BYTE_SIZE;
-    return 4096;
+template <typename Geometry>
+bd_size_t AT25DF<Geometry>::get_erase_size() const {
+    //return page_size;
+    return sector_size;
+}
+
+template <typename Geometry>
+bd_size_t AT25DF<Geometry>::get_erase_size(bd_addr_t addr) const {
+    if (addr >= total_size) {
+        return 0;
+    }
+    return sector_size;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::get_erase_sizes(bd_size_t *sizes, int count) const {
+    bd_size_t supported[AT25DF041B_MAX_ERASE_SIZES];
+    int n = 0;
+
+    if (Geometry::page_erase) {
+        supported[n++] = page_size;
+    }
+    supported[n++] = sector_size;
+    supported[n++] = AT25DF041B_BLOCK_32KB_SIZE;
+    supported[n++] = AT25DF041B_BLOCK_64KB_SIZE;
+
+    for (int i = 0; i < n && i < count; i++) {
+        sizes[i] = supported[i];
+    }
+    return n;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::erase_page(bd_addr_t addr) {
+    if (!Geometry::page_erase)
+        return -1;
+
+    if (check_device_id() == -1)
+        return -1;
+
+    if ((addr & (page_size - 1)) || addr >= total_size
+            || is_locked(addr, page_size))
+        return -2;
+
+    uint32_t start_us = stats_timestamp();
+
+#if AT25DF041B_ENABLE_WEAR_TRACKING
+    // Flush here rather than after the erase, the device is idle right now
+    if (_wear_enabled && _wear_pending_total >= AT25DF041B_WEAR_FLUSH_THRESHOLD) {
+        wear_tracking_sync();
+    }
+#endif
+
+    open_sectors(addr, page_size);
+    erase_block(AT25DF041B_PAGE_ERASE_256B, addr, !_deferred_wait);
+
+#if AT25DF041B_ENABLE_WEAR_TRACKING
+    // Counts are per sector, a page erase wears it as much as any other
+    wear_record(addr, page_size);
+#endif
+
+    stats_record_latency(AT25DF041B_OPERATION_TYPE_ERASE, start_us);
+    trace_record(AT25DF041B_OPERATION_TYPE_ERASE, addr, page_size, start_us);
+
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::get_littlefs_preset(bd_size_t erase_size,
+        AT25DF041BFilesystemPreset *preset) const {
+    if (erase_size != sector_size && erase_size != AT25DF041B_BLOCK_32KB_SIZE
+            && erase_size != AT25DF041B_BLOCK_64KB_SIZE)
+        return -2;
+
+    // One bit of lookahead per block, rounded up to the 8 byte multiple
+    // LittleFS needs, so a single scan finds every free block
+    bd_size_t blocks = total_size / erase_size;
+    bd_size_t lookahead = ((blocks + 63) / 64) * 8;
+
+    preset->block_size = erase_size;
+    // Fewer, larger blocks each see more writes, so move metadata sooner
+    preset->block_cycles = (erase_size == sector_size) ? 500 : 100;
+    // A page-sized cache turns each flush into one page program
+    preset->cache_size = page_size;
+    preset->lookahead_size = lookahead;
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::get_fat_preset(bd_size_t erase_size,
+        AT25DF041BFilesystemPreset *preset) const {
+    if (erase_size != sector_size && erase_size != AT25DF041B_BLOCK_32KB_SIZE
+            && erase_size != AT25DF041B_BLOCK_64KB_SIZE)
+        return -2;
+
+    preset->block_size = erase_size;
+    preset->block_cycles = 0;
+    preset->cache_size = 0;
+    preset->lookahead_size = 0;
+    return 0;
 }
 
-int AT25DF041B::get_erase_value() const {
+template <typename Geometry>
+int AT25DF<Geometry>::get_erase_value() const {
     return AT25DF041B_ERASE_VALUE;
 }
 
-bd_size_t AT25DF041B::size() const {
-    return AT25DF041B_TOTAL_BYTE_SIZE;
+template <typename Geometry>
+bd_size_t AT25DF<Geometry>::size() const {
+    return total_size;
 }
 
-const char* AT25DF041B::get_type() const {
-    static char bd_type_name[] = "AT25DF041B";
-    return bd_type_name;
+template <typename Geometry>
+const char* AT25DF<Geometry>::get_type() const {
+    return Geometry::name();
 }
 
-int AT25DF041B::enter_standby(void) {
+template <typename Geometry>
+int AT25DF<Geometry>::enter_standby(void) {
+    if (_stream_remaining) {
+        return -1;
+    }
+
+    wait_if_busy();
+
     assert_slave_select();
-    _spi.write(AT25DF041B_ULTRA_POWER_DOWN);
+    send_command(AT25DF041B_ULTRA_POWER_DOWN);
     deassert_slave_select();
     return 0;
 }
 
-int AT25DF041B::exit_standby(void) {
+template <typename Geometry>
+int AT25DF<Geometry>::exit_standby(void) {
+    // The chip is awake and a CS pulse would end the open stream
+    if (_stream_remaining) {
+        return -1;
+    }
 
     // If the AT25DF041B is in ultra deep power down, this will wake it up
     assert_slave_select();
@@ -210,73 +535,94 @@ int AT25DF041B::exit_standby(void) {
         return -1;
 }
 
-void AT25DF041B::perform_chip_erase(int magic_word) {
+template <typename Geometry>
+void AT25DF<Geometry>::perform_chip_erase(int magic_word) {
     // Not for use in production firmware
 #ifndef NDEBUG
-    if (magic_word == AT25DF041B_CHIP_ERASE_MAGIC_WORD) {
+    // The AT25DF041B ignores a chip erase while any sector is protected
+    if (magic_word == AT25DF041B_CHIP_ERASE_MAGIC_WORD && !_locked && !_stream_remaining) {
+        apply_protection(0);
+        wait_if_busy();
         disable_write_protection();
         assert_slave_select();
-        _spi.write(AT25DF041B_CHIP_ERASE_2);
+        send_command(AT25DF041B_CHIP_ERASE_2);
         deassert_slave_select();
 
         // NOTE this will wait for a long time!
         wait_for_ready();
+
+        memset(_trimmed, 0, sizeof(_trimmed));
+        mark_sectors(_erased, 0, total_size, true);
+        mark_sectors(_known, 0, total_size, true);
     }
 #endif
 }
 
-void AT25DF041B::enable_write_protection(void) {
+template <typename Geometry>
+void AT25DF<Geometry>::enable_write_protection(void) {
     // Issue write disable command
     assert_slave_select();
-    _spi.write(AT25DF041B_WRITE_DISABLE);
+    send_command(AT25DF041B_WRITE_DISABLE);
     deassert_slave_select();
 }
 
-void AT25DF041B::disable_write_protection(void) {
+template <typename Geometry>
+void AT25DF<Geometry>::disable_write_protection(void) {
     // Issue write enable command
     assert_slave_select();
-    _spi.write(AT25DF041B_WRITE_ENABLE);
+    send_command(AT25DF041B_WRITE_ENABLE);
     deassert_slave_select();
 }
 
-uint8_t AT25DF041B::get_status_register(void) {
+template <typename Geometry>
+uint8_t AT25DF<Geometry>::get_status_register(void) {
     uint8_t status;
     assert_slave_select();
-    _spi.write(AT25DF041B_READ_STATUS_REG);
-    status = _spi.write(AT25DF041B_DUMMY_BYTE);
+    send_command(AT25DF041B_READ_STATUS_REG);
+    status = bus_read_byte();
     deassert_slave_select();
     return status;
 }
 
-void AT25DF041B::get_device_id(uint8_t *id) {
+template <typename Geometry>
+void AT25DF<Geometry>::get_device_id(uint8_t *id) {
     assert_slave_select();
-    _spi.write(AT25DF041B_READ_MFG_AND_DEV_ID);
-    for (int i = 0; i < 3; i++) {
-        id[i] = _spi.write(AT25DF041B_DUMMY_BYTE);
-    }
+    send_command(AT25DF041B_READ_MFG_AND_DEV_ID);
+    bus_read(id, 3);
     deassert_slave_select();
 }
 
-int AT25DF041B::check_device_id(void) {
+template <typename Geometry>
+int AT25DF<Geometry>::check_device_id(void) {
+    // Every operation checks the ID first, so this also keeps them
+    // from clocking commands into the middle of an open stream
+    if (_stream_remaining) {
+        return -1;
+    }
+
+    // The AT25DF041B ignores everything but status reads while it is busy
+    wait_if_busy();
+
     uint8_t id[3];
     get_device_id(id);
 
-    if (id[0] != AT25DF041B_MANUFACTURER_ID)
+    if (id[0] != Geometry::manufacturer_id)
         return -1;
-    if (id[1] != AT25DF041B_DEVICE_ID_BYTE_1)
+    if (id[1] != Geometry::device_id_1)
         return -1;
-    if (id[2] != AT25DF041B_DEVICE_ID_BYTE_2)
+    if (id[2] != Geometry::device_id_2)
         return -1;
 
     return 0;
 }
 
-bool AT25DF041B::is_valid_operation(bd_addr_t addr, bd_size_t size, int type) {
+template <typename Geometry>
+bool AT25DF<Geometry>::is_valid_operation(bd_addr_t addr, bd_size_t size, int type) {
     switch (type) {
     case AT25DF041B_OPERATION_TYPE_ERASE:
         // If the size is not erase-block aligned, invalid
-        //if(((size % AT25DF041B_PAGE_BYTE_SIZE) != 0))
-        if (((size % 4096) != 0)) {
+        //if(((size % page_size) != 0))
+        if ((size & (sector_size - 1)) != 0) {
             return false;
         }
         // fall through to next cases
@@ -288,8 +634,8 @@ bool AT25DF041B::is_valid_operation(bd_addr_t addr, bd_size_t size, int type) {
 
     case AT25DF041B_OPERATION_TYPE_READ:
         // Out of bounds are invalid
-        if (addr >= AT25DF041B_TOTAL_BYTE_SIZE
-                || (addr + size) > AT25DF041B_TOTAL_BYTE_SIZE) {
+        if (addr >= total_size
+                || (addr + size) > total_size) {
             return false;
         }
         // fall through to next cases
@@ -307,25 +653,1838 @@ bool AT25DF041B::is_valid_operation(bd_addr_t addr, bd_size_t size, int type) {
     return true;
 }
 
-int AT25DF041B::boundary_crossings(bd_addr_t addr, bd_size_t size) {
+template <typename Geometry>
+int AT25DF<Geometry>::boundary_crossings(bd_addr_t addr, bd_size_t size) {
     // Calculate the pages of start and end addresses
-    //bd_addr_t start_page = addr >> 8; // / AT25DF041B_PAGE_BYTE_SIZE;
-    //bd_addr_t end_page = (addr + (size - 1)) >> 8;
+    //bd_addr_t start_page = addr >> page_shift; // / page_size;
+    //bd_addr_t end_page = (addr + (size - 1)) >> page_shift;
 
-    return (((addr + (size - 1)) >> 8) - (addr >> 8));
+    return (((addr + (size - 1)) >> Geometry::page_shift)
+            - (addr >> Geometry::page_shift));
 }
 
-void AT25DF041B::send_address(bd_addr_t addr) {
+template <typename Geometry>
+void AT25DF<Geometry>::bus_write(const void *buffer, bd_size_t size) {
+#if AT25DF041B_ENABLE_STATS
+    _stats.bytes_out += size;
+#endif
+    if (_burst_length + size <= AT25DF041B_BURST_SIZE) {
+        memcpy(&_burst[_burst_length], buffer, size);
+        _burst_length += size;
+        return;
+    }
+
+    bus_flush();
+    _spi.write((const char*) buffer, size, NULL, 0);
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::bus_read(void *buffer, bd_size_t size) {
+#if AT25DF041B_ENABLE_STATS
+    _stats.bytes_in += size;
+#endif
+    if (_burst_length && _burst_length + size <= AT25DF041B_BURST_SIZE) {
+        // The staged bytes go out while the first ones come back,
+        // the data follows in the same transfer
+        char rx[AT25DF041B_BURST_SIZE];
+        _spi.write((const char*) _burst, _burst_length, rx, _burst_length + size);
+        memcpy(buffer, &rx[_burst_length], size);
+        _burst_length = 0;
+        return;
+    }
+
+    bus_flush();
+    _spi.write(NULL, 0, (char*) buffer, size);
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::send_address(bd_addr_t addr) {
     char address_bytes[3] = { (char) ((addr & 0xFF0000) >> 16), (char) ((addr
             & 0x00FF00) >> 8), (char) ((addr & 0x0000FF) >> 0) };
-    _spi.write(address_bytes, 3, NULL, 0);
+    bus_write(address_bytes, 3);
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::erase_block(uint8_t opcode, bd_addr_t addr, bool wait) {
+    wait_if_busy();
+
+    bd_size_t block = sector_size;
+    if (opcode == AT25DF041B_BLOCK_ERASE_64KB) {
+        block = AT25DF041B_BLOCK_64KB_SIZE;
+    } else if (opcode == AT25DF041B_BLOCK_ERASE_32KB) {
+        block = AT25DF041B_BLOCK_32KB_SIZE;
+    } else if (opcode == AT25DF041B_PAGE_ERASE_256B) {
+        block = page_size;
+    }
+
+    // A page erase leaves the rest of its sector as it was
+    if (block >= sector_size) {
+        mark_sectors(_erased, addr, block, true);
+        mark_sectors(_trimmed, addr, block, false);
+        mark_sectors(_known, addr, block, true);
+    }
+    unprotect_sectors(addr, block);
+
+    // Write protection is automatically enabled after
+    // an erase operation by the AT25DF041B
+    disable_write_protection();
+
+    assert_slave_select();
+    send_command(opcode);
+    send_address(addr);
+    deassert_slave_select();
+
+    // Blocking wait until the AT25DF041B finishes erase operation
+    if (wait) {
+        wait_for_ready();
+    } else {
+        _write_in_progress = true;
+    }
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::program_page(const void *buffer, bd_addr_t addr, bd_size_t size,
+        bool wait) {
+    wait_if_busy();
+
+    mark_programmed(addr, size);
+    unprotect_sectors(addr, size);
+
+    // Write protection is automatically enabled after
+    // a program operation by the AT25DF041B
+    disable_write_protection();
+
+    assert_slave_select();
+    send_command(AT25DF041B_BYTE_PAGE_PROGRAM);
+    send_address(addr);
+    bus_write(buffer, size);
+    deassert_slave_select();
+
+    // Blocking wait until the AT25DF041B finishes program operation
+    if (wait) {
+        wait_for_ready();
+    } else {
+        _write_in_progress = true;
+    }
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::compare(const void *buffer, bd_addr_t addr, bd_size_t size) {
+    const uint8_t *expected = (const uint8_t*) buffer;
+    uint8_t chunk[AT25DF041B_VERIFY_CHUNK_SIZE];
+    int result = 0;
+
+    assert_slave_select();
+    send_read_command(addr);
+    while (size) {
+        bd_size_t length = (size < sizeof(chunk)) ? size : sizeof(chunk);
+        bus_read(chunk, length);
+        if (memcmp(chunk, expected, length) != 0) {
+            result = -1;
+            break;
+        }
+        expected += length;
+        size -= length;
+    }
+    deassert_slave_select();
+
+    return result;
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::bus_write_segments(segment_cursor &cursor, bd_size_t size) {
+    while (size) {
+        bd_size_t length = cursor.segment->size - cursor.offset;
+        if (length > size) {
+            length = size;
+        }
+        if (length) {
+            bus_write((const char*) cursor.segment->buffer + cursor.offset, length);
+        }
+        size -= length;
+        cursor.offset += length;
+
+        // Move on once this segment is used up, skipping empty ones
+        if (cursor.offset == cursor.segment->size) {
+            cursor.segment++;
+            cursor.offset = 0;
+        }
+    }
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::compare_segments(segment_cursor &cursor, bd_addr_t addr,
+        bd_size_t size) {
+    while (size) {
+        bd_size_t length = cursor.segment->size - cursor.offset;
+        if (length > size) {
+            length = size;
+        }
+        if (length
+                && compare((const char*) cursor.segment->buffer + cursor.offset, addr,
+                        length)) {
+            return -1;
+        }
+        addr += length;
+        size -= length;
+        cursor.offset += length;
+
+        if (cursor.offset == cursor.segment->size) {
+            cursor.segment++;
+            cursor.offset = 0;
+        }
+    }
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::program_pattern(pattern_cursor &cursor, bd_addr_t addr,
+        bd_size_t size) {
+    if (check_device_id() == -1)
+        return -1;
+
+    if (!is_valid_operation(addr, size, AT25DF041B_OPERATION_TYPE_PROGRAM)
+            || is_locked(addr, size))
+        return -2;
+
+    uint32_t start_us = stats_timestamp();
+
+    open_sectors(addr, size);
+
+    int pages = boundary_crossings(addr, size) + 1;
+
+    bd_addr_t start = addr;
+    bd_addr_t chunk_size;
+    for (int i = 0; i < pages; i++) {
+        chunk_size = round_up_to_page_boundary(start) - start;
+
+        // Last iteration, chunk size may be smaller
+        if (i == pages - 1)
+            chunk_size = (addr + size) - start;
+
+        wait_if_busy();
+        mark_programmed(start, chunk_size);
+        disable_write_protection();
+
+        pattern_cursor page_start = cursor;
+        assert_slave_select();
+        send_command(AT25DF041B_BYTE_PAGE_PROGRAM);
+        send_address(start);
+        bus_write_pattern(cursor, chunk_size);
+        deassert_slave_select();
+        _write_in_progress = true;
+
+        if (_verify_on_write) {
+            wait_if_busy();
+            if (compare_pattern(page_start, start, chunk_size)) {
+                return -3;
+            }
+        }
+
+        start += chunk_size;
+    }
+
+    if (!_deferred_wait) {
+        wait_if_busy();
+    }
+
+    stats_record_latency(AT25DF041B_OPERATION_TYPE_PROGRAM, start_us);
+    trace_record(AT25DF041B_OPERATION_TYPE_PROGRAM, addr, size, start_us);
+
+    return 0;
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::bus_write_pattern(pattern_cursor &cursor, bd_size_t size) {
+    while (size) {
+        bd_size_t length = cursor.tile_size - cursor.phase;
+        if (length > size) {
+            length = size;
+        }
+        bus_write(&cursor.tile[cursor.phase], length);
+        cursor.phase = (cursor.phase + length) % cursor.pattern_size;
+        size -= length;
+    }
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::compare_pattern(pattern_cursor &cursor, bd_addr_t addr,
+        bd_size_t size) {
+    uint8_t chunk[AT25DF041B_VERIFY_CHUNK_SIZE];
+    int result = 0;
+
+    assert_slave_select();
+    send_read_command(addr);
+    while (size) {
+        bd_size_t length = cursor.tile_size - cursor.phase;
+        if (length > size) {
+            length = size;
+        }
+        if (length > sizeof(chunk)) {
+            length = sizeof(chunk);
+        }
+        bus_read(chunk, length);
+        if (memcmp(chunk, &cursor.tile[cursor.phase], length) != 0) {
+            result = -1;
+            break;
+        }
+        cursor.phase = (cursor.phase + length) % cursor.pattern_size;
+        size -= length;
+    }
+    deassert_slave_select();
+
+    return result;
+}
+
+template <typename Geometry>
+bd_size_t AT25DF<Geometry>::segments_size(const AT25DF041BIOVec *segments, int count) {
+    bd_size_t size = 0;
+    for (int i = 0; i < count; i++) {
+        size += segments[i].size;
+    }
+    return size;
 }
 
-void AT25DF041B::wait_for_ready(void) {
+template <typename Geometry>
+void AT25DF<Geometry>::wait_for_ready(void) {
     uint8_t status = 0;
     do {
+#if AT25DF041B_ENABLE_STATS
+        _stats.status_polls++;
+#endif
         status = get_status_register();
     } while (status & AT25DF041B_STATUS_READY_BUSY_BIT);
 }
 
+template <typename Geometry>
+const AT25DF041BStats &AT25DF<Geometry>::get_stats(void) const {
+#if AT25DF041B_ENABLE_STATS
+    return _stats;
+#else
+    static const AT25DF041BStats no_stats = { };
+    return no_stats;
+#endif
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::reset_stats(void) {
+#if AT25DF041B_ENABLE_STATS
+    memset(&_stats, 0, sizeof(_stats));
+#endif
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::format_stats(char *buffer, size_t size) const {
+    static const char *type_names[AT25DF041B_OPERATION_TYPE_COUNT] = { "read",
+            "program", "erase" };
+    const AT25DF041BStats &stats = get_stats();
+    int total = 0;
+
+    // snprintf returns the length it would have written, keep advancing
+    // through the buffer like it does so the caller can size a retry
+#define AT25DF041B_STATS_PRINT(...) do { \
+        size_t offset = ((size_t) total < size) ? total : size; \
+        int n = snprintf(buffer + offset, size - offset, __VA_ARGS__); \
+        if (n < 0) return n; \
+        total += n; \
+    } while (0)
+
+    if (size == 0) {
+        buffer = NULL;
+    }
+
+    AT25DF041B_STATS_PRINT("bus: out=%llu in=%llu cs=%lu polls=%lu\n",
+            (unsigned long long) stats.bytes_out,
+            (unsigned long long) stats.bytes_in,
+            (unsigned long) stats.cs_assertions,
+            (unsigned long) stats.status_polls);
+
+    for (int i = 0; i < AT25DF041B_STATS_OPCODE_SLOTS; i++) {
+        if (stats.commands[i].count) {
+            AT25DF041B_STATS_PRINT("cmd 0x%02X: %lu\n", stats.commands[i].opcode,
+                    (unsigned long) stats.commands[i].count);
+        }
+    }
+    if (stats.commands_dropped) {
+        AT25DF041B_STATS_PRINT("cmd other: %lu\n",
+                (unsigned long) stats.commands_dropped);
+    }
+
+    for (int type = 0; type < AT25DF041B_OPERATION_TYPE_COUNT; type++) {
+        AT25DF041B_STATS_PRINT("%s: max=%luus", type_names[type],
+                (unsigned long) stats.latency_max_us[type]);
+        for (int b = 0; b < AT25DF041B_STATS_LATENCY_BUCKETS; b++) {
+            if (stats.latency[type][b]) {
+                // Print the exclusive upper bound of each bucket
+                AT25DF041B_STATS_PRINT(" <%lu:%lu", 1UL << b,
+                        (unsigned long) stats.latency[type][b]);
+            }
+        }
+        AT25DF041B_STATS_PRINT("\n");
+    }
+
+#undef AT25DF041B_STATS_PRINT
+
+    return total;
+}
+
+/** Appends a little-endian value to a binary stats report, trace or blank map checkpoint */
+static uint8_t *put_le(uint8_t *out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        *out++ = (uint8_t) (value >> (8 * i));
+    }
+    return out;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::export_stats(void *buffer, size_t size) const {
+    const AT25DF041BStats &stats = get_stats();
+
+    // Work out the size up front so we never write a partial report
+    size_t needed = 4 + 1 + 1 + 4 + 8 + 8 + 4 + 4 + 1;
+    uint8_t opcodes = 0;
+    for (int i = 0; i < AT25DF041B_STATS_OPCODE_SLOTS; i++) {
+        if (stats.commands[i].count) {
+            opcodes++;
+        }
+    }
+    needed += opcodes * 5;
+    uint8_t buckets = 0;
+    for (int type = 0; type < AT25DF041B_OPERATION_TYPE_COUNT; type++) {
+        needed += 4;
+        for (int b = 0; b < AT25DF041B_STATS_LATENCY_BUCKETS; b++) {
+            if (stats.latency[type][b]) {
+                buckets++;
+            }
+        }
+    }
+    needed += buckets * 6;
+
+    if (needed > size) {
+        return -1;
+    }
+
+    // Header
+    uint8_t *out = (uint8_t*) buffer;
+    out = put_le(out, AT25DF041B_STATS_MAGIC, 4);
+    out = put_le(out, AT25DF041B_STATS_VERSION, 1);
+
+    // Opcode counters as (opcode, count) pairs
+    out = put_le(out, opcodes, 1);
+    for (int i = 0; i < AT25DF041B_STATS_OPCODE_SLOTS; i++) {
+        if (stats.commands[i].count) {
+            out = put_le(out, stats.commands[i].opcode, 1);
+            out = put_le(out, stats.commands[i].count, 4);
+        }
+    }
+    out = put_le(out, stats.commands_dropped, 4);
+
+    // Bus counters
+    out = put_le(out, stats.bytes_out, 8);
+    out = put_le(out, stats.bytes_in, 8);
+    out = put_le(out, stats.cs_assertions, 4);
+    out = put_le(out, stats.status_polls, 4);
+
+    // Latency maximums then sparse histograms as (type, bucket, count)
+    for (int type = 0; type < AT25DF041B_OPERATION_TYPE_COUNT; type++) {
+        out = put_le(out, stats.latency_max_us[type], 4);
+    }
+    out = put_le(out, buckets, 1);
+    for (int type = 0; type < AT25DF041B_OPERATION_TYPE_COUNT; type++) {
+        for (int b = 0; b < AT25DF041B_STATS_LATENCY_BUCKETS; b++) {
+            if (stats.latency[type][b]) {
+                out = put_le(out, type, 1);
+                out = put_le(out, b, 1);
+                out = put_le(out, stats.latency[type][b], 4);
+            }
+        }
+    }
+
+    return out - (uint8_t*) buffer;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::get_trace(AT25DF041BTraceRecord *records, int count) const {
+#if AT25DF041B_ENABLE_TRACE
+    uint32_t available = _trace_count;
+    if (available > AT25DF041B_TRACE_ENTRIES) {
+        available = AT25DF041B_TRACE_ENTRIES;
+    }
+    if ((uint32_t) count > available) {
+        count = available;
+    }
+
+    // The newest count records, oldest first
+    uint32_t first = _trace_count - count;
+    for (int i = 0; i < count; i++) {
+        records[i] = _trace[(first + i) & (AT25DF041B_TRACE_ENTRIES - 1)];
+    }
+    return count;
+#else
+    return 0;
+#endif
+}
+
+template <typename Geometry>
+uint32_t AT25DF<Geometry>::get_trace_dropped(void) const {
+#if AT25DF041B_ENABLE_TRACE
+    if (_trace_count > AT25DF041B_TRACE_ENTRIES) {
+        return _trace_count - AT25DF041B_TRACE_ENTRIES;
+    }
+#endif
+    return 0;
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::reset_trace(void) {
+#if AT25DF041B_ENABLE_TRACE
+    _trace_count = 0;
+#endif
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::export_trace(void *buffer, size_t size) const {
+#if AT25DF041B_ENABLE_TRACE
+    uint32_t count = _trace_count - get_trace_dropped();
+#else
+    uint32_t count = 0;
+#endif
+
+    if (4 + 1 + 4 + 4 + count * AT25DF041B_TRACE_RECORD_SIZE > size) {
+        return -1;
+    }
+
+    uint8_t *out = (uint8_t*) buffer;
+    out = put_le(out, AT25DF041B_TRACE_MAGIC, 4);
+    out = put_le(out, AT25DF041B_TRACE_VERSION, 1);
+    out = put_le(out, count, 4);
+    out = put_le(out, get_trace_dropped(), 4);
+
+#if AT25DF041B_ENABLE_TRACE
+    for (uint32_t i = _trace_count - count; i != _trace_count; i++) {
+        const AT25DF041BTraceRecord &record = _trace[i & (AT25DF041B_TRACE_ENTRIES - 1)];
+        out = put_le(out, record.timestamp_us, 4);
+        out = put_le(out, record.duration_us | ((uint32_t) record.op << 24), 4);
+        out = put_le(out, record.addr, 4);
+        out = put_le(out, record.size, 4);
+    }
+#endif
+
+    return out - (uint8_t*) buffer;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::program_page_async(const void *buffer, bd_addr_t addr,
+        bd_size_t size) {
+    if (check_device_id() == -1)
+        return -1;
+
+    if (!is_valid_operation(addr, size, AT25DF041B_OPERATION_TYPE_PROGRAM)
+            || boundary_crossings(addr, size) != 0 || is_locked(addr, size))
+        return -2;
+
+    open_sectors(addr, size);
+    program_page(buffer, addr, size, false);
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::erase_block_async(bd_addr_t addr, bd_size_t size) {
+    uint8_t opcode;
+    switch (size) {
+    case sector_size:
+        opcode = AT25DF041B_BLOCK_ERASE_4KB;
+        break;
+    case AT25DF041B_BLOCK_32KB_SIZE:
+        opcode = AT25DF041B_BLOCK_ERASE_32KB;
+        break;
+    case AT25DF041B_BLOCK_64KB_SIZE:
+        opcode = AT25DF041B_BLOCK_ERASE_64KB;
+        break;
+    default:
+        return -2;
+    }
+
+    if (check_device_id() == -1)
+        return -1;
+
+    if ((addr & (size - 1)) != 0
+            || !is_valid_operation(addr, size, AT25DF041B_OPERATION_TYPE_ERASE)
+            || is_locked(addr, size))
+        return -2;
+
+#if AT25DF041B_ENABLE_WEAR_TRACKING
+    // Flush here rather than after the erase, the device is idle right now
+    if (_wear_enabled && _wear_pending_total >= AT25DF041B_WEAR_FLUSH_THRESHOLD) {
+        wear_tracking_sync();
+    }
+#endif
+
+    open_sectors(addr, size);
+    erase_block(opcode, addr, false);
+
+#if AT25DF041B_ENABLE_WEAR_TRACKING
+    wear_record(addr, size);
+#endif
+
+    return 0;
+}
+
+template <typename Geometry>
+bool AT25DF<Geometry>::is_busy(void) {
+    if (!_write_in_progress) {
+        return false;
+    }
+
+#if AT25DF041B_ENABLE_STATS
+    _stats.status_polls++;
+#endif
+    if (get_status_register() & AT25DF041B_STATUS_READY_BUSY_BIT) {
+        return true;
+    }
+
+    _write_in_progress = false;
+    return false;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::background_erase(void) {
+    int trimmed = count_sectors(_trimmed);
+    if (trimmed == 0 || _stream_remaining || is_busy()) {
+        return trimmed;
+    }
+
+    int sector = 0;
+    while (!test_sector(_trimmed, sector)) {
+        sector++;
+    }
+
+    // Grow the block while it stays aligned and every sector in it is trimmed
+    bd_addr_t addr = (bd_addr_t) sector << Geometry::sector_shift;
+    bd_size_t block = sector_size;
+    const bd_size_t candidates[] = { AT25DF041B_BLOCK_64KB_SIZE, AT25DF041B_BLOCK_32KB_SIZE };
+    for (unsigned i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+        if ((addr & (candidates[i] - 1)) || addr + candidates[i] > total_size) {
+            continue;
+        }
+        bool all_trimmed = true;
+        for (bd_addr_t offset = 0; offset < candidates[i]; offset += sector_size) {
+            if (!test_sector(_trimmed, (addr + offset) >> Geometry::sector_shift)) {
+                all_trimmed = false;
+                break;
+            }
+        }
+        if (all_trimmed) {
+            block = candidates[i];
+            break;
+        }
+    }
+
+    if (erase_block_async(addr, block)) {
+        return -1;
+    }
+
+    return trimmed - (block >> Geometry::sector_shift);
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::lock_sectors(bd_addr_t addr, bd_size_t size) {
+    if (Geometry::protect_shift == 0)
+        return -1;
+
+    if ((addr & (protect_size - 1)) != 0 || (size & (protect_size - 1)) != 0
+            || !is_valid_operation(addr, size, AT25DF041B_OPERATION_TYPE_ERASE))
+        return -2;
+
+    _locked |= protect_mask(addr, size);
+
+    // Locked sectors are never erased in the background
+    mark_sectors(_trimmed, addr, size, false);
+
+    // Before init() the AT25DF041B may still be in deep power down, init() applies the locks then
+    if (check_device_id() == 0) {
+        apply_protection(idle_protection());
+    }
+
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::unlock_sectors(bd_addr_t addr, bd_size_t size) {
+    if (Geometry::protect_shift == 0)
+        return -1;
+
+    if ((addr & (protect_size - 1)) != 0 || (size & (protect_size - 1)) != 0
+            || !is_valid_operation(addr, size, AT25DF041B_OPERATION_TYPE_ERASE))
+        return -2;
+
+    _locked &= ~protect_mask(addr, size);
+
+    if (check_device_id() == 0) {
+        apply_protection(idle_protection());
+    }
+
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::set_auto_protect(bool enable) {
+    if (Geometry::protect_shift == 0)
+        return -1;
+
+    _auto_protect = enable;
+
+    if (check_device_id() == 0) {
+        apply_protection(idle_protection());
+    }
+
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::refresh_protection(void) {
+    if (check_device_id() == -1)
+        return -1;
+
+    if (Geometry::protect_shift == 0)
+        return 0;
+
+    uint32_t state = 0;
+    for (int i = 0; i < protect_count; i++) {
+        assert_slave_select();
+        send_command(AT25DF041B_READ_PROTECT_REG);
+        send_address((bd_addr_t) i * protect_size);
+        if (bus_read_byte()) {
+            state |= 1u << i;
+        }
+        deassert_slave_select();
+    }
+    _protected = state;
+
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::load_otp(void) {
+    if (_otp_cached) {
+        return 0;
+    }
+
+    if (Geometry::otp_size == 0 || check_device_id() == -1)
+        return -1;
+
+    assert_slave_select();
+    send_command(AT25DF041B_READ_OTP_SEC_REG);
+    send_address(0);
+    for (int i = 0; i < AT25DF041B_OTP_READ_DUMMY_BYTES; i++) {
+        bus_write_byte(AT25DF041B_DUMMY_BYTE);
+    }
+    bus_read(_otp, sizeof(_otp));
+    deassert_slave_select();
+
+    _otp_cached = true;
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::read_user_otp(void *buffer, bd_size_t offset, bd_size_t size) {
+    if (offset > AT25DF041B_OTP_USER_SIZE || size > AT25DF041B_OTP_USER_SIZE - offset)
+        return -2;
+
+    if (load_otp())
+        return -1;
+
+    memcpy(buffer, &_otp[AT25DF041B_OTP_USER_OFFSET + offset], size);
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::program_user_otp(const void *buffer, bd_size_t offset,
+        bd_size_t size, int magic_word) {
+    if (magic_word != AT25DF041B_OTP_MAGIC_WORD)
+        return -1;
+
+    if (offset > AT25DF041B_OTP_USER_SIZE || size > AT25DF041B_OTP_USER_SIZE - offset
+            || size == 0)
+        return -2;
+
+    if (load_otp())
+        return -1;
+
+    // Programmed bits can never be set again, refuse rather than corrupt them
+    for (bd_size_t i = 0; i < size; i++) {
+        if (_otp[AT25DF041B_OTP_USER_OFFSET + offset + i] != AT25DF041B_ERASE_VALUE) {
+            return -1;
+        }
+    }
+
+    if (check_device_id() == -1)
+        return -1;
+
+    disable_write_protection();
+    assert_slave_select();
+    send_command(AT25DF041B_PROGRAM_OTP_SEC_REG);
+    send_address(AT25DF041B_OTP_USER_OFFSET + offset);
+    bus_write(buffer, size);
+    deassert_slave_select();
+    wait_for_ready();
+
+    // Read back what actually stuck
+    _otp_cached = false;
+    if (load_otp())
+        return -1;
+
+    if (memcmp(&_otp[AT25DF041B_OTP_USER_OFFSET + offset], buffer, size) != 0)
+        return -3;
+
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::read_unique_id(uint8_t id[AT25DF041B_OTP_FACTORY_SIZE]) {
+    if (load_otp())
+        return -1;
+
+    memcpy(id, &_otp[AT25DF041B_OTP_FACTORY_OFFSET], AT25DF041B_OTP_FACTORY_SIZE);
+    return 0;
+}
+
+template <typename Geometry>
+uint32_t AT25DF<Geometry>::protect_mask(bd_addr_t addr, bd_size_t size) {
+    uint32_t first = addr / protect_size;
+    uint32_t last = (addr + size - 1) / protect_size;
+    uint32_t below_end = (last >= 31) ? 0xFFFFFFFF : ((1u << (last + 1)) - 1);
+    return below_end & ~((1u << first) - 1);
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::apply_protection(uint32_t mask) {
+    uint32_t changed = mask ^ _protected;
+    if (!changed) {
+        return;
+    }
+
+    // Protection commands are ignored while a program or erase is running
+    wait_if_busy();
+
+    // Protecting or unprotecting everything is a single status register
+    // write however many sectors change
+    if ((mask == 0 || mask == protect_all) && (changed & (changed - 1))) {
+        disable_write_protection();
+        assert_slave_select();
+        send_command(AT25DF041B_WRITE_STATUS_REG);
+        bus_write_byte(mask ? AT25DF041B_GLOBAL_PROTECT : AT25DF041B_GLOBAL_UNPROTECT);
+        deassert_slave_select();
+        _protected = mask;
+        return;
+    }
+
+    for (int i = 0; i < protect_count; i++) {
+        if ((changed >> i) & 1) {
+            // Each protect or unprotect needs its own write enable
+            disable_write_protection();
+            assert_slave_select();
+            send_command(((mask >> i) & 1) ? AT25DF041B_PROTECT_SECTOR
+                    : AT25DF041B_UNPROTECT_SECTOR);
+            send_address((bd_addr_t) i * protect_size);
+            deassert_slave_select();
+        }
+    }
+    _protected = mask;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::find_erased(bd_addr_t addr, bd_addr_t *erased) const {
+    for (int sector = addr >> Geometry::sector_shift; sector < sector_count; sector++) {
+        if (test_sector(_erased, sector)) {
+            *erased = (bd_addr_t) sector << Geometry::sector_shift;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::mark_sectors(uint32_t *map, bd_addr_t addr, bd_size_t size,
+        bool value) {
+    int first = addr >> Geometry::sector_shift;
+    int last = (addr + size - 1) >> Geometry::sector_shift;
+    for (int sector = first; sector <= last; sector++) {
+        if (value) {
+            map[sector >> 5] |= (uint32_t) 1 << (sector & 31);
+        } else {
+            map[sector >> 5] &= ~((uint32_t) 1 << (sector & 31));
+        }
+    }
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::count_sectors(const uint32_t *map) {
+    int count = 0;
+    for (int i = 0; i < sector_map_words; i++) {
+        for (uint32_t word = map[i]; word; word &= word - 1) {
+            count++;
+        }
+    }
+    return count;
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::mark_programmed(bd_addr_t addr, bd_size_t size) {
+    mark_sectors(_erased, addr, size, false);
+    mark_sectors(_trimmed, addr, size, false);
+    mark_sectors(_known, addr, size, true);
+
+    if (!_blank_map_enabled) {
+        return;
+    }
+
+    // The checkpoint has to stop claiming a sector is blank before
+    // anything is written to it
+    int first = addr >> Geometry::sector_shift;
+    int last = (addr + size - 1) >> Geometry::sector_shift;
+    int first_byte = -1;
+    int last_byte = -1;
+    for (int sector = first; sector <= last; sector++) {
+        if (is_blank_map_sector(sector) || test_sector(_blank_map_unknown, sector)
+                || !test_sector(_blank_map_blank, sector)) {
+            continue;
+        }
+        _blank_map_blank[sector >> 5] &= ~((uint32_t) 1 << (sector & 31));
+        if (first_byte < 0) {
+            first_byte = sector >> 3;
+        }
+        last_byte = sector >> 3;
+    }
+    if (first_byte < 0) {
+        return;
+    }
+
+    uint8_t bytes[blank_map_bitmap_size];
+    uint8_t *out = bytes;
+    for (int i = 0; i < sector_map_words; i++) {
+        out = put_le(out, _blank_map_blank[i], 4);
+    }
+    program_page(&bytes[first_byte], _blank_map_slot + blank_map_bitmap_size + first_byte,
+            last_byte - first_byte + 1);
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::blank_map_init(bd_addr_t region) {
+    if ((region & (sector_size - 1)) || (region + blank_map_region_size) > total_size) {
+        return -2;
+    }
+
+    if (check_device_id() == -1) {
+        return -1;
+    }
+
+    _blank_map_enabled = false;
+    _blank_map_region = region;
+
+    // The region's own sectors are never reported as unknown
+    mark_sectors(_known, region, blank_map_region_size, true);
+
+    // The first slot of the sector written last has the higher sequence
+    // number, both are only valid if power was lost before the older
+    // sector was erased
+    bool valid[2];
+    uint32_t sequence[2];
+    for (int copy = 0; copy < 2; copy++) {
+        valid[copy] = blank_map_read_slot(region + copy * sector_size, true);
+        sequence[copy] = _blank_map_sequence;
+    }
+
+    int active;
+    if (valid[0] && valid[1]) {
+        active = ((int32_t) (sequence[1] - sequence[0]) > 0) ? 1 : 0;
+        erase_block(AT25DF041B_BLOCK_ERASE_4KB, region + (1 - active) * sector_size);
+    } else if (valid[0] || valid[1]) {
+        active = valid[0] ? 0 : 1;
+    } else {
+        // Blank or torn region, start again with every sector unknown
+        _blank_map_enabled = true;
+        memset(_blank_map_unknown, 0xFF, sizeof(_blank_map_unknown));
+        memset(_blank_map_blank, 0xFF, sizeof(_blank_map_blank));
+        mark_sectors(_blank_map_unknown, region, blank_map_region_size, false);
+        mark_sectors(_blank_map_blank, region, blank_map_region_size, false);
+        _blank_map_sequence = 0;
+        _blank_map_slot = region;
+        _blank_map_next = region;
+        blank_map_write_slot();
+        return 0;
+    }
+
+    // Slots are used in order, torn ones included, so find the last one
+    // written to with a binary search
+    bd_addr_t base = region + active * sector_size;
+    int low = 0;
+    int high = sector_size / blank_map_slot_size;
+    while (high - low > 1) {
+        int middle = low + (high - low) / 2;
+        if (blank_map_slot_unused(base + middle * blank_map_slot_size)) {
+            high = middle;
+        } else {
+            low = middle;
+        }
+    }
+    _blank_map_next = base + (low + 1) * blank_map_slot_size;
+
+    // A torn checkpoint is skipped, the one before it is complete
+    int slot = low;
+    while (slot > 0 && !blank_map_read_slot(base + slot * blank_map_slot_size, false)) {
+        slot--;
+    }
+    _blank_map_slot = base + slot * blank_map_slot_size;
+    blank_map_read_slot(_blank_map_slot, true);
+    _blank_map_enabled = true;
+
+    // Take the checkpoint's word for every sector not touched since power up
+    for (int sector = 0; sector < sector_count; sector++) {
+        if (test_sector(_known, sector) || is_blank_map_sector(sector)
+                || test_sector(_blank_map_unknown, sector)) {
+            continue;
+        }
+        _known[sector >> 5] |= (uint32_t) 1 << (sector & 31);
+        if (test_sector(_blank_map_blank, sector)) {
+            _erased[sector >> 5] |= (uint32_t) 1 << (sector & 31);
+        }
+    }
+
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::blank_map_sync(void) {
+    if (!_blank_map_enabled) {
+        return 0;
+    }
+
+    if (check_device_id() == -1) {
+        return -1;
+    }
+    wait_if_busy();
+
+    // Blank is unknown 0 and blank 1, programmed is both 0, the
+    // region's own sectors are always recorded as programmed
+    uint32_t unknown[sector_map_words];
+    uint32_t blank[sector_map_words];
+    for (int i = 0; i < sector_map_words; i++) {
+        unknown[i] = ~_known[i];
+        blank[i] = ~_known[i] | _erased[i];
+    }
+    mark_sectors(unknown, _blank_map_region, blank_map_region_size, false);
+    mark_sectors(blank, _blank_map_region, blank_map_region_size, false);
+
+    bool changed = false;
+    bool sets_bits = false;
+    for (int i = 0; i < sector_map_words; i++) {
+        changed |= (unknown[i] != _blank_map_unknown[i]) || (blank[i] != _blank_map_blank[i]);
+        sets_bits |= (unknown[i] & ~_blank_map_unknown[i]) || (blank[i] & ~_blank_map_blank[i]);
+    }
+    if (!changed) {
+        return 0;
+    }
+
+    memcpy(_blank_map_unknown, unknown, sizeof(unknown));
+    memcpy(_blank_map_blank, blank, sizeof(blank));
+
+    if (sets_bits) {
+        blank_map_write_slot();
+        return 0;
+    }
+
+    // Only bits to clear, program them over the active checkpoint
+    uint8_t bytes[2 * blank_map_bitmap_size];
+    uint8_t *out = bytes;
+    for (int i = 0; i < sector_map_words; i++) {
+        out = put_le(out, unknown[i], 4);
+    }
+    for (int i = 0; i < sector_map_words; i++) {
+        out = put_le(out, blank[i], 4);
+    }
+    program_page(bytes, _blank_map_slot, sizeof(bytes));
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::scan_unknown_sectors(void) {
+    if (check_device_id() == -1) {
+        return -1;
+    }
+    wait_if_busy();
+
+    uint32_t words[AT25DF041B_VERIFY_CHUNK_SIZE / 4];
+    for (int sector = 0; sector < sector_count; sector++) {
+        if (test_sector(_known, sector) || is_blank_map_sector(sector)) {
+            continue;
+        }
+
+        // One read per sector, dropped at the first word that is not erased
+        bd_addr_t addr = (bd_addr_t) sector << Geometry::sector_shift;
+        bool blank = true;
+        assert_slave_select();
+        send_read_command(addr);
+        for (bd_size_t offset = 0; offset < sector_size && blank; offset += sizeof(words)) {
+            bus_read(words, sizeof(words));
+            for (unsigned i = 0; i < sizeof(words) / 4; i++) {
+                if (words[i] != 0xFFFFFFFF) {
+                    blank = false;
+                    break;
+                }
+            }
+        }
+        deassert_slave_select();
+
+        mark_sectors(_known, addr, sector_size, true);
+        mark_sectors(_erased, addr, sector_size, blank);
+    }
+
+    return 0;
+}
+
+template <typename Geometry>
+bool AT25DF<Geometry>::blank_map_read_slot(bd_addr_t slot, bool load) {
+    uint8_t bytes[2 * blank_map_bitmap_size + AT25DF041B_BLANK_MAP_HEADER_SIZE];
+    if (read(bytes, slot, sizeof(bytes))) {
+        return false;
+    }
+
+    const uint8_t *header = &bytes[2 * blank_map_bitmap_size];
+    uint32_t sequence = header[0] | (header[1] << 8) | (header[2] << 16)
+            | ((uint32_t) header[3] << 24);
+    uint32_t inverse = header[4] | (header[5] << 8) | (header[6] << 16)
+            | ((uint32_t) header[7] << 24);
+    if (sequence != ~inverse) {
+        return false;
+    }
+
+    if (load) {
+        for (int i = 0; i < 2 * sector_map_words; i++) {
+            const uint8_t *in = &bytes[4 * i];
+            uint32_t word = in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t) in[3] << 24);
+            if (i < sector_map_words) {
+                _blank_map_unknown[i] = word;
+            } else {
+                _blank_map_blank[i - sector_map_words] = word;
+            }
+        }
+        _blank_map_sequence = sequence;
+    }
+    return true;
+}
+
+template <typename Geometry>
+bool AT25DF<Geometry>::blank_map_slot_unused(bd_addr_t slot) {
+    uint8_t bytes[blank_map_slot_size];
+    if (read(bytes, slot, sizeof(bytes))) {
+        return false;
+    }
+    for (unsigned i = 0; i < sizeof(bytes); i++) {
+        if (bytes[i] != AT25DF041B_ERASE_VALUE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::blank_map_write_slot(void) {
+    // Skip slots a torn checkpoint left dirty, moving on to the other
+    // sector once this one is full
+    while (true) {
+        if (_blank_map_next >= _blank_map_region + blank_map_region_size) {
+            _blank_map_next = _blank_map_region;
+        }
+        if ((_blank_map_next & (sector_size - 1)) == 0) {
+            if (!test_sector(_erased, _blank_map_next >> Geometry::sector_shift)) {
+                erase_block(AT25DF041B_BLOCK_ERASE_4KB, _blank_map_next);
+            }
+            break;
+        }
+        if (blank_map_slot_unused(_blank_map_next)) {
+            break;
+        }
+        _blank_map_next += blank_map_slot_size;
+    }
+
+    uint32_t sequence = _blank_map_sequence + 1;
+    uint8_t bytes[2 * blank_map_bitmap_size + AT25DF041B_BLANK_MAP_HEADER_SIZE];
+    uint8_t *out = bytes;
+    for (int i = 0; i < sector_map_words; i++) {
+        out = put_le(out, _blank_map_unknown[i], 4);
+    }
+    for (int i = 0; i < sector_map_words; i++) {
+        out = put_le(out, _blank_map_blank[i], 4);
+    }
+    out = put_le(out, sequence, 4);
+    put_le(out, ~sequence, 4);
+
+    // The header goes last so a torn slot never passes for a checkpoint
+    program_page(bytes, _blank_map_next, 2 * blank_map_bitmap_size);
+    program_page(&bytes[2 * blank_map_bitmap_size], _blank_map_next + 2 * blank_map_bitmap_size,
+            AT25DF041B_BLANK_MAP_HEADER_SIZE);
+
+    // The new sector holds a checkpoint now, the old one can go
+    bd_addr_t previous = _blank_map_slot;
+    _blank_map_slot = _blank_map_next;
+    _blank_map_next += blank_map_slot_size;
+    _blank_map_sequence = sequence;
+    if ((previous ^ _blank_map_slot) & ~((bd_addr_t) sector_size - 1)) {
+        erase_block(AT25DF041B_BLOCK_ERASE_4KB, previous);
+    }
+}
+
+/** Bus clock rates tried by tune_frequency(), slowest first */
+static const int tune_ladder[] = {
+    1000000, 2000000, 4000000, 8000000, 12000000, 16000000, 20000000, 25000000,
+    33000000, 40000000, 50000000, 66000000, 80000000, 104000000
+};
+
+/** Byte i of the tuning pattern: every line toggling, alternating lines, walking 1s and 0s */
+static uint8_t tune_pattern_byte(int i) {
+    switch (i >> 4) {
+    case 0:
+        return (i & 1) ? 0xFF : 0x00;
+    case 1:
+        return (i & 1) ? 0xAA : 0x55;
+    case 2:
+        return (uint8_t) (1 << (i & 7));
+    default:
+        return (uint8_t) ~(1 << (i & 7));
+    }
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::set_frequency(int hz) {
+    _spi.frequency(hz);
+    _frequency = hz;
+
+    // Read Array 03h has no dummy byte and a lower limit, 0Bh goes up to fCLK
+    _read_opcode = (hz > AT25DF041B_MAX_READ_LF_FREQUENCY) ?
+            AT25DF041B_READ_ARRAY_FAST : AT25DF041B_READ_ARRAY;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::tune_frequency(bd_addr_t pattern_addr, int max_hz) {
+    // The pattern is laid down at the bottom of the ladder, max_hz included
+    if ((pattern_addr & (page_size - 1)) || pattern_addr >= total_size
+            || max_hz < tune_ladder[0]) {
+        return -2;
+    }
+
+    uint8_t pattern[AT25DF041B_TUNE_PATTERN_SIZE];
+    for (int i = 0; i < AT25DF041B_TUNE_PATTERN_SIZE; i++) {
+        pattern[i] = tune_pattern_byte(i);
+    }
+
+    // Lay down the pattern at a rate every board manages
+    set_frequency(tune_ladder[0]);
+    if (check_device_id() == -1) {
+        return -1;
+    }
+    if (compare(pattern, pattern_addr, sizeof(pattern))) {
+        bd_addr_t sector = pattern_addr & ~((bd_addr_t) sector_size - 1);
+        if (erase(sector, sector_size) || program(pattern, pattern_addr, sizeof(pattern))) {
+            return -1;
+        }
+        if (compare(pattern, pattern_addr, sizeof(pattern))) {
+            return -1;
+        }
+    }
+
+    // Step up until the ID or the pattern reads back wrong
+    int steps = sizeof(tune_ladder) / sizeof(tune_ladder[0]);
+    int best = 0;
+    for (int step = 1; step < steps && tune_ladder[step] <= max_hz; step++) {
+        set_frequency(tune_ladder[step]);
+
+        bool passed = true;
+        for (int round = 0; round < AT25DF041B_TUNE_ROUNDS && passed; round++) {
+            passed = (check_device_id() == 0)
+                    && (compare(pattern, pattern_addr, sizeof(pattern)) == 0);
+        }
+        if (!passed) {
+            // Back off a step from the last rate that worked, for margin
+            best = (best > 0) ? best - 1 : 0;
+            break;
+        }
+        best = step;
+    }
+
+    // Topping out at max_hz needs no margin, that limit is not the board's
+    set_frequency(tune_ladder[best]);
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::stream_open(bd_addr_t addr, bd_size_t size) {
+    if (check_device_id() == -1)
+        return -1;
+
+    if (!is_valid_operation(addr, size, AT25DF041B_OPERATION_TYPE_READ))
+        return -2;
+
+    _stream_start_us = stats_timestamp();
+    _stream_addr = addr;
+    _stream_size = size;
+
+    assert_slave_select();
+    send_read_command(addr);
+    _stream_remaining = size;
+
+    return 0;
+}
+
+template <typename Geometry>
+bd_size_t AT25DF<Geometry>::stream_read(void *buffer, bd_size_t size) {
+    if (size > _stream_remaining) {
+        size = _stream_remaining;
+    }
+    if (size == 0) {
+        return 0;
+    }
+
+    bus_read(buffer, size);
+    _stream_remaining -= size;
+
+    if (_stream_remaining == 0) {
+        deassert_slave_select();
+        stats_record_latency(AT25DF041B_OPERATION_TYPE_READ, _stream_start_us);
+        trace_record(AT25DF041B_OPERATION_TYPE_READ, _stream_addr, _stream_size,
+                _stream_start_us);
+    }
+
+    return size;
+}
+
+template <typename Geometry>
+bd_size_t AT25DF<Geometry>::stream_fill(AT25DF041BRing *ring) {
+    bd_size_t total = 0;
+
+    // At most two passes, up to the end of the storage then from the start
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t head = ring->head;
+        uint32_t used = head - ring->tail;
+        uint32_t offset = head & (ring->size - 1);
+        uint32_t space = ring->size - used;
+        if (space > ring->size - offset) {
+            space = ring->size - offset;
+        }
+
+        bd_size_t count = stream_read(&ring->data[offset], space);
+        if (count == 0) {
+            break;
+        }
+
+        // Publish the data only after it has landed in the ring
+        ring->head = head + count;
+        total += count;
+    }
+
+    return total;
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::stream_close(void) {
+    if (_stream_remaining) {
+        deassert_slave_select();
+        stats_record_latency(AT25DF041B_OPERATION_TYPE_READ, _stream_start_us);
+
+        // Only the part that was actually read went over the bus
+        trace_record(AT25DF041B_OPERATION_TYPE_READ, _stream_addr,
+                _stream_size - _stream_remaining, _stream_start_us);
+        _stream_remaining = 0;
+    }
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::stream(bd_addr_t addr, bd_size_t size,
+        mbed::Callback<int(const void*, bd_size_t)> sink) {
+    int res = stream_open(addr, size);
+    if (res) {
+        return res;
+    }
+
+    uint8_t chunk[AT25DF041B_STREAM_CHUNK_SIZE];
+    bd_size_t count;
+    while ((count = stream_read(chunk, sizeof(chunk))) != 0) {
+        res = sink(chunk, count);
+        if (res < 0) {
+            stream_close();
+            return res;
+        }
+    }
+
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::verify(const void *buffer, bd_addr_t addr, bd_size_t size) {
+    if (check_device_id() == -1)
+        return -1;
+
+    if (!is_valid_operation(addr, size, AT25DF041B_OPERATION_TYPE_READ))
+        return -2;
+
+    return compare(buffer, addr, size) ? -3 : 0;
+}
+
+/** Table for the reflected CRC-32 polynomial 0xEDB88320 */
+static const uint32_t crc32_table[256] = {
+        0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
+        0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
+        0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2,
+        0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+        0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9,
+        0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
+        0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
+        0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+        0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423,
+        0xCFBA9599, 0xB8BDA50F, 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
+        0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D, 0x76DC4190, 0x01DB7106,
+        0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+        0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
+        0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+        0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950,
+        0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+        0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7,
+        0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
+        0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C, 0x270241AA,
+        0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+        0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
+        0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
+        0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84,
+        0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+        0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB,
+        0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+        0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E,
+        0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+        0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55,
+        0x316E8EEF, 0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
+        0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28,
+        0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+        0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F,
+        0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
+        0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
+        0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+        0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69,
+        0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
+        0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
+        0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+        0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693,
+        0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+        0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
+
+template <typename Geometry>
+uint32_t AT25DF<Geometry>::crc32_update(uint32_t crc, const void *buffer, size_t size) {
+    const uint8_t *data = (const uint8_t*) buffer;
+    crc = ~crc;
+    while (size--) {
+        crc = crc32_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::crc32(bd_addr_t addr, bd_size_t size, uint32_t *crc) {
+    if (check_device_id() == -1)
+        return -1;
+
+    if (!is_valid_operation(addr, size, AT25DF041B_OPERATION_TYPE_READ))
+        return -2;
+
+    uint8_t chunk[AT25DF041B_CRC_CHUNK_SIZE];
+    uint32_t result = *crc;
+
+    // One read transaction for the whole region, chunks are clocked in back to back
+    assert_slave_select();
+    send_read_command(addr);
+    while (size) {
+        bd_size_t length = (size < sizeof(chunk)) ? size : sizeof(chunk);
+        bus_read(chunk, length);
+        result = crc32_update(result, chunk, length);
+        size -= length;
+    }
+    deassert_slave_select();
+
+    *crc = result;
+    return 0;
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::wear_tracking_init(bd_addr_t region) {
+#if AT25DF041B_ENABLE_WEAR_TRACKING
+    if ((region & (sector_size - 1))
+            || (region + wear_region_size) > total_size) {
+        return -2;
+    }
+
+    if (check_device_id() == -1) {
+        return -1;
+    }
+
+    _wear_enabled = false;
+    _wear_region = region;
+    _wear_pending_total = 0;
+    memset(_wear_pending, 0, sizeof(_wear_pending));
+
+    // A copy is complete once its header, programmed last, is
+    bool valid[2];
+    uint32_t sequence[2] = { 0, 0 };
+    for (int copy = 0; copy < 2; copy++) {
+        valid[copy] = wear_read_header(region + copy * wear_copy_size, &sequence[copy]);
+    }
+
+    int active;
+    if (valid[0] && valid[1]) {
+        // Power was lost during a fold before the old copy was retired,
+        // the fold gave the new copy the next sequence number
+        active = ((int32_t) (sequence[1] - sequence[0]) > 0) ? 1 : 0;
+        wear_erase_copy(region + (1 - active) * wear_copy_size);
+    } else if (valid[0] || valid[1]) {
+        active = valid[0] ? 0 : 1;
+    } else {
+        // Blank or torn region, start again from zero
+        active = 0;
+        sequence[0] = 0;
+        wear_erase_copy(region);
+        wear_erase_copy(region + wear_copy_size);
+
+        uint8_t page[page_size];
+        memset(page, AT25DF041B_ERASE_VALUE, sizeof(page));
+        for (int i = 0; i < page_size; i += AT25DF041B_WEAR_SLOT_SIZE) {
+            memset(&page[i], 0, 4);
+        }
+        for (int offset = 0; offset < wear_copy_size;
+                offset += page_size) {
+            // The header slot stays blank until every count is in place
+            int header = wear_header_slot() * AT25DF041B_WEAR_SLOT_SIZE - offset;
+            if (header >= 0 && header < page_size) {
+                memset(&page[header], AT25DF041B_ERASE_VALUE, AT25DF041B_WEAR_SLOT_SIZE);
+            }
+            program_page(page, region + offset, sizeof(page));
+            if (header >= 0 && header < page_size) {
+                memset(&page[header], 0, 4);
+            }
+        }
+        wear_commit(region, 0);
+    }
+    _wear_table = region + active * wear_copy_size;
+    _wear_sequence = sequence[active];
+
+    // Count the bits already cleared in each bitmap, they are cleared in order
+    for (int sector = 0; sector < sector_count; sector++) {
+        uint8_t bitmap[AT25DF041B_WEAR_SLOT_SIZE - 4];
+        read(bitmap, _wear_table + sector * AT25DF041B_WEAR_SLOT_SIZE + 4,
+                sizeof(bitmap));
+        int used = 0;
+        for (unsigned int i = 0; i < sizeof(bitmap); i++) {
+            uint8_t bits = bitmap[i];
+            while ((bits & 1) == 0 && bits != 0) {
+                used++;
+                bits >>= 1;
+            }
+            if (bits != 0) {
+                break;
+            }
+            used += 8 - (used & 7);
+        }
+        _wear_used[sector] = used;
+    }
+
+    // The header slot holds no count
+    _wear_used[wear_header_slot()] = 0;
+
+    _wear_enabled = true;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::wear_tracking_sync(void) {
+#if AT25DF041B_ENABLE_WEAR_TRACKING
+    if (!_wear_enabled || _wear_pending_total == 0) {
+        return 0;
+    }
+
+    if (check_device_id() == -1) {
+        return -1;
+    }
+
+    // Fold first if any bitmap would overflow, that persists everything
+    for (int sector = 0; sector < sector_count; sector++) {
+        if ((_wear_used[sector] + _wear_pending[sector]) > AT25DF041B_WEAR_BITMAP_BITS) {
+            wear_fold();
+            return 0;
+        }
+    }
+
+    for (int sector = 0; sector < sector_count; sector++) {
+        if (_wear_pending[sector] == 0) {
+            continue;
+        }
+
+        // Clear bits [used, used + pending), only the bytes that change are programmed
+        int used = _wear_used[sector];
+        int new_used = used + _wear_pending[sector];
+        int first = used >> 3;
+        int last = (new_used - 1) >> 3;
+        uint8_t bytes[AT25DF041B_WEAR_SLOT_SIZE - 4];
+        for (int i = first; i <= last; i++) {
+            int cleared = new_used - (i * 8);
+            bytes[i - first] = (cleared >= 8) ? 0x00 : (uint8_t) (0xFF << cleared);
+        }
+        program_page(bytes, _wear_table + sector * AT25DF041B_WEAR_SLOT_SIZE + 4 + first,
+                last - first + 1);
+
+        _wear_used[sector] = new_used;
+        _wear_pending[sector] = 0;
+    }
+    _wear_pending_total = 0;
+
+    return 0;
+#else
+    return 0;
+#endif
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::get_erase_count(bd_addr_t addr, uint32_t *count) {
+#if AT25DF041B_ENABLE_WEAR_TRACKING
+    if (!_wear_enabled) {
+        return -1;
+    }
+    if (addr >= total_size) {
+        return -2;
+    }
+
+    int sector = addr >> Geometry::sector_shift;
+    *count = wear_read_base(sector) + _wear_used[sector] + _wear_pending[sector];
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+template <typename Geometry>
+int AT25DF<Geometry>::get_wear_report(AT25DF041BWearReport *report) {
+#if AT25DF041B_ENABLE_WEAR_TRACKING
+    if (!_wear_enabled) {
+        return -1;
+    }
+
+    memset(report, 0, sizeof(*report));
+    report->min_erases = 0xFFFFFFFF;
+    for (int sector = 0; sector < sector_count; sector++) {
+        uint32_t count = wear_read_base(sector) + _wear_used[sector]
+                + _wear_pending[sector];
+        report->total_erases += count;
+        if (count < report->min_erases) {
+            report->min_erases = count;
+        }
+        if (count > report->max_erases) {
+            report->max_erases = count;
+            report->hottest_sector = sector;
+        }
+        if (count) {
+            report->sectors_used++;
+        }
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+#if AT25DF041B_ENABLE_WEAR_TRACKING
+template <typename Geometry>
+void AT25DF<Geometry>::wear_record(bd_addr_t addr, bd_size_t size) {
+    if (!_wear_enabled) {
+        return;
+    }
+
+    for (bd_addr_t sector_addr = addr; sector_addr < addr + size;
+            sector_addr += sector_size) {
+        // The table does not count its own erases
+        if (sector_addr >= _wear_region
+                && sector_addr < _wear_region + wear_region_size) {
+            continue;
+        }
+        _wear_pending[sector_addr >> Geometry::sector_shift]++;
+        _wear_pending_total++;
+    }
+}
+
+template <typename Geometry>
+uint32_t AT25DF<Geometry>::wear_read_base(int sector) {
+    // The table's own sectors are never counted, their first slot is the header
+    if (sector == wear_header_slot()) {
+        return 0;
+    }
+
+    uint8_t bytes[4];
+    read(bytes, _wear_table + sector * AT25DF041B_WEAR_SLOT_SIZE, sizeof(bytes));
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+}
+
+template <typename Geometry>
+bool AT25DF<Geometry>::wear_read_header(bd_addr_t copy, uint32_t *sequence) {
+    uint8_t bytes[AT25DF041B_WEAR_HEADER_SIZE];
+    read(bytes, copy + wear_header_slot() * AT25DF041B_WEAR_SLOT_SIZE, sizeof(bytes));
+
+    uint32_t words[2];
+    for (int i = 0; i < 2; i++) {
+        words[i] = bytes[4 * i] | (bytes[4 * i + 1] << 8) | (bytes[4 * i + 2] << 16)
+                | ((uint32_t) bytes[4 * i + 3] << 24);
+    }
+    *sequence = words[0];
+    return words[1] == ~words[0];
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::wear_commit(bd_addr_t copy, uint32_t sequence) {
+    uint8_t bytes[AT25DF041B_WEAR_HEADER_SIZE];
+    for (int b = 0; b < 4; b++) {
+        bytes[b] = (uint8_t) (sequence >> (8 * b));
+        bytes[4 + b] = (uint8_t) (~sequence >> (8 * b));
+    }
+    program_page(bytes, copy + wear_header_slot() * AT25DF041B_WEAR_SLOT_SIZE,
+            sizeof(bytes));
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::wear_erase_copy(bd_addr_t copy) {
+    // Invalidate the copy before anything else of it is erased, so a torn
+    // erase never leaves a copy that looks complete with missing counts
+    bd_addr_t header = (copy + wear_header_slot() * AT25DF041B_WEAR_SLOT_SIZE)
+            & ~((bd_addr_t) sector_size - 1);
+    erase_block(AT25DF041B_BLOCK_ERASE_4KB, header);
+
+    for (int offset = 0; offset < wear_copy_size;
+            offset += sector_size) {
+        if (copy + offset != header) {
+            erase_block(AT25DF041B_BLOCK_ERASE_4KB, copy + offset);
+        }
+    }
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::wear_fold(void) {
+    bd_addr_t target = (_wear_table == _wear_region) ?
+            (_wear_region + wear_copy_size) : _wear_region;
+
+    // Leave the tracker disabled while its own sectors are erased
+    _wear_enabled = false;
+    wear_erase_copy(target);
+
+    // Rewrite a page of slots at a time with the counts folded into the base
+    uint8_t page[page_size];
+    int sector = 0;
+    for (int offset = 0; offset < wear_copy_size;
+            offset += page_size) {
+        read(page, _wear_table + offset, sizeof(page));
+        for (int i = 0; i < page_size;
+                i += AT25DF041B_WEAR_SLOT_SIZE, sector++) {
+            // The header is programmed once every count is in place
+            if (sector == wear_header_slot()) {
+                memset(&page[i], AT25DF041B_ERASE_VALUE, AT25DF041B_WEAR_SLOT_SIZE);
+                continue;
+            }
+
+            uint32_t count = page[i] | (page[i + 1] << 8) | (page[i + 2] << 16)
+                    | ((uint32_t) page[i + 3] << 24);
+            count += _wear_used[sector] + _wear_pending[sector];
+            for (int b = 0; b < 4; b++) {
+                page[i + b] = (uint8_t) (count >> (8 * b));
+            }
+            memset(&page[i + 4], AT25DF041B_ERASE_VALUE, AT25DF041B_WEAR_SLOT_SIZE - 4);
+        }
+        program_page(page, target + offset, sizeof(page));
+    }
+
+    // The new copy is complete, commit it and retire the old one
+    _wear_sequence++;
+    wear_commit(target, _wear_sequence);
+    wear_erase_copy(_wear_table);
+
+    _wear_table = target;
+    memset(_wear_used, 0, sizeof(_wear_used));
+    memset(_wear_pending, 0, sizeof(_wear_pending));
+    _wear_pending_total = 0;
+    _wear_enabled = true;
+}
+#endif
+
+#if AT25DF041B_ENABLE_STATS
+template <typename Geometry>
+void AT25DF<Geometry>::stats_count_command(uint8_t opcode) {
+    // Slots are claimed in first-use order, an unused slot has a zero count
+    for (int i = 0; i < AT25DF041B_STATS_OPCODE_SLOTS; i++) {
+        if (_stats.commands[i].count == 0) {
+            _stats.commands[i].opcode = opcode;
+        }
+        if (_stats.commands[i].opcode == opcode) {
+            _stats.commands[i].count++;
+            return;
+        }
+    }
+    _stats.commands_dropped++;
+}
+
+template <typename Geometry>
+void AT25DF<Geometry>::stats_record_latency(int type, uint32_t start_us) {
+    uint32_t elapsed = stats_timestamp() - start_us;
+
+    // Bucket index is the bit length of the elapsed time
+    int bucket = 0;
+    for (uint32_t t = elapsed; t && bucket < (AT25DF041B_STATS_LATENCY_BUCKETS - 1);
+            t >>= 1) {
+        bucket++;
+    }
+
+    _stats.latency[type][bucket]++;
+    if (elapsed > _stats.latency_max_us[type]) {
+        _stats.latency_max_us[type] = elapsed;
+    }
+}
+#endif
+
+#if AT25DF041B_ENABLE_STATS || AT25DF041B_ENABLE_TRACE
+template <typename Geometry>
+uint32_t AT25DF<Geometry>::stats_timestamp(void) {
+    return us_ticker_read();
+}
+#endif
+
+#if AT25DF041B_ENABLE_TRACE
+template <typename Geometry>
+void AT25DF<Geometry>::trace_record(int op, bd_addr_t addr, bd_size_t size,
+        uint32_t start_us) {
+    uint32_t elapsed = stats_timestamp() - start_us;
+    if (elapsed > 0xFFFFFF) {
+        elapsed = 0xFFFFFF;
+    }
+
+    AT25DF041BTraceRecord &record = _trace[_trace_count & (AT25DF041B_TRACE_ENTRIES - 1)];
+    record.timestamp_us = start_us;
+    record.duration_us = elapsed;
+    record.op = op;
+    record.addr = addr;
+    record.size = size;
+    _trace_count++;
+}
+#endif
+
+/** Instantiate the driver for each supported part */
+template class AT25DF<AT25DF041BGeometry>;
+template class AT25DF<AT25DF081AGeometry>;
+template class AT25DF<AT25DF161Geometry>;
+template class AT25DF<AT25SF041Geometry>;
+template class AT25DF<AT25SF081Geometry>;
+template class AT25DF<AT25SF161Geometry>;
+
 #endif
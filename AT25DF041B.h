@@ -25,9 +25,22 @@
 
 #if defined(DEVICE_SPI) || defined(DOXYGEN_ONLY)
 
+/** Transport
+ *  Define AT25DF041B_TRANSPORT_SPIDEV to 1 to drive the chip through Linux
+ *  spidev instead of mbed SPI, see AT25DFSpidev.
+ */
+#ifndef AT25DF041B_TRANSPORT_SPIDEV
+#define AT25DF041B_TRANSPORT_SPIDEV     0
+#endif
+
 #include "BlockDevice.h"
+#if AT25DF041B_TRANSPORT_SPIDEV
+#include "AT25DFSpidev.h"
+#else
 #include "drivers/SPI.h"
 #include "drivers/DigitalOut.h"
+#endif
+#include "platform/Callback.h"
 
 #define AT25DF041B_PAGE_COUNT           (2048)
 #define AT25DF041B_PAGE_BYTE_SIZE       (256)
@@ -35,6 +48,9 @@
 
 #define AT25DF041B_ERASE_SECTOR_SIZE    4096
 
+#define AT25DF041B_BLOCK_32KB_SIZE      0x8000
+#define AT25DF041B_BLOCK_64KB_SIZE      0x10000
+
 /** AT25DF041B Opcodes
  *  See the datasheet for more info
  */
@@ -90,35 +106,437 @@
 /** Magic word for whole chip erase */
 #define AT25DF041B_CHIP_ERASE_MAGIC_WORD    0xADE570 // "Adesto"
 
+/** Magic word for programming the one-time programmable security register */
+#define AT25DF041B_OTP_MAGIC_WORD           0x0B7A11 // "OTP, all"
+
+/** Security register layout: a one-time programmable user area followed
+ *  by a unique ID programmed at the factory */
+#define AT25DF041B_OTP_USER_OFFSET          0
+#define AT25DF041B_OTP_USER_SIZE            64
+#define AT25DF041B_OTP_FACTORY_OFFSET       64
+#define AT25DF041B_OTP_FACTORY_SIZE         64
+#define AT25DF041B_OTP_SIZE                 128
+
+/** Dummy bytes between the address and the data of a security register read */
+#define AT25DF041B_OTP_READ_DUMMY_BYTES     2
+
 /** Status Register Bits */
 #define AT25DF041B_STATUS_READY_BUSY_BIT    0x01
 #define AT25DF041B_STATUS_WEL_BIT           0x02
+#define AT25DF041B_STATUS_SWP_MASK          0x0C
+
+/** Write Status Register values that unprotect or protect every sector at once */
+#define AT25DF041B_GLOBAL_UNPROTECT         0x00
+#define AT25DF041B_GLOBAL_PROTECT           0x3C
 
 /** Operation types */
 #define AT25DF041B_OPERATION_TYPE_READ      0x00
 #define AT25DF041B_OPERATION_TYPE_PROGRAM   0x01
 #define AT25DF041B_OPERATION_TYPE_ERASE     0x02
+#define AT25DF041B_OPERATION_TYPE_COUNT     3
+
+/** Performance counters
+ *  Define AT25DF041B_ENABLE_STATS to 1 to compile in the instrumentation.
+ *  When it is 0 (the default) all of the hooks compile away to nothing.
+ */
+#ifndef AT25DF041B_ENABLE_STATS
+#define AT25DF041B_ENABLE_STATS             0
+#endif
+
+/** Number of distinct opcodes the command counter can track */
+#define AT25DF041B_STATS_OPCODE_SLOTS       16
+
+/** Latency histogram buckets, bucket n counts operations that took [2^(n-1), 2^n) us
+ *  Bucket 0 counts operations under 1us, the last bucket catches everything longer */
+#define AT25DF041B_STATS_LATENCY_BUCKETS    24
+
+/** Binary stats report header */
+#define AT25DF041B_STATS_MAGIC              0x53324154 // "AT2S"
+#define AT25DF041B_STATS_VERSION            1
+
+/** I/O trace
+ *  Define AT25DF041B_ENABLE_TRACE to 1 to record every completed read, program,
+ *  erase and trim into a RAM ring, see get_trace() and AT25DFTraceReplay.
+ */
+#ifndef AT25DF041B_ENABLE_TRACE
+#define AT25DF041B_ENABLE_TRACE             0
+#endif
+
+/** Records kept in the trace ring, must be a power of two */
+#ifndef AT25DF041B_TRACE_ENTRIES
+#define AT25DF041B_TRACE_ENTRIES            256
+#endif
+
+/** Trace-only operation type for trim(), follows the AT25DF041B_OPERATION_TYPE_* values */
+#define AT25DF041B_TRACE_TRIM               0x03
+
+/** Binary trace export header and the size of each exported record */
+#define AT25DF041B_TRACE_MAGIC              0x54324154 // "AT2T"
+#define AT25DF041B_TRACE_VERSION            1
+#define AT25DF041B_TRACE_RECORD_SIZE        16
+
+/** Read-back verification
+ *  Data is read back and compared in chunks of this many bytes so that
+ *  verification never needs a second copy of the caller's buffer
+ */
+#ifndef AT25DF041B_VERIFY_CHUNK_SIZE
+#define AT25DF041B_VERIFY_CHUNK_SIZE        32
+#endif
+
+/** Flash is streamed through the CRC in chunks of this many bytes */
+#ifndef AT25DF041B_CRC_CHUNK_SIZE
+#define AT25DF041B_CRC_CHUNK_SIZE           64
+#endif
+
+/** Bytes staged for a single SPI transfer
+ *  Command, address and dummy bytes are gathered with up to this many bytes
+ *  of data and clocked in one transfer, see bus_flush()
+ */
+#ifndef AT25DF041B_BURST_SIZE
+#define AT25DF041B_BURST_SIZE               32
+#endif
+
+/** stream() clocks data into a stack buffer of this many bytes between callbacks */
+#ifndef AT25DF041B_STREAM_CHUNK_SIZE
+#define AT25DF041B_STREAM_CHUNK_SIZE        64
+#endif
+
+/** fill() repeats short patterns into a stack tile of this many bytes and streams from it */
+#ifndef AT25DF041B_FILL_TILE_SIZE
+#define AT25DF041B_FILL_TILE_SIZE           64
+#endif
+
+/** Bus clock tuning, see tune_frequency()
+ *  fCLK is the limit for every command including Read Array 0Bh,
+ *  Read Array 03h is only specified up to fRDLF
+ */
+#ifndef AT25DF041B_MAX_FREQUENCY
+#define AT25DF041B_MAX_FREQUENCY            104000000
+#endif
+#define AT25DF041B_MAX_READ_LF_FREQUENCY    50000000
+
+/** ID and pattern reads that must all pass before a clock rate is accepted */
+#ifndef AT25DF041B_TUNE_ROUNDS
+#define AT25DF041B_TUNE_ROUNDS              4
+#endif
+
+/** Size of the known pattern tune_frequency() keeps in its reserved page */
+#define AT25DF041B_TUNE_PATTERN_SIZE        64
+
+/** Per-sector erase counters
+ *  Define AT25DF041B_ENABLE_WEAR_TRACKING to 1 to count erases of every 4kB sector
+ *  and persist the counts in a reserved region (see wear_tracking_init).
+ */
+#ifndef AT25DF041B_ENABLE_WEAR_TRACKING
+#define AT25DF041B_ENABLE_WEAR_TRACKING     0
+#endif
+
+/** Number of erases buffered in RAM before they are written out */
+#ifndef AT25DF041B_WEAR_FLUSH_THRESHOLD
+#define AT25DF041B_WEAR_FLUSH_THRESHOLD     16
+#endif
+
+/** Persisted wear table layout
+ *  The reserved region holds two copies of the table, one per erase sector.
+ *  Each sector gets a slot with a 32-bit base count followed by a bitmap;
+ *  an erase is recorded by clearing the next bit of the bitmap so only
+ *  page programs are needed until a bitmap fills up and the table is
+ *  folded into the other copy.
+ *
+ *  The region's own sectors are never counted. The slot of its first sector
+ *  holds the copy's header instead, a sequence number and its inverse that
+ *  are programmed after every count. A copy is valid once its header is,
+ *  the newer of two valid copies is active, and retiring a copy erases the
+ *  sector holding its header first.
+ */
+#define AT25DF041B_WEAR_SLOT_SIZE           32
+#define AT25DF041B_WEAR_BITMAP_BITS         ((AT25DF041B_WEAR_SLOT_SIZE - 4) * 8)
+#define AT25DF041B_WEAR_HEADER_SIZE         8
+
+/** Persisted blank sector map layout
+ *  The reserved region is two erase sectors of checkpoint slots written in
+ *  order. A slot holds an "unknown" bitmap and a "blank" bitmap with one bit
+ *  per sector, followed by a sequence number and its inverse that are
+ *  programmed last. A sector is known blank while its unknown bit is clear
+ *  and its blank bit is set. Bits are only ever cleared in place, a
+ *  checkpoint that has to set one again goes into the next slot.
+ */
+#define AT25DF041B_BLANK_MAP_HEADER_SIZE    8
+
+/** Wear summary returned by get_wear_report */
+struct AT25DF041BWearReport {
+    /** Sum of all erase counts */
+    uint64_t total_erases;
+
+    /** Lowest and highest erase count of any sector */
+    uint32_t min_erases;
+    uint32_t max_erases;
+
+    /** Index of the most erased sector */
+    uint32_t hottest_sector;
+
+    /** Number of sectors that have been erased at least once */
+    uint32_t sectors_used;
+};
+
+/** Instrumentation counters, only populated when AT25DF041B_ENABLE_STATS is 1 */
+struct AT25DF041BStats {
+    /** Commands issued, by opcode */
+    struct {
+        uint8_t opcode;
+        uint32_t count;
+    } commands[AT25DF041B_STATS_OPCODE_SLOTS];
+
+    /** Commands whose opcode did not fit in the table above */
+    uint32_t commands_dropped;
+
+    /** Bytes clocked out to / in from the AT25DF041B */
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+
+    /** Number of times slave select was asserted */
+    uint32_t cs_assertions;
+
+    /** Number of status register reads made while waiting on RDY/BSY */
+    uint32_t status_polls;
+
+    /** Latency histograms, indexed by operation type then log2 bucket */
+    uint32_t latency[AT25DF041B_OPERATION_TYPE_COUNT][AT25DF041B_STATS_LATENCY_BUCKETS];
+
+    /** Slowest operation seen of each type, in microseconds */
+    uint32_t latency_max_us[AT25DF041B_OPERATION_TYPE_COUNT];
+};
+
+/** One traced operation, only recorded when AT25DF041B_ENABLE_TRACE is 1 */
+struct AT25DF041BTraceRecord {
+    /** us_ticker time the operation started */
+    uint32_t timestamp_us;
 
-/** Block device-based driver for the AT25DF041B SPI flash chip
+    /** Time the operation took in microseconds, saturates at 2^24 - 1 */
+    uint32_t duration_us : 24;
+
+    /** AT25DF041B_OPERATION_TYPE_* or AT25DF041B_TRACE_TRIM */
+    uint32_t op : 8;
+
+    /** Start address and size in bytes */
+    uint32_t addr;
+    uint32_t size;
+};
+
+/** Filesystem settings derived from one of the chip's erase sizes
+ *
+ *  Filled in by get_littlefs_preset() and get_fat_preset(). The fields line
+ *  up with the LittleFileSystem2 constructor and FATFileSystem::format().
+ */
+struct AT25DF041BFilesystemPreset {
+    /** LittleFS logical block size or FAT cluster size in bytes */
+    bd_size_t block_size;
+
+    /** LittleFS erase cycles before metadata moves on, 0 for FAT */
+    uint32_t block_cycles;
+
+    /** LittleFS read/program cache and lookahead buffer sizes, 0 for FAT */
+    bd_size_t cache_size;
+    bd_size_t lookahead_size;
+};
+
+/** Most entries get_erase_sizes() fills in */
+#define AT25DF041B_MAX_ERASE_SIZES      4
+
+/** One segment of a scatter-gather (vectored) read or program */
+struct AT25DF041BIOVec {
+    /** Segment data, only read from by programv */
+    void *buffer;
+
+    /** Segment length in bytes, may be zero */
+    bd_size_t size;
+};
+
+/** Single producer, single consumer byte ring that stream_fill() writes into
+ *
+ *  head and tail are free-running counters, the ring holds head - tail bytes.
+ *  The driver only ever advances head and the consumer (e.g. a UART
+ *  interrupt) only ever advances tail, so no locking is needed.
+ */
+struct AT25DF041BRing {
+    /** Storage, size bytes long */
+    uint8_t *data;
+
+    /** Capacity in bytes, must be a power of two */
+    uint32_t size;
+
+    /** Total bytes written by the driver */
+    volatile uint32_t head;
+
+    /** Total bytes consumed by the caller */
+    volatile uint32_t tail;
+};
+
+/** Geometry and identification traits for the AT25DF/AT25SF family
+ *
+ *  All sizes are powers of two and given as shifts so that every bit of
+ *  address math in the driver reduces to a compile-time shift or mask.
+ *  To support another density, add a traits struct with the same members
+ *  and instantiate AT25DF with it at the bottom of AT25DF041B.cpp.
+ */
+struct AT25DF041BGeometry {
+    enum {
+        page_shift = 8,         // 256B program pages
+        sector_shift = 12,      // 4kB erase sectors
+        size_shift = 19,        // 512kB
+        protect_shift = 16,     // 64kB individually protected sectors
+        otp_size = AT25DF041B_OTP_SIZE, // 77h/9Bh security register
+        page_erase = 1,         // 81h 256B page erase
+        manufacturer_id = AT25DF041B_MANUFACTURER_ID,
+        device_id_1 = AT25DF041B_DEVICE_ID_BYTE_1,
+        device_id_2 = AT25DF041B_DEVICE_ID_BYTE_2
+    };
+    static const char *name() {
+        return "AT25DF041B";
+    }
+};
+
+struct AT25DF081AGeometry {
+    enum {
+        page_shift = 8,
+        sector_shift = 12,
+        size_shift = 20,        // 1MB
+        protect_shift = 16,
+        otp_size = AT25DF041B_OTP_SIZE,
+        page_erase = 0,         // 4kB is the smallest erase
+        manufacturer_id = AT25DF041B_MANUFACTURER_ID,
+        device_id_1 = 0x45,
+        device_id_2 = 0x01
+    };
+    static const char *name() {
+        return "AT25DF081A";
+    }
+};
+
+struct AT25DF161Geometry {
+    enum {
+        page_shift = 8,
+        sector_shift = 12,
+        size_shift = 21,        // 2MB
+        protect_shift = 16,
+        otp_size = AT25DF041B_OTP_SIZE,
+        page_erase = 0,
+        manufacturer_id = AT25DF041B_MANUFACTURER_ID,
+        device_id_1 = 0x46,
+        device_id_2 = 0x02
+    };
+    static const char *name() {
+        return "AT25DF161";
+    }
+};
+
+struct AT25SF041Geometry {
+    enum {
+        page_shift = 8,
+        sector_shift = 12,
+        size_shift = 19,        // 512kB
+        protect_shift = 0,      // no individual sector protection
+        otp_size = 0,           // security registers use other commands
+        page_erase = 0,
+        manufacturer_id = AT25DF041B_MANUFACTURER_ID,
+        device_id_1 = 0x84,
+        device_id_2 = 0x01
+    };
+    static const char *name() {
+        return "AT25SF041";
+    }
+};
+
+struct AT25SF081Geometry {
+    enum {
+        page_shift = 8,
+        sector_shift = 12,
+        size_shift = 20,        // 1MB
+        protect_shift = 0,
+        otp_size = 0,
+        page_erase = 0,
+        manufacturer_id = AT25DF041B_MANUFACTURER_ID,
+        device_id_1 = 0x85,
+        device_id_2 = 0x01
+    };
+    static const char *name() {
+        return "AT25SF081";
+    }
+};
+
+struct AT25SF161Geometry {
+    enum {
+        page_shift = 8,
+        sector_shift = 12,
+        size_shift = 21,        // 2MB
+        protect_shift = 0,
+        otp_size = 0,
+        page_erase = 0,
+        manufacturer_id = AT25DF041B_MANUFACTURER_ID,
+        device_id_1 = 0x86,
+        device_id_2 = 0x01
+    };
+    static const char *name() {
+        return "AT25SF161";
+    }
+};
+
+/** Block device-based driver for the AT25DF family of SPI flash chips
+ *
+ *  Use one of the typedefs below, e.g. AT25DF041B, rather than naming
+ *  the template directly.
  *
  *  @code
  * @endcode
  */
-class AT25DF041B: public BlockDevice {
+template <typename Geometry>
+class AT25DF: public BlockDevice {
 
 public:
 
+    /** Device geometry, derived from the traits */
+    enum {
+        page_size = 1 << Geometry::page_shift,
+        sector_size = 1 << Geometry::sector_shift,
+        total_size = 1 << Geometry::size_shift,
+        page_count = total_size >> Geometry::page_shift,
+        sector_count = total_size >> Geometry::sector_shift,
+
+        /** Unit of individual sector protection, the whole chip for parts without it */
+        protect_size = (Geometry::protect_shift != 0) ? (1 << Geometry::protect_shift) : total_size,
+        protect_count = total_size / protect_size,
+
+        /** Size of the region wear_tracking_init() needs reserved */
+        wear_copy_size = sector_count * AT25DF041B_WEAR_SLOT_SIZE,
+        wear_region_size = 2 * wear_copy_size,
+
+        /** Size of one blank map checkpoint, a power of two so slots never cross a page */
+        blank_map_bitmap_size = ((sector_count + 31) / 32) * 4,
+        blank_map_slot_size = (2 * blank_map_bitmap_size + AT25DF041B_BLANK_MAP_HEADER_SIZE <= 64) ? 64
+                : (2 * blank_map_bitmap_size + AT25DF041B_BLANK_MAP_HEADER_SIZE <= 128) ? 128 : 256,
+
+        /** Size of the region blank_map_init() needs reserved */
+        blank_map_region_size = 2 * sector_size
+    };
+
+#if AT25DF041B_TRANSPORT_SPIDEV
+    /** This constructor opens a Linux spidev device
+     * @param[in] device Path of the device, e.g. /dev/spidev0.0
+     */
+    AT25DF(const char *device);
+#else
     /** This constructor creates an unshared private member SPI bus object
      * @param[in] mosi MOSI SPI bus pin
      * @param[in] miso MISO SPI bus pin
      * @param[in] sclk SCLK SPI bus pin
      * @param[in] ssel Slave select pin for this AT25DF041B
      */
-    AT25DF041B(PinName mosi, PinName miso, PinName sclk, PinName ssel);
+    AT25DF(PinName mosi, PinName miso, PinName sclk, PinName ssel);
+#endif
 
     /** Lifetime of a block device
      */
-    virtual ~AT25DF041B() {
+    virtual ~AT25DF() {
     }
 
     /** Initialize an AT25DF041B
@@ -153,7 +571,8 @@ public:
      *  @param buffer   Buffer of data to write to blocks
      *  @param addr     Address of block to begin writing to
      *  @param size     Size to write in bytes, must be a multiple of program block size
-     *  @return         0 on success, -1 on SPI error, -2 on malformed operation
+     *  @return         0 on success, -1 on SPI error, -2 on malformed operation,
+     *                  -3 if verify-on-write is enabled and the read back data differs
      */
     virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size);
 
@@ -168,6 +587,75 @@ public:
      */
     virtual int erase(bd_addr_t addr, bd_size_t size);
 
+    /** Mark blocks as no longer in use
+     *
+     *  Nothing is sent to the AT25DF041B, the sectors are only recorded as
+     *  free. background_erase() erases them later, when the device is idle,
+     *  and erase() skips sectors that are already blank so a later write to
+     *  a trimmed region does not pay for the erase. The contents of a
+     *  trimmed sector are undefined until it is erased or programmed.
+     *
+     *  @param addr     Address of block to mark as unused, must be erase aligned
+     *  @param size     Size to mark as unused in bytes, must be a multiple of erase block size
+     *  @return         0 on success, -2 on malformed operation
+     */
+    virtual int trim(bd_addr_t addr, bd_size_t size);
+
+    /** Read into several buffers from one contiguous range of flash
+     *
+     *  The whole range is read in a single read transaction
+     *
+     *  @param segments Buffers to fill, in order
+     *  @param count    Number of segments
+     *  @param addr     Address to begin reading from
+     *  @return         0 on success, -1 on SPI error, -2 on malformed operation
+     */
+    int readv(const AT25DF041BIOVec *segments, int count, bd_addr_t addr);
+
+    /** Program several buffers to one contiguous range of flash
+     *
+     *  The segments are streamed straight from the caller's buffers, one
+     *  program transaction per page, with no staging copy. A segment that
+     *  straddles a page boundary is split between the two transactions.
+     *
+     *  @param segments Buffers to program, in order
+     *  @param count    Number of segments
+     *  @param addr     Address to begin programming at
+     *  @return         0 on success, -1 on SPI error, -2 on malformed operation,
+     *                  -3 if verify-on-write is enabled and the read back data differs
+     */
+    int programv(const AT25DF041BIOVec *segments, int count, bd_addr_t addr);
+
+    /** Program a region with a repeating pattern
+     *
+     *  The pattern is streamed into each page program transaction from a
+     *  small tile on the stack, or straight from pattern if it is larger,
+     *  so no buffer the size of the region is needed. The byte at
+     *  addr + i is pattern[i % pattern_size].
+     *
+     *  @param addr         Address to begin programming at
+     *  @param size         Number of bytes to program
+     *  @param pattern      Pattern to repeat
+     *  @param pattern_size Length of the pattern, at least 1
+     *  @return             0 on success, -1 on SPI error, -2 on malformed operation,
+     *                      -3 if verify-on-write is enabled and the read back data differs
+     */
+    int fill(bd_addr_t addr, bd_size_t size, const void *pattern, bd_size_t pattern_size);
+
+    /** Program a region to zero
+     *
+     *  Programming can only clear bits, so unlike other programs this
+     *  needs no erase first: whatever the region held is overwritten.
+     *  Zeroing secrets before erasing their sector means a power cut
+     *  during the erase cannot leave them readable.
+     *
+     *  @param addr     Address to begin zeroing at
+     *  @param size     Number of bytes to zero
+     *  @return         0 on success, -1 on SPI error, -2 on malformed operation,
+     *                  -3 if verify-on-write is enabled and the read back data differs
+     */
+    int zero(bd_addr_t addr, bd_size_t size);
+
     /** Get the size of a readable block
      *
      *  @return         Size of a readable block in bytes
@@ -188,6 +676,72 @@ public:
      */
     virtual bd_size_t get_erase_size() const;
 
+    /** Get the size of the eraseable block at an address
+     *
+     *  The sectors are uniform, so this is the same as get_erase_size()
+     *  for any address on the chip.
+     *
+     *  @param addr     Address within the eraseable block
+     *  @return         Size of the eraseable block in bytes, 0 if addr is
+     *                  past the end of the chip
+     */
+    virtual bd_size_t get_erase_size(bd_addr_t addr) const;
+
+    /** Get every erase size the chip supports, smallest first
+     *
+     *  4kB sectors, 32kB and 64kB blocks, and 256B pages on parts with page
+     *  erase. erase() coalesces aligned runs of sectors into block erases,
+     *  which take far less time per byte, so filesystems that allocate in
+     *  32kB or 64kB units write faster. Pages are only erased by erase_page().
+     *
+     *  @param sizes    Filled in with up to count sizes
+     *  @param count    Number of entries sizes has room for
+     *  @return         Number of sizes supported, at most AT25DF041B_MAX_ERASE_SIZES
+     */
+    int get_erase_sizes(bd_size_t *sizes, int count) const;
+
+    /** Erase a single 256B page
+     *
+     *  Lets small records be rewritten without erasing the rest of their
+     *  sector. The sector is still counted as holding data afterwards, and
+     *  wear tracking counts the page erase as an erase of the sector.
+     *
+     *  @param addr     Page aligned address of the page
+     *  @return         0 on success, -1 on SPI error or if the part has no
+     *                  page erase, -2 if addr is misaligned, out of range
+     *                  or locked
+     */
+    int erase_page(bd_addr_t addr);
+
+    /** Get LittleFS settings for allocating in units of an erase size
+     *
+     *  Larger blocks make every erase a single 32kB or 64kB block erase and
+     *  cut metadata traffic, at the cost of rounding each file up to a block.
+     *
+     *  @code
+     *  AT25DF041BFilesystemPreset preset;
+     *  flash.get_littlefs_preset(AT25DF041B_BLOCK_32KB_SIZE, &preset);
+     *  LittleFileSystem2 fs("fs", &flash, preset.block_size,
+     *          preset.block_cycles, preset.cache_size, preset.lookahead_size);
+     *  @endcode
+     *
+     *  @param erase_size   Sector size or one of the block sizes
+     *  @param preset       Filled in with the settings
+     *  @return             0 on success, -2 if erase_size is not supported
+     */
+    int get_littlefs_preset(bd_size_t erase_size, AT25DF041BFilesystemPreset *preset) const;
+
+    /** Get FAT settings for clusters of an erase size
+     *
+     *  Use preset.block_size as the cluster size for FATFileSystem::format().
+     *  FAT sectors stay at the 4kB erase size, as FatFs cannot buffer more.
+     *
+     *  @param erase_size   Sector size or one of the block sizes
+     *  @param preset       Filled in with the settings
+     *  @return             0 on success, -2 if erase_size is not supported
+     */
+    int get_fat_preset(bd_size_t erase_size, AT25DF041BFilesystemPreset *preset) const;
+
     /** Get the value of storage when erased
      *
      *  If get_erase_value returns a non-negative byte value, the underlying
@@ -235,105 +789,1091 @@ public:
      */
     void perform_chip_erase(int magic_word);
 
-protected:
+    /**
+     * Gets the instrumentation counters
+     *
+     * @note The counters are all zero unless AT25DF041B_ENABLE_STATS is 1
+     */
+    const AT25DF041BStats &get_stats(void) const;
 
     /**
-     * Asserts the slave select pin, if there is one
+     * Clears all instrumentation counters
      */
-    inline void assert_slave_select(void) {
-        _slave_select = 0;
-    }
+    void reset_stats(void);
 
     /**
-     * Deasserts the slave select pin, if there is one
+     * Writes a human readable report of the counters
+     *
+     * @param[out] buffer Destination for the NUL-terminated report
+     * @param[in] size Size of buffer in bytes
+     * @retval length Number of characters the full report needs, as snprintf
      */
-    inline void deassert_slave_select(void) {
-        _slave_select = 1;
-    }
+    int format_stats(char *buffer, size_t size) const;
 
     /**
-     * Calculates the page address
+     * Writes a compact little-endian binary report of the counters
+     *
+     * The report starts with AT25DF041B_STATS_MAGIC and AT25DF041B_STATS_VERSION,
+     * followed by the non-zero opcode counters, the bus counters and the
+     * non-empty histogram buckets
+     *
+     * @param[out] buffer Destination for the report
+     * @param[in] size Size of buffer in bytes
+     * @retval length Bytes written, or -1 if buffer is too small
      */
-    inline bd_addr_t get_page_addr(bd_addr_t addr) {
-        return (addr >> 8); // Simply divide by 256
-    }
+    int export_stats(void *buffer, size_t size) const;
 
     /**
-     * Enable write protection
+     * Copies the most recent trace records out of the ring, oldest first
+     *
+     * @note Nothing is recorded unless AT25DF041B_ENABLE_TRACE is 1
+     *
+     * @param[out] records Destination
+     * @param[in] count Number of records records can hold
+     * @retval count Number of records copied
      */
-    void enable_write_protection(void);
+    int get_trace(AT25DF041BTraceRecord *records, int count) const;
 
     /**
-     * Disable write protection
+     * Gets the number of records overwritten since the trace was last reset
      */
-    void disable_write_protection(void);
+    uint32_t get_trace_dropped(void) const;
 
     /**
-     * Gets the status register
-     * @retval status status register byte
+     * Empties the trace ring
      */
-    uint8_t get_status_register(void);
+    void reset_trace(void);
 
     /**
-     * Gets the device ID
-     * @param[in] id 3-byte buffer to store ID bytes
+     * Writes the trace ring as a compact little-endian binary trace
+     *
+     * The trace starts with AT25DF041B_TRACE_MAGIC, AT25DF041B_TRACE_VERSION,
+     * the record count and the dropped count, followed by the records oldest
+     * first, AT25DF041B_TRACE_RECORD_SIZE bytes each:
+     * timestamp, duration and op packed as in AT25DF041BTraceRecord, address and size.
+     * AT25DFTraceReplay::import() reads it back.
+     *
+     * @param[out] buffer Destination for the trace
+     * @param[in] size Size of buffer in bytes
+     * @retval length Bytes written, or -1 if buffer is too small
      */
-    void get_device_id(uint8_t *id);
+    int export_trace(void *buffer, size_t size) const;
 
     /**
-     * Checks the device ID to make sure the AT25DF041B is available
-     * @retval available 0 if the AT25DF041B is available, -1 if it is not
+     * Starts programming data within a single page and returns without waiting
+     *
+     * The next operation that needs the AT25DF041B, or sync(), waits for
+     * the program to finish. The buffer may be reused as soon as this returns.
+     *
+     * @param[in] buffer Data to program
+     * @param[in] addr Start address
+     * @param[in] size Number of bytes, the range must not cross a page boundary
+     * @retval error 0 on success, -1 on SPI error, -2 on malformed operation
      */
-    int check_device_id(void);
+    int program_page_async(const void *buffer, bd_addr_t addr, bd_size_t size);
 
     /**
-     * Checks if the operation is valid
+     * Starts erasing a single 4kB, 32kB or 64kB block and returns without waiting
      *
-     * @param[in] addr Start address of operation
-     * @param[in] size Size of operation in bytes
-     * @param[in] type Operation type (0 = read, 1 = program, 2 = erase)
-     * @retval true if operation is valid, false otherwise
+     * @param[in] addr Start address, aligned to size
+     * @param[in] size Block size, one of 4kB, 32kB or 64kB
+     * @retval error 0 on success, -1 on SPI error, -2 on malformed operation
      */
-    static bool is_valid_operation(bd_addr_t addr, bd_size_t size, int type);
+    int erase_block_async(bd_addr_t addr, bd_size_t size);
 
     /**
-     * Checks how many boundaries the desired operation crosses
+     * Checks whether a program or erase started without waiting is still running
      *
-     *  @note For the AT25DF041B, a program cannot cross a page boundary
-     *  This function will check whether the desired operation does so
+     * @retval busy true if the AT25DF041B is still busy
+     */
+    bool is_busy(void);
+
+    /**
+     * Erases trimmed sectors in the background, one block per call
      *
-     *  @retval number_of_crossings The number of page boundaries this operation spans
+     * Meant to be called whenever the application has nothing better to do,
+     * from an EventQueue for example:
+     *
+     * @code
+     * queue.call_every(10ms, mbed::callback(&flash, &AT25DF041B::background_erase));
+     * @endcode
      *
+     * Returns straight away if the AT25DF041B is still busy or a stream is
+     * open. Otherwise the largest aligned run of trimmed sectors that fits a
+     * 4kB, 32kB or 64kB block erase is started without waiting for it.
+     *
+     * @retval count Number of trimmed sectors still waiting to be erased,
+     * or -1 on SPI error
      */
-    static int boundary_crossings(bd_addr_t addr, bd_size_t size);
+    int background_erase(void);
 
     /**
-     * Rounds the given address up to the nearest page boundary
-     * Uses efficient bit shifting
+     * Gets the number of trimmed sectors not yet erased
      */
-    inline bd_addr_t round_up_to_page_boundary(bd_addr_t addr) {
-        // What this does
-        // ((addr / 256) + 1) * 256;
-        return ((addr >> 8) + 1) << 8;
+    int get_trimmed_count(void) const {
+        return count_sectors(_trimmed);
     }
 
     /**
-     * Prints an address onto the SPI bus properly formatted
-     * for the AT25DF041B
+     * Gets the number of sectors known to be blank
+     *
+     * A sector is known to be blank from the moment this driver erases it
+     * until the first program to it. The map is kept in RAM and starts out
+     * empty, sectors that were blank at power up are not counted unless
+     * blank_map_init() loads them or scan_unknown_sectors() finds them.
      */
-    void send_address(bd_addr_t addr);
+    int get_erased_count(void) const {
+        return count_sectors(_erased);
+    }
 
     /**
-     * Blocking loop that waits until the AT25DF041B is ready
-     * Checks the RDY/BSY bit of the status register
+     * Checks whether the sector containing addr is known to be blank
+     *
+     * @param[in] addr Any address within the sector
+     * @retval erased true if the sector can be programmed without erasing it first
      */
-    void wait_for_ready(void);
+    bool is_erased(bd_addr_t addr) const {
+        return addr < total_size && test_sector(_erased, addr >> Geometry::sector_shift);
+    }
 
-protected:
+    /**
+     * Finds the first sector at or after addr that is known to be blank
+     *
+     * Lets an allocator above the driver prefer sectors that can be
+     * written straight away
+     *
+     * @param[in] addr Address to start searching from
+     * @param[out] erased Start address of the blank sector
+     * @retval error 0 if one was found, -1 otherwise
+     */
+    int find_erased(bd_addr_t addr, bd_addr_t *erased) const;
 
-    mbed::SPI _spi;
-    mbed::DigitalOut _slave_select;
-};
+    /**
+     * Loads the persisted blank sector map and starts keeping it up to date
+     *
+     * Lets a file system or allocator learn which sectors are blank at
+     * startup by reading a few small checkpoints instead of every sector.
+     * The map is checkpointed by blank_map_sync(), which sync() calls. A
+     * sector the map says is blank has its bit cleared on flash before it is
+     * first programmed, so a power cut can only ever leave it claiming less.
+     * Sectors erased since the last checkpoint, and every sector when the
+     * region is blank or torn, are of unknown state until
+     * scan_unknown_sectors() checks them.
+     *
+     * @param[in] region Erase sector aligned address of blank_map_region_size
+     * bytes reserved for the driver
+     * @retval error 0 on success, -1 on SPI error, -2 on a malformed region
+     */
+    int blank_map_init(bd_addr_t region);
+
+    /**
+     * Writes a checkpoint of the blank sector map if it changed
+     *
+     * Bits that only need clearing are programmed in place, otherwise the
+     * map goes into the next slot of the region.
+     *
+     * @retval error 0 on success, -1 on SPI error
+     */
+    int blank_map_sync(void);
+
+    /**
+     * Checks every sector of unknown state for blankness
+     *
+     * Each sector is read in a single transaction and compared a word at a
+     * time, the read stops at the first word that is not erased. The
+     * sectors reserved for the blank map are left out.
+     *
+     * @retval error 0 on success, -1 on SPI error
+     */
+    int scan_unknown_sectors(void);
+
+    /**
+     * Gets the number of sectors whose state is unknown
+     *
+     * A sector's state becomes known when this driver erases or programs
+     * it, when blank_map_init() loads it or when scan_unknown_sectors()
+     * checks it.
+     */
+    int get_unknown_count(void) const {
+        return sector_count - count_sectors(_known);
+    }
+
+    /**
+     * Starts a streaming read
+     *
+     * A single read transaction is started and held open, slave select stays
+     * asserted, until size bytes have been clocked in with stream_read() or
+     * stream_fill() or until stream_close() is called. Between calls the bus
+     * clock simply stops, so reading a large region costs one command and
+     * address however it is split up. No other operation may be started
+     * while a stream is open, they fail with -1.
+     *
+     * @param[in] addr Start address
+     * @param[in] size Number of bytes to stream
+     * @retval error 0 on success, -1 on SPI error or if a stream is
+     * already open, -2 on malformed operation
+     */
+    int stream_open(bd_addr_t addr, bd_size_t size);
+
+    /**
+     * Clocks the next bytes of an open stream into buffer
+     *
+     * @param[out] buffer Destination
+     * @param[in] size Maximum number of bytes to read
+     * @retval count Number of bytes read, 0 once the stream is finished
+     */
+    bd_size_t stream_read(void *buffer, bd_size_t size);
+
+    /**
+     * Clocks the next bytes of an open stream directly into the free space of a ring
+     *
+     * Nothing is read if the ring is full, the transaction is left paused
+     * until the consumer makes room
+     *
+     * @param[in,out] ring Ring buffer to fill
+     * @retval count Number of bytes added to the ring
+     */
+    bd_size_t stream_fill(AT25DF041BRing *ring);
+
+    /**
+     * Gets the number of bytes left in the open stream
+     */
+    bd_size_t stream_remaining(void) const {
+        return _stream_remaining;
+    }
+
+    /**
+     * Ends the open stream early, if there is one
+     */
+    void stream_close(void);
+
+    /**
+     * Streams a region through a callback in a single read transaction
+     *
+     * Data is delivered AT25DF041B_STREAM_CHUNK_SIZE bytes at a time.
+     * The sink may block to apply back-pressure, the bus just waits.
+     *
+     * @param[in] addr Start address
+     * @param[in] size Number of bytes to stream
+     * @param[in] sink Called with each chunk, returns 0 to continue or
+     * a negative value to stop the stream early
+     * @retval error 0 on success, the sink's error if it stopped the stream,
+     * -1 on SPI error, -2 on malformed operation
+     */
+    int stream(bd_addr_t addr, bd_size_t size,
+            mbed::Callback<int(const void*, bd_size_t)> sink);
+
+    /**
+     * Sets the SPI clock rate
+     *
+     * Reads switch to Read Array 0Bh, with its dummy byte, above the
+     * rate Read Array 03h is specified for
+     *
+     * @param[in] hz Clock rate in Hz
+     */
+    void set_frequency(int hz);
+
+    /**
+     * Gets the SPI clock rate last set, 0 if it was never set
+     */
+    int get_frequency(void) const {
+        return _frequency;
+    }
+
+    /**
+     * Finds the fastest SPI clock rate this board runs the AT25DF041B at reliably
+     *
+     * Starting at 1MHz, the clock is stepped up through a ladder of rates.
+     * At every step the device ID and a 64-byte pattern in a reserved page
+     * are read back several times. Once a step fails, the clock settles one
+     * step below the last rate that passed. The pattern has every data line
+     * toggling on every bit and is programmed the first time, so the
+     * sector holding the page must be reserved for it.
+     *
+     * Define AT25DF041B_TUNE_PATTERN_ADDR to have init() run this.
+     *
+     * @param[in] pattern_addr Page aligned address of the reserved page
+     * @param[in] max_hz Highest rate to try, for boards whose SPI peripheral
+     * or level shifters are slower than the AT25DF041B, at least 1MHz
+     * @retval error 0 on success, -1 if the device does not work even at
+     * 1MHz, -2 if pattern_addr is not page aligned or max_hz is below 1MHz
+     */
+    int tune_frequency(bd_addr_t pattern_addr, int max_hz = AT25DF041B_MAX_FREQUENCY);
+
+    /**
+     * Enables or disables verify-on-write
+     *
+     * When enabled, every page is read back and compared as soon as it has
+     * been programmed, a few bytes at a time
+     *
+     * @param[in] enable true to verify every program operation
+     */
+    void set_verify_on_write(bool enable) {
+        _verify_on_write = enable;
+    }
+
+    /**
+     * Checks whether verify-on-write is enabled
+     */
+    bool get_verify_on_write(void) const {
+        return _verify_on_write;
+    }
+
+    /**
+     * Enables or disables deferred busy-wait
+     *
+     * When enabled, program() and erase() return as soon as the last
+     * command has been issued instead of polling until the AT25DF041B is
+     * ready. The wait happens at the start of the next operation that
+     * needs the AT25DF041B, so the busy time overlaps whatever the caller
+     * does in between. Call sync() to be sure the data is in flash, for
+     * example before power down. Program latencies in the statistics only
+     * cover issuing the commands in this mode.
+     *
+     * @param[in] enable true to defer the wait for the last program or erase
+     */
+    void set_deferred_wait(bool enable) {
+        _deferred_wait = enable;
+    }
+
+    /**
+     * Checks whether deferred busy-wait is enabled
+     */
+    bool get_deferred_wait(void) const {
+        return _deferred_wait;
+    }
+
+    /**
+     * Locks protection sectors, such as a bootloader or calibration data
+     *
+     * Locked sectors are kept protected in the AT25DF041B and programs,
+     * erases and trims that touch them fail with -2 without reaching the
+     * bus. Locks made before init() are applied by it.
+     *
+     * @param[in] addr Start address, aligned to protect_size
+     * @param[in] size Number of bytes, a multiple of protect_size
+     * @retval error 0 on success, -1 on SPI error or if the part has no
+     * individual sector protection, -2 on malformed range
+     */
+    int lock_sectors(bd_addr_t addr, bd_size_t size);
+
+    /**
+     * Unlocks protection sectors locked by lock_sectors
+     *
+     * @param[in] addr Start address, aligned to protect_size
+     * @param[in] size Number of bytes, a multiple of protect_size
+     * @retval error 0 on success, -1 on SPI error or if the part has no
+     * individual sector protection, -2 on malformed range
+     */
+    int unlock_sectors(bd_addr_t addr, bd_size_t size);
+
+    /**
+     * Enables or disables auto-protect
+     *
+     * By default init() unprotects every sector that is not locked. With
+     * auto-protect every sector stays protected except the ones the most
+     * recent program or erase touched; a write elsewhere protects those
+     * again and sync() protects everything. Protection state is cached, so
+     * writes that stay within the same sectors cost no extra commands.
+     *
+     * @param[in] enable true to keep sectors protected while they are not written
+     * @retval error 0 on success, -1 on SPI error or if the part has no
+     * individual sector protection
+     */
+    int set_auto_protect(bool enable);
+
+    /**
+     * Checks the cached protection state of the sector holding addr
+     *
+     * @retval protected true if the sector is protected in the AT25DF041B
+     */
+    bool is_protected(bd_addr_t addr) const {
+        return addr < total_size && ((_protected >> (addr / protect_size)) & 1);
+    }
+
+    /**
+     * Reads every sector protection register back into the cache
+     *
+     * Only needed if something other than this driver changes the protection
+     *
+     * @retval error 0 on success, -1 on SPI error
+     */
+    int refresh_protection(void);
+
+    /**
+     * Reads from the one-time programmable user area of the security register
+     *
+     * The whole security register is read once and kept in RAM, later
+     * reads of either area never touch the bus
+     *
+     * @param[out] buffer Destination
+     * @param[in] offset Offset into the user area
+     * @param[in] size Number of bytes
+     * @retval error 0 on success, -1 on SPI error or if the part has no
+     * security register, -2 if the range is outside the user area
+     */
+    int read_user_otp(void *buffer, bd_size_t offset, bd_size_t size);
+
+    /**
+     * Reads a value from the user area of the security register
+     */
+    template <typename T>
+    int read_user_otp(T *value, bd_size_t offset = 0) {
+        return read_user_otp((void*) value, offset, sizeof(T));
+    }
+
+    /**
+     * Programs the one-time programmable user area of the security register
+     *
+     * @note THIS CANNOT BE REVERSED! The user area can never be erased and
+     * the AT25DF041B may lock all of it after the first program, so write
+     * everything that belongs there in a single call.
+     *
+     * The target range has to be blank, and is read back and compared
+     * once programmed.
+     *
+     * @param[in] buffer Data to program
+     * @param[in] offset Offset into the user area
+     * @param[in] size Number of bytes
+     * @param[in] magic_word You must input the magic word AT25DF041B_OTP_MAGIC_WORD
+     * @retval error 0 on success, -1 on SPI error, a wrong magic word, a range that is
+     * already programmed or if the part has no security register, -2 if the range is
+     * outside the user area, -3 if the data did not read back correctly
+     */
+    int program_user_otp(const void *buffer, bd_size_t offset, bd_size_t size,
+            int magic_word);
+
+    /**
+     * Programs a value into the user area of the security register, see above
+     */
+    template <typename T>
+    int program_user_otp(const T &value, bd_size_t offset, int magic_word) {
+        return program_user_otp((const void*) &value, offset, sizeof(T), magic_word);
+    }
+
+    /**
+     * Reads the unique ID the factory programmed into the security register
+     *
+     * @param[out] id Destination for AT25DF041B_OTP_FACTORY_SIZE bytes
+     * @retval error 0 on success, -1 on SPI error or if the part has no security register
+     */
+    int read_unique_id(uint8_t id[AT25DF041B_OTP_FACTORY_SIZE]);
+
+    /**
+     * Compares the contents of flash against a buffer without copying it to RAM
+     *
+     * @param[in] buffer Expected data
+     * @param[in] addr Start address
+     * @param[in] size Number of bytes to compare
+     * @retval result 0 if the data matches, -1 on SPI error,
+     * -2 on malformed operation, -3 if the data differs
+     */
+    int verify(const void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /**
+     * Calculates the CRC-32 (IEEE 802.3, as used by zlib) of a region of flash
+     *
+     * The region is streamed through the CRC in a single read transaction,
+     * no caller buffer is needed. CRCs can be chained over several regions
+     * by passing the previous result back in.
+     *
+     * @param[in] addr Start address
+     * @param[in] size Number of bytes to checksum
+     * @param[in,out] crc Running CRC, set to 0 before the first call
+     * @retval error 0 on success, -1 on SPI error, -2 on malformed operation
+     */
+    int crc32(bd_addr_t addr, bd_size_t size, uint32_t *crc);
+
+    /**
+     * Calculates the same CRC-32 as crc32() over a RAM buffer
+     *
+     * @param[in] crc Running CRC, 0 for the first block
+     * @param[in] buffer Data to checksum
+     * @param[in] size Number of bytes to checksum
+     * @retval crc Updated CRC
+     */
+    static uint32_t crc32_update(uint32_t crc, const void *buffer, size_t size);
+
+    /**
+     * Loads the persisted erase counters and starts tracking wear
+     *
+     * The region must be reserved for the driver, it is never counted itself.
+     * A blank region is formatted with all counts at zero.
+     *
+     * @param[in] region Erase sector aligned address of wear_region_size bytes
+     * @retval error 0 on success, -1 on SPI error or when wear tracking
+     * is compiled out, -2 on a malformed region
+     */
+    int wear_tracking_init(bd_addr_t region);
+
+    /**
+     * Writes any erase counts still buffered in RAM to the reserved region
+     *
+     * @retval error 0 on success, -1 on SPI error
+     */
+    int wear_tracking_sync(void);
+
+    /**
+     * Gets the number of times the sector containing addr has been erased
+     *
+     * @param[in] addr Any address within the sector
+     * @param[out] count Erase count, including counts not yet persisted
+     * @retval error 0 on success, -1 if wear tracking is not running, -2 on bad address
+     */
+    int get_erase_count(bd_addr_t addr, uint32_t *count);
+
+    /**
+     * Summarizes the erase counts of every sector
+     *
+     * @param[out] report Wear summary
+     * @retval error 0 on success, -1 if wear tracking is not running
+     */
+    int get_wear_report(AT25DF041BWearReport *report);
+
+    /** Ensure data on storage is in sync with the driver
+     *
+     *  Waits for any program or erase still in progress and persists
+     *  buffered erase counts
+     *
+     *  @return         0 on success or a negative error code on failure,
+     *                  -1 while a stream is open
+     */
+    virtual int sync();
+
+protected:
+
+    /**
+     * Asserts the slave select pin, if there is one
+     */
+    inline void assert_slave_select(void) {
+#if AT25DF041B_ENABLE_STATS
+        _stats.cs_assertions++;
+#endif
+        _slave_select = 0;
+    }
+
+    /**
+     * Deasserts the slave select pin, if there is one,
+     * once anything still staged has been clocked out
+     */
+    inline void deassert_slave_select(void) {
+        bus_flush();
+        _slave_select = 1;
+    }
+
+    /**
+     * Calculates the page address
+     */
+    inline bd_addr_t get_page_addr(bd_addr_t addr) {
+        return (addr >> Geometry::page_shift); // Simply divide by the page size
+    }
+
+    /**
+     * Enable write protection
+     */
+    void enable_write_protection(void);
+
+    /**
+     * Disable write protection
+     */
+    void disable_write_protection(void);
+
+    /**
+     * Gets the status register
+     * @retval status status register byte
+     */
+    uint8_t get_status_register(void);
+
+    /**
+     * Gets the device ID
+     * @param[in] id 3-byte buffer to store ID bytes
+     */
+    void get_device_id(uint8_t *id);
+
+    /**
+     * Checks the device ID to make sure the AT25DF041B is available
+     * @retval available 0 if the AT25DF041B is available, -1 if it is not
+     */
+    int check_device_id(void);
+
+    /**
+     * Checks if the operation is valid
+     *
+     * @param[in] addr Start address of operation
+     * @param[in] size Size of operation in bytes
+     * @param[in] type Operation type (0 = read, 1 = program, 2 = erase)
+     * @retval true if operation is valid, false otherwise
+     */
+    static bool is_valid_operation(bd_addr_t addr, bd_size_t size, int type);
+
+    /**
+     * Checks how many boundaries the desired operation crosses
+     *
+     *  @note For the AT25DF041B, a program cannot cross a page boundary
+     *  This function will check whether the desired operation does so
+     *
+     *  @retval number_of_crossings The number of page boundaries this operation spans
+     *
+     */
+    static int boundary_crossings(bd_addr_t addr, bd_size_t size);
+
+    /**
+     * Rounds the given address up to the nearest page boundary
+     * Uses efficient bit shifting
+     */
+    static inline bd_addr_t round_up_to_page_boundary(bd_addr_t addr) {
+        // What this does
+        // ((addr / page_size) + 1) * page_size;
+        return ((addr >> Geometry::page_shift) + 1) << Geometry::page_shift;
+    }
+
+    /**
+     * Prints an address onto the SPI bus properly formatted
+     * for the AT25DF041B
+     */
+    void send_address(bd_addr_t addr);
+
+    /**
+     * Sends a command opcode, slave select must already be asserted
+     */
+    inline void send_command(uint8_t opcode) {
+        stats_count_command(opcode);
+        bus_write_byte(opcode);
+    }
+
+    /**
+     * Starts a read transaction at addr with the read command that suits the clock rate
+     */
+    inline void send_read_command(bd_addr_t addr) {
+        send_command(_read_opcode);
+        send_address(addr);
+        if (_read_opcode == AT25DF041B_READ_ARRAY_FAST) {
+            bus_write_byte(AT25DF041B_DUMMY_BYTE);
+        }
+    }
+
+    /**
+     * Stages a single byte to be clocked out onto the SPI bus
+     */
+    inline void bus_write_byte(uint8_t value) {
+#if AT25DF041B_ENABLE_STATS
+        _stats.bytes_out++;
+#endif
+        if (_burst_length == AT25DF041B_BURST_SIZE) {
+            bus_flush();
+        }
+        _burst[_burst_length++] = value;
+    }
+
+    /**
+     * Clocks a single byte in from the SPI bus
+     */
+    inline uint8_t bus_read_byte(void) {
+        uint8_t value;
+        bus_read(&value, 1);
+        return value;
+    }
+
+    /**
+     * Clocks anything staged by the bus_write functions out onto the SPI bus
+     */
+    inline void bus_flush(void) {
+        if (_burst_length) {
+            _spi.write((const char*) _burst, _burst_length, NULL, 0);
+            _burst_length = 0;
+        }
+    }
+
+    /**
+     * Stages a buffer to be clocked out onto the SPI bus,
+     * buffers too big to stage go out straight after what is already staged
+     */
+    void bus_write(const void *buffer, bd_size_t size);
+
+    /**
+     * Clocks a buffer in from the SPI bus
+     *
+     * Small reads share one full-duplex transfer with the staged command
+     */
+    void bus_read(void *buffer, bd_size_t size);
+
+#if AT25DF041B_ENABLE_STATS
+    /**
+     * Counts a command against its opcode slot
+     */
+    void stats_count_command(uint8_t opcode);
+
+    /**
+     * Records the latency of an operation that started at start_us
+     */
+    void stats_record_latency(int type, uint32_t start_us);
+
+#else
+    inline void stats_count_command(uint8_t) {
+    }
+
+    inline void stats_record_latency(int, uint32_t) {
+    }
+#endif
+
+#if AT25DF041B_ENABLE_STATS || AT25DF041B_ENABLE_TRACE
+    /**
+     * Timestamp used to measure operation latency
+     */
+    static uint32_t stats_timestamp(void);
+#else
+    static inline uint32_t stats_timestamp(void) {
+        return 0;
+    }
+#endif
+
+#if AT25DF041B_ENABLE_TRACE
+    /**
+     * Appends an operation that started at start_us to the trace ring
+     */
+    void trace_record(int op, bd_addr_t addr, bd_size_t size, uint32_t start_us);
+#else
+    inline void trace_record(int, bd_addr_t, bd_size_t, uint32_t) {
+    }
+#endif
+
+    /**
+     * Erases a single block
+     *
+     * @param[in] opcode One of the block erase opcodes
+     * @param[in] addr Address within the block to erase
+     * @param[in] wait false to return as soon as the command is issued
+     */
+    void erase_block(uint8_t opcode, bd_addr_t addr, bool wait = true);
+
+    /**
+     * Programs data that fits within a single page
+     *
+     * @param[in] wait false to return as soon as the data is sent
+     */
+    void program_page(const void *buffer, bd_addr_t addr, bd_size_t size,
+            bool wait = true);
+
+    /**
+     * Waits for a program or erase issued without waiting, if there is one
+     */
+    inline void wait_if_busy(void) {
+        if (_write_in_progress) {
+            wait_for_ready();
+            _write_in_progress = false;
+        }
+    }
+
+    /**
+     * Number of 32-bit words in a bitmap with one bit per sector
+     */
+    enum {
+        sector_map_words = (sector_count + 31) / 32
+    };
+
+    /**
+     * Mask with a bit for every protection sector
+     */
+    static const uint32_t protect_all = (protect_count >= 32) ? 0xFFFFFFFF
+            : ((1u << protect_count) - 1);
+
+    /**
+     * Tests the bit for sector in a sector bitmap
+     */
+    static inline bool test_sector(const uint32_t *map, int sector) {
+        return (map[sector >> 5] >> (sector & 31)) & 1;
+    }
+
+    /**
+     * Sets or clears the bits of every sector in [addr, addr + size)
+     */
+    static void mark_sectors(uint32_t *map, bd_addr_t addr, bd_size_t size, bool value);
+
+    /**
+     * Counts the bits set in a sector bitmap
+     */
+    static int count_sectors(const uint32_t *map);
+
+    /**
+     * Updates the sector bitmaps for a program of [addr, addr + size)
+     *
+     * Must be called before the program is sent, sectors the persisted
+     * blank map claims are blank have their bit cleared on flash first
+     */
+    void mark_programmed(bd_addr_t addr, bd_size_t size);
+
+    /**
+     * Checks whether a sector is reserved for the blank map
+     */
+    inline bool is_blank_map_sector(int sector) {
+        bd_addr_t addr = (bd_addr_t) sector << Geometry::sector_shift;
+        return _blank_map_enabled && addr >= _blank_map_region
+                && addr < _blank_map_region + blank_map_region_size;
+    }
+
+    /**
+     * Reads a blank map slot, loading its bitmaps and sequence number if asked to
+     *
+     * @retval valid true if the slot holds a complete checkpoint
+     */
+    bool blank_map_read_slot(bd_addr_t slot, bool load);
+
+    /**
+     * Checks whether a blank map slot has never been written to
+     */
+    bool blank_map_slot_unused(bd_addr_t slot);
+
+    /**
+     * Writes the bitmaps in _blank_map_unknown and _blank_map_blank to a new slot
+     */
+    void blank_map_write_slot(void);
+
+    /**
+     * Position within an array of segments
+     */
+    struct segment_cursor {
+        const AT25DF041BIOVec *segment;
+        bd_size_t offset;
+    };
+
+    /**
+     * Clocks size bytes out from the segments, advancing the cursor
+     */
+    void bus_write_segments(segment_cursor &cursor, bd_size_t size);
+
+    /**
+     * Compares size bytes of flash at addr against the segments, advancing the cursor
+     *
+     * @retval result 0 if the data matches, -1 otherwise
+     */
+    int compare_segments(segment_cursor &cursor, bd_addr_t addr, bd_size_t size);
+
+    /**
+     * Position within a repeating pattern
+     *
+     * The tile holds the pattern a whole number of times, phase is the
+     * offset within the pattern of the next byte
+     */
+    struct pattern_cursor {
+        const uint8_t *tile;
+        bd_size_t tile_size;
+        bd_size_t pattern_size;
+        bd_size_t phase;
+    };
+
+    /**
+     * Programs size bytes of the pattern at addr, one page program per page
+     */
+    int program_pattern(pattern_cursor &cursor, bd_addr_t addr, bd_size_t size);
+
+    /**
+     * Clocks size bytes of the pattern out, advancing the cursor
+     */
+    void bus_write_pattern(pattern_cursor &cursor, bd_size_t size);
+
+    /**
+     * Compares size bytes of flash at addr against the pattern, advancing the cursor
+     *
+     * @retval result 0 if the data matches, -1 otherwise
+     */
+    int compare_pattern(pattern_cursor &cursor, bd_addr_t addr, bd_size_t size);
+
+    /**
+     * Sums the segment sizes
+     */
+    static bd_size_t segments_size(const AT25DF041BIOVec *segments, int count);
+
+    /**
+     * Reads flash back in small chunks and compares it against buffer
+     *
+     * @retval result 0 if the data matches, -1 otherwise
+     */
+    int compare(const void *buffer, bd_addr_t addr, bd_size_t size);
+
+#if AT25DF041B_ENABLE_WEAR_TRACKING
+    /**
+     * Records an erase of size bytes starting at addr in the wear table
+     */
+    void wear_record(bd_addr_t addr, bd_size_t size);
+
+    /**
+     * Reads the persisted base count of a sector from the active table
+     */
+    uint32_t wear_read_base(int sector);
+
+    /**
+     * Slot that holds the header of each copy instead of a count
+     */
+    inline int wear_header_slot(void) const {
+        return _wear_region >> Geometry::sector_shift;
+    }
+
+    /**
+     * Reads the sequence number of a copy, returns whether the copy is complete
+     */
+    bool wear_read_header(bd_addr_t copy, uint32_t *sequence);
+
+    /**
+     * Programs the header that marks a copy complete
+     */
+    void wear_commit(bd_addr_t copy, uint32_t sequence);
+
+    /**
+     * Erases one copy of the wear table, its header first
+     */
+    void wear_erase_copy(bd_addr_t copy);
+
+    /**
+     * Moves the counts into the inactive copy of the table and makes it active
+     */
+    void wear_fold(void);
+#endif
+
+    /**
+     * Bit mask of the protection sectors that [addr, addr + size) touches
+     */
+    static uint32_t protect_mask(bd_addr_t addr, bd_size_t size);
+
+    /**
+     * Checks whether [addr, addr + size) touches a locked sector
+     */
+    inline bool is_locked(bd_addr_t addr, bd_size_t size) const {
+        return (_locked & protect_mask(addr, size)) != 0;
+    }
+
+    /**
+     * Protection sectors that should be protected while nothing is written to them
+     */
+    inline uint32_t idle_protection(void) const {
+        return _auto_protect ? (_locked | protect_all) : _locked;
+    }
+
+    /**
+     * Unprotects the unlocked sectors [addr, addr + size) touches and
+     * returns every other sector to its idle protection
+     */
+    inline void open_sectors(bd_addr_t addr, bd_size_t size) {
+        apply_protection(idle_protection() & ~(protect_mask(addr, size) & ~_locked));
+    }
+
+    /**
+     * Unprotects the unlocked sectors [addr, addr + size) touches, leaving the rest as they are
+     */
+    inline void unprotect_sectors(bd_addr_t addr, bd_size_t size) {
+        apply_protection(_protected & ~(protect_mask(addr, size) & ~_locked));
+    }
+
+    /**
+     * Brings the sector protection in line with mask, one bit per protection
+     * sector, only issuing commands for the sectors whose cached state differs
+     */
+    void apply_protection(uint32_t mask);
+
+    /**
+     * Reads the whole security register into the cache unless it is already there
+     */
+    int load_otp(void);
+
+    /**
+     * Blocking loop that waits until the AT25DF041B is ready
+     * Checks the RDY/BSY bit of the status register
+     */
+    void wait_for_ready(void);
+
+protected:
+
+#if AT25DF041B_TRANSPORT_SPIDEV
+    AT25DFSpidev _spi;
+    AT25DFSpidevSelect _slave_select;
+#else
+    mbed::SPI _spi;
+    mbed::DigitalOut _slave_select;
+#endif
+
+    bool _verify_on_write;
+    bool _deferred_wait;
+
+    /** A program or erase was issued without waiting for it to finish */
+    bool _write_in_progress;
+
+    /** Bytes staged for the next SPI transfer */
+    uint8_t _burst[AT25DF041B_BURST_SIZE];
+    int _burst_length;
+
+    /** Bytes left in the open stream, 0 when no stream is open */
+    bd_size_t _stream_remaining;
+
+    /** When, where and how big the open stream started */
+    uint32_t _stream_start_us;
+    bd_addr_t _stream_addr;
+    bd_size_t _stream_size;
+
+    /** SPI clock rate and the read command it needs */
+    int _frequency;
+    uint8_t _read_opcode;
+
+    /** Protection sectors that must stay protected and the cached protection state, one bit each */
+    uint32_t _locked;
+    uint32_t _protected;
+    bool _auto_protect;
+
+    /** Copy of the security register, valid once _otp_cached is set */
+    uint8_t _otp[AT25DF041B_OTP_SIZE];
+    bool _otp_cached;
+
+    /** Sectors freed with trim() and not yet erased, one bit each */
+    uint32_t _trimmed[sector_map_words];
+
+    /** Sectors erased by this driver and not programmed since, one bit each */
+    uint32_t _erased[sector_map_words];
+
+    /** Sectors whose state, blank or not, is known, one bit each */
+    uint32_t _known[sector_map_words];
+
+    /** Reserved region, the active checkpoint and the slot the next one goes to */
+    bool _blank_map_enabled;
+    bd_addr_t _blank_map_region;
+    bd_addr_t _blank_map_slot;
+    bd_addr_t _blank_map_next;
+    uint32_t _blank_map_sequence;
+
+    /** Bitmaps of the active checkpoint as they are on flash */
+    uint32_t _blank_map_unknown[sector_map_words];
+    uint32_t _blank_map_blank[sector_map_words];
+
+#if AT25DF041B_ENABLE_STATS
+    AT25DF041BStats _stats;
+#endif
+
+#if AT25DF041B_ENABLE_TRACE
+    /** Trace ring and the number of records ever appended to it */
+    AT25DF041BTraceRecord _trace[AT25DF041B_TRACE_ENTRIES];
+    uint32_t _trace_count;
+#endif
+
+#if AT25DF041B_ENABLE_WEAR_TRACKING
+    /** Reserved region, the start of its active copy of the wear table and its sequence number */
+    bool _wear_enabled;
+    bd_addr_t _wear_region;
+    bd_addr_t _wear_table;
+    uint32_t _wear_sequence;
+
+    /** Bitmap bits already cleared on flash, per sector */
+    uint8_t _wear_used[sector_count];
+
+    /** Erases not yet written to flash, per sector */
+    uint8_t _wear_pending[sector_count];
+    int _wear_pending_total;
+#endif
+};
+
+/** Supported parts */
+typedef AT25DF<AT25DF041BGeometry> AT25DF041B;
+typedef AT25DF<AT25DF081AGeometry> AT25DF081A;
+typedef AT25DF<AT25DF161Geometry> AT25DF161;
+typedef AT25DF<AT25SF041Geometry> AT25SF041;
+typedef AT25DF<AT25SF081Geometry> AT25SF081;
+typedef AT25DF<AT25SF161Geometry> AT25SF161;
 
 #endif
 #endif
@@ -0,0 +1,360 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#if defined(DEVICE_SPI) || defined(DOXYGEN_ONLY)
+
+#include "AT25DFDeltaApplier.h"
+
+#include <string.h>
+
+static inline uint32_t get_le32(const uint8_t *in) {
+    return (uint32_t) in[0] | ((uint32_t) in[1] << 8) | ((uint32_t) in[2] << 16)
+            | ((uint32_t) in[3] << 24);
+}
+
+template <typename Flash>
+AT25DFDeltaApplier<Flash>::AT25DFDeltaApplier(Flash *flash) :
+        _flash(flash), _old_addr(0), _old_size(0), _new_addr(0), _new_end(0),
+        _cursor(0), _state(STATE_DONE), _opcode(0), _argument_fill(0),
+        _literal_remaining(0), _crc(0), _expected_crc(0), _written(0),
+        _sectors_skipped(0), _sectors_rewritten(0), _pages_programmed(0),
+        _page_erase(false), _fill(0) {
+    memset(_rewritten, 0, sizeof(_rewritten));
+}
+
+template <typename Flash>
+int AT25DFDeltaApplier<Flash>::begin(bd_addr_t old_addr, bd_size_t old_size,
+        bd_addr_t new_addr, bd_size_t new_size) {
+    if ((new_addr & (Flash::sector_size - 1)) || (new_size & (Flash::sector_size - 1))
+            || new_size == 0 || (new_addr + new_size) > Flash::total_size
+            || old_addr > Flash::total_size || old_size > Flash::total_size - old_addr) {
+        return -2;
+    }
+
+    // Page erases only pay off on parts that list them
+    bd_size_t sizes[AT25DF041B_MAX_ERASE_SIZES];
+    int count = _flash->get_erase_sizes(sizes, AT25DF041B_MAX_ERASE_SIZES);
+    _page_erase = count > 0 && sizes[0] == Flash::page_size;
+
+    _old_addr = old_addr;
+    _old_size = old_size;
+    _new_addr = new_addr;
+    _new_end = new_addr + new_size;
+    _cursor = new_addr;
+    _state = STATE_OPCODE;
+    _argument_fill = 0;
+    _literal_remaining = 0;
+    _crc = 0;
+    _expected_crc = 0;
+    _written = 0;
+    _sectors_skipped = 0;
+    _sectors_rewritten = 0;
+    _pages_programmed = 0;
+    _fill = 0;
+    memset(_rewritten, 0, sizeof(_rewritten));
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFDeltaApplier<Flash>::write(const void *patch, bd_size_t size) {
+    const uint8_t *in = (const uint8_t*) patch;
+
+    while (size) {
+        bd_size_t length;
+        int res = 0;
+
+        switch (_state) {
+        case STATE_OPCODE:
+            _opcode = *in;
+            if (_opcode != AT25DF_DELTA_OP_COPY && _opcode != AT25DF_DELTA_OP_INSERT
+                    && _opcode != AT25DF_DELTA_OP_END) {
+                return -2;
+            }
+            _argument_fill = 0;
+            _state = STATE_ARGUMENTS;
+            length = 1;
+            break;
+
+        case STATE_ARGUMENTS: {
+            // Copies carry an offset and a length, the others a single word
+            bd_size_t needed = (_opcode == AT25DF_DELTA_OP_COPY) ? 8 : 4;
+            length = needed - _argument_fill;
+            if (length > size) {
+                length = size;
+            }
+            memcpy(&_arguments[_argument_fill], in, length);
+            _argument_fill += length;
+            if (_argument_fill == needed) {
+                res = run_operation();
+            }
+            break;
+        }
+
+        case STATE_LITERAL:
+            length = _literal_remaining;
+            if (length > size) {
+                length = size;
+            }
+            res = append(in, length);
+            _literal_remaining -= length;
+            if (_literal_remaining == 0) {
+                _state = STATE_OPCODE;
+            }
+            break;
+
+        default:
+            // Nothing may follow the end of the patch
+            return -2;
+        }
+
+        if (res) {
+            return res;
+        }
+        in += length;
+        size -= length;
+    }
+
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFDeltaApplier<Flash>::finish(void) {
+    if (_state != STATE_DONE) {
+        return -2;
+    }
+
+    if (_fill) {
+        int res = flush_sector();
+        if (res) {
+            return res;
+        }
+    }
+
+    int res = _flash->sync();
+    if (res) {
+        return res;
+    }
+
+    return (_crc == _expected_crc) ? 0 : -3;
+}
+
+template <typename Flash>
+int AT25DFDeltaApplier<Flash>::run_operation(void) {
+    bd_size_t first = get_le32(&_arguments[0]);
+
+    switch (_opcode) {
+    case AT25DF_DELTA_OP_COPY:
+        _state = STATE_OPCODE;
+        return copy(first, get_le32(&_arguments[4]));
+
+    case AT25DF_DELTA_OP_INSERT:
+        if (first > _new_end - _cursor - _fill) {
+            return -2;
+        }
+        _literal_remaining = first;
+        _state = first ? STATE_LITERAL : STATE_OPCODE;
+        return 0;
+
+    default:
+        _expected_crc = first;
+        _state = STATE_DONE;
+        return 0;
+    }
+}
+
+template <typename Flash>
+int AT25DFDeltaApplier<Flash>::copy(bd_addr_t offset, bd_size_t length) {
+    if (offset > _old_size || length > _old_size - offset
+            || length > _new_end - _cursor - _fill) {
+        return -2;
+    }
+
+    bd_addr_t source = _old_addr + offset;
+    while (length) {
+        bd_size_t chunk = Flash::sector_size - _fill;
+        if (chunk > length) {
+            chunk = length;
+        }
+
+        // Checked chunk by chunk, as the copy itself may rewrite its source
+        int first = source / Flash::sector_size;
+        int last = (source + chunk - 1) / Flash::sector_size;
+        for (int sector = first; sector <= last; sector++) {
+            if (is_rewritten(sector)) {
+                return -2;
+            }
+        }
+
+        int res = _flash->read(&_sector[_fill], source, chunk);
+        if (res) {
+            return res;
+        }
+        _fill += chunk;
+        _written += chunk;
+        source += chunk;
+        length -= chunk;
+
+        if (_fill == Flash::sector_size) {
+            res = flush_sector();
+            if (res) {
+                return res;
+            }
+        }
+    }
+
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFDeltaApplier<Flash>::append(const uint8_t *data, bd_size_t length) {
+    while (length) {
+        bd_size_t chunk = Flash::sector_size - _fill;
+        if (chunk > length) {
+            chunk = length;
+        }
+        memcpy(&_sector[_fill], data, chunk);
+        _fill += chunk;
+        _written += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if (_fill == Flash::sector_size) {
+            int res = flush_sector();
+            if (res) {
+                return res;
+            }
+        }
+    }
+
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFDeltaApplier<Flash>::flush_sector(void) {
+    const int pages = (_fill + Flash::page_size - 1) / Flash::page_size;
+    const uint32_t all_pages = (pages < 32) ? ((1UL << pages) - 1) : 0xFFFFFFFF;
+    int res;
+
+    _crc = Flash::crc32_update(_crc, _sector, _fill);
+
+    if (_flash->is_erased(_cursor)) {
+        // Nothing to compare against or erase
+        res = program_pages(all_pages);
+    } else {
+        // One read of the whole sector settles the common case
+        res = _flash->verify(_sector, _cursor, _fill);
+        if (res == 0) {
+            _sectors_skipped++;
+            _cursor += Flash::sector_size;
+            _fill = 0;
+            return 0;
+        } else if (res != -3) {
+            return res;
+        }
+
+        uint32_t changed = 0;
+        int changed_count = 0;
+        if (_page_erase) {
+            for (int page = 0; page < pages; page++) {
+                bd_size_t offset = page * Flash::page_size;
+                bd_size_t length = _fill - offset;
+                if (length > Flash::page_size) {
+                    length = Flash::page_size;
+                }
+                res = _flash->verify(&_sector[offset], _cursor + offset, length);
+                if (res == -3) {
+                    changed |= 1UL << page;
+                    changed_count++;
+                } else if (res) {
+                    return res;
+                }
+            }
+        }
+
+        if (_page_erase && changed_count <= AT25DF_DELTA_PAGE_ERASE_MAX) {
+            for (int page = 0; page < pages; page++) {
+                if (changed & (1UL << page)) {
+                    res = _flash->erase_page(_cursor + page * Flash::page_size);
+                    if (res) {
+                        return res;
+                    }
+                }
+            }
+            res = program_pages(changed);
+        } else {
+            res = _flash->erase(_cursor, Flash::sector_size);
+            if (res == 0) {
+                res = program_pages(all_pages);
+            }
+        }
+    }
+
+    if (res) {
+        return res;
+    }
+
+    int sector = _cursor / Flash::sector_size;
+    _rewritten[sector / 32] |= 1UL << (sector % 32);
+    _sectors_rewritten++;
+    _cursor += Flash::sector_size;
+    _fill = 0;
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFDeltaApplier<Flash>::program_pages(uint32_t pages) {
+    for (bd_size_t offset = 0; offset < _fill; offset += Flash::page_size) {
+        if (!(pages & (1UL << (offset / Flash::page_size)))) {
+            continue;
+        }
+
+        bd_size_t length = _fill - offset;
+        if (length > Flash::page_size) {
+            length = Flash::page_size;
+        }
+
+        // Erased pages already hold blank data
+        bool blank = true;
+        for (bd_size_t i = 0; i < length && blank; i++) {
+            blank = _sector[offset + i] == AT25DF041B_ERASE_VALUE;
+        }
+        if (blank) {
+            continue;
+        }
+
+        int res = _flash->program(&_sector[offset], _cursor + offset, length);
+        if (res) {
+            return res;
+        }
+        _pages_programmed++;
+    }
+
+    return 0;
+}
+
+/** Instantiate the applier for each supported part */
+template class AT25DFDeltaApplier<AT25DF041B>;
+template class AT25DFDeltaApplier<AT25DF081A>;
+template class AT25DFDeltaApplier<AT25DF161>;
+template class AT25DFDeltaApplier<AT25SF041>;
+template class AT25DFDeltaApplier<AT25SF081>;
+template class AT25DFDeltaApplier<AT25SF161>;
+
+#endif
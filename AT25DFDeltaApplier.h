@@ -0,0 +1,204 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _AT25DF_DELTA_APPLIER_H_
+#define _AT25DF_DELTA_APPLIER_H_
+
+#include "AT25DF041B.h"
+
+#if defined(DEVICE_SPI) || defined(DOXYGEN_ONLY)
+
+/** Patch operations, an opcode byte followed by little endian 32-bit arguments */
+#define AT25DF_DELTA_OP_COPY            0x01    // offset, length: bytes of the old image
+#define AT25DF_DELTA_OP_INSERT          0x02    // length, then that many literal bytes
+#define AT25DF_DELTA_OP_END             0x03    // CRC-32 of the whole new image
+
+/** Most changed pages of a sector rewritten with page erases rather than a sector erase */
+#ifndef AT25DF_DELTA_PAGE_ERASE_MAX
+#define AT25DF_DELTA_PAGE_ERASE_MAX     4
+#endif
+
+/** Differential firmware update applier
+ *
+ *  Rebuilds a new image from the old one and a streamed patch of copy and
+ *  insert operations, one sector at a time in a sector sized RAM buffer.
+ *  Each finished sector is compared with what the destination already
+ *  holds: a sector that matches is left alone, so an update only costs
+ *  erases and programs in proportion to how much of the image changed.
+ *
+ *  Sectors with only a few changed pages are patched with 256B page erases
+ *  on parts that have them, otherwise the sector is erased and every page
+ *  that is not blank is programmed.
+ *
+ *  The destination may be the old image itself. Copies from sectors that
+ *  have already been rewritten are refused, as their old contents are gone.
+ *
+ *  @code
+ *  AT25DF041B flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+ *  AT25DFDeltaApplier<AT25DF041B> applier(&flash);
+ *
+ *  applier.begin(0x00000, image_size, 0x40000, 0x40000);
+ *  while (receive(packet, &length)) {
+ *      applier.write(packet, length);
+ *  }
+ *  applier.finish();
+ *  @endcode
+ */
+template <typename Flash>
+class AT25DFDeltaApplier {
+
+public:
+
+    /** Create a delta applier
+     *
+     *  @param flash    AT25DF holding both images, must be initialized
+     */
+    AT25DFDeltaApplier(Flash *flash);
+
+    /** Start applying a patch
+     *
+     *  @param old_addr Start of the old image
+     *  @param old_size Size of the old image in bytes
+     *  @param new_addr Start of the slot the new image is built in, erase sector aligned
+     *  @param new_size Size of that slot in bytes, a multiple of the erase sector size
+     *  @return         0 on success, -2 on a malformed image or slot
+     */
+    int begin(bd_addr_t old_addr, bd_size_t old_size, bd_addr_t new_addr, bd_size_t new_size);
+
+    /** Feed the next part of the patch
+     *
+     *  @param patch    Patch data
+     *  @param size     Number of bytes, any size
+     *  @return         0 on success, -1 on SPI error, -2 on a malformed patch,
+     *                  one that overflows the slot or copies from a sector
+     *                  already rewritten
+     */
+    int write(const void *patch, bd_size_t size);
+
+    /** Write out the last sector and check the new image
+     *
+     *  @return         0 on success, -1 on SPI error, -2 if the patch ended
+     *                  early, -3 if the new image fails its CRC
+     */
+    int finish(void);
+
+    /** Get the number of new image bytes produced so far
+     */
+    bd_size_t bytes_written(void) const {
+        return _written;
+    }
+
+    /** Get the number of sectors left alone because they already matched
+     */
+    uint32_t get_sectors_skipped(void) const {
+        return _sectors_skipped;
+    }
+
+    /** Get the number of sectors that had to be programmed
+     */
+    uint32_t get_sectors_rewritten(void) const {
+        return _sectors_rewritten;
+    }
+
+    /** Get the number of pages programmed
+     */
+    uint32_t get_pages_programmed(void) const {
+        return _pages_programmed;
+    }
+
+protected:
+
+    /** Where the patch parser is */
+    enum {
+        STATE_OPCODE,
+        STATE_ARGUMENTS,
+        STATE_LITERAL,
+        STATE_DONE
+    };
+
+    /**
+     * Runs the operation whose arguments have just been gathered
+     */
+    int run_operation(void);
+
+    /**
+     * Copies bytes of the old image into the sector buffer
+     */
+    int copy(bd_addr_t offset, bd_size_t length);
+
+    /**
+     * Appends bytes to the sector buffer, writing it out whenever it fills up
+     */
+    int append(const uint8_t *data, bd_size_t length);
+
+    /**
+     * Brings the destination sector in line with the sector buffer
+     */
+    int flush_sector(void);
+
+    /**
+     * Programs the pages of the sector buffer that are not blank
+     */
+    int program_pages(uint32_t pages);
+
+    inline bool is_rewritten(int sector) const {
+        return _rewritten[sector / 32] & (1UL << (sector % 32));
+    }
+
+    Flash *_flash;
+
+    /** Old image */
+    bd_addr_t _old_addr;
+    bd_size_t _old_size;
+
+    /** Slot of the new image and the address the sector buffer goes to */
+    bd_addr_t _new_addr;
+    bd_addr_t _new_end;
+    bd_addr_t _cursor;
+
+    /** Parser state, the opcode being read and its gathered arguments */
+    int _state;
+    uint8_t _opcode;
+    uint8_t _arguments[8];
+    bd_size_t _argument_fill;
+    bd_size_t _literal_remaining;
+
+    /** Running CRC of the new image and the one the patch ends with */
+    uint32_t _crc;
+    uint32_t _expected_crc;
+
+    bd_size_t _written;
+    uint32_t _sectors_skipped;
+    uint32_t _sectors_rewritten;
+    uint32_t _pages_programmed;
+
+    /** Whether 256B page erases can be used */
+    bool _page_erase;
+
+    /** Sectors of the chip this patch has rewritten, one bit each */
+    uint32_t _rewritten[(Flash::sector_count + 31) / 32];
+
+    /** The new sector being built */
+    uint8_t _sector[Flash::sector_size];
+    bd_size_t _fill;
+};
+
+#endif
+#endif
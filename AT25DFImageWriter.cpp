@@ -0,0 +1,148 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#if defined(DEVICE_SPI) || defined(DOXYGEN_ONLY)
+
+#include "AT25DFImageWriter.h"
+
+#include <string.h>
+
+template <typename Flash>
+AT25DFImageWriter<Flash>::AT25DFImageWriter(Flash *flash) :
+        _flash(flash), _start(0), _end(0), _cursor(0), _erased_end(0), _written(0),
+        _fill(0) {
+}
+
+template <typename Flash>
+int AT25DFImageWriter<Flash>::begin(bd_addr_t addr, bd_size_t size) {
+    if ((addr & (Flash::sector_size - 1)) || (size & (Flash::sector_size - 1))
+            || size == 0 || (addr + size) > Flash::total_size) {
+        return -2;
+    }
+
+    _start = addr;
+    _end = addr + size;
+    _cursor = addr;
+    _erased_end = addr;
+    _written = 0;
+    _fill = 0;
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFImageWriter<Flash>::write(const void *data, bd_size_t size) {
+    const uint8_t *in = (const uint8_t*) data;
+
+    if (_cursor + _fill + size > _end) {
+        return -2;
+    }
+
+    while (size) {
+        bd_size_t length = Flash::page_size - _fill;
+        if (length > size) {
+            length = size;
+        }
+        memcpy(&_page[_fill], in, length);
+        _fill += length;
+        _written += length;
+        in += length;
+        size -= length;
+
+        if (_fill == Flash::page_size) {
+            int res = flush_page();
+            if (res) {
+                return res;
+            }
+        }
+    }
+
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFImageWriter<Flash>::finish(void) {
+    if (_fill) {
+        int res = flush_page();
+        if (res) {
+            return res;
+        }
+    }
+
+    // Wait for the last page program to complete
+    return _flash->sync();
+}
+
+template <typename Flash>
+int AT25DFImageWriter<Flash>::flush_page(void) {
+    while (_cursor + _fill > _erased_end) {
+        int res = erase_ahead();
+        if (res) {
+            return res;
+        }
+    }
+
+    // Returns once the page is on the chip, the program runs on in the background
+    int res = _flash->program_page_async(_page, _cursor, _fill);
+    if (res) {
+        return res;
+    }
+
+    _cursor += _fill;
+    _fill = 0;
+
+    // Start on the next block while the caller receives the data for it,
+    // rather than just before its first page when that page has to wait
+    if (_cursor == _erased_end && _erased_end < _end) {
+        return erase_ahead();
+    }
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFImageWriter<Flash>::erase_ahead(void) {
+    // Largest block that is aligned and stays inside the slot
+    bd_size_t remaining = _end - _erased_end;
+    bd_size_t block = Flash::sector_size;
+    if (((_erased_end & (AT25DF041B_BLOCK_64KB_SIZE - 1)) == 0)
+            && remaining >= AT25DF041B_BLOCK_64KB_SIZE) {
+        block = AT25DF041B_BLOCK_64KB_SIZE;
+    } else if (((_erased_end & (AT25DF041B_BLOCK_32KB_SIZE - 1)) == 0)
+            && remaining >= AT25DF041B_BLOCK_32KB_SIZE) {
+        block = AT25DF041B_BLOCK_32KB_SIZE;
+    }
+
+    int res = _flash->erase_block_async(_erased_end, block);
+    if (res) {
+        return res;
+    }
+
+    _erased_end += block;
+    return 0;
+}
+
+/** Instantiate the writer for each supported part */
+template class AT25DFImageWriter<AT25DF041B>;
+template class AT25DFImageWriter<AT25DF081A>;
+template class AT25DFImageWriter<AT25DF161>;
+template class AT25DFImageWriter<AT25SF041>;
+template class AT25DFImageWriter<AT25SF081>;
+template class AT25DFImageWriter<AT25SF161>;
+
+#endif
@@ -0,0 +1,129 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _AT25DF_IMAGE_WRITER_H_
+#define _AT25DF_IMAGE_WRITER_H_
+
+#include "AT25DF041B.h"
+
+#if defined(DEVICE_SPI) || defined(DOXYGEN_ONLY)
+
+/** Streaming firmware image writer that overlaps reception with programming
+ *
+ *  Chunks of any size are gathered into a page buffer. Each full page is
+ *  handed to the AT25DF with program_page_async(), which returns as soon
+ *  as the data is on the chip, so the caller can receive the next packet
+ *  during the ~1ms page program time. The block ahead of the write cursor
+ *  is erased with the largest block erase that fits, also without waiting,
+ *  as soon as the last page of the block before it has been issued.
+ *
+ *  @code
+ *  AT25DF041B flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+ *  AT25DFImageWriter<AT25DF041B> writer(&flash);
+ *
+ *  writer.begin(0x40000, 0x40000);
+ *  while (receive(packet, &length)) {
+ *      writer.write(packet, length);
+ *  }
+ *  writer.finish();
+ *  @endcode
+ */
+template <typename Flash>
+class AT25DFImageWriter {
+
+public:
+
+    /** Create an image writer
+     *
+     *  @param flash    AT25DF to write the image to, must be initialized
+     */
+    AT25DFImageWriter(Flash *flash);
+
+    /** Start writing a new image
+     *
+     *  Nothing is erased up front, blocks are erased as the cursor reaches them
+     *
+     *  @param addr     Start of the image slot, erase sector aligned
+     *  @param size     Size of the image slot in bytes, a multiple of the erase sector size
+     *  @return         0 on success, -2 on a malformed slot
+     */
+    int begin(bd_addr_t addr, bd_size_t size);
+
+    /** Append image data
+     *
+     *  Only blocks when the AT25DF is still busy with an earlier page
+     *  by the time the page buffer fills up again
+     *
+     *  @param data     Image data
+     *  @param size     Number of bytes, any size
+     *  @return         0 on success, -1 on SPI error, -2 if the image
+     *                  would overflow its slot
+     */
+    int write(const void *data, bd_size_t size);
+
+    /** Program any partial last page and wait for the image to be written
+     *
+     *  @return         0 on success, -1 on SPI error
+     */
+    int finish(void);
+
+    /** Get the number of image bytes accepted so far
+     */
+    bd_size_t bytes_written(void) const {
+        return _written;
+    }
+
+protected:
+
+    /**
+     * Programs the page buffer at the write cursor, erasing ahead first if needed
+     *
+     * Once the cursor reaches the end of the erased region the next block
+     * is erased straight away, so that erase runs while the caller is
+     * still receiving the data for it.
+     */
+    int flush_page(void);
+
+    /**
+     * Erases the next block past the erased region
+     */
+    int erase_ahead(void);
+
+    Flash *_flash;
+
+    /** Image slot */
+    bd_addr_t _start;
+    bd_addr_t _end;
+
+    /** Address the page buffer will be programmed to */
+    bd_addr_t _cursor;
+
+    /** Everything below this address has been erased */
+    bd_addr_t _erased_end;
+
+    bd_size_t _written;
+
+    /** Page staging buffer, the chip holds its own copy once a program is issued */
+    uint8_t _page[Flash::page_size];
+    bd_size_t _fill;
+};
+
+#endif
+#endif
@@ -0,0 +1,439 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#if defined(DEVICE_SPI) || defined(DOXYGEN_ONLY)
+
+#include "AT25DFJournal.h"
+
+#include <string.h>
+
+template <typename Flash>
+AT25DFJournal<Flash>::AT25DFJournal(Flash *flash, bd_addr_t start, bd_size_t size) :
+        _flash(flash), _start(start), _size(size), _sector(0), _sequence(0), _offset(0),
+        _in_transaction(false), _transaction_start(0), _crc(0), _mounted(false),
+        _replayed(0) {
+}
+
+template <typename Flash>
+int AT25DFJournal<Flash>::mount(void) {
+    if ((_start & (Flash::sector_size - 1)) || (_size & (Flash::sector_size - 1))
+            || _size < 2 * Flash::sector_size || _start + _size > Flash::total_size) {
+        return -2;
+    }
+
+    _mounted = false;
+    _in_transaction = false;
+    _replayed = 0;
+
+    // The newest sector is the only one that can hold unfinished work
+    int sectors = _size / Flash::sector_size;
+    int newest = -1;
+    for (int i = 0; i < sectors; i++) {
+        record header;
+        _sector = i;
+        int res = read_record(0, &header);
+        if (res < 0) {
+            return res;
+        }
+        if (res == 0 && header.type == AT25DF_JOURNAL_RECORD_SECTOR
+                && header.addr == AT25DF_JOURNAL_MAGIC
+                && (newest < 0 || (int32_t) (header.value - _sequence) > 0)) {
+            newest = i;
+            _sequence = header.value;
+        }
+    }
+
+    if (newest < 0) {
+        // Nothing here yet, start the journal in the first sector
+        _sector = sectors - 1;
+        _sequence = 0;
+        int res = rotate();
+        if (res == 0) {
+            _mounted = true;
+        }
+        return res;
+    }
+    _sector = newest;
+
+    bd_size_t offset = AT25DF_JOURNAL_HEADER_SIZE;
+    bd_size_t start = offset;
+    bool open = false;
+    bool damaged = false;
+    bool pending = false;
+    bd_size_t pending_start = 0;
+    bd_size_t pending_end = 0;
+
+    while (offset + AT25DF_JOURNAL_HEADER_SIZE <= Flash::sector_size) {
+        record header;
+        int res = read_record(offset, &header);
+        if (res < 0) {
+            return res;
+        } else if (res == 1) {
+            break;
+        } else if (res == 2) {
+            damaged = true;
+            break;
+        }
+
+        switch (header.type) {
+        case AT25DF_JOURNAL_RECORD_PROGRAM:
+        case AT25DF_JOURNAL_RECORD_ERASE:
+            if (!open) {
+                start = offset;
+                open = true;
+            }
+            break;
+
+        case AT25DF_JOURNAL_RECORD_COMMIT: {
+            // A commit record cut short by a power cut will not match
+            uint32_t crc = 0;
+            res = sector_crc(start, offset, &crc);
+            if (res) {
+                return res;
+            }
+            if (!open || crc != header.value) {
+                damaged = true;
+                break;
+            }
+            pending = true;
+            pending_start = start;
+            pending_end = offset;
+            open = false;
+            break;
+        }
+
+        case AT25DF_JOURNAL_RECORD_APPLIED:
+            pending = false;
+            break;
+
+        case AT25DF_JOURNAL_RECORD_ABORT:
+            open = false;
+            break;
+
+        default:
+            damaged = true;
+            break;
+        }
+
+        if (damaged) {
+            break;
+        }
+        offset += AT25DF_JOURNAL_HEADER_SIZE + header.length;
+    }
+    _offset = offset;
+
+    if (pending) {
+        int res = replay(pending_start, pending_end);
+        if (res) {
+            return res;
+        }
+        _replayed++;
+    }
+
+    if (damaged) {
+        // Nothing more can be appended after a damaged record
+        int res = rotate();
+        if (res) {
+            return res;
+        }
+    } else {
+        if (pending) {
+            int res = write_record(AT25DF_JOURNAL_RECORD_APPLIED, 0, 0, NULL, 0);
+            if (res) {
+                return res;
+            }
+        }
+        if (open) {
+            int res = write_record(AT25DF_JOURNAL_RECORD_ABORT, 0, 0, NULL, 0);
+            if (res) {
+                return res;
+            }
+        }
+    }
+
+    _mounted = true;
+    return _flash->sync();
+}
+
+template <typename Flash>
+int AT25DFJournal<Flash>::begin(void) {
+    if (!_mounted || _in_transaction) {
+        return -1;
+    }
+
+    _in_transaction = true;
+    _transaction_start = _offset;
+    _crc = 0;
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFJournal<Flash>::program(const void *buffer, bd_addr_t addr, bd_size_t size) {
+    if (!_in_transaction) {
+        return -1;
+    }
+    if (size == 0 || !is_valid_target(addr, size)) {
+        return -2;
+    }
+
+    int res = reserve(size);
+    if (res) {
+        return res;
+    }
+    return write_record(AT25DF_JOURNAL_RECORD_PROGRAM, addr, 0xFFFFFFFF, buffer, size);
+}
+
+template <typename Flash>
+int AT25DFJournal<Flash>::erase(bd_addr_t addr, bd_size_t size) {
+    if (!_in_transaction) {
+        return -1;
+    }
+    if (size == 0 || (addr & (Flash::sector_size - 1)) || (size & (Flash::sector_size - 1))
+            || !is_valid_target(addr, size)) {
+        return -2;
+    }
+
+    int res = reserve(0);
+    if (res) {
+        return res;
+    }
+    return write_record(AT25DF_JOURNAL_RECORD_ERASE, addr, size, NULL, 0);
+}
+
+template <typename Flash>
+int AT25DFJournal<Flash>::commit(void) {
+    if (!_in_transaction) {
+        return -1;
+    }
+    _in_transaction = false;
+
+    // Nothing staged, nothing to do
+    if (_offset == _transaction_start) {
+        return 0;
+    }
+
+    // reserve() always leaves room for the commit and applied records
+    bd_size_t end = _offset;
+    int res = write_record(AT25DF_JOURNAL_RECORD_COMMIT, 0, _crc, NULL, 0);
+    if (res) {
+        return res;
+    }
+
+    res = replay(_transaction_start, end);
+    if (res) {
+        return res;
+    }
+
+    res = write_record(AT25DF_JOURNAL_RECORD_APPLIED, 0, 0, NULL, 0);
+    if (res) {
+        return res;
+    }
+
+    return _flash->sync();
+}
+
+template <typename Flash>
+int AT25DFJournal<Flash>::abort(void) {
+    if (!_in_transaction) {
+        return -1;
+    }
+    _in_transaction = false;
+
+    if (_offset == _transaction_start) {
+        return 0;
+    }
+    return write_record(AT25DF_JOURNAL_RECORD_ABORT, 0, 0, NULL, 0);
+}
+
+template <typename Flash>
+int AT25DFJournal<Flash>::write_record(uint8_t type, uint32_t addr, uint32_t value,
+        const void *payload, bd_size_t length) {
+    uint8_t header[AT25DF_JOURNAL_HEADER_SIZE] = {
+        type, 0xFF, (uint8_t) length, (uint8_t) (length >> 8),
+        (uint8_t) addr, (uint8_t) (addr >> 8), (uint8_t) (addr >> 16), (uint8_t) (addr >> 24),
+        (uint8_t) value, (uint8_t) (value >> 8), (uint8_t) (value >> 16), (uint8_t) (value >> 24)
+    };
+
+    // Header and payload go out together without copying the payload
+    AT25DF041BIOVec segments[2] = {
+        { header, sizeof(header) },
+        { (void*) payload, length }
+    };
+    int res = _flash->programv(segments, length ? 2 : 1, sector_addr(_sector) + _offset);
+    if (res) {
+        return -1;
+    }
+
+    if (type == AT25DF_JOURNAL_RECORD_PROGRAM || type == AT25DF_JOURNAL_RECORD_ERASE) {
+        _crc = Flash::crc32_update(_crc, header, sizeof(header));
+        _crc = Flash::crc32_update(_crc, payload, length);
+    }
+
+    _offset += sizeof(header) + length;
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFJournal<Flash>::read_record(bd_size_t offset, record *header) {
+    uint8_t bytes[AT25DF_JOURNAL_HEADER_SIZE];
+    if (_flash->read(bytes, sector_addr(_sector) + offset, sizeof(bytes))) {
+        return -1;
+    }
+
+    header->type = bytes[0];
+    header->length = bytes[2] | (bytes[3] << 8);
+    header->addr = bytes[4] | (bytes[5] << 8) | (bytes[6] << 16) | ((uint32_t) bytes[7] << 24);
+    header->value = bytes[8] | (bytes[9] << 8) | (bytes[10] << 16) | ((uint32_t) bytes[11] << 24);
+
+    bool erased = true;
+    for (unsigned i = 0; i < sizeof(bytes); i++) {
+        if (bytes[i] != AT25DF041B_ERASE_VALUE) {
+            erased = false;
+        }
+    }
+    if (erased) {
+        return 1;
+    }
+
+    if (offset + AT25DF_JOURNAL_HEADER_SIZE + header->length > Flash::sector_size
+            || (header->type != AT25DF_JOURNAL_RECORD_PROGRAM && header->length != 0)) {
+        return 2;
+    }
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFJournal<Flash>::reserve(bd_size_t length) {
+    // Room for this record plus the commit and applied records after it
+    bd_size_t needed = (3 * AT25DF_JOURNAL_HEADER_SIZE) + length;
+    if (_offset + needed <= Flash::sector_size) {
+        return 0;
+    }
+
+    bd_size_t staged = _offset - _transaction_start;
+    if (AT25DF_JOURNAL_HEADER_SIZE + staged + needed > Flash::sector_size) {
+        return -2;
+    }
+
+    return rotate();
+}
+
+template <typename Flash>
+int AT25DFJournal<Flash>::rotate(void) {
+    int sectors = _size / Flash::sector_size;
+    int previous = _sector;
+    int next = (_sector + 1) % sectors;
+
+    // Every committed transaction is applied by now, so the oldest sector is free
+    if (_flash->erase(sector_addr(next), Flash::sector_size)) {
+        return -1;
+    }
+
+    uint32_t sequence = _sequence + 1;
+    bd_size_t from = _transaction_start;
+    bd_size_t to = _in_transaction ? _offset : _transaction_start;
+    uint32_t crc = _crc;
+
+    _sector = next;
+    _offset = 0;
+    if (write_record(AT25DF_JOURNAL_RECORD_SECTOR, AT25DF_JOURNAL_MAGIC, sequence, NULL, 0)) {
+        return -1;
+    }
+    _sequence = sequence;
+    _transaction_start = _offset;
+
+    // Carry the open transaction over, the records are copied as they are
+    // so the running CRC stays valid
+    uint8_t buffer[AT25DF_JOURNAL_COPY_SIZE];
+    while (from < to) {
+        bd_size_t length = (to - from < sizeof(buffer)) ? to - from : sizeof(buffer);
+        if (_flash->read(buffer, sector_addr(previous) + from, length)
+                || _flash->program(buffer, sector_addr(_sector) + _offset, length)) {
+            return -1;
+        }
+        from += length;
+        _offset += length;
+    }
+    _crc = crc;
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFJournal<Flash>::replay(bd_size_t from, bd_size_t to) {
+    uint8_t buffer[AT25DF_JOURNAL_COPY_SIZE];
+
+    while (from < to) {
+        record header;
+        if (read_record(from, &header) != 0) {
+            return -1;
+        }
+
+        if (header.type == AT25DF_JOURNAL_RECORD_ERASE) {
+            if (_flash->erase(header.addr, header.value)) {
+                return -1;
+            }
+        } else {
+            bd_addr_t source = sector_addr(_sector) + from + AT25DF_JOURNAL_HEADER_SIZE;
+            bd_addr_t target = header.addr;
+            bd_size_t remaining = header.length;
+            while (remaining) {
+                bd_size_t length = (remaining < sizeof(buffer)) ? remaining : sizeof(buffer);
+                if (_flash->read(buffer, source, length)
+                        || _flash->program(buffer, target, length)) {
+                    return -1;
+                }
+                source += length;
+                target += length;
+                remaining -= length;
+            }
+        }
+
+        from += AT25DF_JOURNAL_HEADER_SIZE + header.length;
+    }
+
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFJournal<Flash>::sector_crc(bd_size_t from, bd_size_t to, uint32_t *crc) {
+    *crc = 0;
+    if (from >= to) {
+        return 0;
+    }
+    return _flash->crc32(sector_addr(_sector) + from, to - from, crc);
+}
+
+template <typename Flash>
+bool AT25DFJournal<Flash>::is_valid_target(bd_addr_t addr, bd_size_t size) {
+    if (addr + size > Flash::total_size || addr + size < addr) {
+        return false;
+    }
+    return addr + size <= _start || addr >= _start + _size;
+}
+
+/** Instantiate the journal for each supported part */
+template class AT25DFJournal<AT25DF041B>;
+template class AT25DFJournal<AT25DF081A>;
+template class AT25DFJournal<AT25DF161>;
+template class AT25DFJournal<AT25SF041>;
+template class AT25DFJournal<AT25SF081>;
+template class AT25DFJournal<AT25SF161>;
+
+#endif
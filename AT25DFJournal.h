@@ -0,0 +1,226 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _AT25DF_JOURNAL_H_
+#define _AT25DF_JOURNAL_H_
+
+#include "AT25DF041B.h"
+
+#if defined(DEVICE_SPI) || defined(DOXYGEN_ONLY)
+
+/** Every journal sector starts with a record of this type holding this magic */
+#define AT25DF_JOURNAL_MAGIC                0x4C4E524A  // "JRNL"
+
+/** Journal records, the type is the first byte of a 12-byte header */
+#define AT25DF_JOURNAL_RECORD_SECTOR        0x5A
+#define AT25DF_JOURNAL_RECORD_PROGRAM       0x01
+#define AT25DF_JOURNAL_RECORD_ERASE         0x02
+#define AT25DF_JOURNAL_RECORD_COMMIT        0x03
+#define AT25DF_JOURNAL_RECORD_APPLIED       0x04
+#define AT25DF_JOURNAL_RECORD_ABORT         0x05
+
+#define AT25DF_JOURNAL_HEADER_SIZE          12
+
+/** Staged data is copied through a stack buffer of this many bytes */
+#ifndef AT25DF_JOURNAL_COPY_SIZE
+#define AT25DF_JOURNAL_COPY_SIZE            64
+#endif
+
+/** Redo journal that makes a set of program and erase operations atomic
+ *
+ *  Writes are staged into a reserved range of sectors instead of going to
+ *  their targets. commit() seals them with a single commit record carrying a
+ *  CRC-32 of everything staged, then applies them. If power fails before
+ *  the commit record is complete nothing happens to the targets; if it
+ *  fails after, mount() replays the whole set. Replaying is safe because
+ *  erasing and then programming the same data always ends in the same
+ *  state.
+ *
+ *  Records are appended until a journal sector is full, only then is the
+ *  next one erased, so small transactions cost no extra erases. The open
+ *  transaction is carried over to the new sector, which is why at least
+ *  two sectors are needed. A transaction has to fit in one journal
+ *  sector. mount() reads the first record of each journal sector to find
+ *  the newest one and then only scans that sector.
+ *
+ *  Programs into areas the transaction does not erase must target erased
+ *  flash, as with a plain program().
+ *
+ *  @code
+ *  AT25DF041B flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+ *  AT25DFJournal<AT25DF041B> journal(&flash, 0x7C000, 0x2000);
+ *
+ *  flash.init();
+ *  journal.mount();
+ *
+ *  journal.begin();
+ *  journal.erase(0x10000, 0x1000);
+ *  journal.program(&config, 0x10000, sizeof(config));
+ *  journal.program(&calibration, 0x10100, sizeof(calibration));
+ *  journal.commit();
+ *  @endcode
+ */
+template <typename Flash>
+class AT25DFJournal {
+
+public:
+
+    /** Create a journal
+     *
+     *  @param flash    AT25DF to journal writes for, must be initialized before mount()
+     *  @param start    Start of the reserved range, sector aligned
+     *  @param size     Size of the reserved range, two or more sectors
+     */
+    AT25DFJournal(Flash *flash, bd_addr_t start, bd_size_t size);
+
+    /** Recover the journal
+     *
+     *  Replays a committed transaction that was not completely applied and
+     *  discards one that was still being staged. Formats the range if it
+     *  holds no journal.
+     *
+     *  @return         0 on success, -1 on SPI error, -2 on a malformed range
+     */
+    int mount(void);
+
+    /** Start staging a transaction
+     *
+     *  @return         0 on success, -1 if not mounted or a transaction is already open
+     */
+    int begin(void);
+
+    /** Stage a program
+     *
+     *  @param buffer   Data to program
+     *  @param addr     Target address, outside the journal
+     *  @param size     Number of bytes
+     *  @return         0 on success, -1 on SPI error or if no transaction is open,
+     *                  -2 on a malformed operation or if the transaction
+     *                  would not fit in a journal sector
+     */
+    int program(const void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Stage an erase
+     *
+     *  @param addr     Target address, sector aligned and outside the journal
+     *  @param size     Number of bytes, a multiple of the sector size
+     *  @return         0 on success, -1 on SPI error or if no transaction is open,
+     *                  -2 on a malformed operation or if the transaction
+     *                  would not fit in a journal sector
+     */
+    int erase(bd_addr_t addr, bd_size_t size);
+
+    /** Commit the staged transaction and apply it
+     *
+     *  The transaction is durable once the commit record is programmed,
+     *  this returns after it has been applied and synced
+     *
+     *  @return         0 on success, -1 on SPI error or if no transaction is open
+     */
+    int commit(void);
+
+    /** Drop the staged transaction
+     *
+     *  @return         0 on success, -1 on SPI error or if no transaction is open
+     */
+    int abort(void);
+
+    /** Get the number of transactions the last mount() replayed
+     */
+    int get_replayed(void) const {
+        return _replayed;
+    }
+
+protected:
+
+    /**
+     * Decoded record header
+     */
+    struct record {
+        uint8_t type;
+        uint16_t length;
+        uint32_t addr;
+        uint32_t value;
+    };
+
+    /**
+     * Programs a record at the end of the active sector
+     */
+    int write_record(uint8_t type, uint32_t addr, uint32_t value,
+            const void *payload, bd_size_t length);
+
+    /**
+     * Reads and checks the record at offset in the active sector
+     *
+     * @retval result 0 if it is valid, 1 if it is erased, 2 if it is damaged,
+     * -1 on SPI error
+     */
+    int read_record(bd_size_t offset, record *header);
+
+    /**
+     * Makes room for a record with length bytes of payload in the active
+     * sector, moving the open transaction to the next sector if needed
+     */
+    int reserve(bd_size_t length);
+
+    /**
+     * Starts the next journal sector, carrying the open transaction over
+     */
+    int rotate(void);
+
+    /**
+     * Applies the records in [from, to) of the active sector to their targets
+     */
+    int replay(bd_size_t from, bd_size_t to);
+
+    /**
+     * Computes the CRC-32 of [from, to) in the active sector
+     */
+    int sector_crc(bd_size_t from, bd_size_t to, uint32_t *crc);
+
+    /**
+     * Checks an operation targets the flash outside the journal
+     */
+    bool is_valid_target(bd_addr_t addr, bd_size_t size);
+
+    inline bd_addr_t sector_addr(int sector) {
+        return _start + (bd_addr_t) sector * Flash::sector_size;
+    }
+
+    Flash *_flash;
+    bd_addr_t _start;
+    bd_size_t _size;
+
+    /** Active journal sector, its sequence number and where the next record goes */
+    int _sector;
+    uint32_t _sequence;
+    bd_size_t _offset;
+
+    /** Open transaction, where its first record is and the CRC of its records so far */
+    bool _in_transaction;
+    bd_size_t _transaction_start;
+    uint32_t _crc;
+
+    bool _mounted;
+    int _replayed;
+};
+
+#endif
+#endif
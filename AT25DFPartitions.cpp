@@ -0,0 +1,470 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#if defined(DEVICE_SPI) || defined(DOXYGEN_ONLY)
+
+#include "AT25DFPartitions.h"
+
+#include <string.h>
+
+static inline bool overlaps(bd_addr_t a, bd_size_t a_size, bd_addr_t b, bd_size_t b_size) {
+    return a < b + b_size && b < a + a_size;
+}
+
+static uint32_t get_le32(const uint8_t *in) {
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t) in[3] << 24);
+}
+
+static uint8_t *put_le32(uint8_t *out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        *out++ = (uint8_t) (value >> (8 * i));
+    }
+    return out;
+}
+
+template <typename Flash>
+AT25DFPartition<Flash>::AT25DFPartition() :
+        _flash(NULL), _cache(NULL), _cache_hits(0),
+        _pending(NULL), _pending_addr(0), _pending_size(0), _merged_programs(0) {
+    memset(&_info, 0, sizeof(_info));
+    invalidate(0, 0);
+}
+
+template <typename Flash>
+AT25DFPartition<Flash>::~AT25DFPartition() {
+    delete[] _cache;
+    delete[] _pending;
+}
+
+template <typename Flash>
+int AT25DFPartition<Flash>::init() {
+    if (!_flash) {
+        return -1;
+    }
+
+    if ((_info.flags & AT25DF_PARTITION_READ_CACHE) && !_cache) {
+        _cache = new uint8_t[AT25DF_PARTITION_CACHE_PAGES * Flash::page_size];
+    }
+    if ((_info.flags & AT25DF_PARTITION_WRITE_BACK) && !_pending) {
+        _pending = new uint8_t[Flash::page_size];
+    }
+    invalidate(0, 0);
+    _pending_size = 0;
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFPartition<Flash>::deinit() {
+    int res = flush();
+
+    delete[] _cache;
+    delete[] _pending;
+    _cache = NULL;
+    _pending = NULL;
+    invalidate(0, 0);
+    return res;
+}
+
+template <typename Flash>
+int AT25DFPartition<Flash>::sync() {
+    int res = flush();
+    if (res) {
+        return res;
+    }
+    return _flash->sync();
+}
+
+template <typename Flash>
+int AT25DFPartition<Flash>::read(void *buffer, bd_addr_t addr, bd_size_t size) {
+    if (!_flash || !is_valid_read(addr, size)) {
+        return -2;
+    }
+
+    // Held back data has to reach the chip before it can be read
+    if (_pending_size && overlaps(addr, size, _pending_addr, _pending_size)) {
+        int res = flush();
+        if (res) {
+            return res;
+        }
+    }
+
+    if (!_cache || size > Flash::page_size) {
+        return _flash->read(buffer, _info.start + addr, size);
+    }
+
+    // Small reads are served a page at a time from the cache
+    uint8_t *out = (uint8_t*) buffer;
+    while (size) {
+        bd_addr_t page = addr & ~((bd_addr_t) Flash::page_size - 1);
+        int line = (page / Flash::page_size) % AT25DF_PARTITION_CACHE_PAGES;
+        uint8_t *cached = &_cache[line * Flash::page_size];
+        if (_cache_tags[line] == page) {
+            _cache_hits++;
+        } else {
+            _cache_tags[line] = _info.size;
+            if (_flash->read(cached, _info.start + page, Flash::page_size)) {
+                return -1;
+            }
+            _cache_tags[line] = page;
+        }
+
+        bd_size_t offset = addr - page;
+        bd_size_t length = Flash::page_size - offset;
+        if (length > size) {
+            length = size;
+        }
+        memcpy(out, &cached[offset], length);
+        out += length;
+        addr += length;
+        size -= length;
+    }
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFPartition<Flash>::program(const void *buffer, bd_addr_t addr, bd_size_t size) {
+    if (!_flash || !is_valid_program(addr, size)) {
+        return -2;
+    }
+
+    invalidate(addr, size);
+
+    const uint8_t *data = (const uint8_t*) buffer;
+    bool verify, deferred;
+    int res = 0;
+
+    if (!_pending) {
+        apply_policy(&verify, &deferred);
+        res = _flash->program(data, _info.start + addr, size);
+        restore_policy(verify, deferred);
+        return res;
+    }
+
+    while (size && res == 0) {
+        bd_addr_t page_end = (addr | (Flash::page_size - 1)) + 1;
+
+        if (_pending_size && addr == _pending_addr + _pending_size) {
+            // Carries on where the held back data ends
+            bd_size_t length = page_end - addr;
+            if (length > size) {
+                length = size;
+            }
+            memcpy(&_pending[_pending_size], data, length);
+            _pending_size += length;
+            _merged_programs++;
+            data += length;
+            addr += length;
+            size -= length;
+
+            if (_pending_addr + _pending_size == page_end) {
+                res = flush();
+            }
+            continue;
+        }
+
+        res = flush();
+        if (res) {
+            break;
+        }
+
+        // Whole pages go straight out, a partial page at the end is held back
+        bd_addr_t end = (addr + size) & ~((bd_addr_t) Flash::page_size - 1);
+        if (end > addr) {
+            apply_policy(&verify, &deferred);
+            res = _flash->program(data, _info.start + addr, end - addr);
+            restore_policy(verify, deferred);
+            data += end - addr;
+            size -= end - addr;
+            addr = end;
+        } else {
+            memcpy(_pending, data, size);
+            _pending_addr = addr;
+            _pending_size = size;
+            size = 0;
+        }
+    }
+    return res;
+}
+
+template <typename Flash>
+int AT25DFPartition<Flash>::erase(bd_addr_t addr, bd_size_t size) {
+    if (!_flash || !is_valid_erase(addr, size)) {
+        return -2;
+    }
+
+    // Anything held back for the range would be erased straight away
+    if (_pending_size && overlaps(addr, size, _pending_addr, _pending_size)) {
+        _pending_size = 0;
+    }
+    invalidate(addr, size);
+
+    bool verify, deferred;
+    apply_policy(&verify, &deferred);
+    int res = _flash->erase(_info.start + addr, size);
+    restore_policy(verify, deferred);
+    return res;
+}
+
+template <typename Flash>
+int AT25DFPartition<Flash>::trim(bd_addr_t addr, bd_size_t size) {
+    if (!_flash || !is_valid_erase(addr, size)) {
+        return -2;
+    }
+
+    if (_pending_size && overlaps(addr, size, _pending_addr, _pending_size)) {
+        _pending_size = 0;
+    }
+    invalidate(addr, size);
+    return _flash->trim(_info.start + addr, size);
+}
+
+template <typename Flash>
+bd_size_t AT25DFPartition<Flash>::get_read_size() const {
+    return 1;
+}
+
+template <typename Flash>
+bd_size_t AT25DFPartition<Flash>::get_program_size() const {
+    return 1;
+}
+
+template <typename Flash>
+bd_size_t AT25DFPartition<Flash>::get_erase_size() const {
+    return _info.erase_size;
+}
+
+template <typename Flash>
+bd_size_t AT25DFPartition<Flash>::get_erase_size(bd_addr_t addr) const {
+    if (addr >= _info.size) {
+        return 0;
+    }
+    return _info.erase_size;
+}
+
+template <typename Flash>
+int AT25DFPartition<Flash>::get_erase_value() const {
+    return AT25DF041B_ERASE_VALUE;
+}
+
+template <typename Flash>
+bd_size_t AT25DFPartition<Flash>::size() const {
+    return _info.size;
+}
+
+template <typename Flash>
+const char *AT25DFPartition<Flash>::get_type() const {
+    return _flash ? _flash->get_type() : "AT25DF";
+}
+
+template <typename Flash>
+void AT25DFPartition<Flash>::configure(Flash *flash, const AT25DFPartitionInfo &info) {
+    _flash = flash;
+    _info = info;
+    invalidate(0, 0);
+    _pending_size = 0;
+}
+
+template <typename Flash>
+int AT25DFPartition<Flash>::flush(void) {
+    if (!_pending_size) {
+        return 0;
+    }
+
+    bool verify, deferred;
+    apply_policy(&verify, &deferred);
+    int res = _flash->program(_pending, _info.start + _pending_addr, _pending_size);
+    restore_policy(verify, deferred);
+    _pending_size = 0;
+    return res;
+}
+
+template <typename Flash>
+void AT25DFPartition<Flash>::invalidate(bd_addr_t addr, bd_size_t size) {
+    for (int line = 0; line < AT25DF_PARTITION_CACHE_PAGES; line++) {
+        if (size == 0 || overlaps(addr, size, _cache_tags[line], Flash::page_size)) {
+            _cache_tags[line] = _info.size;
+        }
+    }
+}
+
+template <typename Flash>
+void AT25DFPartition<Flash>::apply_policy(bool *verify, bool *deferred) {
+    *verify = _flash->get_verify_on_write();
+    *deferred = _flash->get_deferred_wait();
+    _flash->set_verify_on_write(_info.flags & AT25DF_PARTITION_VERIFY);
+    _flash->set_deferred_wait(_info.flags & AT25DF_PARTITION_DEFERRED_WAIT);
+}
+
+template <typename Flash>
+void AT25DFPartition<Flash>::restore_policy(bool verify, bool deferred) {
+    _flash->set_verify_on_write(verify);
+    _flash->set_deferred_wait(deferred);
+}
+
+template <typename Flash>
+AT25DFPartitionTable<Flash>::AT25DFPartitionTable(Flash *flash, bd_addr_t addr) :
+        _flash(flash), _addr(addr), _count(0) {
+}
+
+template <typename Flash>
+int AT25DFPartitionTable<Flash>::load(void) {
+    uint8_t table[AT25DF_PARTITION_TABLE_SIZE];
+    AT25DFPartitionInfo partitions[AT25DF_PARTITION_MAX];
+
+    _count = 0;
+    if ((_addr & (Flash::sector_size - 1)) || _addr >= Flash::total_size) {
+        return -2;
+    }
+    if (_flash->read(table, _addr, sizeof(table))) {
+        return -1;
+    }
+
+    int count = table[5];
+    if (get_le32(table) != AT25DF_PARTITION_TABLE_MAGIC
+            || table[4] != AT25DF_PARTITION_TABLE_VERSION || count > AT25DF_PARTITION_MAX) {
+        return -2;
+    }
+
+    bd_size_t length = AT25DF_PARTITION_HEADER_SIZE + count * AT25DF_PARTITION_ENTRY_SIZE;
+    if (Flash::crc32_update(0, table, length) != get_le32(&table[length])) {
+        return -2;
+    }
+
+    const uint8_t *in = &table[AT25DF_PARTITION_HEADER_SIZE];
+    for (int i = 0; i < count; i++, in += AT25DF_PARTITION_ENTRY_SIZE) {
+        memcpy(partitions[i].name, in, AT25DF_PARTITION_NAME_SIZE);
+        partitions[i].start = get_le32(&in[8]);
+        partitions[i].size = get_le32(&in[12]);
+        partitions[i].erase_size = get_le32(&in[16]);
+        partitions[i].flags = in[20];
+    }
+
+    if (!is_valid_layout(partitions, count)) {
+        return -2;
+    }
+
+    for (int i = 0; i < count; i++) {
+        _partitions[i].configure(_flash, partitions[i]);
+    }
+    _count = count;
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFPartitionTable<Flash>::save(const AT25DFPartitionInfo *partitions, int count) {
+    if (count < 0 || count > AT25DF_PARTITION_MAX || !is_valid_layout(partitions, count)) {
+        return -2;
+    }
+
+    uint8_t table[AT25DF_PARTITION_TABLE_SIZE];
+    memset(table, 0, sizeof(table));
+    uint8_t *out = put_le32(table, AT25DF_PARTITION_TABLE_MAGIC);
+    *out++ = AT25DF_PARTITION_TABLE_VERSION;
+    *out++ = count;
+    out += 2;
+
+    for (int i = 0; i < count; i++) {
+        memcpy(out, partitions[i].name, AT25DF_PARTITION_NAME_SIZE);
+        out = put_le32(out + AT25DF_PARTITION_NAME_SIZE, partitions[i].start);
+        out = put_le32(out, partitions[i].size);
+        out = put_le32(out, partitions[i].erase_size);
+        *out = partitions[i].flags;
+        out += 4;
+    }
+    put_le32(out, Flash::crc32_update(0, table, out - table));
+
+    bd_size_t length = (out - table) + 4;
+    if (_flash->erase(_addr, Flash::sector_size) || _flash->program(table, _addr, length)) {
+        return -1;
+    }
+
+    // Set the partitions up from what actually landed in flash
+    return load();
+}
+
+template <typename Flash>
+AT25DFPartition<Flash> *AT25DFPartitionTable<Flash>::get(int index) {
+    if (index < 0 || index >= _count) {
+        return NULL;
+    }
+    return &_partitions[index];
+}
+
+template <typename Flash>
+AT25DFPartition<Flash> *AT25DFPartitionTable<Flash>::find(const char *name) {
+    if (strlen(name) > AT25DF_PARTITION_NAME_SIZE) {
+        return NULL;
+    }
+    for (int i = 0; i < _count; i++) {
+        if (strncmp(_partitions[i].get_info().name, name, AT25DF_PARTITION_NAME_SIZE) == 0) {
+            return &_partitions[i];
+        }
+    }
+    return NULL;
+}
+
+template <typename Flash>
+bool AT25DFPartitionTable<Flash>::is_valid_layout(const AT25DFPartitionInfo *partitions,
+        int count) const {
+    if ((_addr & (Flash::sector_size - 1)) || _addr >= Flash::total_size) {
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const AT25DFPartitionInfo &info = partitions[i];
+        if (info.erase_size != Flash::sector_size
+                && info.erase_size != AT25DF041B_BLOCK_32KB_SIZE
+                && info.erase_size != AT25DF041B_BLOCK_64KB_SIZE) {
+            return false;
+        }
+        if (info.size == 0 || (info.start & (info.erase_size - 1))
+                || (info.size & (info.erase_size - 1))
+                || info.start + info.size > Flash::total_size
+                || info.start + info.size < info.start) {
+            return false;
+        }
+        if (overlaps(info.start, info.size, _addr, Flash::sector_size)) {
+            return false;
+        }
+        for (int j = 0; j < i; j++) {
+            if (overlaps(info.start, info.size, partitions[j].start, partitions[j].size)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/** Instantiate the partitions for each supported part */
+template class AT25DFPartition<AT25DF041B>;
+template class AT25DFPartition<AT25DF081A>;
+template class AT25DFPartition<AT25DF161>;
+template class AT25DFPartition<AT25SF041>;
+template class AT25DFPartition<AT25SF081>;
+template class AT25DFPartition<AT25SF161>;
+
+template class AT25DFPartitionTable<AT25DF041B>;
+template class AT25DFPartitionTable<AT25DF081A>;
+template class AT25DFPartitionTable<AT25DF161>;
+template class AT25DFPartitionTable<AT25SF041>;
+template class AT25DFPartitionTable<AT25SF081>;
+template class AT25DFPartitionTable<AT25SF161>;
+
+#endif
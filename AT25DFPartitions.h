@@ -0,0 +1,278 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _AT25DF_PARTITIONS_H_
+#define _AT25DF_PARTITIONS_H_
+
+#include "AT25DF041B.h"
+
+#if defined(DEVICE_SPI) || defined(DOXYGEN_ONLY)
+
+/** Partition policy flags */
+#define AT25DF_PARTITION_READ_CACHE         0x01    // Keep recently read pages in RAM, for small random reads
+#define AT25DF_PARTITION_WRITE_BACK         0x02    // Gather contiguous small programs into whole pages
+#define AT25DF_PARTITION_VERIFY             0x04    // Verify every page as it is programmed
+#define AT25DF_PARTITION_DEFERRED_WAIT      0x08    // Return from programs and erases without waiting
+
+/** Pages the read cache of a partition holds, they are direct mapped */
+#ifndef AT25DF_PARTITION_CACHE_PAGES
+#define AT25DF_PARTITION_CACHE_PAGES        4
+#endif
+
+/** Most partitions a table can hold, and the longest name */
+#define AT25DF_PARTITION_MAX                8
+#define AT25DF_PARTITION_NAME_SIZE          8
+
+/** Persisted table layout
+ *  Magic, version, entry count and two reserved bytes, then one entry per
+ *  partition: name, start, size and erase size, policy flags and three
+ *  reserved bytes, all little endian. A CRC-32 of everything before it
+ *  closes the table, which always fits in a single page.
+ */
+#define AT25DF_PARTITION_TABLE_MAGIC        0x54504641  // "AFPT"
+#define AT25DF_PARTITION_TABLE_VERSION      1
+#define AT25DF_PARTITION_HEADER_SIZE        8
+#define AT25DF_PARTITION_ENTRY_SIZE         24
+#define AT25DF_PARTITION_TABLE_SIZE         (AT25DF_PARTITION_HEADER_SIZE \
+        + AT25DF_PARTITION_MAX * AT25DF_PARTITION_ENTRY_SIZE + 4)
+
+/** One partition of the table */
+struct AT25DFPartitionInfo {
+    /** NUL padded name, need not be NUL terminated if all of it is used */
+    char name[AT25DF_PARTITION_NAME_SIZE];
+
+    /** Location on the chip, both aligned to erase_size */
+    uint32_t start;
+    uint32_t size;
+
+    /** Erase granularity the partition reports, 4kB, 32kB or 64kB */
+    uint32_t erase_size;
+
+    /** AT25DF_PARTITION_* policy flags */
+    uint8_t flags;
+};
+
+/** Block device for one partition of an AT25DF, with its own I/O policy
+ *
+ *  Addresses are relative to the start of the partition. Obtained from an
+ *  AT25DFPartitionTable rather than constructed directly. The policy is
+ *  applied around each call, so partitions with different policies can
+ *  share the chip without seeing each other's settings.
+ *
+ *  Erases have to be aligned to the partition's erase size. A larger one
+ *  lets every erase go out as 32kB or 64kB block erases, which are much
+ *  faster per byte, at the cost of coarser allocation.
+ *
+ *  With write-back, programs that do not reach the end of a page are held
+ *  in RAM until the rest of the page arrives, a read or erase touches it,
+ *  or sync() is called, so a stream of small appends costs one page program
+ *  per page. Nothing held back survives a power cut before sync().
+ */
+template <typename Flash>
+class AT25DFPartition: public BlockDevice {
+
+public:
+
+    AT25DFPartition();
+
+    /** Lifetime of the partition
+     */
+    virtual ~AT25DFPartition();
+
+    /** Allocates the buffers the policy needs, the chip must already be initialized
+     */
+    virtual int init();
+
+    /** Writes back held data and frees the buffers
+     */
+    virtual int deinit();
+
+    /** Writes back held data and waits for the chip
+     */
+    virtual int sync();
+
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size);
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size);
+    virtual int erase(bd_addr_t addr, bd_size_t size);
+    virtual int trim(bd_addr_t addr, bd_size_t size);
+
+    virtual bd_size_t get_read_size() const;
+    virtual bd_size_t get_program_size() const;
+    virtual bd_size_t get_erase_size() const;
+    virtual bd_size_t get_erase_size(bd_addr_t addr) const;
+    virtual int get_erase_value() const;
+    virtual bd_size_t size() const;
+    virtual const char *get_type() const;
+
+    /**
+     * Gets the table entry of the partition
+     */
+    const AT25DFPartitionInfo &get_info(void) const {
+        return _info;
+    }
+
+    /**
+     * Gets the number of reads served from the read cache
+     */
+    uint32_t get_cache_hits(void) const {
+        return _cache_hits;
+    }
+
+    /**
+     * Gets the number of page programs write-back saved
+     */
+    uint32_t get_merged_programs(void) const {
+        return _merged_programs;
+    }
+
+protected:
+
+    template <typename> friend class AT25DFPartitionTable;
+
+    /**
+     * Points the partition at its table entry
+     */
+    void configure(Flash *flash, const AT25DFPartitionInfo &info);
+
+    /**
+     * Programs the data held back by write-back, if there is any
+     */
+    int flush(void);
+
+    /**
+     * Drops cached pages that overlap [addr, addr + size), every page if size is 0
+     */
+    void invalidate(bd_addr_t addr, bd_size_t size);
+
+    /**
+     * Sets the driver up for the partition's policy and returns the previous settings
+     */
+    void apply_policy(bool *verify, bool *deferred);
+
+    /**
+     * Puts back the settings apply_policy() replaced
+     */
+    void restore_policy(bool verify, bool deferred);
+
+    Flash *_flash;
+    AT25DFPartitionInfo _info;
+
+    /** Pages held by the read cache and their addresses, the partition size marks an empty line */
+    uint8_t *_cache;
+    bd_addr_t _cache_tags[AT25DF_PARTITION_CACHE_PAGES];
+    uint32_t _cache_hits;
+
+    /** Data write-back is holding, all of it within one page */
+    uint8_t *_pending;
+    bd_addr_t _pending_addr;
+    bd_size_t _pending_size;
+    uint32_t _merged_programs;
+};
+
+/** Partition table stored in flash
+ *
+ *  Carves the chip into named regions such as a bootloader, A/B images,
+ *  configuration and a log, each with an I/O policy suited to how it is
+ *  used. The table lives in the first page of a reserved sector and is
+ *  loaded at startup.
+ *
+ *  @code
+ *  static const AT25DFPartitionInfo layout[] = {
+ *      { "boot", 0x00000, 0x10000, 0x10000, 0 },
+ *      { "image", 0x10000, 0x40000, 0x10000, AT25DF_PARTITION_VERIFY },
+ *      { "config", 0x50000, 0x2000, 0x1000, AT25DF_PARTITION_READ_CACHE },
+ *      { "log", 0x60000, 0x1F000, 0x1000,
+ *              AT25DF_PARTITION_WRITE_BACK | AT25DF_PARTITION_DEFERRED_WAIT },
+ *  };
+ *
+ *  AT25DF041B flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+ *  AT25DFPartitionTable<AT25DF041B> table(&flash, 0x7F000);
+ *
+ *  flash.init();
+ *  if (table.load() != 0) {
+ *      table.save(layout, 4);
+ *  }
+ *  BlockDevice *log = table.find("log");
+ *  log->init();
+ *  @endcode
+ */
+template <typename Flash>
+class AT25DFPartitionTable {
+
+public:
+
+    /** Create a partition table
+     *
+     *  @param flash    AT25DF holding the table, must be initialized before load() or save()
+     *  @param addr     Erase sector aligned address of the sector reserved for the table
+     */
+    AT25DFPartitionTable(Flash *flash, bd_addr_t addr);
+
+    /** Read the table from flash and set the partitions up
+     *
+     *  @return         0 on success, -1 on SPI error, -2 if there is no valid table
+     */
+    int load(void);
+
+    /** Write a new table and set the partitions up from it
+     *
+     *  Partitions already handed out must be deinitialized first.
+     *
+     *  @param partitions   Entries of the table
+     *  @param count        Number of entries, at most AT25DF_PARTITION_MAX
+     *  @return             0 on success, -1 on SPI error, -2 if an entry is
+     *                      misaligned, out of range or overlaps another one
+     *                      or the table itself
+     */
+    int save(const AT25DFPartitionInfo *partitions, int count);
+
+    /** Get the number of partitions loaded
+     */
+    int get_count(void) const {
+        return _count;
+    }
+
+    /** Get a partition by index
+     *
+     *  @return         The partition, or NULL if there is no such partition
+     */
+    AT25DFPartition<Flash> *get(int index);
+
+    /** Get a partition by name
+     *
+     *  @return         The partition, or NULL if there is no such partition
+     */
+    AT25DFPartition<Flash> *find(const char *name);
+
+protected:
+
+    /**
+     * Checks entries against the chip, the table sector and each other
+     */
+    bool is_valid_layout(const AT25DFPartitionInfo *partitions, int count) const;
+
+    Flash *_flash;
+    bd_addr_t _addr;
+    int _count;
+    AT25DFPartition<Flash> _partitions[AT25DF_PARTITION_MAX];
+};
+
+#endif
+#endif
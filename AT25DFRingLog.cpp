@@ -0,0 +1,384 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#if defined(DEVICE_SPI) || defined(DOXYGEN_ONLY)
+
+#include "AT25DFRingLog.h"
+
+#include <string.h>
+
+template <typename Flash>
+AT25DFRingLog<Flash>::AT25DFRingLog(Flash *flash, bd_addr_t start, bd_size_t size) :
+        _flash(flash), _start(start), _size(size), _sectors(0), _head(0), _head_sequence(0),
+        _offset(0), _tail(0), _tail_sequence(0), _read_sector(0), _read_sequence(0),
+        _read_offset(0), _mounted(false), _mount_reads(0) {
+}
+
+template <typename Flash>
+int AT25DFRingLog<Flash>::format(void) {
+    if ((_start & (Flash::sector_size - 1)) || (_size & (Flash::sector_size - 1))
+            || _size < 2 * Flash::sector_size || _start + _size > Flash::total_size) {
+        return -2;
+    }
+
+    _mounted = false;
+    _sectors = _size / Flash::sector_size;
+
+    if (_flash->erase(_start, _size) || start_sector(0, 0)) {
+        return -1;
+    }
+
+    _head = 0;
+    _head_sequence = 0;
+    _offset = AT25DF_RING_LOG_SECTOR_HEADER_SIZE;
+    _tail = 0;
+    _tail_sequence = 0;
+    _mounted = true;
+    return rewind();
+}
+
+template <typename Flash>
+int AT25DFRingLog<Flash>::mount(void) {
+    if ((_start & (Flash::sector_size - 1)) || (_size & (Flash::sector_size - 1))
+            || _size < 2 * Flash::sector_size || _start + _size > Flash::total_size) {
+        return -2;
+    }
+
+    _mounted = false;
+    _mount_reads = 0;
+    _sectors = _size / Flash::sector_size;
+
+    // The first sector is only erased when the head is the last one, the
+    // second sector is the oldest then
+    int base = 0;
+    uint32_t base_sequence;
+    int res = read_sector_header(0, &base_sequence);
+    if (res == 1) {
+        base = 1;
+        res = read_sector_header(1, &base_sequence);
+        if (res == 1) {
+            return -2;
+        }
+    }
+    if (res < 0) {
+        return res;
+    }
+
+    // Sequence numbers go up from the base until the head and are older or
+    // erased after it, find the last sector that is not older than the base
+    int low = base;
+    int high = _sectors;
+    uint32_t low_sequence = base_sequence;
+    while (high - low > 1) {
+        int middle = low + (high - low) / 2;
+        uint32_t sequence;
+        res = read_sector_header(middle, &sequence);
+        if (res < 0) {
+            return res;
+        }
+        if (res == 0 && (int32_t) (sequence - base_sequence) >= 0) {
+            low = middle;
+            low_sequence = sequence;
+        } else {
+            high = middle;
+        }
+    }
+    _head = low;
+    _head_sequence = low_sequence;
+
+    // Once the ring has wrapped the oldest sector is two after the head,
+    // the one in between is kept erased
+    _tail = base;
+    _tail_sequence = base_sequence;
+    int oldest = next_sector(next_sector(_head));
+    if (oldest != base && oldest != _head) {
+        uint32_t sequence;
+        res = read_sector_header(oldest, &sequence);
+        if (res < 0) {
+            return res;
+        }
+        if (res == 0) {
+            _tail = oldest;
+            _tail_sequence = sequence;
+        }
+    }
+
+    // Walk the records of the head sector to find where the next one goes
+    _offset = AT25DF_RING_LOG_SECTOR_HEADER_SIZE;
+    while (_offset + AT25DF_RING_LOG_RECORD_HEADER_SIZE <= Flash::sector_size) {
+        uint16_t length;
+        uint32_t crc;
+        res = read_record_header(_head, _offset, &length, &crc);
+        if (res < 0) {
+            return res;
+        } else if (res == 1) {
+            break;
+        } else if (res == 2) {
+            // Nothing more can be appended after a damaged record
+            _offset = Flash::sector_size;
+            break;
+        }
+        _offset += AT25DF_RING_LOG_RECORD_HEADER_SIZE + length;
+    }
+
+    int ahead = next_sector(_head);
+    if (ahead == _tail) {
+        _tail = _head;
+        _tail_sequence = _head_sequence;
+    }
+
+    // Records only go into a sector once the one after it is erased, so
+    // only an empty head can have been cut short before or during that
+    // erase. Finish the job then.
+    if (_offset == AT25DF_RING_LOG_SECTOR_HEADER_SIZE) {
+        bool blank;
+        res = is_blank(ahead, &blank);
+        if (res) {
+            return res;
+        }
+        if (!blank && _flash->erase(sector_addr(ahead), Flash::sector_size)) {
+            return -1;
+        }
+    }
+
+    _mounted = true;
+    return rewind();
+}
+
+template <typename Flash>
+int AT25DFRingLog<Flash>::append(const void *data, bd_size_t size) {
+    if (!_mounted) {
+        return -1;
+    }
+    if (size == 0 || size > max_record_size) {
+        return -2;
+    }
+
+    if (_offset + AT25DF_RING_LOG_RECORD_HEADER_SIZE + size > Flash::sector_size) {
+        int res = advance();
+        if (res) {
+            return res;
+        }
+    }
+
+    uint16_t length = size;
+    uint16_t inverse = ~length;
+    uint32_t crc = Flash::crc32_update(0, data, size);
+    uint8_t header[AT25DF_RING_LOG_RECORD_HEADER_SIZE] = {
+        (uint8_t) length, (uint8_t) (length >> 8), (uint8_t) inverse, (uint8_t) (inverse >> 8),
+        (uint8_t) crc, (uint8_t) (crc >> 8), (uint8_t) (crc >> 16), (uint8_t) (crc >> 24)
+    };
+
+    // Header and payload go out together without copying the payload
+    AT25DF041BIOVec segments[2] = {
+        { header, sizeof(header) },
+        { (void*) data, size }
+    };
+    if (_flash->programv(segments, 2, sector_addr(_head) + _offset)) {
+        // The slot may be half written, carry on in the next sector
+        _offset = Flash::sector_size;
+        return -1;
+    }
+
+    _offset += AT25DF_RING_LOG_RECORD_HEADER_SIZE + size;
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFRingLog<Flash>::rewind(void) {
+    if (!_mounted) {
+        return -1;
+    }
+
+    _read_sector = _tail;
+    _read_sequence = _tail_sequence;
+    _read_offset = AT25DF_RING_LOG_SECTOR_HEADER_SIZE;
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFRingLog<Flash>::read_next(void *buffer, bd_size_t size, bd_size_t *length) {
+    if (!_mounted) {
+        return -1;
+    }
+
+    while (true) {
+        // Appends erased the sector under the reader, skip to what is left
+        if ((int32_t) (_read_sequence - _tail_sequence) < 0) {
+            rewind();
+        }
+
+        bool at_head = (_read_sector == _head);
+        if (at_head && _read_offset >= _offset) {
+            return 1;
+        }
+
+        uint16_t record_length = 0;
+        uint32_t crc = 0;
+        int res = 1;
+        if (_read_offset + AT25DF_RING_LOG_RECORD_HEADER_SIZE <= Flash::sector_size) {
+            res = read_record_header(_read_sector, _read_offset, &record_length, &crc);
+        }
+        if (res < 0) {
+            return res;
+        }
+
+        if (res) {
+            // End of this sector, the rest of it is erased or given up
+            if (at_head) {
+                return 1;
+            }
+            _read_sector = next_sector(_read_sector);
+            _read_sequence++;
+            _read_offset = AT25DF_RING_LOG_SECTOR_HEADER_SIZE;
+            continue;
+        }
+
+        if (record_length > size) {
+            return -2;
+        }
+
+        bd_addr_t addr = sector_addr(_read_sector) + _read_offset
+                + AT25DF_RING_LOG_RECORD_HEADER_SIZE;
+        if (_flash->read(buffer, addr, record_length)) {
+            return -1;
+        }
+        _read_offset += AT25DF_RING_LOG_RECORD_HEADER_SIZE + record_length;
+
+        if (Flash::crc32_update(0, buffer, record_length) != crc) {
+            return -3;
+        }
+        *length = record_length;
+        return 0;
+    }
+}
+
+template <typename Flash>
+int AT25DFRingLog<Flash>::read_sector_header(int sector, uint32_t *sequence) {
+    uint8_t bytes[AT25DF_RING_LOG_SECTOR_HEADER_SIZE];
+    _mount_reads++;
+    if (_flash->read(bytes, sector_addr(sector), sizeof(bytes))) {
+        return -1;
+    }
+
+    uint32_t magic = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+    uint32_t value = bytes[4] | (bytes[5] << 8) | (bytes[6] << 16) | ((uint32_t) bytes[7] << 24);
+    uint32_t inverse = bytes[8] | (bytes[9] << 8) | (bytes[10] << 16) | ((uint32_t) bytes[11] << 24);
+
+    // A header cut short by a power cut will not have both copies
+    if (magic != AT25DF_RING_LOG_MAGIC || value != ~inverse) {
+        return 1;
+    }
+    *sequence = value;
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFRingLog<Flash>::read_record_header(int sector, bd_size_t offset, uint16_t *length,
+        uint32_t *crc) {
+    uint8_t bytes[AT25DF_RING_LOG_RECORD_HEADER_SIZE];
+    if (_flash->read(bytes, sector_addr(sector) + offset, sizeof(bytes))) {
+        return -1;
+    }
+
+    bool erased = true;
+    for (unsigned i = 0; i < sizeof(bytes); i++) {
+        if (bytes[i] != AT25DF041B_ERASE_VALUE) {
+            erased = false;
+        }
+    }
+    if (erased) {
+        return 1;
+    }
+
+    *length = bytes[0] | (bytes[1] << 8);
+    uint16_t inverse = bytes[2] | (bytes[3] << 8);
+    *crc = bytes[4] | (bytes[5] << 8) | (bytes[6] << 16) | ((uint32_t) bytes[7] << 24);
+
+    if (*length != (uint16_t) ~inverse || *length == 0
+            || offset + AT25DF_RING_LOG_RECORD_HEADER_SIZE + *length > Flash::sector_size) {
+        return 2;
+    }
+    return 0;
+}
+
+template <typename Flash>
+int AT25DFRingLog<Flash>::start_sector(int sector, uint32_t sequence) {
+    uint32_t inverse = ~sequence;
+    uint8_t header[AT25DF_RING_LOG_SECTOR_HEADER_SIZE] = {
+        (uint8_t) AT25DF_RING_LOG_MAGIC, (uint8_t) (AT25DF_RING_LOG_MAGIC >> 8),
+        (uint8_t) (AT25DF_RING_LOG_MAGIC >> 16), (uint8_t) (AT25DF_RING_LOG_MAGIC >> 24),
+        (uint8_t) sequence, (uint8_t) (sequence >> 8), (uint8_t) (sequence >> 16),
+        (uint8_t) (sequence >> 24),
+        (uint8_t) inverse, (uint8_t) (inverse >> 8), (uint8_t) (inverse >> 16),
+        (uint8_t) (inverse >> 24)
+    };
+    return _flash->program(header, sector_addr(sector), sizeof(header)) ? -1 : 0;
+}
+
+template <typename Flash>
+int AT25DFRingLog<Flash>::advance(void) {
+    // The next sector is always erased already, only its header is written
+    int next = next_sector(_head);
+    uint32_t sequence = _head_sequence + 1;
+    if (start_sector(next, sequence)) {
+        return -1;
+    }
+    _head = next;
+    _head_sequence = sequence;
+    _offset = AT25DF_RING_LOG_SECTOR_HEADER_SIZE;
+
+    // Keep the sector after the new head erased, dropping the oldest records
+    int ahead = next_sector(_head);
+    if (ahead == _tail) {
+        _tail = next_sector(ahead);
+        _tail_sequence++;
+    }
+    return _flash->erase(sector_addr(ahead), Flash::sector_size) ? -1 : 0;
+}
+
+template <typename Flash>
+int AT25DFRingLog<Flash>::is_blank(int sector, bool *blank) {
+    // The whole sector is streamed through the CRC in one transaction and
+    // compared with the CRC of an erased sector
+    uint8_t erased[64];
+    memset(erased, AT25DF041B_ERASE_VALUE, sizeof(erased));
+    uint32_t expected = 0;
+    for (bd_size_t i = 0; i < Flash::sector_size; i += sizeof(erased)) {
+        expected = Flash::crc32_update(expected, erased, sizeof(erased));
+    }
+
+    uint32_t crc = 0;
+    if (_flash->crc32(sector_addr(sector), Flash::sector_size, &crc)) {
+        return -1;
+    }
+    *blank = (crc == expected);
+    return 0;
+}
+
+/** Instantiate the ring log for each supported part */
+template class AT25DFRingLog<AT25DF041B>;
+template class AT25DFRingLog<AT25DF081A>;
+template class AT25DFRingLog<AT25DF161>;
+template class AT25DFRingLog<AT25SF041>;
+template class AT25DFRingLog<AT25SF081>;
+template class AT25DFRingLog<AT25SF161>;
+
+#endif
@@ -0,0 +1,197 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _AT25DF_RING_LOG_H_
+#define _AT25DF_RING_LOG_H_
+
+#include "AT25DF041B.h"
+
+#if defined(DEVICE_SPI) || defined(DOXYGEN_ONLY)
+
+/** Every ring log sector starts with this magic, its sequence number and the inverted sequence number */
+#define AT25DF_RING_LOG_MAGIC               0x474E4952  // "RING"
+#define AT25DF_RING_LOG_SECTOR_HEADER_SIZE  12
+
+/** Record header: 16-bit length, its inverse and a CRC-32 of the payload, little endian */
+#define AT25DF_RING_LOG_RECORD_HEADER_SIZE  8
+
+/** Circular append-only log for endless record streams such as telemetry
+ *
+ *  Records are appended to a reserved range of sectors with page programs
+ *  and never span a sector. The sector after the one being written is
+ *  always kept erased, so moving on to it costs only a header program; the
+ *  sector after that is erased then, dropping the oldest records once the
+ *  ring has wrapped.
+ *
+ *  Each sector starts with a header holding a sequence number that goes
+ *  up by one per sector. Going round the ring from the first sector, the
+ *  sequence numbers only go up until the newest sector, so mount() finds it
+ *  with a binary search over the sector headers, O(log sectors) small
+ *  reads, then walks the records of that one sector to find the end.
+ *
+ *  A record cut short by a power cut fails its CRC and is skipped by the
+ *  reader; the rest of its sector is given up and appending carries on in
+ *  the next one.
+ *
+ *  @code
+ *  AT25DF041B flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+ *  AT25DFRingLog<AT25DF041B> telemetry(&flash, 0x40000, 0x40000);
+ *
+ *  flash.init();
+ *  if (telemetry.mount() != 0) {
+ *      telemetry.format();
+ *  }
+ *  telemetry.append(&sample, sizeof(sample));
+ *  @endcode
+ */
+template <typename Flash>
+class AT25DFRingLog {
+
+public:
+
+    /** Largest record that fits in a sector */
+    enum {
+        max_record_size = Flash::sector_size - AT25DF_RING_LOG_SECTOR_HEADER_SIZE
+                - AT25DF_RING_LOG_RECORD_HEADER_SIZE
+    };
+
+    /** Create a ring log
+     *
+     *  @param flash    AT25DF to log to, must be initialized before mount() or format()
+     *  @param start    Start of the reserved range, sector aligned
+     *  @param size     Size of the reserved range, two or more sectors
+     */
+    AT25DFRingLog(Flash *flash, bd_addr_t start, bd_size_t size);
+
+    /** Erase the range and start an empty log
+     *
+     *  @return         0 on success, -1 on SPI error, -2 on a malformed range
+     */
+    int format(void);
+
+    /** Find the head and tail of an existing log
+     *
+     *  @return         0 on success, -1 on SPI error, -2 on a malformed range
+     *                  or if the range holds no log
+     */
+    int mount(void);
+
+    /** Append a record
+     *
+     *  @param data     Record to append
+     *  @param size     Number of bytes, at most max_record_size
+     *  @return         0 on success, -1 on SPI error or if not mounted,
+     *                  -2 on a malformed record
+     */
+    int append(const void *data, bd_size_t size);
+
+    /** Move the reader to the oldest record
+     *
+     *  @return         0 on success, -1 if not mounted
+     */
+    int rewind(void);
+
+    /** Read the next record, oldest first
+     *
+     *  Reading can go on while records are appended. If the reader falls so
+     *  far behind that its sector is erased it skips ahead to the oldest
+     *  record left.
+     *
+     *  @param buffer   Destination
+     *  @param size     Size of buffer
+     *  @param length   Set to the length of the record
+     *  @return         0 on success, 1 once every record has been read,
+     *                  -1 on SPI error or if not mounted, -2 if the record
+     *                  does not fit in buffer, -3 if the record is damaged
+     *                  and was skipped
+     */
+    int read_next(void *buffer, bd_size_t size, bd_size_t *length);
+
+    /** Get the number of headers the last mount() read
+     */
+    int get_mount_reads(void) const {
+        return _mount_reads;
+    }
+
+protected:
+
+    /**
+     * Reads the header of a sector
+     *
+     * @retval result 0 if it is valid, 1 if it is not, -1 on SPI error
+     */
+    int read_sector_header(int sector, uint32_t *sequence);
+
+    /**
+     * Reads the header of the record at offset in a sector
+     *
+     * @retval result 0 if it is valid, 1 if it is erased, 2 if it is damaged,
+     * -1 on SPI error
+     */
+    int read_record_header(int sector, bd_size_t offset, uint16_t *length, uint32_t *crc);
+
+    /**
+     * Starts a sector with the given sequence number, it must be erased
+     */
+    int start_sector(int sector, uint32_t sequence);
+
+    /**
+     * Moves the head on to the next sector and erases the one after it
+     */
+    int advance(void);
+
+    /**
+     * Checks a whole sector is erased in a single read
+     */
+    int is_blank(int sector, bool *blank);
+
+    inline bd_addr_t sector_addr(int sector) {
+        return _start + (bd_addr_t) sector * Flash::sector_size;
+    }
+
+    inline int next_sector(int sector) {
+        return (sector + 1) % _sectors;
+    }
+
+    Flash *_flash;
+    bd_addr_t _start;
+    bd_size_t _size;
+    int _sectors;
+
+    /** Sector being appended to, its sequence number and where the next record goes */
+    int _head;
+    uint32_t _head_sequence;
+    bd_size_t _offset;
+
+    /** Sector holding the oldest records and its sequence number */
+    int _tail;
+    uint32_t _tail_sequence;
+
+    /** Reader position */
+    int _read_sector;
+    uint32_t _read_sequence;
+    bd_size_t _read_offset;
+
+    bool _mounted;
+    int _mount_reads;
+};
+
+#endif
+#endif
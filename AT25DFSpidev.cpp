@@ -0,0 +1,202 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#if AT25DF041B_TRANSPORT_SPIDEV || defined(DOXYGEN_ONLY)
+
+#include "AT25DFSpidev.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+AT25DFSpidev::AT25DFSpidev(const char *device) :
+        _fd(-1), _hz(1000000), _selected(false), _held(false), _transaction_start(0),
+        _segment_count(0), _buffer_fill(0), _errors(0), _messages(0) {
+    _fd = open(device, O_RDWR);
+    if (_fd < 0) {
+        _errors++;
+        return;
+    }
+
+    // Mode 0 and 8-bit words, as mbed::SPI defaults to
+    uint8_t mode = SPI_MODE_0;
+    uint8_t bits = 8;
+    if (AT25DF_SPIDEV_IOCTL(_fd, SPI_IOC_WR_MODE, &mode) < 0
+            || AT25DF_SPIDEV_IOCTL(_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0) {
+        _errors++;
+    }
+}
+
+AT25DFSpidev::~AT25DFSpidev() {
+    if (_fd >= 0) {
+        _selected = false;
+        flush();
+        close(_fd);
+    }
+}
+
+int AT25DFSpidev::write(const char *tx, int tx_length, char *rx, int rx_length) {
+    if (_fd < 0 || tx_length < 0 || rx_length < 0) {
+        return -1;
+    }
+    if (!tx) {
+        tx_length = 0;
+    }
+    if (!rx) {
+        rx_length = 0;
+    }
+
+    uint32_t length = (tx_length > rx_length) ? tx_length : rx_length;
+    if (length == 0) {
+        return 0;
+    }
+
+    // A spidev transfer sends and receives the same number of bytes, so it
+    // is split where rx runs out, or where tx runs out with more padding
+    // than the buffer holds
+    uint32_t split = length;
+    if (rx_length && (uint32_t) rx_length < length) {
+        split = rx_length;
+    } else if (tx_length && (uint32_t) tx_length < length
+            && length > AT25DF_SPIDEV_BUFFER_SIZE) {
+        split = tx_length;
+    }
+
+    uint32_t tx_first = ((uint32_t) tx_length < split) ? tx_length : split;
+    if (add_segment(tx, tx_first, rx_length ? rx : NULL, split)) {
+        return -1;
+    }
+    if (split < length) {
+        bool tx_rest = (uint32_t) tx_length > split;
+        bool rx_rest = (uint32_t) rx_length > split;
+        if (add_segment(tx_rest ? tx + split : NULL, tx_rest ? length - split : 0,
+                rx_rest ? rx + split : NULL, length - split)) {
+            return -1;
+        }
+    }
+
+    // The caller reads rx as soon as this returns
+    if (rx_length && flush()) {
+        return -1;
+    }
+
+    return length;
+}
+
+void AT25DFSpidev::frequency(int hz) {
+    _hz = hz;
+
+    // Raise the device limit too, speed_hz of a transfer cannot exceed it
+    uint32_t speed = hz;
+    if (_fd >= 0 && AT25DF_SPIDEV_IOCTL(_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0) {
+        _errors++;
+    }
+}
+
+void AT25DFSpidev::select(bool asserted) {
+    if (asserted) {
+        _selected = true;
+        _transaction_start = _segment_count;
+        return;
+    }
+
+    _selected = false;
+    if (_fd < 0) {
+        return;
+    }
+
+    // A transaction with nothing left to send still has to move chip select,
+    // to pulse it or to release it after a message that kept it asserted
+    if (_segment_count == _transaction_start) {
+        add_segment(NULL, 0, NULL, 0);
+    }
+
+    struct spi_ioc_transfer *last = &_segments[_segment_count - 1];
+    last->cs_change = 1;
+
+    // A lone Write Enable waits for the command it enables
+    if (_segment_count - _transaction_start == 1 && !_held && last->len == 1
+            && last->tx_buf
+            && *(const uint8_t*) (uintptr_t) last->tx_buf == AT25DF_SPIDEV_WRITE_ENABLE) {
+        return;
+    }
+
+    flush();
+}
+
+int AT25DFSpidev::flush(void) {
+    if (_segment_count == 0) {
+        return 0;
+    }
+
+    // Ends of transactions inside the batch already deselect the chip,
+    // the last transfer keeps it selected if the transaction carries on
+    _segments[_segment_count - 1].cs_change = _selected ? 1 : 0;
+
+    int res = AT25DF_SPIDEV_IOCTL(_fd, SPI_IOC_MESSAGE(_segment_count), _segments);
+    _messages++;
+    _held = _selected;
+    _segment_count = 0;
+    _buffer_fill = 0;
+    _transaction_start = 0;
+
+    if (res < 0) {
+        _errors++;
+        return -1;
+    }
+    return 0;
+}
+
+int AT25DFSpidev::add_segment(const char *tx, uint32_t tx_length, char *rx, uint32_t length) {
+    // Small writes are copied, padded with 0xFF up to length like
+    // mbed::SPI pads with its default write value
+    bool copy = tx_length && length <= AT25DF_SPIDEV_BUFFER_SIZE;
+
+    if (_segment_count == AT25DF_SPIDEV_MAX_SEGMENTS
+            || (copy && _buffer_fill + length > AT25DF_SPIDEV_BUFFER_SIZE)) {
+        if (flush()) {
+            return -1;
+        }
+    }
+
+    struct spi_ioc_transfer *segment = &_segments[_segment_count++];
+    memset(segment, 0, sizeof(*segment));
+    if (copy) {
+        memcpy(&_buffer[_buffer_fill], tx, tx_length);
+        memset(&_buffer[_buffer_fill + tx_length], 0xFF, length - tx_length);
+        segment->tx_buf = (uintptr_t) &_buffer[_buffer_fill];
+        _buffer_fill += length;
+    } else if (tx_length) {
+        // write() only passes uncopied data that covers the whole transfer
+        segment->tx_buf = (uintptr_t) tx;
+    }
+    segment->rx_buf = (uintptr_t) rx;
+    segment->len = length;
+    segment->speed_hz = _hz;
+    segment->bits_per_word = 8;
+
+    // Data too large to copy is only valid until write() returns
+    if (tx_length && !copy) {
+        return flush();
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,180 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _AT25DF_SPIDEV_H_
+#define _AT25DF_SPIDEV_H_
+
+#if AT25DF041B_TRANSPORT_SPIDEV || defined(DOXYGEN_ONLY)
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+/** Most transfers gathered into one SPI_IOC_MESSAGE */
+#ifndef AT25DF_SPIDEV_MAX_SEGMENTS
+#define AT25DF_SPIDEV_MAX_SEGMENTS          8
+#endif
+
+/** Bytes of write data copied into a batch, enough for a whole page program */
+#ifndef AT25DF_SPIDEV_BUFFER_SIZE
+#define AT25DF_SPIDEV_BUFFER_SIZE           512
+#endif
+
+/** Function the transport hands SPI_IOC_* requests to
+ *  Point it at a user-space fake device to test without the kernel driver,
+ *  it has the signature of ioctl(fd, request, arg).
+ */
+#ifndef AT25DF_SPIDEV_IOCTL
+#define AT25DF_SPIDEV_IOCTL                 ioctl
+#endif
+
+/** Write Enable, held back so it shares a message with the command it enables */
+#define AT25DF_SPIDEV_WRITE_ENABLE          0x06
+
+/** Linux spidev transport for the AT25DF driver
+ *
+ *  Stands in for mbed::SPI when the driver is built with
+ *  AT25DF041B_TRANSPORT_SPIDEV, so the same driver and caching layers run
+ *  on Linux. The rest of the Mbed platform layer the driver uses
+ *  (BlockDevice, wait_us, us_ticker) comes from the host port.
+ *
+ *  Transfers are gathered into batches and sent with one SPI_IOC_MESSAGE
+ *  ioctl, with chip select toggled between transactions by the kernel.
+ *  Write-only transactions are sent when they end, except a lone Write
+ *  Enable, which waits for the command after it. A program is then a
+ *  single syscall for Write Enable, command, address and data. Transfers
+ *  that read data are sent straight away, as the caller needs the data.
+ *
+ *  @code
+ *  AT25DF041B flash("/dev/spidev0.0");
+ *
+ *  flash.init();
+ *  flash.set_frequency(20000000);
+ *  @endcode
+ */
+class AT25DFSpidev {
+
+public:
+
+    /** Open a spidev device
+     *
+     *  @param device   Path of the device, e.g. /dev/spidev0.0
+     */
+    AT25DFSpidev(const char *device);
+
+    /** Sends anything still held back and closes the device
+     */
+    ~AT25DFSpidev();
+
+    /** Clock bytes in and out, as mbed::SPI::write does
+     *
+     *  The larger of tx_length and rx_length bytes are clocked. Bytes past
+     *  tx_length go out as 0xFF, or as zeros when more than
+     *  AT25DF_SPIDEV_BUFFER_SIZE bytes are clocked. Bytes received past
+     *  rx_length are dropped.
+     *
+     *  @param tx           Bytes to send, NULL to send zeros
+     *  @param tx_length    Number of bytes to send
+     *  @param rx           Buffer for the bytes received, NULL to drop them
+     *  @param rx_length    Size of rx
+     *  @return             Number of bytes clocked, -1 on error
+     */
+    int write(const char *tx, int tx_length, char *rx, int rx_length);
+
+    /** Set the clock rate of the following transfers
+     */
+    void frequency(int hz);
+
+    /** Start or end a transaction
+     */
+    void select(bool asserted);
+
+    /** Send every transfer gathered so far
+     *
+     *  @return         0 on success, -1 on error
+     */
+    int flush(void);
+
+    /** Get the number of ioctls that failed, the device could not be opened counts as one
+     */
+    uint32_t get_errors(void) const {
+        return _errors;
+    }
+
+    /** Get the number of SPI_IOC_MESSAGE ioctls sent
+     */
+    uint32_t get_messages(void) const {
+        return _messages;
+    }
+
+protected:
+
+    /**
+     * Adds a transfer of length bytes to the batch, tx is copied and padded
+     * unless it is too large, in which case tx_length is 0 or length
+     */
+    int add_segment(const char *tx, uint32_t tx_length, char *rx, uint32_t length);
+
+    int _fd;
+    uint32_t _hz;
+
+    /** Transaction state: selected by the driver, and still selected on the bus after a message */
+    bool _selected;
+    bool _held;
+
+    /** First transfer of the current transaction */
+    int _transaction_start;
+
+    /** Batch of transfers and the copies of the data they send */
+    struct spi_ioc_transfer _segments[AT25DF_SPIDEV_MAX_SEGMENTS];
+    int _segment_count;
+    uint8_t _buffer[AT25DF_SPIDEV_BUFFER_SIZE];
+    uint32_t _buffer_fill;
+
+    uint32_t _errors;
+    uint32_t _messages;
+};
+
+/** Chip select for AT25DFSpidev, stands in for mbed::DigitalOut
+ *
+ *  The kernel drives the pin, so writes only mark where transactions start and end.
+ */
+class AT25DFSpidevSelect {
+
+public:
+
+    AT25DFSpidevSelect(AT25DFSpidev *bus) :
+            _bus(bus) {
+    }
+
+    /** 0 selects the chip, 1 deselects it
+     */
+    AT25DFSpidevSelect &operator=(int value) {
+        _bus->select(value == 0);
+        return *this;
+    }
+
+private:
+
+    AT25DFSpidev *_bus;
+};
+
+#endif
+#endif
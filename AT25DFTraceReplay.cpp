@@ -0,0 +1,201 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "AT25DFTraceReplay.h"
+
+#if defined(DEVICE_SPI) || defined(DOXYGEN_ONLY)
+
+#include "hal/us_ticker_api.h"
+#include "platform/mbed_wait_api.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/** Size of the export_trace() header: magic, version, count and dropped count */
+#define TRACE_HEADER_SIZE   (4 + 1 + 4 + 4)
+
+static uint32_t get_le32(const uint8_t *in) {
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t) in[3] << 24);
+}
+
+AT25DFTraceReplay::AT25DFTraceReplay(BlockDevice *bd, bd_size_t buffer_size) :
+        _bd(bd), _buffer_size(buffer_size) {
+    _buffer = new uint8_t[buffer_size];
+    memset(_buffer, 0, buffer_size);
+    reset_result();
+}
+
+AT25DFTraceReplay::~AT25DFTraceReplay() {
+    delete[] _buffer;
+}
+
+int AT25DFTraceReplay::import(const void *buffer, size_t size,
+        AT25DF041BTraceRecord *records, int count) {
+    const uint8_t *in = (const uint8_t*) buffer;
+
+    if (size < TRACE_HEADER_SIZE || get_le32(in) != AT25DF041B_TRACE_MAGIC
+            || in[4] != AT25DF041B_TRACE_VERSION) {
+        return -2;
+    }
+
+    // Divide rather than multiply, a corrupt count must not wrap size_t
+    uint32_t available = get_le32(in + 5);
+    if (available > (size - TRACE_HEADER_SIZE) / AT25DF041B_TRACE_RECORD_SIZE) {
+        return -2;
+    }
+
+    // Keep the newest records if they do not all fit
+    in += TRACE_HEADER_SIZE;
+    if (available > (uint32_t) count) {
+        in += (available - count) * AT25DF041B_TRACE_RECORD_SIZE;
+        available = count;
+    }
+
+    for (uint32_t i = 0; i < available; i++) {
+        uint32_t packed = get_le32(in + 4);
+        records[i].timestamp_us = get_le32(in);
+        records[i].duration_us = packed & 0xFFFFFF;
+        records[i].op = packed >> 24;
+        records[i].addr = get_le32(in + 8);
+        records[i].size = get_le32(in + 12);
+        in += AT25DF041B_TRACE_RECORD_SIZE;
+    }
+
+    return available;
+}
+
+int AT25DFTraceReplay::replay(const AT25DF041BTraceRecord *records, int count,
+        uint32_t max_gap_us) {
+    int failed = 0;
+
+    for (int i = 0; i < count; i++) {
+        const AT25DF041BTraceRecord &record = records[i];
+
+        if (record.op >= AT25DF_TRACE_REPLAY_TYPES) {
+            _result.errors++;
+            failed++;
+            continue;
+        }
+
+        // Idle for as long as the firmware did after the previous operation
+        if (max_gap_us && i > 0) {
+            uint32_t end = records[i - 1].timestamp_us + records[i - 1].duration_us;
+            uint32_t gap = record.timestamp_us - end;
+            if ((int32_t) gap > 0) {
+                if (gap > max_gap_us) {
+                    gap = max_gap_us;
+                }
+                wait_us(gap);
+                _result.idle_us += gap;
+            }
+        }
+
+        uint32_t start_us = us_ticker_read();
+        int res = run(record);
+        uint32_t elapsed = us_ticker_read() - start_us;
+
+        if (res) {
+            _result.errors++;
+            failed++;
+            continue;
+        }
+
+        _result.ops[record.op]++;
+        _result.bytes[record.op] += record.size;
+        _result.replay_us[record.op] += elapsed;
+        _result.traced_us[record.op] += record.duration_us;
+    }
+
+    return failed;
+}
+
+void AT25DFTraceReplay::reset_result(void) {
+    memset(&_result, 0, sizeof(_result));
+}
+
+int AT25DFTraceReplay::format_result(char *buffer, size_t size) const {
+    static const char *type_names[AT25DF_TRACE_REPLAY_TYPES] = { "read",
+            "program", "erase", "trim" };
+    int total = 0;
+
+    // snprintf returns the length it would have written, keep advancing
+    // through the buffer like it does so the caller can size a retry
+#define TRACE_REPLAY_PRINT(...) do { \
+        size_t offset = ((size_t) total < size) ? total : size; \
+        int n = snprintf(buffer + offset, size - offset, __VA_ARGS__); \
+        if (n < 0) return n; \
+        total += n; \
+    } while (0)
+
+    if (size == 0) {
+        buffer = NULL;
+    }
+
+    for (int type = 0; type < AT25DF_TRACE_REPLAY_TYPES; type++) {
+        if (_result.ops[type]) {
+            TRACE_REPLAY_PRINT("%s: ops=%lu bytes=%llu replay=%lluus traced=%lluus\n",
+                    type_names[type], (unsigned long) _result.ops[type],
+                    (unsigned long long) _result.bytes[type],
+                    (unsigned long long) _result.replay_us[type],
+                    (unsigned long long) _result.traced_us[type]);
+        }
+    }
+    TRACE_REPLAY_PRINT("idle=%lluus errors=%lu\n", (unsigned long long) _result.idle_us,
+            (unsigned long) _result.errors);
+
+#undef TRACE_REPLAY_PRINT
+
+    return total;
+}
+
+int AT25DFTraceReplay::run(const AT25DF041BTraceRecord &record) {
+    bd_addr_t addr = record.addr;
+    bd_size_t remaining = record.size;
+
+    switch (record.op) {
+    case AT25DF041B_OPERATION_TYPE_ERASE:
+        return _bd->erase(addr, remaining);
+
+    case AT25DF041B_TRACE_TRIM:
+        return _bd->trim(addr, remaining);
+
+    default:
+        break;
+    }
+
+    while (remaining) {
+        bd_size_t chunk = remaining < _buffer_size ? remaining : _buffer_size;
+        int res;
+        if (record.op == AT25DF041B_OPERATION_TYPE_READ) {
+            res = _bd->read(_buffer, addr, chunk);
+        } else {
+            res = _bd->program(_buffer, addr, chunk);
+        }
+        if (res) {
+            return res;
+        }
+        addr += chunk;
+        remaining -= chunk;
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,147 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _AT25DF_TRACE_REPLAY_H_
+#define _AT25DF_TRACE_REPLAY_H_
+
+#include "AT25DF041B.h"
+
+#if defined(DEVICE_SPI) || defined(DOXYGEN_ONLY)
+
+/** Number of operation types a replay keeps totals for, trims included */
+#define AT25DF_TRACE_REPLAY_TYPES           (AT25DF041B_TRACE_TRIM + 1)
+
+/** Totals of a replay, indexed by AT25DF041B_OPERATION_TYPE_* or AT25DF041B_TRACE_TRIM */
+struct AT25DFTraceReplayResult {
+    /** Operations replayed and their payload bytes */
+    uint32_t ops[AT25DF_TRACE_REPLAY_TYPES];
+    uint64_t bytes[AT25DF_TRACE_REPLAY_TYPES];
+
+    /** Time the replay spent in each type, and what the trace recorded for the same operations */
+    uint64_t replay_us[AT25DF_TRACE_REPLAY_TYPES];
+    uint64_t traced_us[AT25DF_TRACE_REPLAY_TYPES];
+
+    /** Time spent idle between operations to reproduce the gaps in the trace */
+    uint64_t idle_us;
+
+    /** Operations the block device rejected, they are skipped */
+    uint32_t errors;
+};
+
+/** Replays an I/O trace recorded by an AT25DF against a block device
+ *
+ *  A trace captured in the field with AT25DF041B_ENABLE_TRACE and
+ *  export_trace() holds the exact access pattern the firmware generated.
+ *  Replaying it against a driver built with another caching or scheduling
+ *  configuration, or wrapped in a ReadAheadBlockDevice, shows how that
+ *  configuration does on the real workload rather than on a synthetic one.
+ *  The block device can be an AT25DF on target or one talking to a
+ *  simulated chip on a host.
+ *
+ *  Traces hold no data, programs write whatever the scratch buffer holds.
+ *  Operations larger than the scratch buffer are issued in buffer-sized
+ *  pieces. The idle time between operations can be reproduced up to a
+ *  limit so that background work, such as background_erase(), gets the
+ *  chances it had in the field.
+ *
+ *  @code
+ *  static uint8_t trace[4096];
+ *  static AT25DF041BTraceRecord records[256];
+ *
+ *  AT25DF041B flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+ *  ReadAheadBlockDevice cached(&flash, 1024);
+ *  AT25DFTraceReplay replay(&cached);
+ *
+ *  int count = AT25DFTraceReplay::import(trace, trace_size, records, 256);
+ *  cached.init();
+ *  replay.replay(records, count, 10000);
+ *  @endcode
+ */
+class AT25DFTraceReplay {
+
+public:
+
+    /** Create a replayer
+     *
+     *  @param bd           Block device to replay against, must be initialized before replay()
+     *  @param buffer_size  Largest transfer issued at once, allocated here
+     */
+    AT25DFTraceReplay(BlockDevice *bd, bd_size_t buffer_size = 4096);
+
+    /** Lifetime of the replayer
+     */
+    virtual ~AT25DFTraceReplay();
+
+    /** Decode a binary trace written by export_trace()
+     *
+     *  @param buffer   Binary trace
+     *  @param size     Size of the trace in bytes
+     *  @param records  Destination
+     *  @param count    Number of records records can hold
+     *  @return         Number of records decoded, -2 if the trace is malformed
+     *                  or from another version
+     */
+    static int import(const void *buffer, size_t size, AT25DF041BTraceRecord *records,
+            int count);
+
+    /** Replay records against the block device, adding to the totals
+     *
+     *  @param records      Trace records, oldest first
+     *  @param count        Number of records
+     *  @param max_gap_us   Longest gap between operations to reproduce,
+     *                      0 replays them back to back
+     *  @return             0 on success, or the number of operations that failed
+     */
+    int replay(const AT25DF041BTraceRecord *records, int count, uint32_t max_gap_us = 0);
+
+    /** Get the totals of every replay since the last reset_result()
+     */
+    const AT25DFTraceReplayResult &get_result(void) const {
+        return _result;
+    }
+
+    /** Clear the totals
+     */
+    void reset_result(void);
+
+    /** Write a human readable summary of the totals
+     *
+     *  @param buffer   Destination for the NUL-terminated summary
+     *  @param size     Size of buffer in bytes
+     *  @return         Number of characters the full summary needs, as snprintf
+     */
+    int format_result(char *buffer, size_t size) const;
+
+protected:
+
+    /**
+     * Issues one traced operation, in pieces if it does not fit the buffer
+     */
+    int run(const AT25DF041BTraceRecord &record);
+
+    BlockDevice *_bd;
+    uint8_t *_buffer;
+    bd_size_t _buffer_size;
+
+    AT25DFTraceReplayResult _result;
+};
+
+#endif
+#endif
@@ -0,0 +1,483 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "CompressedLog.h"
+
+#include <string.h>
+
+/** LZ4 block format limits, a match never starts in the last 12 bytes
+ *  and the last 5 bytes are always literals */
+#define LZ4_MIN_MATCH       4
+#define LZ4_MATCH_LIMIT     12
+#define LZ4_LAST_LITERALS   5
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/** CRC-32 (IEEE 802.3) a nibble at a time, the polynomial reflected */
+static const uint32_t crc32_nibble_table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4,
+    0x4DB26158, 0x5005713C, 0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+    0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+static inline uint32_t hash32(uint32_t value) {
+    return (value * 2654435761u) >> (32 - COMPRESSED_LOG_HASH_BITS);
+}
+
+/** Writes an LZ4 length continuation, 255s followed by the remainder */
+static inline uint8_t *write_length(uint8_t *op, int length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t) length;
+    return op;
+}
+
+CompressedLog::CompressedLog(BlockDevice *bd, bd_addr_t start, bd_size_t size,
+        int index_entries) :
+        _bd(bd), _start(start), _size(size), _index_size(index_entries),
+        _index_count(0), _records(0), _append(0), _flushed(0), _writable(false),
+        _mounted(false), _chunk_fill(0), _cache_logical(0), _cache_size(0) {
+    _index = new IndexEntry[index_entries];
+}
+
+CompressedLog::~CompressedLog() {
+    delete[] _index;
+}
+
+int CompressedLog::format(void) {
+    int res = reset();
+    if (res) {
+        return res;
+    }
+
+    res = _bd->erase(_start, _size);
+    if (res) {
+        return res;
+    }
+
+    _writable = true;
+    _mounted = true;
+    return 0;
+}
+
+int CompressedLog::mount(void) {
+    int res = reset();
+    if (res) {
+        return res;
+    }
+
+    _writable = true;
+    while (_append + COMPRESSED_LOG_HEADER_SIZE <= _size) {
+        uint16_t stored, logical;
+        uint32_t crc;
+        res = read_header(_append, &stored, &logical, &crc);
+        if (res == 1) {
+            break;
+        } else if (res == -1) {
+            // Whatever follows is unknown, so nothing more may be appended
+            _writable = false;
+            break;
+        } else if (res) {
+            return res;
+        }
+
+        add_record(COMPRESSED_LOG_HEADER_SIZE + (stored & ~COMPRESSED_LOG_RAW_FLAG), logical);
+    }
+
+    _mounted = true;
+    return 0;
+}
+
+int CompressedLog::append(const void *data, bd_size_t size) {
+    const uint8_t *in = (const uint8_t*) data;
+
+    if (!_mounted || !_writable) {
+        return -1;
+    }
+
+    while (size) {
+        bd_size_t length = COMPRESSED_LOG_CHUNK_SIZE - _chunk_fill;
+        if (length > size) {
+            length = size;
+        }
+        memcpy(&_chunk[_chunk_fill], in, length);
+        _chunk_fill += length;
+        in += length;
+        size -= length;
+
+        if (_chunk_fill == COMPRESSED_LOG_CHUNK_SIZE) {
+            int res = write_chunk();
+            if (res) {
+                return res;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int CompressedLog::flush(void) {
+    if (_chunk_fill == 0) {
+        return 0;
+    }
+    return write_chunk();
+}
+
+int CompressedLog::read(void *buffer, bd_size_t offset, bd_size_t size) {
+    uint8_t *out = (uint8_t*) buffer;
+
+    if (offset + size > logical_size()) {
+        return -2;
+    }
+
+    while (size) {
+        const uint8_t *source;
+        bd_size_t available;
+
+        if (offset >= _flushed) {
+            // Still in the chunk being appended to
+            source = &_chunk[offset - _flushed];
+            available = _flushed + _chunk_fill - offset;
+        } else {
+            if (_cache_size == 0 || offset < _cache_logical
+                    || offset >= _cache_logical + _cache_size) {
+                int res = load_chunk(offset);
+                if (res) {
+                    return res;
+                }
+            }
+            source = &_cache[offset - _cache_logical];
+            available = _cache_logical + _cache_size - offset;
+        }
+
+        bd_size_t length = (available < size) ? available : size;
+        memcpy(out, source, length);
+        out += length;
+        offset += length;
+        size -= length;
+    }
+
+    return 0;
+}
+
+int CompressedLog::compress(const uint8_t *in, int size, uint8_t *out, int capacity,
+        uint16_t *table) {
+    uint8_t *op = out;
+    uint8_t *op_end = out + capacity;
+    int anchor = 0;
+    int ip = 0;
+
+    memset(table, 0, sizeof(uint16_t) << COMPRESSED_LOG_HASH_BITS);
+
+    while (ip + LZ4_MATCH_LIMIT < size) {
+        uint32_t sequence = read32(&in[ip]);
+        uint32_t h = hash32(sequence);
+        int ref = table[h];
+        table[h] = (uint16_t) ip;
+
+        if (ref >= ip || read32(&in[ref]) != sequence) {
+            ip++;
+            continue;
+        }
+
+        int match = LZ4_MIN_MATCH;
+        while (ip + match < size - LZ4_LAST_LITERALS && in[ref + match] == in[ip + match]) {
+            match++;
+        }
+
+        // Token, literal run, offset and match length, worst case
+        int literals = ip - anchor;
+        if (op + 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1 > op_end) {
+            return -1;
+        }
+
+        uint8_t *token = op++;
+        *token = 0;
+        if (literals >= 15) {
+            *token = 15 << 4;
+            op = write_length(op, literals - 15);
+        } else {
+            *token = (uint8_t) (literals << 4);
+        }
+        memcpy(op, &in[anchor], literals);
+        op += literals;
+
+        uint16_t distance = (uint16_t) (ip - ref);
+        *op++ = (uint8_t) distance;
+        *op++ = (uint8_t) (distance >> 8);
+
+        int extra = match - LZ4_MIN_MATCH;
+        if (extra >= 15) {
+            *token |= 15;
+            op = write_length(op, extra - 15);
+        } else {
+            *token |= (uint8_t) extra;
+        }
+
+        ip += match;
+        anchor = ip;
+    }
+
+    // The rest goes out as a final run of literals
+    int literals = size - anchor;
+    if (op + 1 + literals / 255 + 1 + literals > op_end) {
+        return -1;
+    }
+    if (literals >= 15) {
+        *op++ = 15 << 4;
+        op = write_length(op, literals - 15);
+    } else {
+        *op++ = (uint8_t) (literals << 4);
+    }
+    memcpy(op, &in[anchor], literals);
+    op += literals;
+
+    return op - out;
+}
+
+int CompressedLog::decompress(const uint8_t *in, int size, uint8_t *out, int capacity) {
+    int ip = 0;
+    int op = 0;
+
+    while (ip < size) {
+        uint8_t token = in[ip++];
+
+        int literals = token >> 4;
+        if (literals == 15) {
+            uint8_t extra;
+            do {
+                if (ip >= size) {
+                    return -1;
+                }
+                extra = in[ip++];
+                literals += extra;
+            } while (extra == 255);
+        }
+        if (literals > size - ip || literals > capacity - op) {
+            return -1;
+        }
+        memcpy(&out[op], &in[ip], literals);
+        ip += literals;
+        op += literals;
+
+        // The last sequence has no match
+        if (ip == size) {
+            break;
+        }
+
+        if (ip + 2 > size) {
+            return -1;
+        }
+        int distance = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        if (distance == 0 || distance > op) {
+            return -1;
+        }
+
+        int match = token & 15;
+        if (match == 15) {
+            uint8_t extra;
+            do {
+                if (ip >= size) {
+                    return -1;
+                }
+                extra = in[ip++];
+                match += extra;
+            } while (extra == 255);
+        }
+        match += LZ4_MIN_MATCH;
+        if (match > capacity - op) {
+            return -1;
+        }
+
+        // Byte by byte, the source may overlap what is being written
+        for (int i = 0; i < match; i++, op++) {
+            out[op] = out[op - distance];
+        }
+    }
+
+    return op;
+}
+
+int CompressedLog::reset(void) {
+    if (_bd->get_read_size() != 1 || _bd->get_program_size() != 1
+            || _start + _size > _bd->size()) {
+        return -2;
+    }
+
+    _index_count = 0;
+    _records = 0;
+    _append = 0;
+    _flushed = 0;
+    _writable = false;
+    _mounted = false;
+    _chunk_fill = 0;
+    _cache_size = 0;
+    return 0;
+}
+
+int CompressedLog::write_chunk(void) {
+    uint8_t *payload = &_packed[COMPRESSED_LOG_HEADER_SIZE];
+
+    // Keep chunks that do not shrink as they are
+    int stored = compress(_chunk, _chunk_fill, payload, _chunk_fill - 1, _table);
+    uint16_t stored_field = (uint16_t) stored;
+    if (stored < 0) {
+        memcpy(payload, _chunk, _chunk_fill);
+        stored = _chunk_fill;
+        stored_field = (uint16_t) (stored | COMPRESSED_LOG_RAW_FLAG);
+    }
+
+    bd_size_t record = COMPRESSED_LOG_HEADER_SIZE + stored;
+    if (_append + record > _size) {
+        return -1;
+    }
+
+    _packed[0] = (uint8_t) stored_field;
+    _packed[1] = (uint8_t) (stored_field >> 8);
+    _packed[2] = (uint8_t) _chunk_fill;
+    _packed[3] = (uint8_t) (_chunk_fill >> 8);
+    uint32_t crc = crc32_update(0, payload, stored);
+    for (int i = 0; i < 4; i++) {
+        _packed[4 + i] = (uint8_t) (crc >> (8 * i));
+    }
+
+    // Header and data in one program. A record cut short by a power cut
+    // keeps a valid header and fails its CRC when it is read
+    int res = _bd->program(_packed, _start + _append, record);
+    if (res) {
+        return res;
+    }
+
+    add_record(record, _chunk_fill);
+    _chunk_fill = 0;
+    return 0;
+}
+
+int CompressedLog::read_header(bd_size_t physical, uint16_t *stored, uint16_t *logical,
+        uint32_t *crc) {
+    uint8_t header[COMPRESSED_LOG_HEADER_SIZE];
+    int res = _bd->read(header, _start + physical, sizeof(header));
+    if (res) {
+        return res;
+    }
+
+    *stored = header[0] | (header[1] << 8);
+    *logical = header[2] | (header[3] << 8);
+    *crc = header[4] | (header[5] << 8) | (header[6] << 16) | ((uint32_t) header[7] << 24);
+
+    if (*stored == 0xFFFF && *logical == 0xFFFF) {
+        return 1;
+    }
+
+    bd_size_t length = *stored & ~COMPRESSED_LOG_RAW_FLAG;
+    if (*logical == 0 || *logical > COMPRESSED_LOG_CHUNK_SIZE || length == 0
+            || length > COMPRESSED_LOG_CHUNK_SIZE
+            || physical + COMPRESSED_LOG_HEADER_SIZE + length > _size) {
+        return -1;
+    }
+
+    return 0;
+}
+
+uint32_t CompressedLog::crc32_update(uint32_t crc, const uint8_t *data, bd_size_t size) {
+    crc = ~crc;
+    while (size--) {
+        crc = crc32_nibble_table[(crc ^ *data) & 0x0F] ^ (crc >> 4);
+        crc = crc32_nibble_table[(crc ^ (*data++ >> 4)) & 0x0F] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+void CompressedLog::add_record(bd_size_t stored, bd_size_t logical) {
+    if ((_records % COMPRESSED_LOG_INDEX_STRIDE) == 0 && _index_count < _index_size) {
+        _index[_index_count].logical = _flushed;
+        _index[_index_count].physical = _append;
+        _index_count++;
+    }
+
+    _records++;
+    _append += stored;
+    _flushed += logical;
+}
+
+int CompressedLog::load_chunk(bd_size_t offset) {
+    bd_size_t logical = 0;
+    bd_size_t physical = 0;
+
+    // Last index entry at or before offset, the first record is always indexed
+    if (_index_count) {
+        int low = 0;
+        int high = _index_count - 1;
+        while (low < high) {
+            int mid = (low + high + 1) / 2;
+            if (_index[mid].logical <= offset) {
+                low = mid;
+            } else {
+                high = mid - 1;
+            }
+        }
+        logical = _index[low].logical;
+        physical = _index[low].physical;
+    }
+    uint16_t stored, length;
+    uint32_t crc;
+
+    // Walk the headers up to the record holding offset
+    while (true) {
+        int res = read_header(physical, &stored, &length, &crc);
+        if (res) {
+            return (res > 0) ? -1 : res;
+        }
+        if (offset < logical + length) {
+            break;
+        }
+        logical += length;
+        physical += COMPRESSED_LOG_HEADER_SIZE + (stored & ~COMPRESSED_LOG_RAW_FLAG);
+    }
+
+    bd_size_t size = stored & ~COMPRESSED_LOG_RAW_FLAG;
+    _cache_size = 0;
+
+    // Raw records are read straight into the cache, a torn one reads as erased filler
+    uint8_t *payload = (stored & COMPRESSED_LOG_RAW_FLAG) ? _cache : _packed;
+    int res = _bd->read(payload, _start + physical + COMPRESSED_LOG_HEADER_SIZE, size);
+    if (res) {
+        return res;
+    }
+    if (crc32_update(0, payload, size) != crc) {
+        return -1;
+    }
+    if (!(stored & COMPRESSED_LOG_RAW_FLAG)) {
+        if (decompress(_packed, size, _cache, sizeof(_cache)) != length) {
+            return -1;
+        }
+    }
+
+    _cache_logical = logical;
+    _cache_size = length;
+    return 0;
+}
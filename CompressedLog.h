@@ -0,0 +1,259 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _COMPRESSED_LOG_H_
+#define _COMPRESSED_LOG_H_
+
+#include "BlockDevice.h"
+
+/** Logical bytes compressed together as one record, also the size of each working buffer */
+#ifndef COMPRESSED_LOG_CHUNK_SIZE
+#define COMPRESSED_LOG_CHUNK_SIZE           1024
+#endif
+
+/** The match finder hash table has 1 << COMPRESSED_LOG_HASH_BITS 16-bit entries */
+#ifndef COMPRESSED_LOG_HASH_BITS
+#define COMPRESSED_LOG_HASH_BITS            10
+#endif
+
+/** Every this many records gets an entry in the RAM index */
+#ifndef COMPRESSED_LOG_INDEX_STRIDE
+#define COMPRESSED_LOG_INDEX_STRIDE         8
+#endif
+
+/** Record header: 16-bit stored length, 16-bit logical length and the CRC-32
+ *  of the stored data, little endian */
+#define COMPRESSED_LOG_HEADER_SIZE          8
+
+/** Set in the stored length when a chunk did not compress and is stored as is */
+#define COMPRESSED_LOG_RAW_FLAG             0x8000
+
+/** Append-only compressing store for logs and firmware images
+ *
+ *  Data is appended to a region of a byte-programmable block device, such
+ *  as an AT25DF, and read back at any logical offset. Appended bytes are
+ *  gathered into COMPRESSED_LOG_CHUNK_SIZE chunks and each chunk is
+ *  compressed on its own in the LZ4 block format, so a read only has to
+ *  decompress the chunk it lands in. Chunks that do not shrink are stored
+ *  as they are.
+ *
+ *  On flash every chunk is a record: an 8-byte header followed by the
+ *  compressed data, packed back to back from the start of the region. An
+ *  erased header marks the end of the log, so mount() rebuilds the state
+ *  by walking the headers. The header carries a CRC-32 of the stored data,
+ *  so a record cut short by a power cut is caught when it is read. A RAM index remembers where every
+ *  COMPRESSED_LOG_INDEX_STRIDE-th record starts; reads binary search it and
+ *  walk at most that many headers. Once the index is full, reads past its
+ *  end walk further but still work.
+ *
+ *  Working memory is fixed: three chunk-sized buffers and the hash table,
+ *  about 5kB with the defaults, plus 8 bytes per index entry.
+ *
+ *  @code
+ *  AT25DF041B flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+ *  CompressedLog log(&flash, 0, flash.size());
+ *
+ *  flash.init();
+ *  if (log.mount() != 0) {
+ *      log.format();
+ *  }
+ *  log.append(sample, sizeof(sample));
+ *  log.flush();
+ *  @endcode
+ */
+class CompressedLog {
+
+public:
+
+    /** Create a compressed log over part of a block device
+     *
+     *  @param bd               Block device, must have read and program sizes of 1
+     *  @param start            Start of the region, erase aligned
+     *  @param size             Size of the region, a multiple of the erase size
+     *  @param index_entries    Number of index entries to allocate
+     */
+    CompressedLog(BlockDevice *bd, bd_addr_t start, bd_size_t size,
+            int index_entries = 128);
+
+    /** Lifetime of the log
+     */
+    virtual ~CompressedLog();
+
+    /** Erase the region and start an empty log
+     *
+     *  @return         0 on success, -2 if the device or region is unsuitable,
+     *                  or the block device's error
+     */
+    int format(void);
+
+    /** Find the end of an existing log
+     *
+     *  A record with a damaged header, from a power cut half way through
+     *  an append for example, ends the log and no more can be appended
+     *  until the next format().
+     *
+     *  @return         0 on success, -2 if the device or region is unsuitable,
+     *                  or the block device's error
+     */
+    int mount(void);
+
+    /** Append data to the log
+     *
+     *  Data is compressed and programmed a chunk at a time, the last
+     *  partial chunk stays in RAM until it fills up or flush() is called
+     *
+     *  @param data     Data to append
+     *  @param size     Number of bytes
+     *  @return         0 on success, -1 if the region is full or the log is not
+     *                  mounted, or the block device's error
+     */
+    int append(const void *data, bd_size_t size);
+
+    /** Write the partial chunk held in RAM to flash
+     *
+     *  The next append starts a new chunk, so flushing often costs some
+     *  compression
+     *
+     *  @return         0 on success, -1 if the region is full, or the block device's error
+     */
+    int flush(void);
+
+    /** Read logical bytes back
+     *
+     *  @param buffer   Destination
+     *  @param offset   Logical offset from the start of the log
+     *  @param size     Number of bytes
+     *  @return         0 on success, -2 if the range is past the end of the log,
+     *                  -1 if a record fails its CRC or to decompress, or the
+     *                  block device's error
+     */
+    int read(void *buffer, bd_size_t offset, bd_size_t size);
+
+    /** Get the number of bytes appended, including any not yet flushed
+     */
+    bd_size_t logical_size(void) const {
+        return _flushed + _chunk_fill;
+    }
+
+    /** Get the number of bytes of the region used by flushed records
+     */
+    bd_size_t physical_size(void) const {
+        return _append;
+    }
+
+    /** Compress in[0..size) in the LZ4 block format
+     *
+     *  @param in       Data to compress, at most 65535 bytes
+     *  @param size     Number of bytes
+     *  @param out      Destination
+     *  @param capacity Size of out
+     *  @param table    Hash table of 1 << COMPRESSED_LOG_HASH_BITS entries
+     *  @return         Compressed size, or -1 if it would not fit in capacity
+     */
+    static int compress(const uint8_t *in, int size, uint8_t *out, int capacity,
+            uint16_t *table);
+
+    /** Decompress an LZ4 block, checking every length and offset
+     *
+     *  @param in       Compressed data
+     *  @param size     Number of compressed bytes
+     *  @param out      Destination
+     *  @param capacity Size of out
+     *  @return         Decompressed size, or -1 if the data is malformed
+     */
+    static int decompress(const uint8_t *in, int size, uint8_t *out, int capacity);
+
+protected:
+
+    /**
+     * Index entry, where a record starts and which logical offset it holds
+     */
+    struct IndexEntry {
+        uint32_t logical;
+        uint32_t physical;
+    };
+
+    /**
+     * Checks the device and region are usable and clears the state
+     */
+    int reset(void);
+
+    /**
+     * Compresses and programs the chunk buffer as the next record
+     */
+    int write_chunk(void);
+
+    /**
+     * Reads the record header at physical offset
+     *
+     * @retval error 0 if it is a valid header, 1 if it is erased, -1 if it is
+     * damaged, or the block device's error
+     */
+    int read_header(bd_size_t physical, uint16_t *stored, uint16_t *logical,
+            uint32_t *crc);
+
+    /**
+     * Updates a CRC-32, the same one AT25DF::crc32() computes
+     */
+    static uint32_t crc32_update(uint32_t crc, const uint8_t *data, bd_size_t size);
+
+    /**
+     * Notes a record that was just appended or found by mount()
+     */
+    void add_record(bd_size_t stored, bd_size_t logical);
+
+    /**
+     * Decompresses the record holding a logical offset into the cache
+     */
+    int load_chunk(bd_size_t offset);
+
+    BlockDevice *_bd;
+    bd_addr_t _start;
+    bd_size_t _size;
+
+    IndexEntry *_index;
+    int _index_size;
+    int _index_count;
+    uint32_t _records;
+
+    /** Region offset of the next record and logical bytes already in flash */
+    bd_size_t _append;
+    bd_size_t _flushed;
+
+    /** Cleared by a damaged record, appending would program over it */
+    bool _writable;
+    bool _mounted;
+
+    /** Chunk being appended to */
+    uint8_t _chunk[COMPRESSED_LOG_CHUNK_SIZE];
+    bd_size_t _chunk_fill;
+
+    /** Record as stored, header included */
+    uint8_t _packed[COMPRESSED_LOG_HEADER_SIZE + COMPRESSED_LOG_CHUNK_SIZE];
+
+    /** Last chunk decompressed by read(), _cache_size is 0 when empty */
+    uint8_t _cache[COMPRESSED_LOG_CHUNK_SIZE];
+    bd_size_t _cache_logical;
+    bd_size_t _cache_size;
+
+    uint16_t _table[1 << COMPRESSED_LOG_HASH_BITS];
+};
+
+#endif
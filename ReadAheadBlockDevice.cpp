@@ -0,0 +1,211 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "ReadAheadBlockDevice.h"
+
+#include <string.h>
+
+ReadAheadBlockDevice::ReadAheadBlockDevice(BlockDevice *bd, bd_size_t buffer_size,
+        bd_size_t min_window) :
+        _bd(bd), _buffer(NULL), _buffer_size(buffer_size), _min_window(min_window),
+        _window(min_window), _cached_addr(0), _cached_size(0), _cached_used(0),
+        _next_addr(0) {
+    if (_min_window > _buffer_size) {
+        _min_window = _buffer_size;
+        _window = _buffer_size;
+    }
+    reset_stats();
+}
+
+ReadAheadBlockDevice::~ReadAheadBlockDevice() {
+    delete[] _buffer;
+}
+
+int ReadAheadBlockDevice::init() {
+    int res = _bd->init();
+    if (res) {
+        return res;
+    }
+
+    if (!_buffer) {
+        _buffer = new uint8_t[_buffer_size];
+    }
+    _cached_size = 0;
+    _window = _min_window;
+    return 0;
+}
+
+int ReadAheadBlockDevice::deinit() {
+    retire_buffer();
+    delete[] _buffer;
+    _buffer = NULL;
+    return _bd->deinit();
+}
+
+int ReadAheadBlockDevice::sync() {
+    return _bd->sync();
+}
+
+int ReadAheadBlockDevice::read(void *buffer, bd_addr_t addr, bd_size_t size) {
+    uint8_t *out = (uint8_t*) buffer;
+    bool sequential = (addr == _next_addr);
+    _next_addr = addr + size;
+
+    // Serve whatever part of the read is already buffered
+    if (_cached_size && addr >= _cached_addr && addr < _cached_addr + _cached_size) {
+        bd_size_t offset = addr - _cached_addr;
+        bd_size_t length = _cached_size - offset;
+        if (length > size) {
+            length = size;
+        }
+        memcpy(out, &_buffer[offset], length);
+        if (offset + length > _cached_used) {
+            _stats.used_bytes += (offset + length) - _cached_used;
+            _cached_used = offset + length;
+        }
+
+        if (length == size) {
+            _stats.hits++;
+            return 0;
+        }
+
+        // The stream ran off the end of the buffer, the rest is a sequential miss
+        out += length;
+        addr += length;
+        size -= length;
+        sequential = true;
+    }
+
+    // A stream that consumed the whole window gets a bigger one next time
+    if (_cached_size && addr == _cached_addr + _cached_size && _window < _buffer_size) {
+        _window *= 2;
+        if (_window > _buffer_size) {
+            _window = _buffer_size;
+        }
+    }
+
+    // Random and oversized reads go straight through at no extra cost
+    if (!sequential || size >= _buffer_size) {
+        _stats.bypasses++;
+        return _bd->read(out, addr, size);
+    }
+
+    retire_buffer();
+
+    // Fetch the rest of this read plus the window ahead of it in one read
+    bd_size_t fetch = size + _window;
+    if (fetch > _buffer_size) {
+        fetch = _buffer_size;
+    }
+    if (addr + fetch > _bd->size()) {
+        fetch = _bd->size() - addr;
+    }
+
+    // Keep the fetch aligned to the device's read size
+    bd_size_t read_size = _bd->get_read_size();
+    fetch -= fetch % read_size;
+    if (fetch < size) {
+        _stats.bypasses++;
+        return _bd->read(out, addr, size);
+    }
+
+    int res = _bd->read(_buffer, addr, fetch);
+    if (res) {
+        return res;
+    }
+
+    _stats.misses++;
+    _stats.prefetched_bytes += fetch;
+    _stats.used_bytes += size;
+    _cached_addr = addr;
+    _cached_size = fetch;
+    _cached_used = size;
+    memcpy(out, _buffer, size);
+    return 0;
+}
+
+int ReadAheadBlockDevice::program(const void *buffer, bd_addr_t addr, bd_size_t size) {
+    invalidate(addr, size);
+    return _bd->program(buffer, addr, size);
+}
+
+int ReadAheadBlockDevice::erase(bd_addr_t addr, bd_size_t size) {
+    invalidate(addr, size);
+    return _bd->erase(addr, size);
+}
+
+int ReadAheadBlockDevice::trim(bd_addr_t addr, bd_size_t size) {
+    invalidate(addr, size);
+    return _bd->trim(addr, size);
+}
+
+bd_size_t ReadAheadBlockDevice::get_read_size() const {
+    return _bd->get_read_size();
+}
+
+bd_size_t ReadAheadBlockDevice::get_program_size() const {
+    return _bd->get_program_size();
+}
+
+bd_size_t ReadAheadBlockDevice::get_erase_size() const {
+    return _bd->get_erase_size();
+}
+
+bd_size_t ReadAheadBlockDevice::get_erase_size(bd_addr_t addr) const {
+    return _bd->get_erase_size(addr);
+}
+
+int ReadAheadBlockDevice::get_erase_value() const {
+    return _bd->get_erase_value();
+}
+
+bd_size_t ReadAheadBlockDevice::size() const {
+    return _bd->size();
+}
+
+const char *ReadAheadBlockDevice::get_type() const {
+    return _bd->get_type();
+}
+
+void ReadAheadBlockDevice::reset_stats(void) {
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void ReadAheadBlockDevice::invalidate(bd_addr_t addr, bd_size_t size) {
+    if (_cached_size && addr < _cached_addr + _cached_size
+            && _cached_addr < addr + size) {
+        _cached_size = 0;
+    }
+}
+
+void ReadAheadBlockDevice::retire_buffer(void) {
+    if (_cached_size == 0) {
+        return;
+    }
+
+    // Shrink the window if most of what was prefetched went unused
+    if (_cached_used < _cached_size / 2 && _window > _min_window) {
+        _window /= 2;
+        if (_window < _min_window) {
+            _window = _min_window;
+        }
+    }
+    _cached_size = 0;
+}
@@ -0,0 +1,157 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _READ_AHEAD_BLOCK_DEVICE_H_
+#define _READ_AHEAD_BLOCK_DEVICE_H_
+
+#include "BlockDevice.h"
+
+/** Read-ahead statistics */
+struct ReadAheadStats {
+    /** Reads served entirely from the prefetch buffer */
+    uint32_t hits;
+
+    /** Sequential reads that had to go to the device and refilled the buffer */
+    uint32_t misses;
+
+    /** Reads passed straight through, random or too large to buffer */
+    uint32_t bypasses;
+
+    /** Bytes read ahead from the device and bytes of those actually used */
+    uint64_t prefetched_bytes;
+    uint64_t used_bytes;
+};
+
+/** Block device wrapper that prefetches ahead of sequential reads
+ *
+ *  Filesystems tend to read sequentially in small chunks, each of which
+ *  costs a command and address on the SPI bus. Once two reads in a row
+ *  are found to be contiguous, the next read fetches a whole window in a
+ *  single device read and later reads are served from RAM. The window
+ *  doubles each time a sequential stream runs off its end, up to the
+ *  buffer size, and halves when prefetched data goes unused. Random reads
+ *  go straight to the underlying device and cost nothing extra.
+ *
+ *  @code
+ *  AT25DF041B flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+ *  ReadAheadBlockDevice cached(&flash, 1024);
+ *  @endcode
+ */
+class ReadAheadBlockDevice: public BlockDevice {
+
+public:
+
+    /** Create a read-ahead layer
+     *
+     *  @param bd           Block device to wrap
+     *  @param buffer_size  Largest read-ahead window in bytes, allocated in init()
+     *  @param min_window   Window used when a sequential stream is first detected
+     */
+    ReadAheadBlockDevice(BlockDevice *bd, bd_size_t buffer_size,
+            bd_size_t min_window = 256);
+
+    /** Lifetime of the block device
+     */
+    virtual ~ReadAheadBlockDevice();
+
+    virtual int init();
+    virtual int deinit();
+    virtual int sync();
+
+    /** Read blocks, from the prefetch buffer when possible
+     *
+     *  @param buffer   Buffer to write blocks to
+     *  @param addr     Address of block to begin reading from
+     *  @param size     Size to read in bytes
+     *  @return         0 on success or a negative error code on failure
+     */
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Program blocks, invalidating any overlapping prefetched data
+     */
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size);
+
+    /** Erase blocks, invalidating any overlapping prefetched data
+     */
+    virtual int erase(bd_addr_t addr, bd_size_t size);
+
+    /** Trim blocks, invalidating any overlapping prefetched data
+     */
+    virtual int trim(bd_addr_t addr, bd_size_t size);
+
+    virtual bd_size_t get_read_size() const;
+    virtual bd_size_t get_program_size() const;
+    virtual bd_size_t get_erase_size() const;
+    virtual bd_size_t get_erase_size(bd_addr_t addr) const;
+    virtual int get_erase_value() const;
+    virtual bd_size_t size() const;
+    virtual const char *get_type() const;
+
+    /**
+     * Gets the read-ahead statistics
+     */
+    const ReadAheadStats &get_stats(void) const {
+        return _stats;
+    }
+
+    /**
+     * Clears the read-ahead statistics
+     */
+    void reset_stats(void);
+
+    /**
+     * Gets the current read-ahead window in bytes
+     */
+    bd_size_t get_window(void) const {
+        return _window;
+    }
+
+protected:
+
+    /**
+     * Drops the buffered data if it overlaps the given range
+     */
+    void invalidate(bd_addr_t addr, bd_size_t size);
+
+    /**
+     * Accounts for buffered data that is about to be discarded
+     */
+    void retire_buffer(void);
+
+    BlockDevice *_bd;
+    uint8_t *_buffer;
+    bd_size_t _buffer_size;
+    bd_size_t _min_window;
+    bd_size_t _window;
+
+    /** Range held in the buffer, _cached_size is 0 when it is empty */
+    bd_addr_t _cached_addr;
+    bd_size_t _cached_size;
+
+    /** Highest offset into the buffer that has been read so far */
+    bd_size_t _cached_used;
+
+    /** Address just past the end of the previous read */
+    bd_addr_t _next_addr;
+
+    ReadAheadStats _stats;
+};
+
+#endif
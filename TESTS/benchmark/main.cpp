@@ -0,0 +1,660 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/** Throughput and latency benchmarks
+ *
+ *  Every scenario reports one machine readable line:
+ *
+ *      {{bench;<scenario>,ops=<n>,bytes=<n>,kib_per_s=<n>,ops_per_s=<n>,p50_us=<n>,p99_us=<n>,bus_milli=<n>}}
+ *
+ *  kib_per_s is payload KiB/s and bus_milli is bytes on the SPI bus per 1000
+ *  payload bytes, 0 unless the driver is built with AT25DF041B_ENABLE_STATS.
+ *  The compressed log scenarios add one {{bench_clog;...}} line with the
+ *  logical and stored sizes, the bus bytes of both ways of writing the
+ *  log and the RAM the CompressedLog object takes, without its index.
+ *  A {{bench_config;...}} line first records the part, clock rate and
+ *  schema version so results from different driver versions line up.
+ *
+ *  The benchmarks erase and program the lower half of the chip, apart
+ *  from the image write, which fills the upper half, and the filesystem
+ *  presets, which format all of it. Image write times include the
+ *  simulated BENCHMARK_PACKET_US reception of every packet.
+ *
+ *  TESTS/host builds the suite against a chip model. That build sets
+ *  BENCHMARK_FILESYSTEMS to 0, as LittleFS and FAT come with Mbed OS and
+ *  are not part of this tree, so filesystem throughput and mount times
+ *  are only measured on target for now.
+ */
+
+/** Standard test headers */
+#include "greentea-client/test_env.h"
+#include "utest/utest.h"
+#include "unity/unity.h"
+
+#include "hal/us_ticker_api.h"
+#include "platform/mbed_wait_api.h"
+
+#include "AT25DF041B.h"
+#include "AT25DFRingLog.h"
+#include "AT25DFImageWriter.h"
+#include "CompressedLog.h"
+#include "PinNames.h"
+
+/** Whether to run the filesystem preset scenarios */
+#ifndef BENCHMARK_FILESYSTEMS
+#define BENCHMARK_FILESYSTEMS       1
+#endif
+
+#if BENCHMARK_FILESYSTEMS
+#include "LittleFileSystem2.h"
+#include "FATFileSystem.h"
+#include "platform/File.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace utest::v1;
+
+/** Bumped whenever a field of the bench line changes meaning */
+#define BENCHMARK_SCHEMA_VERSION    2
+
+/** Fixed so results are comparable between runs */
+#ifndef BENCHMARK_SPI_FREQUENCY
+#define BENCHMARK_SPI_FREQUENCY     8000000
+#endif
+
+/** Image write scenarios, packet size and the time each packet takes to arrive */
+#ifndef BENCHMARK_PACKET_SIZE
+#define BENCHMARK_PACKET_SIZE       244
+#endif
+#ifndef BENCHMARK_PACKET_US
+#define BENCHMARK_PACKET_US         900
+#endif
+
+/** Latency samples kept per scenario, later operations only count towards the totals */
+#define BENCHMARK_MAX_SAMPLES       256
+
+AT25DF041B flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+
+static uint8_t buffer[4096];
+static uint32_t samples[BENCHMARK_MAX_SAMPLES];
+
+/** Accumulates one scenario */
+struct bench_run {
+	const char *name;
+	uint32_t ops;
+	uint64_t bytes;
+	uint64_t total_us;
+	uint64_t bus_bytes;
+	int sample_count;
+};
+
+static uint32_t random_state = 0x2545F491;
+
+/** Small deterministic generator, the same addresses every run */
+static uint32_t next_random(void)
+{
+	random_state = random_state * 1664525 + 1013904223;
+	return random_state >> 8;
+}
+
+static uint64_t bus_bytes(void)
+{
+#if AT25DF041B_ENABLE_STATS
+	const AT25DF041BStats &stats = flash.get_stats();
+	return stats.bytes_out + stats.bytes_in;
+#else
+	return 0;
+#endif
+}
+
+static void bench_start(bench_run *run, const char *name)
+{
+	memset(run, 0, sizeof(*run));
+	run->name = name;
+	run->bus_bytes = bus_bytes();
+}
+
+static void bench_record(bench_run *run, uint32_t elapsed_us, bd_size_t size)
+{
+	if (run->sample_count < BENCHMARK_MAX_SAMPLES) {
+		samples[run->sample_count++] = elapsed_us;
+	}
+	run->ops++;
+	run->bytes += size;
+	run->total_us += elapsed_us;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+	uint32_t left = *(const uint32_t*) a;
+	uint32_t right = *(const uint32_t*) b;
+	return (left > right) - (left < right);
+}
+
+static void bench_report(bench_run *run)
+{
+	uint64_t bus = bus_bytes() - run->bus_bytes;
+	uint64_t total_us = run->total_us ? run->total_us : 1;
+
+	qsort(samples, run->sample_count, sizeof(samples[0]), compare_samples);
+	uint32_t p50 = run->sample_count ? samples[(run->sample_count - 1) / 2] : 0;
+	uint32_t p99 = run->sample_count ? samples[((run->sample_count - 1) * 99) / 100] : 0;
+
+	char line[160];
+	snprintf(line, sizeof(line),
+			"%s,ops=%lu,bytes=%lu,kib_per_s=%lu,ops_per_s=%lu,p50_us=%lu,p99_us=%lu,bus_milli=%lu",
+			run->name, (unsigned long) run->ops, (unsigned long) run->bytes,
+			(unsigned long) ((run->bytes * 1000000) / total_us / 1024),
+			(unsigned long) (((uint64_t) run->ops * 1000000) / total_us),
+			(unsigned long) p50, (unsigned long) p99,
+			(unsigned long) (run->bytes ? (bus * 1000) / run->bytes : 0));
+	greentea_send_kv("bench", line);
+}
+
+/** Fill the benchmark area with data so reads and erases do real work */
+static void prepare_area(bd_addr_t addr, bd_size_t size)
+{
+	for (unsigned i = 0; i < sizeof(buffer); i++) {
+		buffer[i] = (uint8_t) next_random();
+	}
+	TEST_ASSERT_EQUAL(0, flash.erase(addr, size));
+	for (bd_size_t offset = 0; offset < size; offset += sizeof(buffer)) {
+		TEST_ASSERT_EQUAL(0, flash.program(buffer, addr + offset, sizeof(buffer)));
+	}
+}
+
+static bd_size_t stream_sink_bytes;
+
+static int stream_sink(const void *data, bd_size_t size)
+{
+	stream_sink_bytes += size;
+	return 0;
+}
+
+/** Reads of one size, sequential or at random offsets in the first 128kB */
+static void bench_read(const char *name, bd_size_t size, bool sequential, int count)
+{
+	const bd_size_t area = 0x20000;
+	bench_run run;
+	bd_addr_t addr = 0;
+
+	bench_start(&run, name);
+	for (int i = 0; i < count; i++) {
+		if (!sequential) {
+			addr = next_random() % (area - size + 1);
+		} else if (addr + size > area) {
+			addr = 0;
+		}
+
+		uint32_t start = us_ticker_read();
+		if (size > sizeof(buffer)) {
+			// Too big for RAM, one read transaction streamed through a sink
+			stream_sink_bytes = 0;
+			TEST_ASSERT_EQUAL(0, flash.stream(addr, size, stream_sink));
+			TEST_ASSERT_EQUAL(size, stream_sink_bytes);
+		} else {
+			TEST_ASSERT_EQUAL(0, flash.read(buffer, addr, size));
+		}
+		bench_record(&run, us_ticker_read() - start, size);
+
+		addr += size;
+	}
+	bench_report(&run);
+}
+
+void test_config(void)
+{
+	char line[96];
+	snprintf(line, sizeof(line), "schema=%d,part=%s,spi_hz=%d,stats=%d",
+			BENCHMARK_SCHEMA_VERSION, flash.get_type(), flash.get_frequency(),
+			AT25DF041B_ENABLE_STATS);
+	greentea_send_kv("bench_config", line);
+}
+
+void test_reads(void)
+{
+	prepare_area(0, 0x20000);
+
+	bench_read("read_seq_1", 1, true, 256);
+	bench_read("read_seq_16", 16, true, 256);
+	bench_read("read_seq_256", 256, true, 256);
+	bench_read("read_seq_4096", 4096, true, 64);
+	bench_read("read_seq_65536", 65536, true, 8);
+
+	bench_read("read_rand_1", 1, false, 256);
+	bench_read("read_rand_16", 16, false, 256);
+	bench_read("read_rand_256", 256, false, 256);
+	bench_read("read_rand_4096", 4096, false, 64);
+	bench_read("read_rand_65536", 65536, false, 8);
+}
+
+/** Programs of one size into freshly erased flash, start offset within each page */
+static void bench_program(const char *name, bd_size_t size, bd_size_t page_offset, int count)
+{
+	const bd_addr_t area = 0x20000;
+	const bd_size_t area_size = 0x20000;
+	bd_size_t stride = ((size + page_offset + AT25DF041B::page_size - 1)
+			/ AT25DF041B::page_size) * AT25DF041B::page_size;
+	bench_run run;
+
+	TEST_ASSERT_EQUAL(0, flash.erase(area, area_size));
+
+	bench_start(&run, name);
+	for (int i = 0; i < count && (i + 1) * stride <= area_size; i++) {
+		bd_addr_t addr = area + i * stride + page_offset;
+
+		uint32_t start = us_ticker_read();
+		TEST_ASSERT_EQUAL(0, flash.program(buffer, addr, size));
+		bench_record(&run, us_ticker_read() - start, size);
+	}
+	bench_report(&run);
+}
+
+/** fill() against program() of a buffer holding the same pattern */
+static void bench_fill(const char *name, bd_size_t size, int count)
+{
+	const bd_addr_t area = 0x20000;
+	const uint8_t pattern[4] = { 0xDE, 0xAD, 0xBE, 0xEF };
+	bench_run run;
+
+	TEST_ASSERT_EQUAL(0, flash.erase(area, 0x20000));
+
+	bench_start(&run, name);
+	for (int i = 0; i < count && (i + 1) * size <= 0x20000; i++) {
+		uint32_t start = us_ticker_read();
+		TEST_ASSERT_EQUAL(0, flash.fill(area + i * size, size, pattern, sizeof(pattern)));
+		bench_record(&run, us_ticker_read() - start, size);
+	}
+	bench_report(&run);
+}
+
+void test_programs(void)
+{
+	bench_program("program_aligned_16", 16, 0, 128);
+	bench_program("program_aligned_256", 256, 0, 128);
+	bench_program("program_unaligned_256", 256, 100, 128);
+	bench_program("program_aligned_4096", 4096, 0, 16);
+	bench_program("program_unaligned_4096", 4096, 100, 16);
+	bench_fill("fill_4096", 4096, 16);
+}
+
+/** Erases of one block size, each block is dirtied first so the erase is not skipped */
+static void bench_erase(const char *name, bd_size_t size, int count)
+{
+	const bd_addr_t area = 0x20000;
+	bench_run run;
+
+	bench_start(&run, name);
+	for (int i = 0; i < count; i++) {
+		bd_addr_t addr = area + (i * size) % 0x20000;
+		uint64_t dirty_bytes = bus_bytes();
+		for (bd_size_t offset = 0; offset < size; offset += AT25DF041B::sector_size) {
+			TEST_ASSERT_EQUAL(0, flash.program(buffer, addr + offset, 1));
+		}
+		// Only the erase itself counts towards bus traffic
+		run.bus_bytes += bus_bytes() - dirty_bytes;
+
+		uint32_t start = us_ticker_read();
+		TEST_ASSERT_EQUAL(0, flash.erase(addr, size));
+		bench_record(&run, us_ticker_read() - start, size);
+	}
+	bench_report(&run);
+}
+
+void test_erases(void)
+{
+	bench_erase("erase_4k", AT25DF041B::sector_size, 16);
+	bench_erase("erase_32k", 0x8000, 4);
+	bench_erase("erase_64k", 0x10000, 2);
+}
+
+/** 70% random 256B reads, 25% sequential 256B programs, 5% 4kB erases ahead of the writer */
+void test_mixed(void)
+{
+	const bd_addr_t area = 0x20000;
+	const bd_size_t area_size = 0x20000;
+	bd_addr_t write_addr = area;
+	bench_run run;
+
+	TEST_ASSERT_EQUAL(0, flash.erase(area, area_size));
+
+	bench_start(&run, "mixed_70r_25p_5e");
+	for (int i = 0; i < 400; i++) {
+		uint32_t dice = next_random() % 100;
+		uint32_t start = us_ticker_read();
+
+		if (dice < 70) {
+			bd_addr_t addr = next_random() % (0x40000 - 256);
+			TEST_ASSERT_EQUAL(0, flash.read(buffer, addr, 256));
+		} else if (dice < 95) {
+			if (write_addr + 256 > area + area_size) {
+				write_addr = area;
+			}
+			if ((write_addr & (AT25DF041B::sector_size - 1)) == 0) {
+				TEST_ASSERT_EQUAL(0, flash.erase(write_addr, AT25DF041B::sector_size));
+			}
+			TEST_ASSERT_EQUAL(0, flash.program(buffer, write_addr, 256));
+			write_addr += 256;
+		} else {
+			// Recycle the sector furthest from the writer
+			bd_addr_t addr = area + ((write_addr - area + area_size / 2) % area_size);
+			addr &= ~((bd_addr_t) AT25DF041B::sector_size - 1);
+			TEST_ASSERT_EQUAL(0, flash.erase(addr, AT25DF041B::sector_size));
+		}
+
+		bench_record(&run, us_ticker_read() - start, 256);
+	}
+	bench_report(&run);
+}
+
+/** Ring log mount against the linear scan of every sector header it replaces */
+void test_ring_log_mount(void)
+{
+	const bd_size_t area_size = 0x40000;
+	AT25DFRingLog<AT25DF041B> log(&flash, 0, area_size);
+	bench_run run;
+
+	// Go round the ring once so the head is somewhere in the middle
+	TEST_ASSERT_EQUAL(0, log.format());
+	for (bd_size_t written = 0; written < area_size + area_size / 2; written += 256) {
+		TEST_ASSERT_EQUAL(0, log.append(buffer, 256 - AT25DF_RING_LOG_RECORD_HEADER_SIZE));
+	}
+
+	bench_start(&run, "ringlog_mount");
+	for (int i = 0; i < 32; i++) {
+		AT25DFRingLog<AT25DF041B> mounted(&flash, 0, area_size);
+		uint32_t start = us_ticker_read();
+		TEST_ASSERT_EQUAL(0, mounted.mount());
+		bench_record(&run, us_ticker_read() - start, 0);
+		if (i == 0) {
+			greentea_send_kv("ringlog_mount_reads", mounted.get_mount_reads());
+		}
+	}
+	bench_report(&run);
+
+	bench_start(&run, "ringlog_linear_scan");
+	for (int i = 0; i < 32; i++) {
+		uint32_t start = us_ticker_read();
+		for (bd_addr_t addr = 0; addr < area_size; addr += AT25DF041B::sector_size) {
+			TEST_ASSERT_EQUAL(0, flash.read(buffer, addr, AT25DF_RING_LOG_SECTOR_HEADER_SIZE));
+		}
+		bench_record(&run, us_ticker_read() - start, 0);
+	}
+	bench_report(&run);
+}
+
+/** A 256kB image arriving in packets, each one timed from the start of its reception */
+static void bench_image(const char *name, bool pipelined)
+{
+	const bd_addr_t slot = 0x40000;
+	const bd_size_t slot_size = 0x40000;
+	AT25DFImageWriter<AT25DF041B> writer(&flash);
+	bench_run run;
+
+	// Dirty the slot so every erase does real work
+	for (bd_addr_t addr = slot; addr < slot + slot_size; addr += AT25DF041B::sector_size) {
+		TEST_ASSERT_EQUAL(0, flash.program(buffer, addr, 1));
+	}
+	if (pipelined) {
+		TEST_ASSERT_EQUAL(0, writer.begin(slot, slot_size));
+	}
+
+	bench_start(&run, name);
+	for (bd_size_t offset = 0; offset < slot_size; offset += BENCHMARK_PACKET_SIZE) {
+		bd_size_t length = slot_size - offset;
+		if (length > BENCHMARK_PACKET_SIZE) {
+			length = BENCHMARK_PACKET_SIZE;
+		}
+		const uint8_t *packet = &buffer[offset % (sizeof(buffer) - BENCHMARK_PACKET_SIZE)];
+
+		uint32_t start = us_ticker_read();
+		wait_us(BENCHMARK_PACKET_US);
+		if (pipelined) {
+			TEST_ASSERT_EQUAL(0, writer.write(packet, length));
+		} else {
+			// Erase each sector as the packets reach it, then program and wait
+			bd_addr_t addr = slot + offset;
+			bd_addr_t next_sector = (addr + AT25DF041B::sector_size)
+					& ~((bd_addr_t) AT25DF041B::sector_size - 1);
+			if ((addr & (AT25DF041B::sector_size - 1)) == 0) {
+				TEST_ASSERT_EQUAL(0, flash.erase(addr, AT25DF041B::sector_size));
+			}
+			if (addr + length > next_sector) {
+				TEST_ASSERT_EQUAL(0, flash.erase(next_sector, AT25DF041B::sector_size));
+			}
+			TEST_ASSERT_EQUAL(0, flash.program(packet, addr, length));
+		}
+		bench_record(&run, us_ticker_read() - start, length);
+	}
+
+	// Until the last page is on flash the image is not written
+	uint32_t start = us_ticker_read();
+	TEST_ASSERT_EQUAL(0, pipelined ? writer.finish() : flash.sync());
+	run.total_us += us_ticker_read() - start;
+	bench_report(&run);
+}
+
+void test_image_write(void)
+{
+	bench_image("image_blocking", false);
+	bench_image("image_pipelined", true);
+}
+
+/** Logical bytes of telemetry written by the compressed log scenarios */
+#define BENCHMARK_TELEMETRY_SIZE    0x10000
+
+/** Next line of CSV-style telemetry, returns its length */
+static int telemetry_line(char *line, size_t size, int index)
+{
+	return snprintf(line, size, "%d,temp=21.%d,hum=4%d,state=ok\n", 100000 + index,
+			index % 10, (index / 7) % 10);
+}
+
+/** The same telemetry appended to a CompressedLog and programmed as is, then read back */
+void test_compressed_log(void)
+{
+	const bd_addr_t raw_area = 0x20000;
+	CompressedLog log(&flash, 0, 0x20000);
+	char line[48];
+	bench_run run;
+
+	TEST_ASSERT_EQUAL(0, log.format());
+	TEST_ASSERT_EQUAL(0, flash.erase(raw_area, 0x20000));
+
+	bench_start(&run, "clog_write");
+	uint64_t bus_start = run.bus_bytes;
+	for (int i = 0; log.logical_size() < BENCHMARK_TELEMETRY_SIZE; i++) {
+		int length = telemetry_line(line, sizeof(line), i);
+		uint32_t start = us_ticker_read();
+		TEST_ASSERT_EQUAL(0, log.append(line, length));
+		bench_record(&run, us_ticker_read() - start, length);
+	}
+	uint32_t start = us_ticker_read();
+	TEST_ASSERT_EQUAL(0, log.flush());
+	run.total_us += us_ticker_read() - start;
+	uint64_t write_bus = bus_bytes() - bus_start;
+	bench_report(&run);
+
+	bench_start(&run, "raw_log_write");
+	bd_addr_t raw_end = raw_area;
+	for (int i = 0; raw_end - raw_area < log.logical_size(); i++) {
+		int length = telemetry_line(line, sizeof(line), i);
+		uint32_t start = us_ticker_read();
+		TEST_ASSERT_EQUAL(0, flash.program(line, raw_end, length));
+		bench_record(&run, us_ticker_read() - start, length);
+		raw_end += length;
+	}
+	uint64_t raw_write_bus = bus_bytes() - run.bus_bytes;
+	bench_report(&run);
+
+	bench_start(&run, "clog_read_256");
+	for (bd_size_t offset = 0; offset + 256 <= log.logical_size(); offset += 256) {
+		uint32_t start = us_ticker_read();
+		TEST_ASSERT_EQUAL(0, log.read(buffer, offset, 256));
+		bench_record(&run, us_ticker_read() - start, 256);
+	}
+	bench_report(&run);
+
+	bench_start(&run, "raw_log_read_256");
+	for (bd_addr_t addr = raw_area; addr + 256 <= raw_end; addr += 256) {
+		uint32_t start = us_ticker_read();
+		TEST_ASSERT_EQUAL(0, flash.read(buffer, addr, 256));
+		bench_record(&run, us_ticker_read() - start, 256);
+	}
+	bench_report(&run);
+
+	char text[160];
+	snprintf(text, sizeof(text),
+			"logical=%lu,stored=%lu,bus_write=%lu,raw_bus_write=%lu,ram=%lu",
+			(unsigned long) log.logical_size(), (unsigned long) log.physical_size(),
+			(unsigned long) write_bus, (unsigned long) raw_write_bus,
+			(unsigned long) sizeof(log));
+	greentea_send_kv("bench_clog", text);
+}
+
+#if BENCHMARK_FILESYSTEMS
+/** Streams two 16kB files in 256B writes, creates 16 small files, then times remounts */
+static void bench_filesystem(const char *name, mbed::FileSystem *fs)
+{
+	char scenario[40];
+	char path[16];
+	mbed::File file;
+	bench_run run;
+
+	TEST_ASSERT_EQUAL(0, fs->mount(&flash));
+
+	snprintf(scenario, sizeof(scenario), "%s_write", name);
+	bench_start(&run, scenario);
+	for (int i = 0; i < 2; i++) {
+		snprintf(path, sizeof(path), "large%d", i);
+		uint32_t start = us_ticker_read();
+		TEST_ASSERT_EQUAL(0, file.open(fs, path, O_WRONLY | O_CREAT | O_TRUNC));
+		for (bd_size_t offset = 0; offset < 0x4000; offset += 256) {
+			TEST_ASSERT_EQUAL(256, file.write(&buffer[offset % sizeof(buffer)], 256));
+		}
+		TEST_ASSERT_EQUAL(0, file.close());
+		bench_record(&run, us_ticker_read() - start, 0x4000);
+	}
+	bench_report(&run);
+
+	snprintf(scenario, sizeof(scenario), "%s_small", name);
+	bench_start(&run, scenario);
+	for (int i = 0; i < 16; i++) {
+		snprintf(path, sizeof(path), "small%02d", i);
+		uint32_t start = us_ticker_read();
+		TEST_ASSERT_EQUAL(0, file.open(fs, path, O_WRONLY | O_CREAT | O_TRUNC));
+		TEST_ASSERT_EQUAL(128, file.write(buffer, 128));
+		TEST_ASSERT_EQUAL(0, file.close());
+		bench_record(&run, us_ticker_read() - start, 128);
+	}
+	bench_report(&run);
+
+	snprintf(scenario, sizeof(scenario), "%s_mount", name);
+	bench_start(&run, scenario);
+	for (int i = 0; i < 8; i++) {
+		TEST_ASSERT_EQUAL(0, fs->unmount());
+		uint32_t start = us_ticker_read();
+		TEST_ASSERT_EQUAL(0, fs->mount(&flash));
+		bench_record(&run, us_ticker_read() - start, 0);
+	}
+	bench_report(&run);
+
+	TEST_ASSERT_EQUAL(0, fs->unmount());
+}
+
+static void bench_littlefs(const char *name, bd_size_t erase_size)
+{
+	AT25DF041BFilesystemPreset preset;
+	TEST_ASSERT_EQUAL(0, flash.get_littlefs_preset(erase_size, &preset));
+	TEST_ASSERT_EQUAL(0, mbed::LittleFileSystem2::format(&flash, preset.block_size,
+			preset.block_cycles, preset.cache_size, preset.lookahead_size));
+
+	mbed::LittleFileSystem2 fs(NULL, NULL, preset.block_size, preset.block_cycles,
+			preset.cache_size, preset.lookahead_size);
+	bench_filesystem(name, &fs);
+}
+
+static void bench_fat(const char *name, bd_size_t erase_size)
+{
+	AT25DF041BFilesystemPreset preset;
+	TEST_ASSERT_EQUAL(0, flash.get_fat_preset(erase_size, &preset));
+	TEST_ASSERT_EQUAL(0, mbed::FATFileSystem::format(&flash, preset.block_size));
+
+	mbed::FATFileSystem fs(NULL);
+	bench_filesystem(name, &fs);
+}
+
+/** Write throughput and mount time of the filesystem presets for each erase size
+ *
+ *  FAT needs at least 128 sectors, so it formats the whole chip like LittleFS
+ *  does and 64kB clusters would leave too few of them.
+ */
+void test_filesystem_presets(void)
+{
+	bench_littlefs("fs_littlefs_4k", AT25DF041B::sector_size);
+	bench_littlefs("fs_littlefs_32k", AT25DF041B_BLOCK_32KB_SIZE);
+	bench_littlefs("fs_littlefs_64k", AT25DF041B_BLOCK_64KB_SIZE);
+	bench_fat("fs_fat_4k", AT25DF041B::sector_size);
+	bench_fat("fs_fat_32k", AT25DF041B_BLOCK_32KB_SIZE);
+}
+#endif
+
+utest::v1::status_t test_setup(const Case *const source, const size_t index_of_case)
+{
+	TEST_ASSERT_EQUAL(0, flash.init());
+	flash.set_frequency(BENCHMARK_SPI_FREQUENCY);
+	flash.reset_stats();
+	return greentea_case_setup_handler(source, index_of_case);
+}
+
+// Custom setup handler required for proper Greentea support
+status_t greentea_setup(const size_t number_of_cases) {
+    GREENTEA_SETUP(600, "default_auto");
+
+    // Call the default reporting function
+    return greentea_test_setup_handler(number_of_cases);
+}
+
+// Specify all your test cases here
+Case cases[] = {
+	Case("Benchmark Configuration", test_setup, test_config),
+	Case("Read Throughput", test_setup, test_reads),
+	Case("Program Throughput", test_setup, test_programs),
+	Case("Erase Throughput", test_setup, test_erases),
+	Case("Mixed Workload", test_setup, test_mixed),
+	Case("Ring Log Mount", test_setup, test_ring_log_mount),
+	Case("Image Write", test_setup, test_image_write),
+	Case("Compressed Log", test_setup, test_compressed_log),
+#if BENCHMARK_FILESYSTEMS
+	Case("Filesystem Presets", test_setup, test_filesystem_presets),
+#endif
+};
+
+// Declare your test specification with a custom setup handler
+Specification specification(greentea_setup, cases);
+
+int main(void)
+{
+  Harness::run(specification);
+  return 0;
+}
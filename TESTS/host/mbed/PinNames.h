@@ -0,0 +1,15 @@
+/**
+ * Host stand-in for the target pin map, the model has a single SPI bus
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HOST_PIN_NAMES_H_
+#define _HOST_PIN_NAMES_H_
+
+#define SPI_MOSI    0
+#define SPI_MISO    1
+#define SPI_SCLK    2
+#define SPI_CS      3
+
+#endif
@@ -0,0 +1,51 @@
+/**
+ * Host stand-in for mbed::DigitalOut, drives the model's chip select
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HOST_DIGITAL_OUT_H_
+#define _HOST_DIGITAL_OUT_H_
+
+#include "platform/platform.h"
+#include "AT25DFModel.h"
+
+namespace mbed {
+
+class DigitalOut {
+
+public:
+
+	DigitalOut(PinName pin, int value = 0) :
+			_value(value) {
+	}
+
+	void write(int value) {
+		// Chip select is active low
+		if (value != _value) {
+			model_select(value == 0);
+		}
+		_value = value;
+	}
+
+	int read(void) {
+		return _value;
+	}
+
+	DigitalOut &operator=(int value) {
+		write(value);
+		return *this;
+	}
+
+	operator int() {
+		return _value;
+	}
+
+private:
+
+	int _value;
+};
+
+}
+
+#endif
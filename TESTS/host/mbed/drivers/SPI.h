@@ -0,0 +1,65 @@
+/**
+ * Host stand-in for mbed::SPI, clocks every byte through the chip model
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HOST_SPI_H_
+#define _HOST_SPI_H_
+
+#include "platform/platform.h"
+#include "AT25DFModel.h"
+
+namespace mbed {
+
+class SPI {
+
+public:
+
+	SPI(PinName mosi, PinName miso, PinName sclk, PinName ssel = NC) :
+			_fill(0xFF) {
+	}
+
+	void format(int bits, int mode = 0) {
+	}
+
+	void frequency(int hz) {
+		model_set_frequency(hz);
+	}
+
+	void set_default_write_value(char data) {
+		_fill = data;
+	}
+
+	void lock(void) {
+	}
+
+	void unlock(void) {
+	}
+
+	int write(int value) {
+		model_call();
+		return model_transfer((uint8_t) value);
+	}
+
+	/** Clocks max(tx_length, rx_length) bytes, padding tx with the default write value */
+	int write(const char *tx, int tx_length, char *rx, int rx_length) {
+		model_call();
+		int length = (tx_length > rx_length) ? tx_length : rx_length;
+		for (int i = 0; i < length; i++) {
+			uint8_t in = model_transfer((i < tx_length) ? (uint8_t) tx[i] : (uint8_t) _fill);
+			if (i < rx_length) {
+				rx[i] = (char) in;
+			}
+		}
+		return length;
+	}
+
+private:
+
+	char _fill;
+};
+
+}
+
+#endif
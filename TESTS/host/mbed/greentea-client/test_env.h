@@ -0,0 +1,27 @@
+/**
+ * Host stand-in for greentea-client, key-value pairs go to stdout
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HOST_TEST_ENV_H_
+#define _HOST_TEST_ENV_H_
+
+#include <stdio.h>
+
+#define GREENTEA_SETUP(timeout, host_test) \
+	printf("{{__timeout;%d}}\r\n{{__host_test_name;%s}}\r\n", (int) (timeout), host_test)
+
+inline void greentea_send_kv(const char *key, const char *value) {
+	printf("{{%s;%s}}\r\n", key, value);
+}
+
+inline void greentea_send_kv(const char *key, const int value) {
+	printf("{{%s;%d}}\r\n", key, value);
+}
+
+inline void greentea_send_kv(const char *key, const char *value, const int result) {
+	printf("{{%s;%s;%d}}\r\n", key, value, result);
+}
+
+#endif
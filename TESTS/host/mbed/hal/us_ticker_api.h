@@ -0,0 +1,16 @@
+/**
+ * Host stand-in for us_ticker_api.h, reads the model's clock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HOST_US_TICKER_API_H_
+#define _HOST_US_TICKER_API_H_
+
+#include "AT25DFModel.h"
+
+inline uint32_t us_ticker_read(void) {
+	return (uint32_t) model_now_us();
+}
+
+#endif
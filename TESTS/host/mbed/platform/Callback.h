@@ -0,0 +1,54 @@
+/**
+ * Host stand-in for mbed::Callback, backed by std::function
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HOST_CALLBACK_H_
+#define _HOST_CALLBACK_H_
+
+#include <functional>
+
+namespace mbed {
+
+template <typename F>
+class Callback;
+
+template <typename R, typename... Args>
+class Callback<R(Args...)> {
+
+public:
+
+	Callback() {
+	}
+
+	template <typename F>
+	Callback(F function) :
+			_function(function) {
+	}
+
+	template <typename T, typename M>
+	Callback(T *object, M method) :
+			_function([object, method](Args... args) { return (object->*method)(args...); }) {
+	}
+
+	R call(Args... args) const {
+		return _function(args...);
+	}
+
+	R operator()(Args... args) const {
+		return _function(args...);
+	}
+
+	explicit operator bool() const {
+		return (bool) _function;
+	}
+
+private:
+
+	std::function<R(Args...)> _function;
+};
+
+}
+
+#endif
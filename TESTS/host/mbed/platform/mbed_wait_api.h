@@ -0,0 +1,20 @@
+/**
+ * Host stand-in for mbed_wait_api.h, waits advance the model's clock
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HOST_MBED_WAIT_API_H_
+#define _HOST_MBED_WAIT_API_H_
+
+#include "AT25DFModel.h"
+
+inline void wait_us(int us) {
+	model_advance_us(us);
+}
+
+inline void wait_ns(unsigned int ns) {
+	model_advance_us((ns + 999) / 1000);
+}
+
+#endif
@@ -0,0 +1,18 @@
+/**
+ * Host stand-in for the parts of the Mbed OS platform layer the driver uses
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HOST_PLATFORM_H_
+#define _HOST_PLATFORM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef int PinName;
+#define NC (-1)
+
+#endif
@@ -0,0 +1,72 @@
+/**
+ * Host stand-in for the Unity assertions the tests use
+ *
+ * A failed assertion reports its location and throws, the utest stand-in
+ * catches it and moves on to the next case.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HOST_UNITY_H_
+#define _HOST_UNITY_H_
+
+#include <stdio.h>
+#include <string.h>
+
+struct UnityFailure {
+};
+
+#define UNITY_FAIL_AT(message) \
+	do { \
+		printf("%s:%d:FAIL: %s\r\n", __FILE__, __LINE__, message); \
+		throw UnityFailure(); \
+	} while (0)
+
+#define TEST_ASSERT_MESSAGE(condition, message) \
+	do { \
+		if (!(condition)) { \
+			UNITY_FAIL_AT(message); \
+		} \
+	} while (0)
+
+#define TEST_ASSERT_EQUAL_MESSAGE(expected, actual, message) \
+	do { \
+		long long _expected = (long long) (expected); \
+		long long _actual = (long long) (actual); \
+		if (_expected != _actual) { \
+			printf("Expected %lld Was %lld\r\n", _expected, _actual); \
+			UNITY_FAIL_AT(message); \
+		} \
+	} while (0)
+
+#define TEST_ASSERT(condition)                  TEST_ASSERT_MESSAGE(condition, #condition)
+#define TEST_ASSERT_TRUE(condition)             TEST_ASSERT_MESSAGE(condition, #condition)
+#define TEST_ASSERT_FALSE(condition)            TEST_ASSERT_MESSAGE(!(condition), #condition)
+#define TEST_ASSERT_NULL(pointer)               TEST_ASSERT_MESSAGE((pointer) == NULL, #pointer)
+#define TEST_ASSERT_NOT_NULL(pointer)           TEST_ASSERT_MESSAGE((pointer) != NULL, #pointer)
+#define TEST_ASSERT_EQUAL(expected, actual)     TEST_ASSERT_EQUAL_MESSAGE(expected, actual, #actual)
+#define TEST_ASSERT_EQUAL_INT(expected, actual) TEST_ASSERT_EQUAL(expected, actual)
+#define TEST_ASSERT_EQUAL_UINT32(expected, actual) TEST_ASSERT_EQUAL(expected, actual)
+#define TEST_ASSERT_EQUAL_HEX8(expected, actual)   TEST_ASSERT_EQUAL(expected, actual)
+#define TEST_ASSERT_EQUAL_HEX32(expected, actual)  TEST_ASSERT_EQUAL(expected, actual)
+#define TEST_ASSERT_EQUAL_HEX64(expected, actual)  TEST_ASSERT_EQUAL(expected, actual)
+#define TEST_ASSERT_NOT_EQUAL(expected, actual) TEST_ASSERT_MESSAGE((expected) != (actual), #actual)
+#define TEST_ASSERT_GREATER_THAN(threshold, actual)     TEST_ASSERT_MESSAGE((actual) > (threshold), #actual)
+#define TEST_ASSERT_GREATER_OR_EQUAL(threshold, actual) TEST_ASSERT_MESSAGE((actual) >= (threshold), #actual)
+#define TEST_ASSERT_LESS_THAN(threshold, actual)        TEST_ASSERT_MESSAGE((actual) < (threshold), #actual)
+#define TEST_ASSERT_LESS_OR_EQUAL(threshold, actual)    TEST_ASSERT_MESSAGE((actual) <= (threshold), #actual)
+#define TEST_ASSERT_EQUAL_MEMORY(expected, actual, length) \
+	TEST_ASSERT_MESSAGE(memcmp(expected, actual, length) == 0, #actual)
+#define TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, actual, count) \
+	TEST_ASSERT_EQUAL_MEMORY(expected, actual, count)
+#define TEST_ASSERT_EQUAL_STRING(expected, actual) \
+	TEST_ASSERT_MESSAGE(strcmp(expected, actual) == 0, #actual)
+#define TEST_FAIL_MESSAGE(message)              UNITY_FAIL_AT(message)
+
+#define TEST_IGNORE_MESSAGE(message) \
+	do { \
+		printf("%s:%d:IGNORE: %s\r\n", __FILE__, __LINE__, message); \
+		return; \
+	} while (0)
+
+#endif
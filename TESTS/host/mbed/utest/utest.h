@@ -0,0 +1,113 @@
+/**
+ * Host stand-in for utest, runs the cases in order against the chip model
+ *
+ * The model starts out as a blank AT25DF041B. Results are reported with
+ * the same summary key-value pairs Greentea prints on target.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _HOST_UTEST_H_
+#define _HOST_UTEST_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "unity/unity.h"
+#include "AT25DFModel.h"
+
+namespace utest {
+namespace v1 {
+
+enum status_t {
+	STATUS_CONTINUE = 0,
+	STATUS_ABORT = -1,
+};
+
+class Case;
+
+typedef status_t (*test_setup_handler_t)(const size_t number_of_cases);
+typedef status_t (*case_setup_handler_t)(const Case *const source, const size_t index_of_case);
+typedef void (*case_handler_t)(void);
+
+class Case {
+
+public:
+
+	Case(const char *description, case_handler_t handler) :
+			description(description), setup(NULL), handler(handler) {
+	}
+
+	Case(const char *description, case_setup_handler_t setup, case_handler_t handler) :
+			description(description), setup(setup), handler(handler) {
+	}
+
+	const char *description;
+	case_setup_handler_t setup;
+	case_handler_t handler;
+};
+
+class Specification {
+
+public:
+
+	template <size_t N>
+	Specification(test_setup_handler_t setup, Case (&cases)[N]) :
+			setup(setup), cases(cases), count(N) {
+	}
+
+	test_setup_handler_t setup;
+	Case *cases;
+	size_t count;
+};
+
+inline status_t greentea_test_setup_handler(const size_t number_of_cases) {
+	printf("{{__testcase_count;%u}}\r\n", (unsigned int) number_of_cases);
+	return STATUS_CONTINUE;
+}
+
+inline status_t greentea_case_setup_handler(const Case *const source, const size_t index_of_case) {
+	return STATUS_CONTINUE;
+}
+
+class Harness {
+
+public:
+
+	/** Runs every case, returns the number that failed */
+	static int run(Specification &specification) {
+		model_reset(512 * 1024, 0x44, 0x02);
+
+		if (specification.setup(specification.count) != STATUS_CONTINUE) {
+			return -1;
+		}
+
+		int failed = 0;
+		for (size_t i = 0; i < specification.count; i++) {
+			const Case &test_case = specification.cases[i];
+			bool passed = true;
+
+			printf("{{__testcase_start;%s}}\r\n", test_case.description);
+			try {
+				if (test_case.setup) {
+					test_case.setup(&test_case, i);
+				}
+				test_case.handler();
+			} catch (const UnityFailure &) {
+				passed = false;
+				failed++;
+			}
+			printf("{{__testcase_finish;%s;%d;%d}}\r\n", test_case.description,
+					passed ? 1 : 0, passed ? 0 : 1);
+		}
+
+		printf("{{__testcase_summary;%d;%d}}\r\n", (int) specification.count - failed, failed);
+		printf("{{end;%s}}\r\n", failed ? "failure" : "success");
+		return failed;
+	}
+};
+
+}
+}
+
+#endif
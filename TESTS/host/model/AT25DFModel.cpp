@@ -0,0 +1,411 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "AT25DFModel.h"
+
+#include <string.h>
+
+/** Longest command kept, opcode, address and a full page of data */
+#define MODEL_COMMAND_SIZE      (4 + 256)
+
+/** Busy times in nanoseconds */
+#define MODEL_PROGRAM_NS        1000000ULL
+#define MODEL_ERASE_256B_NS     8000000ULL
+#define MODEL_ERASE_4KB_NS      45000000ULL
+#define MODEL_ERASE_32KB_NS     200000000ULL
+#define MODEL_ERASE_64KB_NS     350000000ULL
+#define MODEL_CHIP_ERASE_NS     3000000000ULL
+
+/** Fastest clock Read Array (03h) supports */
+#define MODEL_READ_ARRAY_MAX_HZ 50000000
+
+/** Status register bits */
+#define MODEL_STATUS_BUSY       0x01
+#define MODEL_STATUS_WEL        0x02
+#define MODEL_STATUS_SWP        0x0C
+
+uint8_t model_memory[AT25DF_MODEL_MAX_SIZE];
+uint32_t model_size = 512 * 1024;
+uint8_t model_security[128];
+uint16_t model_protected = 0xFFFF;
+AT25DFModelStats model_stats;
+int model_max_reliable_hz = 20000000;
+int model_call_overhead_ns = 0;
+long model_power_cut_after = -1;
+
+static uint8_t device_id[2] = { 0x44, 0x02 };
+static uint64_t now_ns = 0;
+static uint64_t busy_until_ns = 0;
+static int frequency_hz = 1000000;
+static bool selected = false;
+static bool write_enabled = false;
+static bool ultra_deep_power_down = false;
+
+/** Bytes of the current command, data past MODEL_COMMAND_SIZE is dropped */
+static uint8_t command[MODEL_COMMAND_SIZE];
+static uint32_t command_length = 0;
+
+/** Program data beyond the first page wraps, only its last 256 bytes count */
+static uint8_t program_data[256];
+static uint32_t program_length = 0;
+
+void model_reset(uint32_t size, uint8_t device_id_1, uint8_t device_id_2) {
+	model_size = size;
+	device_id[0] = device_id_1;
+	device_id[1] = device_id_2;
+	memset(model_memory, 0xFF, sizeof(model_memory));
+	memset(&model_stats, 0, sizeof(model_stats));
+	model_protected = 0xFFFF;
+	model_power_cut_after = -1;
+	busy_until_ns = now_ns;
+	write_enabled = false;
+	ultra_deep_power_down = false;
+
+	// The factory half of the security register holds a fixed pattern
+	for (int i = 0; i < 64; i++) {
+		model_security[i] = 0xFF;
+		model_security[64 + i] = (uint8_t) ((64 + i) * 7);
+	}
+}
+
+void model_call(void) {
+	model_stats.calls++;
+	now_ns += model_call_overhead_ns;
+}
+
+uint64_t model_now_us(void) {
+	return now_ns / 1000;
+}
+
+void model_advance_us(uint64_t us) {
+	now_ns += us * 1000;
+}
+
+void model_set_frequency(int hz) {
+	frequency_hz = hz;
+}
+
+int model_get_frequency(void) {
+	return frequency_hz;
+}
+
+static bool is_busy(void) {
+	return now_ns < busy_until_ns;
+}
+
+static uint32_t command_address(void) {
+	uint32_t addr = ((uint32_t) command[1] << 16) | ((uint32_t) command[2] << 8) | command[3];
+	return addr % model_size;
+}
+
+static bool is_protected(uint32_t addr) {
+	return (model_protected >> ((addr >> 16) & 15)) & 1;
+}
+
+/** Mask of the 64kB sectors the array has */
+static uint16_t all_sectors(void) {
+	uint32_t sectors = model_size >> 16;
+	return (sectors >= 16) ? 0xFFFF : (uint16_t) ((1UL << sectors) - 1);
+}
+
+static uint8_t read_status(void) {
+	uint16_t protect = model_protected & all_sectors();
+	uint8_t status = 0;
+	if (protect == all_sectors()) {
+		status |= MODEL_STATUS_SWP;
+	} else if (protect) {
+		status |= 0x04;
+	}
+	if (is_busy()) {
+		status |= MODEL_STATUS_BUSY;
+	}
+	if (write_enabled) {
+		status |= MODEL_STATUS_WEL;
+	}
+	return status;
+}
+
+static void erase(uint32_t addr, uint32_t size, uint64_t busy_ns) {
+	if (!write_enabled || is_busy() || command_length < 4) {
+		return;
+	}
+	write_enabled = false;
+
+	addr &= ~(size - 1);
+	if (is_protected(addr)) {
+		return;
+	}
+	memset(&model_memory[addr], 0xFF, size);
+	busy_until_ns = now_ns + busy_ns;
+	model_stats.erases++;
+	model_stats.erase_bytes += size;
+}
+
+static void program(void) {
+	if (!write_enabled || is_busy() || command_length < 4 || program_length == 0) {
+		return;
+	}
+	write_enabled = false;
+
+	uint32_t addr = command_address();
+	if (is_protected(addr)) {
+		return;
+	}
+
+	// Bytes past the end of the page wrap around to its start
+	uint32_t page = addr & ~0xFFUL;
+	uint32_t skip = (program_length > 256) ? (program_length - 256) : 0;
+	for (uint32_t i = skip; i < program_length; i++) {
+		model_memory[page + ((addr + i) & 0xFF)] &= program_data[i & 0xFF];
+	}
+	busy_until_ns = now_ns + MODEL_PROGRAM_NS;
+	model_stats.programs++;
+}
+
+static void program_security(void) {
+	if (!write_enabled || is_busy() || command_length < 4) {
+		return;
+	}
+	write_enabled = false;
+
+	uint32_t offset = command_address() & 0x7F;
+	for (uint32_t i = 0; i < program_length && i < 256; i++) {
+		uint32_t byte = (offset + i) & 0x7F;
+		if (byte < 64) {
+			model_security[byte] &= program_data[i];
+		}
+	}
+	busy_until_ns = now_ns + MODEL_PROGRAM_NS;
+}
+
+/** Whether a power cut stops the command, tearing it first if it is a program */
+static bool power_cut(uint8_t opcode) {
+	if (model_power_cut_after == 0) {
+		return true;
+	}
+	if (model_power_cut_after < 0) {
+		return false;
+	}
+
+	switch (opcode) {
+	case 0x02:
+	case 0x20:
+	case 0x52:
+	case 0x81:
+	case 0xD8:
+		break;
+	default:
+		return false;
+	}
+
+	if (--model_power_cut_after) {
+		return false;
+	}
+	if (opcode == 0x02 && program_length > 1) {
+		program_length /= 2;
+		return false;
+	}
+	return true;
+}
+
+void model_select(bool asserted) {
+	if (asserted) {
+		if (!selected) {
+			selected = true;
+			command_length = 0;
+			program_length = 0;
+			model_stats.selects++;
+			now_ns += 100;
+
+			// Any chip select pulse wakes the chip from ultra deep power down
+			ultra_deep_power_down = false;
+		}
+		return;
+	}
+
+	if (!selected) {
+		return;
+	}
+	selected = false;
+	if (command_length == 0) {
+		return;
+	}
+
+	uint8_t opcode = command[0];
+	if (power_cut(opcode)) {
+		return;
+	}
+
+	switch (opcode) {
+	case 0x06:
+		if (!is_busy()) {
+			write_enabled = true;
+		}
+		break;
+
+	case 0x04:
+		if (!is_busy()) {
+			write_enabled = false;
+		}
+		break;
+
+	case 0x01:
+		// Global protect and unprotect through the SWP bits
+		if (write_enabled && !is_busy() && command_length >= 2) {
+			if ((command[1] & 0x3C) == 0) {
+				model_protected = 0;
+			} else if ((command[1] & 0x3C) == 0x3C) {
+				model_protected = 0xFFFF;
+			}
+			write_enabled = false;
+		}
+		break;
+
+	case 0x02:
+		program();
+		break;
+
+	case 0x81:
+		erase(command_address(), 256, MODEL_ERASE_256B_NS);
+		break;
+
+	case 0x20:
+		erase(command_address(), 4096, MODEL_ERASE_4KB_NS);
+		break;
+
+	case 0x52:
+		erase(command_address(), 32768, MODEL_ERASE_32KB_NS);
+		break;
+
+	case 0xD8:
+		erase(command_address(), 65536, MODEL_ERASE_64KB_NS);
+		break;
+
+	case 0x60:
+	case 0xC7:
+		if (write_enabled && !is_busy()) {
+			write_enabled = false;
+			if ((model_protected & all_sectors()) == 0) {
+				memset(model_memory, 0xFF, model_size);
+				busy_until_ns = now_ns + MODEL_CHIP_ERASE_NS;
+				model_stats.erases++;
+				model_stats.erase_bytes += model_size;
+			}
+		}
+		break;
+
+	case 0x36:
+	case 0x39:
+		if (write_enabled && !is_busy() && command_length >= 4) {
+			uint16_t sector = 1 << ((command_address() >> 16) & 15);
+			if (opcode == 0x36) {
+				model_protected |= sector;
+			} else {
+				model_protected &= ~sector;
+			}
+			write_enabled = false;
+		}
+		break;
+
+	case 0x9B:
+		program_security();
+		break;
+
+	case 0x79:
+		ultra_deep_power_down = true;
+		break;
+
+	default:
+		break;
+	}
+}
+
+uint8_t model_transfer(uint8_t out) {
+	model_stats.bytes++;
+	now_ns += 8000000000ULL / (uint64_t) frequency_hz;
+
+	if (!selected || ultra_deep_power_down) {
+		return 0xFF;
+	}
+
+	uint32_t n = ++command_length;
+	if (n <= MODEL_COMMAND_SIZE) {
+		command[n - 1] = out;
+	}
+	uint8_t opcode = command[0];
+	if ((opcode == 0x02 || opcode == 0x9B) && n > 4) {
+		program_data[program_length++ & 0xFF] = out;
+	}
+
+	uint8_t in = 0xFF;
+	switch (opcode) {
+	case 0x9F:
+		if (n == 2) {
+			in = 0x1F;
+		} else if (n == 3 || n == 4) {
+			in = device_id[n - 3];
+		} else {
+			in = 0x00;
+		}
+		break;
+
+	case 0x05:
+		if (n >= 2) {
+			in = read_status();
+		}
+		break;
+
+	case 0x03:
+		if (n >= 5) {
+			in = model_memory[(command_address() + (n - 5)) % model_size];
+		}
+		break;
+
+	case 0x0B:
+		if (n >= 6) {
+			in = model_memory[(command_address() + (n - 6)) % model_size];
+		}
+		break;
+
+	case 0x3C:
+		if (n >= 5) {
+			in = is_protected(command_address()) ? 0xFF : 0x00;
+		}
+		break;
+
+	case 0x77:
+		if (n >= 7) {
+			in = model_security[(command_address() + (n - 7)) & 0x7F];
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	// Past their limits the chip's outputs can no longer be sampled reliably
+	if (frequency_hz > model_max_reliable_hz && n > 1) {
+		in ^= 0x10;
+	}
+	if (opcode == 0x03 && frequency_hz > MODEL_READ_ARRAY_MAX_HZ && n >= 5) {
+		in ^= 0x01;
+	}
+	return in;
+}
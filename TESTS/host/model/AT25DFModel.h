@@ -0,0 +1,107 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _AT25DF_MODEL_H_
+#define _AT25DF_MODEL_H_
+
+#include <stdint.h>
+
+/** Behavioural model of an AT25DF/AT25SF chip for host builds
+ *
+ *  The host stand-ins for mbed::SPI, DigitalOut, wait_us and us_ticker feed
+ *  every bus transfer through this model. It decodes the commands the
+ *  driver uses, keeps the array, the write enable latch, sector protection
+ *  and the security register, and runs a virtual clock so that benchmarks
+ *  and traces measure modelled time rather than host time:
+ *
+ *  - each byte costs 8 clock periods at the current SPI frequency
+ *  - a page program keeps the chip busy for 1ms, 256B/4kB/32kB/64kB erases
+ *    for 8/45/200/350ms and a chip erase for 3s
+ *  - commands sent while busy are ignored, as the chip does
+ *
+ *  Clocks above model_max_reliable_hz corrupt data, and Read Array (03h)
+ *  above 50MHz, so clock tuning has a limit to find.
+ */
+
+/** Bus and array activity since the last model_reset() */
+struct AT25DFModelStats {
+	uint64_t calls;         // Driver calls into the SPI stand-in
+	uint64_t bytes;         // Bytes clocked
+	uint64_t selects;       // Chip select assertions
+	uint64_t programs;      // Page programs that reached the array
+	uint64_t erases;        // Erases that reached the array
+	uint64_t erase_bytes;   // Bytes those erases covered
+};
+
+/** Largest array the model holds, the AT25DF161 */
+#define AT25DF_MODEL_MAX_SIZE       (2 * 1024 * 1024)
+
+/** Array contents, only the first model_size bytes are used */
+extern uint8_t model_memory[AT25DF_MODEL_MAX_SIZE];
+extern uint32_t model_size;
+
+/** Security register, 64 user programmable bytes then 64 factory bytes */
+extern uint8_t model_security[128];
+
+/** Protected 64kB sectors, one bit each */
+extern uint16_t model_protected;
+
+extern AT25DFModelStats model_stats;
+
+/** Fastest clock at which transfers are still reliable */
+extern int model_max_reliable_hz;
+
+/** Time each driver call into the SPI stand-in costs, in nanoseconds */
+extern int model_call_overhead_ns;
+
+/** Power cut injection
+ *  When positive, the model counts down program and erase commands. The
+ *  one that reaches zero is torn, a program writes only half of its data
+ *  and an erase never starts, and every later command is dropped as if
+ *  the chip had lost power. Negative disables it.
+ */
+extern long model_power_cut_after;
+
+/** Reset the model to a blank, fully protected chip
+ *
+ *  @param size             Array size in bytes
+ *  @param device_id_1      First device ID byte returned by 9Fh
+ *  @param device_id_2      Second device ID byte returned by 9Fh
+ */
+void model_reset(uint32_t size, uint8_t device_id_1, uint8_t device_id_2);
+
+/** Assert or release chip select, commands take effect on release */
+void model_select(bool asserted);
+
+/** Clock one byte out to the chip and return the byte it clocked back */
+uint8_t model_transfer(uint8_t out);
+
+/** Account for one driver call into the bus */
+void model_call(void);
+
+/** Virtual clock */
+uint64_t model_now_us(void);
+void model_advance_us(uint64_t us);
+
+/** Clock rate of the following transfers */
+void model_set_frequency(int hz);
+int model_get_frequency(void);
+
+#endif
@@ -0,0 +1,248 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/** Power cut tests, host only
+ *
+ *  Each case runs a workload once for every program and erase it issues,
+ *  with the chip model losing power at that point, then checks that a
+ *  fresh driver recovers a consistent state from what was left on flash.
+ */
+
+/** Standard test headers */
+#include "greentea-client/test_env.h"
+#include "utest/utest.h"
+#include "unity/unity.h"
+
+#include "AT25DF041B.h"
+#include "AT25DFJournal.h"
+#include "AT25DFModel.h"
+#include "PinNames.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+using namespace utest::v1;
+
+static uint8_t snapshot[AT25DF_MODEL_MAX_SIZE];
+static uint8_t old_data[1024];
+static uint8_t new_data[1024];
+static uint8_t read_back[4096];
+
+/** Journal and the sector its transactions rewrite */
+static const bd_addr_t journal_addr = 0x70000;
+static const bd_size_t journal_size = 0x4000;
+static const bd_addr_t target_addr = 0x10000;
+
+static void journal_transaction(AT25DFJournal<AT25DF041B> *journal, const uint8_t *data)
+{
+	journal->begin();
+	journal->erase(target_addr, AT25DF041B::sector_size);
+	journal->program(data, target_addr, sizeof(old_data));
+	journal->program(data, target_addr + 2048, sizeof(old_data));
+	journal->commit();
+}
+
+/** 0 if the target holds the old data, 1 if the new data, -1 if a mix */
+static int journal_target_state(AT25DF041B *flash)
+{
+	TEST_ASSERT_EQUAL(0, flash->read(read_back, target_addr, sizeof(read_back)));
+	if (!memcmp(read_back, old_data, sizeof(old_data))
+			&& !memcmp(&read_back[2048], old_data, sizeof(old_data))) {
+		return 0;
+	}
+	if (!memcmp(read_back, new_data, sizeof(new_data))
+			&& !memcmp(&read_back[2048], new_data, sizeof(new_data))) {
+		return 1;
+	}
+	return -1;
+}
+
+/** Three transactions, the last one writing the new data, cut at every write */
+void test_journal_power_cut(void)
+{
+	int outcomes[2] = { 0, 0 };
+	int replayed = 0;
+
+	for (size_t i = 0; i < sizeof(old_data); i++) {
+		old_data[i] = rand();
+		new_data[i] = rand();
+	}
+
+	{
+		AT25DF041B flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+		TEST_ASSERT_EQUAL(0, flash.init());
+		AT25DFJournal<AT25DF041B> journal(&flash, journal_addr, journal_size);
+		TEST_ASSERT_EQUAL(0, journal.mount());
+		journal_transaction(&journal, old_data);
+		TEST_ASSERT_EQUAL(0, journal_target_state(&flash));
+	}
+	memcpy(snapshot, model_memory, model_size);
+
+	for (long cut = 1; ; cut++) {
+		memcpy(model_memory, snapshot, model_size);
+		model_power_cut_after = cut;
+		{
+			AT25DF041B flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+			TEST_ASSERT_EQUAL(0, flash.init());
+			AT25DFJournal<AT25DF041B> journal(&flash, journal_addr, journal_size);
+			TEST_ASSERT_EQUAL(0, journal.mount());
+			journal_transaction(&journal, new_data);
+			journal_transaction(&journal, old_data);
+			journal_transaction(&journal, new_data);
+		}
+		bool finished = (model_power_cut_after != 0);
+		model_power_cut_after = -1;
+
+		// Whatever was left, a mount ends in the old or the new state
+		AT25DF041B flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+		TEST_ASSERT_EQUAL(0, flash.init());
+		AT25DFJournal<AT25DF041B> journal(&flash, journal_addr, journal_size);
+		TEST_ASSERT_EQUAL(0, journal.mount());
+		replayed += journal.get_replayed();
+		int state = journal_target_state(&flash);
+		TEST_ASSERT_NOT_EQUAL(-1, state);
+		outcomes[state]++;
+
+		// And the journal keeps working
+		journal_transaction(&journal, old_data);
+		TEST_ASSERT_EQUAL(0, journal_target_state(&flash));
+
+		if (finished) {
+			printf("cut points=%ld old=%d new=%d replayed=%d\r\n", cut - 1, outcomes[0],
+					outcomes[1], replayed);
+			break;
+		}
+	}
+}
+
+/** Wear table of an AT25DF081A, whose table copies span two sectors */
+static const bd_addr_t wear_region = AT25DF081A::total_size - AT25DF081A::wear_region_size;
+static const bd_addr_t hot_sector = 0x3000;
+static const bd_addr_t cold_sector = 0x8000;
+
+/** Erases a sector and programs a byte, the driver skips erases of sectors it knows are blank */
+static int cycle_sector(AT25DF081A *flash, bd_addr_t addr)
+{
+	const uint8_t data = 0;
+	int res = flash->erase(addr, AT25DF081A::sector_size);
+	if (res == 0) {
+		res = flash->program(&data, addr, sizeof(data));
+	}
+	return res;
+}
+
+static uint32_t erase_count(AT25DF081A *flash, bd_addr_t addr)
+{
+	uint32_t count = 0;
+	TEST_ASSERT_EQUAL(0, flash->get_erase_count(addr, &count));
+	return count;
+}
+
+/** Erases the hot sector until its bitmap overflows, cut at every write of the fold
+ *
+ *  A table copy on this part spans two sectors, so a fold torn while it
+ *  retires the old copy leaves half of that copy erased. The counts must
+ *  come back from whichever copy was complete, never from the torn one.
+ */
+void test_wear_fold_power_cut(void)
+{
+	int outcomes[2] = { 0, 0 };
+
+	model_reset(AT25DF081A::total_size, AT25DF081AGeometry::device_id_1,
+			AT25DF081AGeometry::device_id_2);
+	{
+		AT25DF081A flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+		TEST_ASSERT_EQUAL(0, flash.init());
+		TEST_ASSERT_EQUAL(0, flash.wear_tracking_init(wear_region));
+		for (int i = 0; i < 5; i++) {
+			TEST_ASSERT_EQUAL(0, cycle_sector(&flash, cold_sector));
+		}
+		for (int i = 0; i < AT25DF041B_WEAR_BITMAP_BITS; i++) {
+			TEST_ASSERT_EQUAL(0, cycle_sector(&flash, hot_sector));
+		}
+		TEST_ASSERT_EQUAL(0, flash.sync());
+	}
+	memcpy(snapshot, model_memory, model_size);
+
+	for (long cut = 1; ; cut++) {
+		memcpy(model_memory, snapshot, model_size);
+		model_power_cut_after = cut;
+		{
+			AT25DF081A flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+			TEST_ASSERT_EQUAL(0, flash.init());
+			TEST_ASSERT_EQUAL(0, flash.wear_tracking_init(wear_region));
+			for (int i = 0; i < AT25DF041B_WEAR_FLUSH_THRESHOLD; i++) {
+				cycle_sector(&flash, hot_sector);
+			}
+		}
+		bool finished = (model_power_cut_after != 0);
+		model_power_cut_after = -1;
+
+		// The erases are counted all together by the fold or not at all
+		AT25DF081A flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+		TEST_ASSERT_EQUAL(0, flash.init());
+		TEST_ASSERT_EQUAL(0, flash.wear_tracking_init(wear_region));
+		uint32_t hot = erase_count(&flash, hot_sector);
+		if (hot == AT25DF041B_WEAR_BITMAP_BITS) {
+			outcomes[0]++;
+		} else {
+			TEST_ASSERT_EQUAL(AT25DF041B_WEAR_BITMAP_BITS + AT25DF041B_WEAR_FLUSH_THRESHOLD, hot);
+			outcomes[1]++;
+		}
+		TEST_ASSERT_EQUAL(5, erase_count(&flash, cold_sector));
+		TEST_ASSERT_EQUAL(0, erase_count(&flash, wear_region));
+
+		// And the recovered table keeps counting
+		TEST_ASSERT_EQUAL(0, cycle_sector(&flash, cold_sector));
+		TEST_ASSERT_EQUAL(0, flash.sync());
+		AT25DF081A remounted(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+		TEST_ASSERT_EQUAL(0, remounted.init());
+		TEST_ASSERT_EQUAL(0, remounted.wear_tracking_init(wear_region));
+		TEST_ASSERT_EQUAL(6, erase_count(&remounted, cold_sector));
+		TEST_ASSERT_EQUAL(hot, erase_count(&remounted, hot_sector));
+
+		if (finished) {
+			printf("cut points=%ld old=%d new=%d\r\n", cut - 1, outcomes[0], outcomes[1]);
+			break;
+		}
+	}
+}
+
+// Custom setup handler required for proper Greentea support
+status_t greentea_setup(const size_t number_of_cases) {
+    GREENTEA_SETUP(600, "default_auto");
+
+    // Call the default reporting function
+    return greentea_test_setup_handler(number_of_cases);
+}
+
+// Specify all your test cases here
+Case cases[] = {
+	Case("Journal Power Cut", test_journal_power_cut),
+	Case("Wear Table Fold Power Cut", test_wear_fold_power_cut),
+};
+
+// Declare your test specification with a custom setup handler
+Specification specification(greentea_setup, cases);
+
+int main(void)
+{
+  return Harness::run(specification) ? 1 : 0;
+}
@@ -0,0 +1,103 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "FakeSpidev.h"
+#include "AT25DFModel.h"
+
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+uint8_t fake_spidev_log[FAKE_SPIDEV_LOG_SIZE];
+uint32_t fake_spidev_log_length;
+uint32_t fake_spidev_messages;
+uint32_t fake_spidev_transfers;
+uint32_t fake_spidev_last_message_length;
+bool fake_spidev_selected;
+
+void fake_spidev_reset(void) {
+	fake_spidev_log_length = 0;
+	fake_spidev_messages = 0;
+	fake_spidev_transfers = 0;
+	fake_spidev_last_message_length = 0;
+}
+
+int fake_spidev_ioctl(int fd, unsigned long request, void *arg) {
+	switch (request) {
+	case SPI_IOC_WR_MODE:
+	case SPI_IOC_WR_BITS_PER_WORD:
+		return 0;
+
+	case SPI_IOC_WR_MAX_SPEED_HZ:
+		model_set_frequency(*(uint32_t*) arg);
+		return 0;
+
+	default:
+		break;
+	}
+
+	if (_IOC_TYPE(request) != SPI_IOC_MAGIC || _IOC_NR(request) != 0
+			|| _IOC_DIR(request) != _IOC_WRITE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct spi_ioc_transfer *transfers = (struct spi_ioc_transfer*) arg;
+	int count = _IOC_SIZE(request) / sizeof(struct spi_ioc_transfer);
+
+	int total = 0;
+	fake_spidev_messages++;
+	model_call();
+	for (int i = 0; i < count; i++) {
+		const uint8_t *tx = (const uint8_t*) (uintptr_t) transfers[i].tx_buf;
+		uint8_t *rx = (uint8_t*) (uintptr_t) transfers[i].rx_buf;
+
+		fake_spidev_transfers++;
+		total += transfers[i].len;
+		if (!fake_spidev_selected) {
+			model_select(true);
+			fake_spidev_selected = true;
+		}
+
+		// Without tx_buf the controller clocks out zeros
+		for (uint32_t n = 0; n < transfers[i].len; n++) {
+			uint8_t out = tx ? tx[n] : 0x00;
+			uint8_t in = model_transfer(out);
+			if (rx) {
+				rx[n] = in;
+			}
+			if (fake_spidev_log_length < FAKE_SPIDEV_LOG_SIZE) {
+				fake_spidev_log[fake_spidev_log_length] = out;
+			}
+			fake_spidev_log_length++;
+		}
+
+		// cs_change deselects after a transfer inside the message, and keeps
+		// the chip selected after the last one
+		bool last = (i == count - 1);
+		if (last != (transfers[i].cs_change != 0)) {
+			model_select(false);
+			fake_spidev_selected = false;
+		}
+	}
+
+	fake_spidev_last_message_length = total;
+	return total;
+}
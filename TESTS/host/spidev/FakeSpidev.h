@@ -0,0 +1,53 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _FAKE_SPIDEV_H_
+#define _FAKE_SPIDEV_H_
+
+#include <stdint.h>
+
+/** User-space stand-in for the spidev kernel driver
+ *
+ *  Built into the spidev host test with AT25DF_SPIDEV_IOCTL pointing at
+ *  fake_spidev_ioctl. SPI_IOC_MESSAGE requests are played into the chip
+ *  model byte by byte, with chip select following cs_change the way the
+ *  kernel drives it. Every byte sent is also logged so tests can check
+ *  exactly what went out on the bus.
+ */
+int fake_spidev_ioctl(int fd, unsigned long request, void *arg);
+
+/** Bytes sent since the last fake_spidev_reset(), the log keeps the first ones */
+#define FAKE_SPIDEV_LOG_SIZE    4096
+
+extern uint8_t fake_spidev_log[FAKE_SPIDEV_LOG_SIZE];
+extern uint32_t fake_spidev_log_length;
+
+/** SPI_IOC_MESSAGE requests and transfers received, and the bytes of the last message */
+extern uint32_t fake_spidev_messages;
+extern uint32_t fake_spidev_transfers;
+extern uint32_t fake_spidev_last_message_length;
+
+/** Whether the last message left chip select asserted */
+extern bool fake_spidev_selected;
+
+/** Clear the log and the counters */
+void fake_spidev_reset(void);
+
+#endif
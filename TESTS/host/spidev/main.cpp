@@ -0,0 +1,179 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/** spidev transport tests, host only
+ *
+ *  Built with AT25DF041B_TRANSPORT_SPIDEV and AT25DF_SPIDEV_IOCTL pointing
+ *  at FakeSpidev, which plays every SPI_IOC_MESSAGE into the chip model.
+ */
+
+/** Standard test headers */
+#include "greentea-client/test_env.h"
+#include "utest/utest.h"
+#include "unity/unity.h"
+
+#include "AT25DF041B.h"
+#include "AT25DFModel.h"
+#include "FakeSpidev.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+using namespace utest::v1;
+
+/** Opened for real, the fake takes over every ioctl */
+#define FAKE_SPIDEV_DEVICE  "/dev/null"
+
+static uint8_t data[8192];
+static uint8_t read_back[8192];
+
+void test_round_trip(void)
+{
+	AT25DF041B flash(FAKE_SPIDEV_DEVICE);
+
+	for (size_t i = 0; i < sizeof(data); i++) {
+		data[i] = rand();
+	}
+
+	TEST_ASSERT_EQUAL(0, flash.init());
+	flash.set_frequency(20000000);
+	TEST_ASSERT_EQUAL(0, flash.erase(0, 0x10000));
+
+	// Write Enable, command, address and data go out in one message
+	flash.set_deferred_wait(true);
+	TEST_ASSERT_EQUAL(0, flash.program(data, 0, 256));
+	TEST_ASSERT_EQUAL(1 + 4 + 256, fake_spidev_last_message_length);
+	flash.set_deferred_wait(false);
+
+	TEST_ASSERT_EQUAL(0, flash.program(&data[256], 256, 5000));
+	TEST_ASSERT_EQUAL_MEMORY(data, model_memory, 5256);
+	TEST_ASSERT_EQUAL(0, flash.read(read_back, 0, 5256));
+	TEST_ASSERT_EQUAL_MEMORY(data, read_back, 5256);
+	TEST_ASSERT_EQUAL(0, flash.verify(data, 0, 5256));
+
+	uint32_t crc = 0;
+	TEST_ASSERT_EQUAL(0, flash.crc32(0, 5256, &crc));
+	TEST_ASSERT_EQUAL_HEX32(AT25DF041B::crc32_update(0, data, 5256), crc);
+
+	TEST_ASSERT_EQUAL(0, flash.enter_standby());
+	TEST_ASSERT_EQUAL(0, flash.exit_standby());
+	TEST_ASSERT_EQUAL(0, flash.read(read_back, 100, 16));
+	TEST_ASSERT_EQUAL_MEMORY(&data[100], read_back, 16);
+
+	TEST_ASSERT_EQUAL(0, flash.deinit());
+	TEST_ASSERT_FALSE(fake_spidev_selected);
+}
+
+/** Bytes past tx_length go out as 0xFF, never as leftovers of earlier writes */
+void test_short_transmit(void)
+{
+	AT25DFSpidev bus(FAKE_SPIDEV_DEVICE);
+	const char stale[8] = { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x7F };
+	const char command[2] = { 0x05, 0x00 };
+	const uint8_t expected[6] = { 0x05, 0x00, 0xFF, 0xFF, 0xFF, 0xFF };
+	char rx[6];
+
+	bus.select(true);
+	TEST_ASSERT_EQUAL(8, bus.write(stale, sizeof(stale), NULL, 0));
+	bus.select(false);
+
+	fake_spidev_reset();
+	bus.select(true);
+	TEST_ASSERT_EQUAL(6, bus.write(command, sizeof(command), rx, sizeof(rx)));
+	bus.select(false);
+	TEST_ASSERT_EQUAL(6, fake_spidev_log_length);
+	TEST_ASSERT_EQUAL_MEMORY(expected, fake_spidev_log, sizeof(expected));
+
+	// Padding too long for the copy buffer goes out as zeros
+	static char long_rx[AT25DF_SPIDEV_BUFFER_SIZE + 100];
+	fake_spidev_reset();
+	bus.select(true);
+	TEST_ASSERT_EQUAL(sizeof(long_rx), bus.write(command, sizeof(command), long_rx,
+			sizeof(long_rx)));
+	bus.select(false);
+	TEST_ASSERT_EQUAL(sizeof(long_rx), fake_spidev_log_length);
+	TEST_ASSERT_EQUAL_MEMORY(command, fake_spidev_log, sizeof(command));
+	for (uint32_t i = sizeof(command); i < sizeof(long_rx); i++) {
+		TEST_ASSERT_EQUAL_HEX8(0x00, fake_spidev_log[i]);
+	}
+	TEST_ASSERT_FALSE(fake_spidev_selected);
+	TEST_ASSERT_EQUAL(0, bus.get_errors());
+}
+
+/** rx shorter than tx, as mbed::SPI accepts, takes only the first bytes received */
+void test_short_receive(void)
+{
+	AT25DFSpidev bus(FAKE_SPIDEV_DEVICE);
+	static char tx[AT25DF_SPIDEV_BUFFER_SIZE + 100];
+	char *rx = new char[4];
+
+	// Read Manufacturer and Device ID, only the manufacturer byte is kept
+	memset(tx, 0, sizeof(tx));
+	tx[0] = AT25DF041B_READ_MFG_AND_DEV_ID;
+	fake_spidev_reset();
+	bus.select(true);
+	TEST_ASSERT_EQUAL(4, bus.write(tx, 4, rx, 2));
+	bus.select(false);
+	TEST_ASSERT_EQUAL(4, fake_spidev_log_length);
+	TEST_ASSERT_EQUAL_HEX8(AT25DF041B_MANUFACTURER_ID, rx[1]);
+
+	// The same with tx too large to copy
+	fake_spidev_reset();
+	bus.select(true);
+	TEST_ASSERT_EQUAL(sizeof(tx), bus.write(tx, sizeof(tx), rx, 3));
+	bus.select(false);
+	TEST_ASSERT_EQUAL(sizeof(tx), fake_spidev_log_length);
+	TEST_ASSERT_EQUAL_HEX8(AT25DF041B_MANUFACTURER_ID, rx[1]);
+	TEST_ASSERT_EQUAL_HEX8(AT25DF041B_DEVICE_ID_BYTE_1, rx[2]);
+	TEST_ASSERT_FALSE(fake_spidev_selected);
+
+	delete[] rx;
+	TEST_ASSERT_EQUAL(0, bus.get_errors());
+}
+
+utest::v1::status_t test_setup(const Case *const source, const size_t index_of_case)
+{
+	model_reset(512 * 1024, AT25DF041B_DEVICE_ID_BYTE_1, AT25DF041B_DEVICE_ID_BYTE_2);
+	fake_spidev_reset();
+	return greentea_case_setup_handler(source, index_of_case);
+}
+
+// Custom setup handler required for proper Greentea support
+status_t greentea_setup(const size_t number_of_cases) {
+    GREENTEA_SETUP(60, "default_auto");
+
+    // Call the default reporting function
+    return greentea_test_setup_handler(number_of_cases);
+}
+
+// Specify all your test cases here
+Case cases[] = {
+	Case("Driver Round Trip", test_setup, test_round_trip),
+	Case("Short Transmit", test_setup, test_short_transmit),
+	Case("Short Receive", test_setup, test_short_receive),
+};
+
+// Declare your test specification with a custom setup handler
+Specification specification(greentea_setup, cases);
+
+int main(void)
+{
+  return Harness::run(specification) ? 1 : 0;
+}
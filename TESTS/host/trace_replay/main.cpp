@@ -0,0 +1,154 @@
+/**
+ * Built with ARM Mbed-OS
+ *
+ * Copyright (c) 2019-2021 George Beckstein
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/** Replays an exported AT25DF trace against the chip model
+ *
+ *      trace_replay [trace.bin [read_ahead_bytes [max_gap_us]]]
+ *
+ *  The trace is replayed twice on a blank AT25DF041B model, once against
+ *  the driver and once through a ReadAheadBlockDevice, and the totals of
+ *  both are printed. Without a trace file a trace of a small logging
+ *  workload is recorded on the model first and written to trace.bin.
+ */
+
+#include "AT25DF041B.h"
+#include "AT25DFTraceReplay.h"
+#include "ReadAheadBlockDevice.h"
+#include "AT25DFModel.h"
+#include "PinNames.h"
+#include "platform/mbed_wait_api.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Largest trace read from a file */
+#define TRACE_REPLAY_MAX_FILE       (1024 * 1024)
+
+static uint8_t trace[TRACE_REPLAY_MAX_FILE];
+
+/** Appends 64B records to a log, reading back the previous ones every so often */
+static int record_workload(void)
+{
+	AT25DF041B flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+	uint8_t record[64];
+	uint8_t back[512];
+
+	if (flash.init()) {
+		return -1;
+	}
+	flash.set_frequency(8000000);
+	flash.reset_trace();
+
+	memset(record, 0x5A, sizeof(record));
+	for (bd_addr_t addr = 0; addr < 0x4000; addr += sizeof(record)) {
+		if ((addr & (AT25DF041B::sector_size - 1)) == 0
+				&& flash.erase(addr, AT25DF041B::sector_size)) {
+			return -1;
+		}
+		if (flash.program(record, addr, sizeof(record))) {
+			return -1;
+		}
+		if ((addr & 0x3FF) == 0x3C0) {
+			for (bd_addr_t offset = addr & ~0x3FFULL; offset <= addr; offset += 32) {
+				if (flash.read(back, offset, 32)) {
+					return -1;
+				}
+			}
+		}
+		wait_us(500);
+	}
+
+	int length = flash.export_trace(trace, sizeof(trace));
+	flash.deinit();
+	return length;
+}
+
+static int replay(BlockDevice *bd, const char *name, const AT25DF041BTraceRecord *records,
+		int count, uint32_t max_gap_us)
+{
+	char text[512];
+	AT25DFTraceReplay replay(bd);
+
+	model_reset(512 * 1024, AT25DF041B_DEVICE_ID_BYTE_1, AT25DF041B_DEVICE_ID_BYTE_2);
+	if (bd->init()) {
+		printf("%s: init failed\n", name);
+		return -1;
+	}
+
+	int failed = replay.replay(records, count, max_gap_us);
+	replay.format_result(text, sizeof(text));
+	printf("%s:\n%s", name, text);
+	bd->deinit();
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	bd_size_t read_ahead_size = (argc > 2) ? strtoul(argv[2], NULL, 0) : 1024;
+	uint32_t max_gap_us = (argc > 3) ? strtoul(argv[3], NULL, 0) : 10000;
+	int length;
+
+	model_reset(512 * 1024, AT25DF041B_DEVICE_ID_BYTE_1, AT25DF041B_DEVICE_ID_BYTE_2);
+	if (argc > 1) {
+		FILE *file = fopen(argv[1], "rb");
+		if (!file) {
+			printf("cannot open %s\n", argv[1]);
+			return 1;
+		}
+		length = fread(trace, 1, sizeof(trace), file);
+		fclose(file);
+	} else {
+		length = record_workload();
+		FILE *file = fopen("trace.bin", "wb");
+		if (length > 0 && file) {
+			fwrite(trace, 1, length, file);
+		}
+		if (file) {
+			fclose(file);
+		}
+	}
+	if (length <= 0) {
+		printf("no trace, build the driver with AT25DF041B_ENABLE_TRACE\n");
+		return 1;
+	}
+
+	int capacity = length / AT25DF041B_TRACE_RECORD_SIZE;
+	AT25DF041BTraceRecord *records = new AT25DF041BTraceRecord[capacity];
+	int count = AT25DFTraceReplay::import(trace, length, records, capacity);
+	if (count < 0) {
+		printf("malformed trace\n");
+		delete[] records;
+		return 1;
+	}
+	printf("replaying %d records\n", count);
+
+	AT25DF041B flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+	ReadAheadBlockDevice read_ahead(&flash, read_ahead_size);
+	int failed = replay(&flash, "driver", records, count, max_gap_us);
+	failed |= replay(&read_ahead, "read_ahead", records, count, max_gap_us);
+
+	const ReadAheadStats &stats = read_ahead.get_stats();
+	printf("read_ahead: hits=%lu misses=%lu bypasses=%lu\n", (unsigned long) stats.hits,
+			(unsigned long) stats.misses, (unsigned long) stats.bypasses);
+
+	delete[] records;
+	return failed ? 1 : 0;
+}
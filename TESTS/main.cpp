@@ -25,10 +25,19 @@
 
 /** mbed drivers */
 #include "drivers/SPI.h"
+#include "platform/mbed_wait_api.h"
 //#include "mbedtls/entropy.h"
 //#include "mbedtls/ctr_drbg.h"
 
 #include "AT25DF041B.h"
+#include "ReadAheadBlockDevice.h"
+#include "AT25DFImageWriter.h"
+#include "CompressedLog.h"
+#include "AT25DFJournal.h"
+#include "AT25DFTraceReplay.h"
+#include "AT25DFRingLog.h"
+#include "AT25DFPartitions.h"
+#include "AT25DFDeltaApplier.h"
 #include "PinNames.h"
 
 using namespace utest::v1;
@@ -61,10 +70,36 @@ class AT25DF041BTest : public AT25DF041B
 		{
 			return round_up_to_page_boundary(addr);
 		}
+
+		void blank_map_disable(void)
+		{
+			_blank_map_enabled = false;
+		}
 };
 
 AT25DF041BTest flash(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
 
+/** Test class to access the geometry math of any part in the family */
+template <typename Part>
+class AT25DFMathTest : public Part
+{
+	public:
+		static bool is_valid_operation_wrapper(bd_addr_t addr, bd_size_t size, int type)
+		{
+			return Part::is_valid_operation(addr, size, type);
+		}
+
+		static int boundary_crossings_wrapper(bd_addr_t addr, bd_size_t size)
+		{
+			return Part::boundary_crossings(addr, size);
+		}
+
+		static bd_addr_t page_boundary_round_wrapper(bd_addr_t addr)
+		{
+			return Part::round_up_to_page_boundary(addr);
+		}
+};
+
 /** Static test data */
 const static uint8_t static_bytes[1024] =
 {
@@ -396,6 +431,52 @@ void test_page_boundary_rounding(void)
 
 }
 
+// Checks the shift-based math of a part against plain division
+template <typename Part>
+void check_geometry_math(bd_size_t total_size, bd_size_t page_size, bd_size_t sector_size)
+{
+	typedef AT25DFMathTest<Part> Math;
+
+	TEST_ASSERT_EQUAL_HEX64(total_size, Part::total_size);
+	TEST_ASSERT_EQUAL(page_size, Part::page_size);
+	TEST_ASSERT_EQUAL(sector_size, Part::sector_size);
+	TEST_ASSERT_EQUAL(total_size / page_size, Part::page_count);
+	TEST_ASSERT_EQUAL(total_size / sector_size, Part::sector_count);
+
+	// Walk a spread of addresses and sizes, including the ends of the part
+	const bd_addr_t addrs[] = { 0, 1, page_size - 1, page_size, 12345,
+			sector_size + 17, total_size - page_size - 3, total_size - 1 };
+	const bd_size_t sizes[] = { 1, 2, page_size - 1, page_size, page_size + 1, 1000, sector_size };
+
+	for (unsigned int a = 0; a < sizeof(addrs) / sizeof(addrs[0]); a++) {
+		bd_addr_t addr = addrs[a];
+		TEST_ASSERT_EQUAL_HEX64(((addr / page_size) + 1) * page_size,
+				Math::page_boundary_round_wrapper(addr));
+
+		for (unsigned int z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++) {
+			bd_size_t size = sizes[z];
+			int expected = ((addr + size - 1) / page_size) - (addr / page_size);
+			TEST_ASSERT_EQUAL(expected, Math::boundary_crossings_wrapper(addr, size));
+
+			bool in_bounds = (addr + size) <= total_size;
+			TEST_ASSERT_EQUAL(in_bounds, Math::is_valid_operation_wrapper(addr, size,
+					AT25DF041B_OPERATION_TYPE_PROGRAM));
+			TEST_ASSERT_EQUAL(in_bounds && ((size % sector_size) == 0),
+					Math::is_valid_operation_wrapper(addr, size, AT25DF041B_OPERATION_TYPE_ERASE));
+		}
+	}
+}
+
+void test_family_geometry(void)
+{
+	check_geometry_math<AT25DF041B>(512 * 1024, 256, 4096);
+	check_geometry_math<AT25DF081A>(1024 * 1024, 256, 4096);
+	check_geometry_math<AT25DF161>(2048 * 1024, 256, 4096);
+	check_geometry_math<AT25SF041>(512 * 1024, 256, 4096);
+	check_geometry_math<AT25SF081>(1024 * 1024, 256, 4096);
+	check_geometry_math<AT25SF161>(2048 * 1024, 256, 4096);
+}
+
 // Also tests the wakeup command
 status_t test_setup_check_device_id(const Case *const source, const size_t index_of_case)
 {
@@ -580,6 +661,708 @@ void test_random_read_program_erase(void)
 	// TODO have greentea automatically repeat this a number of times
 }
 
+// Instrumentation report test
+void test_stats_report(void)
+{
+	char text[512];
+	uint8_t binary[256];
+
+	flash.reset_stats();
+	TEST_ASSERT_EQUAL(0, flash.erase(0, flash.get_erase_size()));
+	TEST_ASSERT_EQUAL(0, flash.program(static_bytes, 0, 300));
+	TEST_ASSERT_EQUAL(0, flash.read(test_buffer, 0, 300));
+
+#if AT25DF041B_ENABLE_STATS
+	const AT25DF041BStats &stats = flash.get_stats();
+	TEST_ASSERT(stats.bytes_out >= 300);
+	TEST_ASSERT(stats.bytes_in >= 300);
+	TEST_ASSERT(stats.status_polls > 0);
+	TEST_ASSERT_EQUAL(1, stats.latency_max_us[AT25DF041B_OPERATION_TYPE_ERASE] > 0);
+
+	// A plain program checks the ID once
+	flash.reset_stats();
+	TEST_ASSERT_EQUAL(0, flash.program(static_bytes, 512, 16));
+	uint32_t id_reads = 0;
+	for (int i = 0; i < AT25DF041B_STATS_OPCODE_SLOTS; i++) {
+		if (stats.commands[i].opcode == AT25DF041B_READ_MFG_AND_DEV_ID) {
+			id_reads = stats.commands[i].count;
+		}
+	}
+	TEST_ASSERT_EQUAL(1, id_reads);
+#endif
+
+	int length = flash.format_stats(text, sizeof(text));
+	TEST_ASSERT(length > 0);
+	TEST_ASSERT((size_t) length < sizeof(text));
+	greentea_send_kv("stats", text);
+
+	TEST_ASSERT(flash.export_stats(binary, sizeof(binary)) > 0);
+	TEST_ASSERT_EQUAL(-1, flash.export_stats(binary, 4));
+}
+
+// Verify-on-write and streaming CRC test
+void test_verify_and_crc32(void)
+{
+	uint32_t crc = 0;
+
+	// Known answer for the standard check string
+	TEST_ASSERT_EQUAL_HEX32(0xCBF43926, AT25DF041B::crc32_update(0, "123456789", 9));
+
+	TEST_ASSERT_EQUAL(0, flash.erase(0, flash.get_erase_size()));
+	flash.set_verify_on_write(true);
+	TEST_ASSERT_EQUAL(0, flash.program(static_bytes, 37, sizeof(static_bytes)));
+	flash.set_verify_on_write(false);
+
+	TEST_ASSERT_EQUAL(0, flash.verify(static_bytes, 37, sizeof(static_bytes)));
+	TEST_ASSERT_EQUAL(-3, flash.verify(static_bytes, 38, sizeof(static_bytes)));
+
+	// Chained CRC over two regions matches the CRC of the source data
+	TEST_ASSERT_EQUAL(0, flash.crc32(37, 100, &crc));
+	TEST_ASSERT_EQUAL(0, flash.crc32(137, sizeof(static_bytes) - 100, &crc));
+	TEST_ASSERT_EQUAL_HEX32(AT25DF041B::crc32_update(0, static_bytes, sizeof(static_bytes)), crc);
+
+	// Bits cannot be set by programming, so this must fail verification
+	flash.set_verify_on_write(true);
+	TEST_ASSERT_EQUAL(-3, flash.program(&static_bytes[1], 37, 16));
+	flash.set_verify_on_write(false);
+}
+
+// Scatter-gather read/program test
+void test_vectored_read_program(void)
+{
+	uint8_t header[7], trailer[4];
+	AT25DF041BIOVec program_segments[] = {
+		{ (void*) static_bytes, 7 },
+		{ (void*) &static_bytes[7], 0 },
+		{ (void*) &static_bytes[7], 500 },
+		{ (void*) &static_bytes[507], 4 }
+	};
+
+	// Start near the end of a page so segments straddle page boundaries
+	bd_addr_t addr = AT25DF041B_PAGE_BYTE_SIZE - 3;
+	TEST_ASSERT_EQUAL(0, flash.erase(0, flash.get_erase_size()));
+	TEST_ASSERT_EQUAL(0, flash.programv(program_segments, 4, addr));
+	TEST_ASSERT_EQUAL(0, flash.read(test_buffer, addr, 511));
+	TEST_ASSERT_EQUAL(0, memcmp(static_bytes, test_buffer, 511));
+
+	memset(test_buffer, 0, sizeof(test_buffer));
+	AT25DF041BIOVec read_segments[] = {
+		{ header, sizeof(header) },
+		{ test_buffer, 500 },
+		{ trailer, sizeof(trailer) }
+	};
+	TEST_ASSERT_EQUAL(0, flash.readv(read_segments, 3, addr));
+	TEST_ASSERT_EQUAL(0, memcmp(static_bytes, header, sizeof(header)));
+	TEST_ASSERT_EQUAL(0, memcmp(&static_bytes[7], test_buffer, 500));
+	TEST_ASSERT_EQUAL(0, memcmp(&static_bytes[507], trailer, sizeof(trailer)));
+
+	// Out of bounds and empty requests are rejected
+	TEST_ASSERT_EQUAL(-2, flash.readv(read_segments, 3, flash.size() - 100));
+	TEST_ASSERT_EQUAL(-2, flash.programv(program_segments, 0, 0));
+}
+
+/** Ring consumer state for the streaming read test */
+static bd_size_t stream_offset;
+
+static int check_stream_chunk(const void *data, bd_size_t size)
+{
+	if (memcmp(data, &static_bytes[stream_offset], size) != 0) {
+		return -10;
+	}
+	stream_offset += size;
+	return 0;
+}
+
+// Streaming read test
+void test_streaming_read(void)
+{
+	uint8_t storage[64];
+	AT25DF041BRing ring = { storage, sizeof(storage), 0, 0 };
+
+	TEST_ASSERT_EQUAL(0, flash.erase(0, flash.get_erase_size()));
+	TEST_ASSERT_EQUAL(0, flash.program(static_bytes, 0, sizeof(static_bytes)));
+
+	// Drain the ring in odd sized pieces so it wraps and fills up
+	TEST_ASSERT_EQUAL(0, flash.stream_open(0, sizeof(static_bytes)));
+	TEST_ASSERT_EQUAL(-1, flash.read(test_buffer, 0, 1));
+	bd_size_t consumed = 0;
+	while (flash.stream_remaining() || ring.head != ring.tail) {
+		flash.stream_fill(&ring);
+		for (uint32_t n = 0; n < 13 && ring.head != ring.tail; n++) {
+			TEST_ASSERT_EQUAL_HEX8(static_bytes[consumed], storage[ring.tail & (ring.size - 1)]);
+			ring.tail++;
+			consumed++;
+		}
+	}
+	TEST_ASSERT_EQUAL(sizeof(static_bytes), consumed);
+
+	// Callback delivery
+	stream_offset = 0;
+	TEST_ASSERT_EQUAL(0, flash.stream(0, sizeof(static_bytes), check_stream_chunk));
+	TEST_ASSERT_EQUAL(sizeof(static_bytes), stream_offset);
+
+	// Closing early releases the bus for other operations
+	TEST_ASSERT_EQUAL(0, flash.stream_open(0, sizeof(static_bytes)));
+	TEST_ASSERT_EQUAL(10, flash.stream_read(test_buffer, 10));
+
+	// Entry points that do not check the ID stay off the bus too
+	TEST_ASSERT_EQUAL(-1, flash.sync());
+	TEST_ASSERT_EQUAL(-1, flash.enter_standby());
+	TEST_ASSERT_EQUAL(-1, flash.exit_standby());
+	TEST_ASSERT_EQUAL(10, flash.stream_read(test_buffer, 10));
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(&static_bytes[10], test_buffer, 10);
+	flash.stream_close();
+	TEST_ASSERT_EQUAL(0, flash.read(test_buffer, 0, 1));
+}
+
+// Sequential read-ahead test
+void test_read_ahead(void)
+{
+	ReadAheadBlockDevice read_ahead(&flash, 512);
+	TEST_ASSERT_EQUAL(0, read_ahead.init());
+
+	TEST_ASSERT_EQUAL(0, read_ahead.erase(0, flash.get_erase_size()));
+	TEST_ASSERT_EQUAL(0, read_ahead.program(static_bytes, 0, sizeof(static_bytes)));
+
+	// Small sequential reads should mostly come from the buffer
+	for (bd_addr_t addr = 0; addr < sizeof(static_bytes); addr += 16) {
+		TEST_ASSERT_EQUAL(0, read_ahead.read(test_buffer, addr, 16));
+		TEST_ASSERT_EQUAL(0, memcmp(&static_bytes[addr], test_buffer, 16));
+	}
+	const ReadAheadStats &stats = read_ahead.get_stats();
+	TEST_ASSERT(stats.hits > stats.misses);
+	greentea_send_kv("read ahead hits", (int) stats.hits);
+	greentea_send_kv("read ahead misses", (int) stats.misses);
+
+	// Random reads bypass the buffer
+	read_ahead.reset_stats();
+	TEST_ASSERT_EQUAL(0, read_ahead.read(test_buffer, 700, 5));
+	TEST_ASSERT_EQUAL(0, read_ahead.read(test_buffer, 100, 5));
+	TEST_ASSERT_EQUAL(0, memcmp(&static_bytes[100], test_buffer, 5));
+	TEST_ASSERT_EQUAL(2, stats.bypasses);
+
+	// Writes invalidate buffered data
+	TEST_ASSERT_EQUAL(0, read_ahead.read(test_buffer, 200, 16));
+	TEST_ASSERT_EQUAL(0, read_ahead.read(test_buffer, 216, 16));
+	TEST_ASSERT_EQUAL(0, read_ahead.erase(0, flash.get_erase_size()));
+	TEST_ASSERT_EQUAL(0, read_ahead.read(test_buffer, 232, 16));
+	TEST_ASSERT_EQUAL(true, is_all_erased(&flash, test_buffer, 16));
+}
+
+void test_image_writer(void)
+{
+	AT25DFImageWriter<AT25DF041B> writer(&flash);
+	TEST_ASSERT_EQUAL(-2, writer.begin(100, flash.get_erase_size()));
+	TEST_ASSERT_EQUAL(0, writer.begin(0, flash.get_erase_size()));
+
+	// Odd sized chunks, the way packets come off a radio
+	for (bd_size_t offset = 0; offset < sizeof(static_bytes); offset += 100) {
+		bd_size_t length = sizeof(static_bytes) - offset;
+		if (length > 100) {
+			length = 100;
+		}
+		TEST_ASSERT_EQUAL(0, writer.write(&static_bytes[offset], length));
+	}
+	TEST_ASSERT_EQUAL(0, writer.finish());
+	TEST_ASSERT_EQUAL(sizeof(static_bytes), writer.bytes_written());
+
+	TEST_ASSERT_EQUAL(0, flash.read(test_buffer, 0, sizeof(static_bytes)));
+	TEST_ASSERT_EQUAL(0, memcmp(static_bytes, test_buffer, sizeof(static_bytes)));
+
+	// The next block is already being erased while its data is on the way
+	bd_size_t sector = flash.get_erase_size();
+	TEST_ASSERT_EQUAL(0, writer.begin(0, 2 * sector));
+	for (bd_size_t offset = 0; offset < sector; offset += sizeof(static_bytes)) {
+		TEST_ASSERT_EQUAL(0, writer.write(static_bytes, sizeof(static_bytes)));
+	}
+	wait_us(5000);
+	TEST_ASSERT_EQUAL(true, flash.is_busy());
+	TEST_ASSERT_EQUAL(0, writer.write(static_bytes, sizeof(static_bytes)));
+	TEST_ASSERT_EQUAL(0, writer.finish());
+	TEST_ASSERT_EQUAL(0, flash.read(test_buffer, sector, sizeof(static_bytes)));
+	TEST_ASSERT_EQUAL(0, memcmp(static_bytes, test_buffer, sizeof(static_bytes)));
+}
+
+void test_deferred_wait(void)
+{
+	flash.set_deferred_wait(true);
+
+	TEST_ASSERT_EQUAL(0, flash.erase(0, flash.get_erase_size()));
+	TEST_ASSERT_EQUAL(0, flash.program(static_bytes, 0, sizeof(static_bytes)));
+
+	// The next operation waits for the last page on its own
+	TEST_ASSERT_EQUAL(0, flash.read(test_buffer, 0, sizeof(static_bytes)));
+	TEST_ASSERT_EQUAL(0, memcmp(static_bytes, test_buffer, sizeof(static_bytes)));
+
+	TEST_ASSERT_EQUAL(0, flash.erase(0, flash.get_erase_size()));
+	TEST_ASSERT_EQUAL(0, flash.sync());
+	TEST_ASSERT_EQUAL(false, flash.is_busy());
+
+	flash.set_deferred_wait(false);
+}
+
+void test_trim(void)
+{
+	bd_size_t sector = flash.get_erase_size();
+
+	TEST_ASSERT_EQUAL(0, flash.erase(0, 2 * sector));
+	TEST_ASSERT_EQUAL(0, flash.program(static_bytes, 0, sizeof(static_bytes)));
+	TEST_ASSERT_EQUAL(0, flash.program(static_bytes, sector, sizeof(static_bytes)));
+	TEST_ASSERT_EQUAL(false, flash.is_erased(0));
+
+	TEST_ASSERT_EQUAL(-2, flash.trim(1, sector));
+	TEST_ASSERT_EQUAL(0, flash.trim(0, 2 * sector));
+	TEST_ASSERT_EQUAL(2, flash.get_trimmed_count());
+
+	int remaining;
+	while ((remaining = flash.background_erase()) > 0) {
+	}
+	TEST_ASSERT_EQUAL(0, remaining);
+	TEST_ASSERT_EQUAL(0, flash.sync());
+
+	bd_addr_t erased;
+	TEST_ASSERT_EQUAL(0, flash.find_erased(0, &erased));
+	TEST_ASSERT_EQUAL(0, erased);
+	TEST_ASSERT_EQUAL(true, flash.is_erased(sector));
+
+	// Already blank, so this erase costs nothing
+	TEST_ASSERT_EQUAL(0, flash.erase(sector, sector));
+	TEST_ASSERT_EQUAL(0, flash.read(test_buffer, sector, sizeof(test_buffer)));
+	TEST_ASSERT_EQUAL(true, is_all_erased(&flash, test_buffer, sizeof(test_buffer)));
+}
+
+void test_compressed_log(void)
+{
+	CompressedLog log(&flash, 0, 2 * flash.get_erase_size());
+	TEST_ASSERT_EQUAL(0, log.format());
+
+	// Repetitive text like a telemetry log
+	char line[48];
+	for (int i = 0; i < 200; i++) {
+		int length = snprintf(line, sizeof(line), "%d,temp=21.%d,state=ok\n", 1000 + i, i % 10);
+		TEST_ASSERT_EQUAL(0, log.append(line, length));
+	}
+	TEST_ASSERT_EQUAL(0, log.flush());
+	TEST_ASSERT(log.physical_size() * 2 < log.logical_size());
+	greentea_send_kv("compressed bytes", (int) log.physical_size());
+
+	// Find the end again from flash and read a line back
+	CompressedLog mounted(&flash, 0, 2 * flash.get_erase_size());
+	TEST_ASSERT_EQUAL(0, mounted.mount());
+	TEST_ASSERT_EQUAL(log.logical_size(), mounted.logical_size());
+	int length = snprintf(line, sizeof(line), "%d,temp=21.%d,state=ok\n", 1199, 9);
+	TEST_ASSERT_EQUAL(0, mounted.read(test_buffer, mounted.logical_size() - length, length));
+	TEST_ASSERT_EQUAL(0, memcmp(line, test_buffer, length));
+
+	// A stored chunk torn by a power cut, only half its data made it
+	uint8_t header[COMPRESSED_LOG_HEADER_SIZE] = {
+		0x00, 0x04 | (COMPRESSED_LOG_RAW_FLAG >> 8), 0x00, 0x04
+	};
+	uint32_t crc = AT25DF041B::crc32_update(0, static_bytes, 1024);
+	for (int i = 0; i < 4; i++) {
+		header[4 + i] = (uint8_t) (crc >> (8 * i));
+	}
+	bd_size_t torn = mounted.physical_size();
+	TEST_ASSERT_EQUAL(0, flash.program(header, torn, sizeof(header)));
+	TEST_ASSERT_EQUAL(0, flash.program(static_bytes, torn + sizeof(header), 512));
+
+	// Its header is whole so it is mounted, but reading it fails
+	CompressedLog torn_log(&flash, 0, 2 * flash.get_erase_size());
+	TEST_ASSERT_EQUAL(0, torn_log.mount());
+	TEST_ASSERT_EQUAL(log.logical_size() + 1024, torn_log.logical_size());
+	TEST_ASSERT_EQUAL(-1, torn_log.read(test_buffer, log.logical_size(), 16));
+	TEST_ASSERT_EQUAL(0, torn_log.read(test_buffer, mounted.logical_size() - length, length));
+	TEST_ASSERT_EQUAL(0, memcmp(line, test_buffer, length));
+}
+
+void test_journal(void)
+{
+	bd_size_t sector = flash.get_erase_size();
+	AT25DFJournal<AT25DF041B> journal(&flash, 2 * sector, 2 * sector);
+	TEST_ASSERT_EQUAL(0, journal.mount());
+
+	// Two pages in another sector change together
+	TEST_ASSERT_EQUAL(0, journal.begin());
+	TEST_ASSERT_EQUAL(0, journal.erase(0, sector));
+	TEST_ASSERT_EQUAL(0, journal.program(static_bytes, 0, 256));
+	TEST_ASSERT_EQUAL(0, journal.program(&static_bytes[256], 512, 256));
+	TEST_ASSERT_EQUAL(-2, journal.program(static_bytes, 2 * sector, 16));
+	TEST_ASSERT_EQUAL(0, journal.commit());
+
+	TEST_ASSERT_EQUAL(0, flash.read(test_buffer, 0, 768));
+	TEST_ASSERT_EQUAL(0, memcmp(static_bytes, test_buffer, 256));
+	TEST_ASSERT_EQUAL(true, is_all_erased(&flash, &test_buffer[256], 256));
+	TEST_ASSERT_EQUAL(0, memcmp(&static_bytes[256], &test_buffer[512], 256));
+
+	// An aborted transaction leaves the targets alone and is not replayed
+	TEST_ASSERT_EQUAL(0, journal.begin());
+	TEST_ASSERT_EQUAL(0, journal.erase(0, sector));
+	TEST_ASSERT_EQUAL(0, journal.abort());
+
+	AT25DFJournal<AT25DF041B> remounted(&flash, 2 * sector, 2 * sector);
+	TEST_ASSERT_EQUAL(0, remounted.mount());
+	TEST_ASSERT_EQUAL(0, remounted.get_replayed());
+	TEST_ASSERT_EQUAL(0, flash.read(test_buffer, 0, 256));
+	TEST_ASSERT_EQUAL(0, memcmp(static_bytes, test_buffer, 256));
+}
+
+void test_frequency_tuning(void)
+{
+	bd_addr_t reserved = flash.size() - flash.get_erase_size();
+	TEST_ASSERT_EQUAL(-2, flash.tune_frequency(reserved + 1));
+	TEST_ASSERT_EQUAL(-2, flash.tune_frequency(reserved, 500000));
+	TEST_ASSERT_EQUAL(0, flash.tune_frequency(reserved));
+	greentea_send_kv("tuned frequency", flash.get_frequency());
+
+	TEST_ASSERT_EQUAL(0, flash.erase(0, flash.get_erase_size()));
+	TEST_ASSERT_EQUAL(0, flash.program(static_bytes, 0, sizeof(static_bytes)));
+	TEST_ASSERT_EQUAL(0, flash.read(test_buffer, 0, sizeof(static_bytes)));
+	TEST_ASSERT_EQUAL(0, memcmp(static_bytes, test_buffer, sizeof(static_bytes)));
+
+	// Back to the slow capture friendly rate for the remaining cases
+	flash.set_frequency(250E3);
+}
+
+void test_trace_replay(void)
+{
+	static AT25DF041BTraceRecord records[8];
+	uint8_t binary[13 + 8 * AT25DF041B_TRACE_RECORD_SIZE];
+
+	flash.reset_trace();
+	TEST_ASSERT_EQUAL(0, flash.erase(0, flash.get_erase_size()));
+	TEST_ASSERT_EQUAL(0, flash.program(static_bytes, 0, 300));
+	TEST_ASSERT_EQUAL(0, flash.read(test_buffer, 0, 300));
+
+	int length = flash.export_trace(binary, sizeof(binary));
+	TEST_ASSERT(length > 0);
+	int count = AT25DFTraceReplay::import(binary, length, records, 8);
+	TEST_ASSERT_EQUAL(flash.get_trace(records, 8), count);
+	TEST_ASSERT_EQUAL(-2, AT25DFTraceReplay::import(binary, 4, records, 8));
+
+	// A record count whose size in bytes wraps a 32-bit size_t
+	binary[5] = binary[6] = binary[7] = 0;
+	binary[8] = 0x10;
+	TEST_ASSERT_EQUAL(-2, AT25DFTraceReplay::import(binary, 13, records, 8));
+
+#if AT25DF041B_ENABLE_TRACE
+	TEST_ASSERT_EQUAL(3, count);
+	TEST_ASSERT_EQUAL(AT25DF041B_OPERATION_TYPE_ERASE, records[0].op);
+	TEST_ASSERT_EQUAL(AT25DF041B_OPERATION_TYPE_PROGRAM, records[1].op);
+	TEST_ASSERT_EQUAL(300, records[1].size);
+	TEST_ASSERT_EQUAL(AT25DF041B_OPERATION_TYPE_READ, records[2].op);
+#else
+	// Nothing is recorded, replay a handmade trace instead
+	TEST_ASSERT_EQUAL(0, count);
+	memset(records, 0, sizeof(records));
+	records[0].op = AT25DF041B_OPERATION_TYPE_ERASE;
+	records[0].size = flash.get_erase_size();
+	records[1].op = AT25DF041B_OPERATION_TYPE_PROGRAM;
+	records[1].size = 300;
+	records[2].op = AT25DF041B_OPERATION_TYPE_READ;
+	records[2].size = 300;
+	count = 3;
+#endif
+
+	AT25DFTraceReplay replay(&flash, 256);
+	TEST_ASSERT_EQUAL(0, replay.replay(records, count));
+	TEST_ASSERT_EQUAL(1, replay.get_result().ops[AT25DF041B_OPERATION_TYPE_PROGRAM]);
+	TEST_ASSERT_EQUAL(300, replay.get_result().bytes[AT25DF041B_OPERATION_TYPE_READ]);
+
+	// Operations the device rejects are counted and skipped
+	records[0].addr = flash.size();
+	TEST_ASSERT_EQUAL(1, replay.replay(records, 1));
+	TEST_ASSERT_EQUAL(1, replay.get_result().errors);
+
+	char text[256];
+	TEST_ASSERT(replay.format_result(text, sizeof(text)) > 0);
+	greentea_send_kv("replay", text);
+}
+
+void test_sector_protection(void)
+{
+	const bd_size_t locked = AT25DF041B::protect_size;
+
+	TEST_ASSERT_EQUAL(-2, flash.lock_sectors(1, locked));
+	TEST_ASSERT_EQUAL(0, flash.lock_sectors(0, locked));
+	TEST_ASSERT(flash.is_protected(0));
+	TEST_ASSERT(!flash.is_protected(locked));
+
+	// Nothing reaches a locked sector
+	TEST_ASSERT_EQUAL(-2, flash.erase(0, flash.get_erase_size()));
+	TEST_ASSERT_EQUAL(-2, flash.program(static_bytes, locked - 16, 32));
+	TEST_ASSERT_EQUAL(0, flash.erase(locked, flash.get_erase_size()));
+
+	// With auto-protect only the sector being written is left unprotected
+	TEST_ASSERT_EQUAL(0, flash.set_auto_protect(true));
+	TEST_ASSERT(flash.is_protected(locked));
+	TEST_ASSERT_EQUAL(0, flash.program(static_bytes, locked, 256));
+	TEST_ASSERT(!flash.is_protected(locked));
+	TEST_ASSERT(flash.is_protected(2 * locked));
+	TEST_ASSERT_EQUAL(0, flash.sync());
+	TEST_ASSERT(flash.is_protected(locked));
+
+	// The cache agrees with the protection registers
+	TEST_ASSERT_EQUAL(0, flash.refresh_protection());
+	TEST_ASSERT(flash.is_protected(locked));
+
+	TEST_ASSERT_EQUAL(0, flash.set_auto_protect(false));
+	TEST_ASSERT_EQUAL(0, flash.unlock_sectors(0, locked));
+	TEST_ASSERT(!flash.is_protected(0));
+	TEST_ASSERT_EQUAL(0, flash.read(test_buffer, locked, 256));
+	TEST_ASSERT_EQUAL(0, memcmp(static_bytes, test_buffer, 256));
+}
+
+void test_security_register(void)
+{
+	uint8_t id[AT25DF041B_OTP_FACTORY_SIZE];
+	uint8_t again[AT25DF041B_OTP_FACTORY_SIZE];
+	uint32_t user;
+
+	TEST_ASSERT_EQUAL(0, flash.read_unique_id(id));
+	TEST_ASSERT_EQUAL(0, flash.read_unique_id(again));
+	TEST_ASSERT_EQUAL(0, memcmp(id, again, sizeof(id)));
+	TEST_ASSERT_EQUAL(0, flash.read_user_otp(&user));
+	TEST_ASSERT_EQUAL(-2, flash.read_user_otp(&user, AT25DF041B_OTP_USER_SIZE - 2));
+
+	// Only the safeguards, programming the real register cannot be undone
+	TEST_ASSERT_EQUAL(-1, flash.program_user_otp(user, 0, 0));
+	TEST_ASSERT_EQUAL(-2, flash.program_user_otp(user, AT25DF041B_OTP_USER_SIZE,
+			AT25DF041B_OTP_MAGIC_WORD));
+}
+
+void test_ring_log(void)
+{
+	bd_size_t sector = flash.get_erase_size();
+	AT25DFRingLog<AT25DF041B> log(&flash, 0, 3 * sector);
+	bd_size_t length;
+	int records = 0;
+
+	TEST_ASSERT_EQUAL(0, log.format());
+	TEST_ASSERT_EQUAL(-2, log.append(static_bytes, 0));
+
+	// Enough records to go round the three sectors a few times
+	for (int i = 0; i < 100; i++) {
+		TEST_ASSERT_EQUAL(0, log.append(&static_bytes[i], 200));
+	}
+
+	// The newest records are left in order, the oldest were dropped
+	AT25DFRingLog<AT25DF041B> remounted(&flash, 0, 3 * sector);
+	TEST_ASSERT_EQUAL(0, remounted.mount());
+	TEST_ASSERT(remounted.get_mount_reads() <= 4);
+	int res;
+	while ((res = remounted.read_next(test_buffer, sizeof(test_buffer), &length)) == 0) {
+		TEST_ASSERT_EQUAL(200, length);
+		records++;
+	}
+	TEST_ASSERT_EQUAL(1, res);
+	TEST_ASSERT(records > 0 && records < 100);
+	TEST_ASSERT_EQUAL(0, memcmp(&static_bytes[99], test_buffer, 200));
+}
+
+void test_blank_map(void)
+{
+	bd_size_t sector = flash.get_erase_size();
+	bd_addr_t region = flash.size() - 3 * sector;
+
+	TEST_ASSERT_EQUAL(-2, flash.blank_map_init(region + 1));
+	TEST_ASSERT_EQUAL(0, flash.blank_map_init(region));
+	TEST_ASSERT_EQUAL(0, flash.erase(0, 2 * sector));
+	TEST_ASSERT_EQUAL(0, flash.program(static_bytes, sector, 16));
+	TEST_ASSERT_EQUAL(0, flash.sync());
+
+	flash.blank_map_disable();
+
+	// A fresh driver only knows what it reloads from the checkpoint
+	AT25DF041B reloaded(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+	TEST_ASSERT_EQUAL(0, reloaded.init());
+	TEST_ASSERT(!reloaded.is_erased(0));
+	TEST_ASSERT_EQUAL(0, reloaded.blank_map_init(region));
+	TEST_ASSERT(reloaded.is_erased(0));
+	TEST_ASSERT(!reloaded.is_erased(sector));
+
+	// Whatever the checkpoint does not cover is scanned, every claim holds
+	TEST_ASSERT_EQUAL(0, reloaded.scan_unknown_sectors());
+	TEST_ASSERT_EQUAL(0, reloaded.get_unknown_count());
+	TEST_ASSERT_EQUAL(0, reloaded.read(test_buffer, 0, 256));
+	TEST_ASSERT_EQUAL(true, is_all_erased(&reloaded, test_buffer, 256));
+}
+
+void test_partitions(void)
+{
+	const uint32_t sector = AT25DF041B::sector_size;
+	const AT25DFPartitionInfo layout[] = {
+		{ "config", 0, 2 * sector, sector, AT25DF_PARTITION_READ_CACHE },
+		{ "log", 2 * sector, 2 * sector, sector, AT25DF_PARTITION_WRITE_BACK | AT25DF_PARTITION_VERIFY },
+	};
+	const AT25DFPartitionInfo overlapping[] = {
+		{ "a", 0, 2 * sector, sector, 0 },
+		{ "b", sector, 2 * sector, sector, 0 },
+	};
+
+	AT25DFPartitionTable<AT25DF041B> table(&flash, 4 * sector);
+	TEST_ASSERT_EQUAL(-2, table.save(overlapping, 2));
+	TEST_ASSERT_EQUAL(0, table.save(layout, 2));
+
+	// The table is read back from flash
+	AT25DFPartitionTable<AT25DF041B> loaded(&flash, 4 * sector);
+	TEST_ASSERT_EQUAL(0, loaded.load());
+	TEST_ASSERT_EQUAL(2, loaded.get_count());
+	BlockDevice *config = loaded.find("config");
+	AT25DFPartition<AT25DF041B> *log = loaded.find("log");
+	TEST_ASSERT(config != NULL && log != NULL);
+	TEST_ASSERT_EQUAL(0, config->init());
+	TEST_ASSERT_EQUAL(0, log->init());
+
+	// Small appends to the log are gathered into one page program
+	TEST_ASSERT_EQUAL(0, log->erase(0, sector));
+	for (int i = 0; i < 16; i++) {
+		TEST_ASSERT_EQUAL(0, log->program(&static_bytes[16 * i], 16 * i, 16));
+	}
+	TEST_ASSERT_EQUAL(15, log->get_merged_programs());
+	TEST_ASSERT_EQUAL(0, flash.read(test_buffer, 2 * sector, 256));
+	TEST_ASSERT_EQUAL(0, memcmp(static_bytes, test_buffer, 256));
+	TEST_ASSERT(!flash.get_verify_on_write());
+
+	// Repeated small reads of the configuration come from RAM
+	TEST_ASSERT_EQUAL(0, config->erase(0, sector));
+	TEST_ASSERT_EQUAL(0, config->program(static_bytes, 0, 64));
+	TEST_ASSERT_EQUAL(0, config->read(test_buffer, 0, 8));
+	TEST_ASSERT_EQUAL(0, config->read(test_buffer, 8, 8));
+	TEST_ASSERT_EQUAL(1, loaded.get(0)->get_cache_hits());
+	TEST_ASSERT_EQUAL(0, memcmp(&static_bytes[8], test_buffer, 8));
+
+	TEST_ASSERT_EQUAL(0, config->deinit());
+	TEST_ASSERT_EQUAL(0, log->deinit());
+}
+
+void test_erase_sizes(void)
+{
+	bd_size_t sector = flash.get_erase_size();
+	bd_size_t sizes[AT25DF041B_MAX_ERASE_SIZES];
+
+	TEST_ASSERT_EQUAL(4, flash.get_erase_sizes(sizes, AT25DF041B_MAX_ERASE_SIZES));
+	TEST_ASSERT_EQUAL(AT25DF041B_PAGE_BYTE_SIZE, sizes[0]);
+	TEST_ASSERT_EQUAL(sector, sizes[1]);
+	TEST_ASSERT_EQUAL(AT25DF041B_BLOCK_64KB_SIZE, sizes[3]);
+	TEST_ASSERT_EQUAL(sector, flash.get_erase_size(flash.size() - 1));
+	TEST_ASSERT_EQUAL(0, flash.get_erase_size(flash.size()));
+
+	// Presets follow the erase size asked for
+	AT25DF041BFilesystemPreset preset;
+	TEST_ASSERT_EQUAL(-2, flash.get_littlefs_preset(AT25DF041B_PAGE_BYTE_SIZE, &preset));
+	TEST_ASSERT_EQUAL(0, flash.get_littlefs_preset(AT25DF041B_BLOCK_32KB_SIZE, &preset));
+	TEST_ASSERT_EQUAL(AT25DF041B_BLOCK_32KB_SIZE, preset.block_size);
+	TEST_ASSERT_EQUAL(0, preset.lookahead_size % 8);
+	TEST_ASSERT_EQUAL(0, flash.get_fat_preset(sector, &preset));
+	TEST_ASSERT_EQUAL(sector, preset.block_size);
+
+	// A page erase leaves its neighbours alone
+	TEST_ASSERT_EQUAL(0, flash.erase(0, sector));
+	TEST_ASSERT_EQUAL(0, flash.program(static_bytes, 0, 512));
+	TEST_ASSERT_EQUAL(-2, flash.erase_page(1));
+	TEST_ASSERT_EQUAL(0, flash.erase_page(256));
+	TEST_ASSERT_EQUAL(0, flash.read(test_buffer, 0, 512));
+	TEST_ASSERT_EQUAL(0, memcmp(static_bytes, test_buffer, 256));
+	TEST_ASSERT_EQUAL(true, is_all_erased(&flash, &test_buffer[256], 256));
+	TEST_ASSERT(!flash.is_erased(0));
+
+#if AT25DF041B_ENABLE_WEAR_TRACKING
+	// And wears its sector like any other erase
+	AT25DF041B counted(SPI_MOSI, SPI_MISO, SPI_SCLK, SPI_CS);
+	uint32_t before = 0;
+	uint32_t after = 0;
+	TEST_ASSERT_EQUAL(0, counted.init());
+	TEST_ASSERT_EQUAL(0, counted.wear_tracking_init(flash.size() / 2));
+	TEST_ASSERT_EQUAL(0, counted.get_erase_count(256, &before));
+	TEST_ASSERT_EQUAL(0, counted.erase_page(256));
+	TEST_ASSERT_EQUAL(0, counted.get_erase_count(256, &after));
+	TEST_ASSERT_EQUAL(before + 1, after);
+#endif
+}
+
+static bd_size_t put_delta_op(uint8_t *out, uint8_t opcode, uint32_t first, uint32_t second)
+{
+	bd_size_t length = (opcode == AT25DF_DELTA_OP_COPY) ? 9 : 5;
+	out[0] = opcode;
+	for (int i = 0; i < 4; i++) {
+		out[1 + i] = (uint8_t) (first >> (8 * i));
+		out[5 + i] = (uint8_t) (second >> (8 * i));
+	}
+	return length;
+}
+
+void test_delta_update(void)
+{
+	bd_size_t sector = flash.get_erase_size();
+	const uint8_t literal[4] = { 0xDE, 0xAD, 0xBE, 0xEF };
+	uint8_t patch[64];
+	bd_size_t length = 0;
+
+	// Old image in the first two sectors, the slot already holds a copy
+	TEST_ASSERT_EQUAL(0, flash.erase(0, 4 * sector));
+	for (bd_addr_t addr = 0; addr < 4 * sector; addr += sector) {
+		TEST_ASSERT_EQUAL(0, flash.program(static_bytes, addr, sizeof(static_bytes)));
+	}
+
+	// The new image changes four bytes at the start of the second sector
+	uint32_t crc = 0;
+	TEST_ASSERT_EQUAL(0, flash.crc32(0, sector, &crc));
+	crc = AT25DF041B::crc32_update(crc, literal, sizeof(literal));
+	TEST_ASSERT_EQUAL(0, flash.crc32(sector + 4, sector - 4, &crc));
+
+	length += put_delta_op(&patch[length], AT25DF_DELTA_OP_COPY, 0, sector);
+	length += put_delta_op(&patch[length], AT25DF_DELTA_OP_INSERT, sizeof(literal), 0);
+	memcpy(&patch[length], literal, sizeof(literal));
+	length += sizeof(literal);
+	length += put_delta_op(&patch[length], AT25DF_DELTA_OP_COPY, sector + 4, sector - 4);
+	length += put_delta_op(&patch[length], AT25DF_DELTA_OP_END, crc, 0);
+
+	AT25DFDeltaApplier<AT25DF041B> applier(&flash);
+	TEST_ASSERT_EQUAL(0, applier.begin(0, 2 * sector, 2 * sector, 2 * sector));
+	for (bd_size_t offset = 0; offset < length; offset += 5) {
+		TEST_ASSERT_EQUAL(0, applier.write(&patch[offset], (length - offset < 5) ? length - offset : 5));
+	}
+	TEST_ASSERT_EQUAL(0, applier.finish());
+
+	// Only the changed sector was touched, with a single page program
+	TEST_ASSERT_EQUAL(1, applier.get_sectors_skipped());
+	TEST_ASSERT_EQUAL(1, applier.get_sectors_rewritten());
+	TEST_ASSERT_EQUAL(1, applier.get_pages_programmed());
+	TEST_ASSERT_EQUAL(0, flash.read(test_buffer, 3 * sector, 8));
+	TEST_ASSERT_EQUAL(0, memcmp(literal, test_buffer, sizeof(literal)));
+	TEST_ASSERT_EQUAL(0, memcmp(&static_bytes[4], &test_buffer[4], 4));
+
+	// A patch that copies past the old image is refused
+	TEST_ASSERT_EQUAL(0, applier.begin(0, 2 * sector, 2 * sector, 2 * sector));
+	length = put_delta_op(patch, AT25DF_DELTA_OP_COPY, sector, 2 * sector);
+	TEST_ASSERT_EQUAL(-2, applier.write(patch, length));
+}
+
+void test_fill(void)
+{
+	const uint8_t pattern[3] = { 0xA5, 0x5A, 0x00 };
+
+	// Unaligned and across a page boundary
+	TEST_ASSERT_EQUAL(0, flash.erase(0, flash.get_erase_size()));
+	TEST_ASSERT_EQUAL(-2, flash.fill(0, 16, pattern, 0));
+	TEST_ASSERT_EQUAL(0, flash.fill(200, 300, pattern, sizeof(pattern)));
+	TEST_ASSERT_EQUAL(0, flash.read(test_buffer, 199, 302));
+	TEST_ASSERT_EQUAL(0xFF, test_buffer[0]);
+	for (int i = 0; i < 300; i++) {
+		TEST_ASSERT_EQUAL(pattern[i % sizeof(pattern)], test_buffer[1 + i]);
+	}
+	TEST_ASSERT_EQUAL(0xFF, test_buffer[301]);
+
+	// Zeroing needs no erase first
+	flash.set_verify_on_write(true);
+	TEST_ASSERT_EQUAL(0, flash.zero(100, 500));
+	flash.set_verify_on_write(false);
+	TEST_ASSERT_EQUAL(0, flash.read(test_buffer, 100, 500));
+	for (int i = 0; i < 500; i++) {
+		TEST_ASSERT_EQUAL(0, test_buffer[i]);
+	}
+}
+
 // Custom setup handler required for proper Greentea support
 status_t greentea_setup(const size_t number_of_cases) {
     GREENTEA_SETUP(20, "default_auto");
@@ -595,8 +1378,29 @@ Case cases[] = {
 	Case("Operation Validation", test_is_valid_operation),
 	Case("Page Boundary Crossing Formula", test_page_boundary_crossings),
 	Case("Page Boundary Rounding Formula", test_page_boundary_rounding),
+	Case("Family Geometry Formulas", test_family_geometry),
 	Case("Check Device ID", test_setup_check_device_id, test_check_device_id),
 	Case("Constant Data Read/Program/Erase", test_setup_flash, test_constant_read_program_erase),
+	Case("Instrumentation Report", test_setup_flash, test_stats_report),
+	Case("Verify-on-write and CRC32", test_setup_flash, test_verify_and_crc32),
+	Case("Vectored Read/Program", test_setup_flash, test_vectored_read_program),
+	Case("Streaming Read", test_setup_flash, test_streaming_read),
+	Case("Sequential Read-Ahead", test_setup_flash, test_read_ahead),
+	Case("Pipelined Image Writer", test_setup_flash, test_image_writer),
+	Case("Deferred Busy-Wait", test_setup_flash, test_deferred_wait),
+	Case("Trim and Background Erase", test_setup_flash, test_trim),
+	Case("Compressed Log", test_setup_flash, test_compressed_log),
+	Case("Atomic Journal", test_setup_flash, test_journal),
+	Case("SPI Clock Tuning", test_setup_flash, test_frequency_tuning),
+	Case("Trace Capture and Replay", test_setup_flash, test_trace_replay),
+	Case("Sector Protection", test_setup_flash, test_sector_protection),
+	Case("Security Register", test_setup_flash, test_security_register),
+	Case("Ring Log", test_setup_flash, test_ring_log),
+	Case("Blank Sector Map", test_setup_flash, test_blank_map),
+	Case("Partition Table", test_setup_flash, test_partitions),
+	Case("Erase Size Hierarchy", test_setup_flash, test_erase_sizes),
+	Case("Delta Update", test_setup_flash, test_delta_update),
+	Case("Pattern Fill", test_setup_flash, test_fill),
 	//Case("Random Data Read/Program/Erase", test_setup_flash, test_random_read_program_erase)
 };
 